@@ -67,11 +67,20 @@ private:
     std::map<std::u32string, int> byte_decoder;
     std::map<std::u32string, int> encoder;
     std::map<int, std::u32string> decoder;
-    std::map<std::pair<std::u32string, std::u32string>, int> bpe_ranks;
-    std::regex pat;
     int encoder_len;
     int bpe_len;
 
+    // bpe works on vocab ids instead of strings
+    // (left id << 32 | right id) => (merge rank, merged id)
+    std::unordered_map<uint64_t, std::pair<int, int>> bpe_merges;
+    int byte_ids[256];
+    int byte_end_ids[256];       // byte + "</w>"
+    std::vector<int> token_ids;  // vocab id => token id, only differs after add_token
+
+    // pre-token => token ids, cleared when full
+    std::unordered_map<std::string, std::vector<int>> word_cache;
+    static const size_t WORD_CACHE_SIZE = 16384;
+
 public:
     const std::string UNK_TOKEN = "<|endoftext|>";
     const std::string BOS_TOKEN = "<|startoftext|>";
@@ -96,25 +105,154 @@ private:
         return str.substr(start, end - start + 1);
     }
 
-    static std::string whitespace_clean(std::string text) {
-        text = std::regex_replace(text, std::regex(R"(\s+)"), " ");
-        text = strip(text);
-        return text;
+    // ascii only, like the "C" locale character classes
+    static bool is_space(unsigned char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    static bool is_alpha(unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool is_digit(unsigned char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static std::string whitespace_clean(const std::string& text) {
+        std::string result;
+        result.reserve(text.size());
+        for (size_t i = 0; i < text.size(); i++) {
+            if (is_space(text[i])) {
+                if (result.empty() || result.back() != ' ') {
+                    result += ' ';
+                }
+            } else {
+                result += text[i];
+            }
+        }
+        return strip(result);
+    }
+
+    // finds the next pre-token at or after pos, same split as the regex of the reference implementation
+    // <\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+
+    static size_t find_pretoken(const std::string& str, size_t pos, size_t& len) {
+        static const char* specials[] = {"<|startoftext|>", "<|endoftext|>", "'s", "'t", "'re", "'ve", "'m", "'ll", "'d"};
+
+        while (pos < str.size() && is_space(str[pos])) {
+            pos++;
+        }
+        if (pos == str.size()) {
+            return std::string::npos;
+        }
+        for (const char* special : specials) {
+            if (str.compare(pos, strlen(special), special) == 0) {
+                len = strlen(special);
+                return pos;
+            }
+        }
+        size_t end = pos + 1;
+        if (is_alpha(str[pos])) {
+            while (end < str.size() && is_alpha(str[end])) {
+                end++;
+            }
+        } else if (!is_digit(str[pos])) {
+            while (end < str.size() && !is_space(str[end]) && !is_alpha(str[end]) && !is_digit(str[end])) {
+                end++;
+            }
+        }
+        len = end - pos;
+        return pos;
+    }
+
+    static uint64_t bpe_pair_key(int left, int right) {
+        return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
     }
 
-    static std::set<std::pair<std::u32string, std::u32string>> get_pairs(const std::vector<std::u32string>& subwords) {
-        std::set<std::pair<std::u32string, std::u32string>> pairs;
-        if (subwords.size() == 0) {
-            return pairs;
+    // merges the lowest ranked pair at every (non overlapping, leftmost first) position until no known pair is left,
+    // which gives the same result as the reference implementation in O(n log n)
+    void bpe(std::vector<int>& word) {
+        if (word.size() < 2) {
+            return;
+        }
+        struct Symbol {
+            int id;  // -1: merged into its left neighbour
+            int prev;
+            int next;
+        };
+        std::vector<Symbol> symbols(word.size());
+        for (int i = 0; i < word.size(); i++) {
+            symbols[i].id   = word[i];
+            symbols[i].prev = i - 1;
+            symbols[i].next = i + 1 < word.size() ? i + 1 : -1;
+        }
+
+        // (rank, position of the left symbol)
+        typedef std::pair<int, int> bigram_t;
+        std::priority_queue<bigram_t, std::vector<bigram_t>, std::greater<bigram_t>> queue;
+        auto add_bigram = [&](int left) {
+            if (left < 0 || symbols[left].next < 0) {
+                return;
+            }
+            auto it = bpe_merges.find(bpe_pair_key(symbols[left].id, symbols[symbols[left].next].id));
+            if (it != bpe_merges.end()) {
+                queue.push(bigram_t(it->second.first, left));
+            }
+        };
+        for (int i = 0; i < word.size(); i++) {
+            add_bigram(i);
+        }
+
+        while (!queue.empty()) {
+            // all bigrams of one rank pop in position order, stale ones are skipped
+            int rank = queue.top().first;
+            while (!queue.empty() && queue.top().first == rank) {
+                int left = queue.top().second;
+                queue.pop();
+
+                Symbol& l = symbols[left];
+                if (l.id < 0 || l.next < 0) {
+                    continue;
+                }
+                Symbol& r = symbols[l.next];
+                auto it   = bpe_merges.find(bpe_pair_key(l.id, r.id));
+                if (it == bpe_merges.end() || it->second.first != rank) {
+                    continue;
+                }
+                l.id   = it->second.second;
+                l.next = r.next;
+                if (r.next >= 0) {
+                    symbols[r.next].prev = left;
+                }
+                r.id = -1;
+                add_bigram(l.prev);
+                add_bigram(left);
+            }
+        }
+
+        word.clear();
+        for (int i = 0; i >= 0; i = symbols[i].next) {
+            word.push_back(symbols[i].id);
         }
-        std::u32string prev_subword = subwords[0];
-        for (int i = 1; i < subwords.size(); i++) {
-            std::u32string subword = subwords[i];
-            std::pair<std::u32string, std::u32string> pair(prev_subword, subword);
-            pairs.insert(pair);
-            prev_subword = subword;
+    }
+
+    void encode_pretoken(const std::string& pretoken, std::vector<int32_t>& bpe_tokens) {
+        auto it = word_cache.find(pretoken);
+        if (it == word_cache.end()) {
+            std::vector<int> word(pretoken.size());
+            for (size_t i = 0; i < pretoken.size(); i++) {
+                unsigned char b = pretoken[i];
+                word[i]         = i + 1 < pretoken.size() ? byte_ids[b] : byte_end_ids[b];
+            }
+            bpe(word);
+            for (int& id : word) {
+                id = token_ids[id];
+            }
+            if (word_cache.size() >= WORD_CACHE_SIZE) {
+                word_cache.clear();
+            }
+            it = word_cache.emplace(pretoken, word).first;
         }
-        return pairs;
+        bpe_tokens.insert(bpe_tokens.end(), it->second.begin(), it->second.end());
     }
 
 public:
@@ -184,98 +322,46 @@ public:
             LOG_DEBUG(" trigger word img not in vocab yet");
         }
 
+        for (int b = 0; b < 256; b++) {
+            byte_ids[b]     = encoder[byte_encoder[b]];
+            byte_end_ids[b] = encoder[byte_encoder[b] + utf8_to_utf32("</w>")];
+        }
+        token_ids.resize(encoder_len);
+        for (int id = 0; id < encoder_len; id++) {
+            token_ids[id] = id;
+        }
+
         int rank = 0;
         for (const auto& merge : merge_pairs) {
-            bpe_ranks[merge] = rank++;
+            auto first  = encoder.find(merge.first);
+            auto second = encoder.find(merge.second);
+            if (first != encoder.end() && second != encoder.end()) {
+                int merged_id = encoder[merge.first + merge.second];
+
+                bpe_merges[bpe_pair_key(first->second, second->second)] = std::make_pair(rank, merged_id);
+            }
+            rank++;
         }
         bpe_len = rank;
+        word_cache.clear();
     };
 
     void add_token(const std::string& text) {
         std::u32string token = utf8_to_utf32(text);
         auto it              = encoder.find(token);
         if (it != encoder.end()) {
+            for (int& id : token_ids) {
+                if (id == it->second) {
+                    id = encoder_len;
+                }
+            }
+            word_cache.clear();
             encoder[token]       = encoder_len;
             decoder[encoder_len] = token;
             encoder_len++;
         }
     }
 
-    std::u32string bpe(const std::u32string& token) {
-        std::vector<std::u32string> word;
-
-        for (int i = 0; i < token.size() - 1; i++) {
-            word.emplace_back(1, token[i]);
-        }
-        word.push_back(token.substr(token.size() - 1) + utf8_to_utf32("</w>"));
-
-        std::set<std::pair<std::u32string, std::u32string>> pairs = get_pairs(word);
-
-        if (pairs.empty()) {
-            return token + utf8_to_utf32("</w>");
-        }
-
-        while (true) {
-            auto min_pair_iter = std::min_element(pairs.begin(),
-                                                  pairs.end(),
-                                                  [&](const std::pair<std::u32string, std::u32string>& a,
-                                                      const std::pair<std::u32string, std::u32string>& b) {
-                                                      if (bpe_ranks.find(a) == bpe_ranks.end()) {
-                                                          return false;
-                                                      } else if (bpe_ranks.find(b) == bpe_ranks.end()) {
-                                                          return true;
-                                                      }
-                                                      return bpe_ranks.at(a) < bpe_ranks.at(b);
-                                                  });
-
-            const std::pair<std::u32string, std::u32string>& bigram = *min_pair_iter;
-
-            if (bpe_ranks.find(bigram) == bpe_ranks.end()) {
-                break;
-            }
-
-            std::u32string first  = bigram.first;
-            std::u32string second = bigram.second;
-            std::vector<std::u32string> new_word;
-            int32_t i = 0;
-
-            while (i < word.size()) {
-                auto it = std::find(word.begin() + i, word.end(), first);
-                if (it == word.end()) {
-                    new_word.insert(new_word.end(), word.begin() + i, word.end());
-                    break;
-                }
-                new_word.insert(new_word.end(), word.begin() + i, it);
-                i = static_cast<int32_t>(std::distance(word.begin(), it));
-
-                if (word[i] == first && i < static_cast<int32_t>(word.size()) - 1 && word[i + 1] == second) {
-                    new_word.push_back(first + second);
-                    i += 2;
-                } else {
-                    new_word.push_back(word[i]);
-                    i += 1;
-                }
-            }
-
-            word = new_word;
-
-            if (word.size() == 1) {
-                break;
-            }
-            pairs = get_pairs(word);
-        }
-
-        std::u32string result;
-        for (int i = 0; i < word.size(); i++) {
-            result += word[i];
-            if (i != word.size() - 1) {
-                result += utf8_to_utf32(" ");
-            }
-        }
-
-        return result;
-    }
-
     std::vector<int> tokenize(std::string text,
                               on_new_token_cb_t on_new_token_cb,
                               size_t max_length = 0,
@@ -380,53 +466,22 @@ public:
     }
 
     std::vector<int> encode(std::string text, on_new_token_cb_t on_new_token_cb) {
-        std::string original_text = text;
         std::vector<int32_t> bpe_tokens;
         text = whitespace_clean(text);
         std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
 
-        std::regex pat(R"(<\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+)",
-                       std::regex::icase);
-
-        std::smatch matches;
         std::string str = text;
-        std::vector<std::string> token_strs;
-        while (std::regex_search(str, matches, pat)) {
+        size_t len      = 0;
+        size_t pos;
+        while ((pos = find_pretoken(str, 0, len)) != std::string::npos) {
+            // the callback sees the remaining text and may consume a custom embedding from it
             bool skip = on_new_token_cb(str, bpe_tokens);
             if (skip) {
                 continue;
             }
-            for (auto& token : matches) {
-                std::string token_str = token.str();
-                std::u32string utf32_token;
-                for (int i = 0; i < token_str.length(); i++) {
-                    unsigned char b = token_str[i];
-                    utf32_token += byte_encoder[b];
-                }
-                auto bpe_strs = bpe(utf32_token);
-                size_t start  = 0;
-                size_t pos;
-                while ((pos = bpe_strs.find(' ', start)) != std::u32string::npos) {
-                    auto bpe_str = bpe_strs.substr(start, pos - start);
-                    bpe_tokens.push_back(encoder[bpe_str]);
-                    token_strs.push_back(utf32_to_utf8(bpe_str));
-
-                    start = pos + 1;
-                }
-                auto bpe_str = bpe_strs.substr(start, bpe_strs.size() - start);
-                bpe_tokens.push_back(encoder[bpe_str]);
-                token_strs.push_back(utf32_to_utf8(bpe_str));
-            }
-            str = matches.suffix();
-        }
-        std::stringstream ss;
-        ss << "[";
-        for (auto token : token_strs) {
-            ss << "\"" << token << "\", ";
+            encode_pretoken(str.substr(pos, len), bpe_tokens);
+            str.erase(0, pos + len);
         }
-        ss << "]";
-        // LOG_DEBUG("split prompt \"%s\" to tokens %s", original_text.c_str(), ss.str().c_str());
-        // printf("split prompt \"%s\" to tokens %s \n", original_text.c_str(), ss.str().c_str());
         return bpe_tokens;
     }
 };
@@ -680,7 +735,8 @@ public:
 
     CLIPTextModel(CLIPVersion version = OPENAI_CLIP_VIT_L_14,
                   int clip_skip_value = -1,
-                  bool with_final_ln  = true)
+                  bool with_final_ln  = true,
+                  int n_layer_value   = -1)
         : version(version), with_final_ln(with_final_ln) {
         if (version == OPEN_CLIP_VIT_H_14) {
             hidden_size       = 1024;
@@ -693,6 +749,9 @@ public:
             n_head            = 20;
             n_layer           = 32;
         }
+        if (n_layer_value > 0 && n_layer_value < n_layer) {
+            n_layer = n_layer_value;
+        }
         set_clip_skip(clip_skip_value);
 
         blocks["embeddings"]       = std::shared_ptr<GGMLBlock>(new CLIPEmbeddings(hidden_size, vocab_size, n_token));
@@ -875,7 +934,19 @@ struct CLIPTextModelRunner : public GGMLRunner {
                         CLIPVersion version = OPENAI_CLIP_VIT_L_14,
                         int clip_skip_value = 1,
                         bool with_final_ln  = true)
-        : GGMLRunner(backend), model(version, clip_skip_value, with_final_ln) {
+        : GGMLRunner(backend) {
+        // the random weight models of sd-tiny-model have fewer layers, real checkpoints keep the depth
+        // of their version even if some layers are missing, clip_skip depends on it
+        int n_layer               = -1;
+        std::string layers_prefix = prefix + ".encoder.layers.";
+        if (is_tiny_model(tensor_types)) {
+            for (auto& pair : tensor_types) {
+                if (pair.first.compare(0, layers_prefix.size(), layers_prefix) == 0) {
+                    n_layer = std::max(n_layer, atoi(pair.first.c_str() + layers_prefix.size()) + 1);
+                }
+            }
+        }
+        model = CLIPTextModel(version, clip_skip_value, with_final_ln, n_layer);
         model.init(params_ctx, tensor_types, prefix);
     }
 
@@ -15,6 +15,8 @@ struct SDCondition {
 };
 
 struct Conditioner {
+    int64_t tokenize_time_us = 0;  // spent in the tokenizers by get_learned_condition*, summed until the caller resets it
+
     virtual SDCondition get_learned_condition(ggml_context* work_ctx,
                                               int n_threads,
                                               const std::string& text,
@@ -27,6 +29,7 @@ struct Conditioner {
     virtual void free_params_buffer()                                                                                         = 0;
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors)                                       = 0;
     virtual size_t get_params_buffer_size()                                                                                   = 0;
+    virtual void get_runners(std::vector<GGMLRunner*>& runners)                                                               = 0;
     virtual std::tuple<SDCondition, std::vector<bool>> get_learned_condition_with_trigger(ggml_context* work_ctx,
                                                                                           int n_threads,
                                                                                           const std::string& text,
@@ -40,6 +43,50 @@ struct Conditioner {
                                                    const std::string& prompt)                                                 = 0;
 };
 
+// hidden_states: [chunk_count, chunk_len, hidden_size] => [chunk_len, hidden_size] of chunk chunk_idx
+__STATIC_INLINE__ struct ggml_tensor* get_chunk(ggml_context* work_ctx,
+                                                struct ggml_tensor* hidden_states,
+                                                size_t chunk_len,
+                                                int chunk_idx) {
+    return ggml_view_2d(work_ctx,
+                        hidden_states,
+                        hidden_states->ne[0],
+                        chunk_len,
+                        hidden_states->nb[1],
+                        chunk_idx * chunk_len * hidden_states->nb[1]);
+}
+
+// scales each token by its weight, then restores the mean of each chunk
+__STATIC_INLINE__ void apply_chunk_weights(ggml_context* work_ctx,
+                                           struct ggml_tensor* hidden_states,
+                                           const std::vector<float>& weights,
+                                           size_t chunk_len) {
+    size_t chunk_count = ggml_nelements(hidden_states) / (hidden_states->ne[0] * chunk_len);
+    for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+        auto tensor         = get_chunk(work_ctx, hidden_states, chunk_len, chunk_idx);
+        float original_mean = ggml_tensor_mean(tensor);
+        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
+            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
+                float value = ggml_tensor_get_f32(tensor, i0, i1);
+                value *= weights[chunk_idx * chunk_len + i1];
+                ggml_tensor_set_f32(tensor, value, i0, i1);
+            }
+        }
+        float new_mean = ggml_tensor_mean(tensor);
+        ggml_tensor_scale(tensor, (original_mean / new_mean));
+    }
+}
+
+// first chunk_count * chunk_len tokens => input_ids: [chunk_count, chunk_len], to encode all chunks in one batch
+__STATIC_INLINE__ struct ggml_tensor* chunks_to_input_ids(ggml_context* work_ctx,
+                                                          const std::vector<int>& tokens,
+                                                          size_t chunk_len,
+                                                          size_t chunk_count) {
+    auto input_ids = ggml_new_tensor_2d(work_ctx, GGML_TYPE_I32, chunk_len, chunk_count);
+    memcpy(input_ids->data, tokens.data(), ggml_nbytes(input_ids));
+    return input_ids;
+}
+
 // ldm.modules.encoders.modules.FrozenCLIPEmbedder
 // Ref: https://github.com/AUTOMATIC1111/stable-diffusion-webui/blob/cad87bf4e3e0b0a759afa94e933527c3123d59bc/modules/sd_hijack_clip.py#L283
 struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
@@ -115,6 +162,13 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         return buffer_size;
     }
 
+    void get_runners(std::vector<GGMLRunner*>& runners) {
+        runners.push_back(text_model.get());
+        if (sd_version_is_sdxl(version)) {
+            runners.push_back(text_model2.get());
+        }
+    }
+
     bool load_embedding(std::string embd_name, std::string embd_path, std::vector<int32_t>& bpe_tokens) {
         // the order matters
         ModelLoader model_loader;
@@ -413,105 +467,85 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         set_clip_skip(clip_skip);
         int64_t t0                               = ggml_time_ms();
         struct ggml_tensor* hidden_states        = NULL;  // [N, n_token, hidden_size]
-        struct ggml_tensor* chunk_hidden_states  = NULL;  // [n_token, hidden_size] or [n_token, hidden_size + hidden_size2]
-        struct ggml_tensor* chunk_hidden_states1 = NULL;  // [n_token, hidden_size]
-        struct ggml_tensor* chunk_hidden_states2 = NULL;  // [n_token, hidden_size2]
+        struct ggml_tensor* chunk_hidden_states  = NULL;  // [chunk_count, n_token, hidden_size] or [chunk_count, n_token, hidden_size + hidden_size2]
+        struct ggml_tensor* chunk_hidden_states1 = NULL;  // [chunk_count, n_token, hidden_size]
+        struct ggml_tensor* chunk_hidden_states2 = NULL;  // [chunk_count, n_token, hidden_size2]
         struct ggml_tensor* pooled               = NULL;
-        std::vector<float> hidden_states_vec;
 
         size_t chunk_len   = 77;
         size_t chunk_count = tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            std::vector<int> chunk_tokens(tokens.begin() + chunk_idx * chunk_len,
-                                          tokens.begin() + (chunk_idx + 1) * chunk_len);
-            std::vector<float> chunk_weights(weights.begin() + chunk_idx * chunk_len,
-                                             weights.begin() + (chunk_idx + 1) * chunk_len);
-
-            auto input_ids                 = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-            struct ggml_tensor* input_ids2 = NULL;
-            size_t max_token_idx           = 0;
-            if (sd_version_is_sdxl(version)) {
-                auto it = std::find(chunk_tokens.begin(), chunk_tokens.end(), tokenizer.EOS_TOKEN_ID);
-                if (it != chunk_tokens.end()) {
-                    std::fill(std::next(it), chunk_tokens.end(), 0);
-                }
-
-                max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-
-                input_ids2 = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-
-                // for (int i = 0; i < chunk_tokens.size(); i++) {
-                //     printf("%d ", chunk_tokens[i]);
-                // }
-                // printf("\n");
-            }
 
-            {
-                text_model->compute(n_threads,
-                                    input_ids,
-                                    num_custom_embeddings,
-                                    token_embed_custom.data(),
-                                    max_token_idx,
-                                    false,
-                                    &chunk_hidden_states1,
-                                    work_ctx);
-                if (sd_version_is_sdxl(version)) {
-                    text_model2->compute(n_threads,
-                                         input_ids2,
-                                         num_custom_embeddings,
-                                         token_embed_custom.data(),
-                                         max_token_idx,
-                                         false,
-                                         &chunk_hidden_states2, work_ctx);
-                    // concat
-                    chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states1, chunk_hidden_states2, 0);
-
-                    if (chunk_idx == 0) {
-                        text_model2->compute(n_threads,
-                                             input_ids2,
-                                             num_custom_embeddings,
-                                             token_embed_custom.data(),
-                                             max_token_idx,
-                                             true,
-                                             &pooled,
-                                             work_ctx);
-                    }
-                } else {
-                    chunk_hidden_states = chunk_hidden_states1;
+        // all chunks go through the text encoders as one batch
+        auto input_ids                 = chunks_to_input_ids(work_ctx, tokens, chunk_len, chunk_count);
+        struct ggml_tensor* input_ids2 = NULL;
+        struct ggml_tensor* pooled_ids = NULL;
+        size_t max_token_idx           = 0;
+        if (sd_version_is_sdxl(version)) {
+            std::vector<int> tokens2 = tokens;
+            for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+                auto chunk_begin = tokens2.begin() + chunk_idx * chunk_len;
+                auto chunk_end   = chunk_begin + chunk_len;
+                auto it          = std::find(chunk_begin, chunk_end, tokenizer.EOS_TOKEN_ID);
+                if (it != chunk_end) {
+                    std::fill(std::next(it), chunk_end, 0);
+                }
+                if (chunk_idx == 0) {
+                    max_token_idx = std::min<size_t>(std::distance(chunk_begin, it), chunk_len - 1);
                 }
             }
 
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            ggml_tensor* result = ggml_dup_tensor(work_ctx, chunk_hidden_states);
-            {
-                float original_mean = ggml_tensor_mean(chunk_hidden_states);
-                for (int i2 = 0; i2 < chunk_hidden_states->ne[2]; i2++) {
-                    for (int i1 = 0; i1 < chunk_hidden_states->ne[1]; i1++) {
-                        for (int i0 = 0; i0 < chunk_hidden_states->ne[0]; i0++) {
-                            float value = ggml_tensor_get_f32(chunk_hidden_states, i0, i1, i2);
-                            value *= chunk_weights[i1];
-                            ggml_tensor_set_f32(result, value, i0, i1, i2);
-                        }
-                    }
-                }
-                float new_mean = ggml_tensor_mean(result);
-                ggml_tensor_scale(result, (original_mean / new_mean));
+            input_ids2 = chunks_to_input_ids(work_ctx, tokens2, chunk_len, chunk_count);
+            pooled_ids = chunks_to_input_ids(work_ctx, tokens2, chunk_len, 1);
+        }
+
+        {
+            text_model->compute(n_threads,
+                                input_ids,
+                                num_custom_embeddings,
+                                token_embed_custom.data(),
+                                max_token_idx,
+                                false,
+                                &chunk_hidden_states1,
+                                work_ctx);
+            if (sd_version_is_sdxl(version)) {
+                text_model2->compute(n_threads,
+                                     input_ids2,
+                                     num_custom_embeddings,
+                                     token_embed_custom.data(),
+                                     max_token_idx,
+                                     false,
+                                     &chunk_hidden_states2, work_ctx);
+                // concat
+                chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states1, chunk_hidden_states2, 0);
+
+                // pooled output of the first chunk only
+                text_model2->compute(n_threads,
+                                     pooled_ids,
+                                     num_custom_embeddings,
+                                     token_embed_custom.data(),
+                                     max_token_idx,
+                                     true,
+                                     &pooled,
+                                     work_ctx);
+            } else {
+                chunk_hidden_states = chunk_hidden_states1;
             }
-            if (force_zero_embeddings) {
-                float* vec = (float*)result->data;
-                for (int i = 0; i < ggml_nelements(result); i++) {
-                    vec[i] = 0;
-                }
+        }
+
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
+        apply_chunk_weights(work_ctx, chunk_hidden_states, weights, chunk_len);
+        if (force_zero_embeddings) {
+            float* vec = (float*)chunk_hidden_states->data;
+            for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
+                vec[i] = 0;
             }
-            hidden_states_vec.insert(hidden_states_vec.end(), (float*)result->data, ((float*)result->data) + ggml_nelements(result));
         }
 
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
         hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
+                                        chunk_hidden_states,
                                         chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
+                                        ggml_nelements(chunk_hidden_states) / chunk_hidden_states->ne[0]);
 
         ggml_tensor* vec = NULL;
         if (sd_version_is_sdxl(version)) {
@@ -568,10 +602,12 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         //     printf(" image token id is: %d \n", image_tokens[0]);
         // }
         GGML_ASSERT(image_tokens.size() == 1);
+        int64_t t0                  = ggml_time_us();
         auto tokens_and_weights     = tokenize_with_trigger_token(text,
                                                                   num_input_imgs,
                                                                   image_tokens[0],
                                                                   true);
+        tokenize_time_us += ggml_time_us() - t0;
         std::vector<int>& tokens    = std::get<0>(tokens_and_weights);
         std::vector<float>& weights = std::get<1>(tokens_and_weights);
         std::vector<bool>& clsm     = std::get<2>(tokens_and_weights);
@@ -607,7 +643,9 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
+        int64_t t0                  = ggml_time_us();
         auto tokens_and_weights     = tokenize(text, true);
+        tokenize_time_us += ggml_time_us() - t0;
         std::vector<int>& tokens    = tokens_and_weights.first;
         std::vector<float>& weights = tokens_and_weights.second;
         return get_learned_condition_common(work_ctx, n_threads, tokens, weights, clip_skip, width, height, adm_in_channels, force_zero_embeddings);
@@ -761,6 +799,18 @@ struct SD3CLIPEmbedder : public Conditioner {
         return buffer_size;
     }
 
+    void get_runners(std::vector<GGMLRunner*>& runners) {
+        if (use_clip_l) {
+            runners.push_back(clip_l.get());
+        }
+        if (use_clip_g) {
+            runners.push_back(clip_g.get());
+        }
+        if (use_t5) {
+            runners.push_back(t5.get());
+        }
+    }
+
     std::vector<std::pair<std::vector<int>, std::vector<float>>> tokenize(std::string text,
                                                                           size_t max_length = 0,
                                                                           bool padding      = false) {
@@ -860,15 +910,15 @@ struct SD3CLIPEmbedder : public Conditioner {
 
         size_t chunk_len   = 77;
         size_t chunk_count = std::max(std::max(clip_l_tokens.size(), clip_g_tokens.size()), t5_tokens.size()) / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+
+        // each encoder runs all chunks as one batch, [chunk_count, n_token, hidden_size]
+        struct ggml_tensor* hidden_states_l  = NULL;
+        struct ggml_tensor* hidden_states_g  = NULL;
+        struct ggml_tensor* hidden_states_t5 = NULL;
+        if (chunk_count > 0) {
             // clip_l
             if (use_clip_l) {
-                std::vector<int> chunk_tokens(clip_l_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_l_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_l_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_l_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+                auto input_ids       = chunks_to_input_ids(work_ctx, clip_l_tokens, chunk_len, chunk_count);
                 size_t max_token_idx = 0;
 
                 clip_l->compute(n_threads,
@@ -877,53 +927,30 @@ struct SD3CLIPEmbedder : public Conditioner {
                                 NULL,
                                 max_token_idx,
                                 false,
-                                &chunk_hidden_states_l,
+                                &hidden_states_l,
                                 work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_l;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+                apply_chunk_weights(work_ctx, hidden_states_l, clip_l_weights, chunk_len);
 
-                if (chunk_idx == 0) {
-                    auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                    max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    clip_l->compute(n_threads,
-                                    input_ids,
-                                    0,
-                                    NULL,
-                                    max_token_idx,
-                                    true,
-                                    &pooled_l,
-                                    work_ctx);
-                }
+                auto it       = std::find(clip_l_tokens.begin(), clip_l_tokens.begin() + chunk_len, clip_l_tokenizer.EOS_TOKEN_ID);
+                max_token_idx = std::min<size_t>(std::distance(clip_l_tokens.begin(), it), chunk_len - 1);
+                clip_l->compute(n_threads,
+                                chunks_to_input_ids(work_ctx, clip_l_tokens, chunk_len, 1),
+                                0,
+                                NULL,
+                                max_token_idx,
+                                true,
+                                &pooled_l,
+                                work_ctx);
             } else {
-                chunk_hidden_states_l = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, 768, chunk_len);
-                ggml_set_f32(chunk_hidden_states_l, 0.f);
-                if (chunk_idx == 0) {
-                    pooled_l = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768);
-                    ggml_set_f32(pooled_l, 0.f);
-                }
+                hidden_states_l = ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, 768, chunk_len, chunk_count);
+                ggml_set_f32(hidden_states_l, 0.f);
+                pooled_l = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768);
+                ggml_set_f32(pooled_l, 0.f);
             }
 
             // clip_g
             if (use_clip_g) {
-                std::vector<int> chunk_tokens(clip_g_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_g_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_g_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_g_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+                auto input_ids       = chunks_to_input_ids(work_ctx, clip_g_tokens, chunk_len, chunk_count);
                 size_t max_token_idx = 0;
 
                 clip_g->compute(n_threads,
@@ -932,74 +959,47 @@ struct SD3CLIPEmbedder : public Conditioner {
                                 NULL,
                                 max_token_idx,
                                 false,
-                                &chunk_hidden_states_g,
+                                &hidden_states_g,
                                 work_ctx);
+                apply_chunk_weights(work_ctx, hidden_states_g, clip_g_weights, chunk_len);
 
-                {
-                    auto tensor         = chunk_hidden_states_g;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
-
-                if (chunk_idx == 0) {
-                    auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_g_tokenizer.EOS_TOKEN_ID);
-                    max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    clip_g->compute(n_threads,
-                                    input_ids,
-                                    0,
-                                    NULL,
-                                    max_token_idx,
-                                    true,
-                                    &pooled_g,
-                                    work_ctx);
-                }
+                auto it       = std::find(clip_g_tokens.begin(), clip_g_tokens.begin() + chunk_len, clip_g_tokenizer.EOS_TOKEN_ID);
+                max_token_idx = std::min<size_t>(std::distance(clip_g_tokens.begin(), it), chunk_len - 1);
+                clip_g->compute(n_threads,
+                                chunks_to_input_ids(work_ctx, clip_g_tokens, chunk_len, 1),
+                                0,
+                                NULL,
+                                max_token_idx,
+                                true,
+                                &pooled_g,
+                                work_ctx);
             } else {
-                chunk_hidden_states_g = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, 1280, chunk_len);
-                ggml_set_f32(chunk_hidden_states_g, 0.f);
-                if (chunk_idx == 0) {
-                    pooled_g = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 1280);
-                    ggml_set_f32(pooled_g, 0.f);
-                }
+                hidden_states_g = ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, 1280, chunk_len, chunk_count);
+                ggml_set_f32(hidden_states_g, 0.f);
+                pooled_g = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 1280);
+                ggml_set_f32(pooled_g, 0.f);
             }
 
             // t5
             if (use_t5) {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+                auto input_ids = chunks_to_input_ids(work_ctx, t5_tokens, chunk_len, chunk_count);
 
                 t5->compute(n_threads,
                             input_ids,
-                            &chunk_hidden_states_t5,
+                            &hidden_states_t5,
                             work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_t5;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+                apply_chunk_weights(work_ctx, hidden_states_t5, t5_weights, chunk_len);
+            }
+
+            int64_t t1 = ggml_time_ms();
+            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
+        }
+
+        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+            chunk_hidden_states_l = get_chunk(work_ctx, hidden_states_l, chunk_len, chunk_idx);
+            chunk_hidden_states_g = get_chunk(work_ctx, hidden_states_g, chunk_len, chunk_idx);
+            if (use_t5) {
+                chunk_hidden_states_t5 = get_chunk(work_ctx, hidden_states_t5, chunk_len, chunk_idx);
             } else {
                 chunk_hidden_states_t5 = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, 4096, 0);
             }
@@ -1030,8 +1030,6 @@ struct SD3CLIPEmbedder : public Conditioner {
                 pooled = ggml_tensor_concat(work_ctx, pooled_l, pooled_g, 0);  // [768 + 1280]
             }
 
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
             if (force_zero_embeddings) {
                 float* vec = (float*)chunk_hidden_states->data;
                 for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
@@ -1068,7 +1066,9 @@ struct SD3CLIPEmbedder : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
+        int64_t t0              = ggml_time_us();
         auto tokens_and_weights = tokenize(text, 77, true);
+        tokenize_time_us += ggml_time_us() - t0;
         return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
     }
 
@@ -1176,6 +1176,15 @@ struct FluxCLIPEmbedder : public Conditioner {
         return buffer_size;
     }
 
+    void get_runners(std::vector<GGMLRunner*>& runners) {
+        if (use_clip_l) {
+            runners.push_back(clip_l.get());
+        }
+        if (use_t5) {
+            runners.push_back(t5.get());
+        }
+    }
+
     std::vector<std::pair<std::vector<int>, std::vector<float>>> tokenize(std::string text,
                                                                           size_t max_length = 0,
                                                                           bool padding      = false) {
@@ -1244,92 +1253,57 @@ struct FluxCLIPEmbedder : public Conditioner {
         auto& t5_tokens      = token_and_weights[1].first;
         auto& t5_weights     = token_and_weights[1].second;
 
-        int64_t t0                              = ggml_time_ms();
-        struct ggml_tensor* hidden_states       = NULL;  // [N, n_token, 4096]
-        struct ggml_tensor* chunk_hidden_states = NULL;  // [n_token, 4096]
-        struct ggml_tensor* pooled              = NULL;  // [768,]
-        std::vector<float> hidden_states_vec;
+        int64_t t0                        = ggml_time_ms();
+        struct ggml_tensor* hidden_states = NULL;  // [N, n_token, 4096]
+        struct ggml_tensor* pooled        = NULL;  // [768,]
 
         size_t chunk_count = std::max(clip_l_tokens.size() > 0 ? chunk_len : 0, t5_tokens.size()) / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+        if (chunk_count > 0) {
             // clip_l
-            if (chunk_idx == 0) {
-                if (use_clip_l) {
-                    size_t chunk_len_l = 77;
-                    std::vector<int> chunk_tokens(clip_l_tokens.begin(),
-                                                  clip_l_tokens.begin() + chunk_len_l);
-                    std::vector<float> chunk_weights(clip_l_weights.begin(),
-                                                     clip_l_weights.begin() + chunk_len_l);
-
-                    auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                    size_t max_token_idx = 0;
-
-                    auto it       = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                    max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-
-                    clip_l->compute(n_threads,
-                                    input_ids,
-                                    0,
-                                    NULL,
-                                    max_token_idx,
-                                    true,
-                                    &pooled,
-                                    work_ctx);
-                }
+            if (use_clip_l) {
+                size_t chunk_len_l   = 77;
+                auto input_ids       = chunks_to_input_ids(work_ctx, clip_l_tokens, chunk_len_l, 1);
+                size_t max_token_idx = 0;
+
+                auto it       = std::find(clip_l_tokens.begin(), clip_l_tokens.begin() + chunk_len_l, clip_l_tokenizer.EOS_TOKEN_ID);
+                max_token_idx = std::min<size_t>(std::distance(clip_l_tokens.begin(), it), chunk_len_l - 1);
+
+                clip_l->compute(n_threads,
+                                input_ids,
+                                0,
+                                NULL,
+                                max_token_idx,
+                                true,
+                                &pooled,
+                                work_ctx);
             }
 
-            // t5
+            // t5, all chunks in one batch
             if (use_t5) {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+                auto input_ids = chunks_to_input_ids(work_ctx, t5_tokens, chunk_len, chunk_count);
 
                 t5->compute(n_threads,
                             input_ids,
-                            &chunk_hidden_states,
+                            &hidden_states,
                             work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+                apply_chunk_weights(work_ctx, hidden_states, t5_weights, chunk_len);
             } else {
-                chunk_hidden_states = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, 4096, chunk_len);
-                ggml_set_f32(chunk_hidden_states, 0.f);
+                hidden_states = ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, 4096, chunk_len, chunk_count);
+                ggml_set_f32(hidden_states, 0.f);
             }
 
             int64_t t1 = ggml_time_ms();
             LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
             if (force_zero_embeddings) {
-                float* vec = (float*)chunk_hidden_states->data;
-                for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
-                    vec[i] = 0;
-                }
+                ggml_set_f32(hidden_states, 0.f);
             }
-            hidden_states_vec.insert(hidden_states_vec.end(),
-                                     (float*)chunk_hidden_states->data,
-                                     ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
         }
 
-        if (hidden_states_vec.size() > 0) {
-            hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
+        if (hidden_states != NULL) {
             hidden_states = ggml_reshape_2d(work_ctx,
                                             hidden_states,
-                                            chunk_hidden_states->ne[0],
-                                            ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
+                                            hidden_states->ne[0],
+                                            ggml_nelements(hidden_states) / hidden_states->ne[0]);
         } else {
             hidden_states = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, 4096, 256);
             ggml_set_f32(hidden_states, 0.f);
@@ -1349,7 +1323,9 @@ struct FluxCLIPEmbedder : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
+        int64_t t0              = ggml_time_us();
         auto tokens_and_weights = tokenize(text, chunk_len, true);
+        tokenize_time_us += ggml_time_us() - t0;
         return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
     }
 
@@ -1405,6 +1381,10 @@ struct PixArtCLIPEmbedder : public Conditioner {
         return buffer_size;
     }
 
+    void get_runners(std::vector<GGMLRunner*>& runners) {
+        runners.push_back(t5.get());
+    }
+
     std::tuple<std::vector<int>, std::vector<float>, std::vector<float>> tokenize(std::string text,
                                                                                   size_t max_length = 0,
                                                                                   bool padding      = false) {
@@ -1568,7 +1548,9 @@ struct PixArtCLIPEmbedder : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
+        int64_t t0              = ggml_time_us();
         auto tokens_and_weights = tokenize(text, chunk_len, true);
+        tokenize_time_us += ggml_time_us() - t0;
         return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
     }
 
@@ -488,6 +488,125 @@ struct FluxFlowDenoiser : public Denoiser {
     }
 };
 
+// CFG of one step. Mixes the outputs of the cond, uncond, image cond and skip layer passes of the model (NULL when
+// the pass did not run) and writes denoised = result * c_out + input * c_skip. denoised also holds the deltas, and
+// apg_momentum_buffer keeps the APG momentum between steps. ne3 is the number of frames of the outputs.
+__STATIC_INLINE__ void cfg_combine(float* denoised,
+                                   const float* input,
+                                   const float* positive_data,
+                                   const float* negative_data,
+                                   const float* img_cond_data,
+                                   const float* skip_layer_data,
+                                   float* apg_momentum_buffer,
+                                   int ne_elements,
+                                   int64_t ne3,
+                                   const sd_guidance_params_t& guidance,
+                                   float img_cfg_scale,
+                                   float c_out,
+                                   float c_skip,
+                                   bool log_cfg_norm = false) {
+    float cfg_scale        = guidance.txt_cfg;
+    float min_cfg          = guidance.min_cfg;
+    bool has_unconditioned = negative_data != NULL;
+    bool has_img_guidance  = img_cond_data != NULL;
+    float* deltas          = denoised;
+
+    // APG: https://arxiv.org/pdf/2410.02416
+    float apg_scale_factor = 1.;
+    float diff_norm        = 0;
+    float cond_norm_sq     = 0;
+    float dot              = 0;
+    if (has_unconditioned || has_img_guidance) {
+        for (int i = 0; i < ne_elements; i++) {
+            float delta;
+            if (has_img_guidance) {
+                if (cfg_scale == 1) {
+                    // Weird guidance (important: use img_cfg_scale instead of cfg_scale in the final formula)
+                    delta = img_cond_data[i] - negative_data[i];
+                } else if (has_unconditioned) {
+                    // 2-conditioning CFG (img_cfg_scale != cfg_scale != 1)
+                    delta = positive_data[i] + (negative_data[i] * (1 - img_cfg_scale) + img_cond_data[i] * (img_cfg_scale - cfg_scale)) / (cfg_scale - 1);
+                } else {
+                    // pure img CFG (img_cfg_scale == 1, cfg_scale !=1)
+                    delta = positive_data[i] - img_cond_data[i];
+                }
+
+            } else {
+                // classic CFG (img_cfg_scale == cfg_scale != 1)
+                delta = positive_data[i] - negative_data[i];
+            }
+            if (guidance.apg.momentum != 0) {
+                delta += guidance.apg.momentum * apg_momentum_buffer[i];
+                apg_momentum_buffer[i] = delta;
+            }
+            if (guidance.apg.norm_treshold > 0 || log_cfg_norm) {
+                diff_norm += delta * delta;
+            }
+            if (guidance.apg.eta != 1.0f) {
+                cond_norm_sq += positive_data[i] * positive_data[i];
+                dot += positive_data[i] * delta;
+            }
+            deltas[i] = delta;
+        }
+        if (log_cfg_norm) {
+            LOG_INFO("CFG Delta norm: %.2f", sqrtf(diff_norm));
+        }
+        if (guidance.apg.norm_treshold > 0) {
+            diff_norm = sqrtf(diff_norm);
+            if (guidance.apg.norm_treshold_smoothing <= 0) {
+                apg_scale_factor = std::min(1.0f, guidance.apg.norm_treshold / diff_norm);
+            } else {
+                // Experimental: smooth saturate
+                float x          = guidance.apg.norm_treshold / diff_norm;
+                apg_scale_factor = x / std::pow(1 + std::pow(x, 1.0 / guidance.apg.norm_treshold_smoothing), guidance.apg.norm_treshold_smoothing);
+            }
+        }
+        if (guidance.apg.eta != 1.0f) {
+            dot *= apg_scale_factor;
+            // pre-normalize (avoids one square root and ne_elements extra divs)
+            dot /= cond_norm_sq;
+        }
+
+        for (int i = 0; i < ne_elements; i++) {
+            deltas[i] *= apg_scale_factor;
+            if (guidance.apg.eta != 1.0f) {
+                float apg_parallel   = dot * positive_data[i];
+                float apg_orthogonal = deltas[i] - apg_parallel;
+
+                // tweak deltas
+                deltas[i] = apg_orthogonal + guidance.apg.eta * apg_parallel;
+            }
+        }
+    }
+
+    for (int i = 0; i < ne_elements; i++) {
+        float latent_result = positive_data[i];
+        if (has_unconditioned || has_img_guidance) {
+            // out_uncond + cfg_scale * (out_cond - out_uncond)
+            if (min_cfg != cfg_scale && ne3 != 1) {
+                // the scale ramp from min_cfg over the frames is not applied, the result stays the cond output
+            } else {
+                float delta = deltas[i];
+                if (cfg_scale != 1) {
+                    latent_result = positive_data[i] + (cfg_scale - 1) * delta;
+                } else if (has_img_guidance) {
+                    // disables apg
+                    latent_result = positive_data[i] + (img_cfg_scale - 1) * delta;
+                }
+            }
+        } else if (has_img_guidance) {
+            // img_cfg_scale == 1
+            latent_result = img_cond_data[i] + cfg_scale * (positive_data[i] - img_cond_data[i]);
+        }
+        if (skip_layer_data != NULL) {
+            latent_result = latent_result + (positive_data[i] - skip_layer_data[i]) * guidance.slg.scale;
+        }
+        // v = latent_result, eps = latent_result
+        // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
+        denoised[i] = latent_result * c_out + input[i] * c_skip;
+    }
+}
+
 typedef std::function<ggml_tensor*(ggml_tensor*, float, int)> denoise_cb_t;
 
 // k diffusion reverse ODE: dx = (x - D(x;\sigma)) / \sigma dt; \sigma(t) = t
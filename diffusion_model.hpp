@@ -25,6 +25,7 @@ struct DiffusionModel {
     virtual void free_compute_buffer()                                                  = 0;
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors) = 0;
     virtual size_t get_params_buffer_size()                                             = 0;
+    virtual GGMLRunner* get_runner()                                                    = 0;
     virtual int64_t get_adm_in_channels()                                               = 0;
 };
 
@@ -58,6 +59,10 @@ struct UNetModel : public DiffusionModel {
         return unet.get_params_buffer_size();
     }
 
+    GGMLRunner* get_runner() {
+        return &unet;
+    }
+
     int64_t get_adm_in_channels() {
         return unet.unet.adm_in_channels;
     }
@@ -109,6 +114,10 @@ struct MMDiTModel : public DiffusionModel {
         return mmdit.get_params_buffer_size();
     }
 
+    GGMLRunner* get_runner() {
+        return &mmdit;
+    }
+
     int64_t get_adm_in_channels() {
         return 768 + 1280;
     }
@@ -161,6 +170,10 @@ struct FluxModel : public DiffusionModel {
         return flux.get_params_buffer_size();
     }
 
+    GGMLRunner* get_runner() {
+        return &flux;
+    }
+
     int64_t get_adm_in_channels() {
         return 768;
     }
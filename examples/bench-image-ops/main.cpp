@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml_extend.hpp"
+#include "image_ops.h"
+#include "stable-diffusion.h"
+
+// Micro-benchmark of the image conversion and resize kernels.
+// Compares them against the per-pixel reference loops they replaced (ggml_tensor_get_f32 / set_f32
+// stride math) and reports the throughput of both in megapixels per second.
+//
+// usage: sd-bench-image-ops [width] [height] [threads] [repeat]
+//   defaults: 2048 2048, all cores, 5 repeats
+
+/*=========================================== Reference implementations ==========================================*/
+
+static void reference_image_to_tensor(const uint8_t* image_data, ggml_tensor* output) {
+    int64_t width    = output->ne[0];
+    int64_t height   = output->ne[1];
+    int64_t channels = output->ne[2];
+    for (int iy = 0; iy < height; iy++) {
+        for (int ix = 0; ix < width; ix++) {
+            for (int k = 0; k < channels; k++) {
+                float value = *(image_data + iy * width * channels + ix * channels + k);
+                ggml_tensor_set_f32(output, value / 255.f, ix, iy, k);
+            }
+        }
+    }
+}
+
+static void reference_tensor_to_image(ggml_tensor* input, uint8_t* image_data) {
+    int64_t width    = input->ne[0];
+    int64_t height   = input->ne[1];
+    int64_t channels = input->ne[2];
+    for (int iy = 0; iy < height; iy++) {
+        for (int ix = 0; ix < width; ix++) {
+            for (int k = 0; k < channels; k++) {
+                float value                                               = ggml_tensor_get_f32(input, ix, iy, k);
+                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
+            }
+        }
+    }
+}
+
+static float interpolate(float v1, float v2, float v3, float v4, float x_ratio, float y_ratio) {
+    return v1 * (1 - x_ratio) * (1 - y_ratio) + v2 * x_ratio * (1 - y_ratio) + v3 * (1 - x_ratio) * y_ratio + v4 * x_ratio * y_ratio;
+}
+
+static void reference_resize(const float* src, int width, int height, float* dst, int target_width, int target_height, int channels) {
+    for (int y = 0; y < target_height; y++) {
+        for (int x = 0; x < target_width; x++) {
+            float original_x = (float)x * width / target_width;
+            float original_y = (float)y * height / target_height;
+
+            // clamped, the original read one pixel past the right and bottom edges
+            int x1 = (int)original_x;
+            int y1 = (int)original_y;
+            int x2 = std::min(x1 + 1, width - 1);
+            int y2 = std::min(y1 + 1, height - 1);
+
+            for (int k = 0; k < channels; k++) {
+                float v1 = *(src + y1 * width * channels + x1 * channels + k);
+                float v2 = *(src + y1 * width * channels + x2 * channels + k);
+                float v3 = *(src + y2 * width * channels + x1 * channels + k);
+                float v4 = *(src + y2 * width * channels + x2 * channels + k);
+
+                float x_ratio = original_x - x1;
+                float y_ratio = original_y - y1;
+
+                *(dst + y * target_width * channels + x * channels + k) = interpolate(v1, v2, v3, v4, x_ratio, y_ratio);
+            }
+        }
+    }
+}
+
+static void reference_normalize(float* data, int width, int height, int channels, const float* means, const float* stds) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int k = 0; k < channels; k++) {
+                int index   = (y * width + x) * channels + k;
+                data[index] = (data[index] - means[k]) / stds[k];
+            }
+        }
+    }
+}
+
+/*==================================================== Benchmark =====================================================*/
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+template <typename F>
+static double time_ms(int repeat, F f) {
+    f();  // warm up
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        f();
+    }
+    return ms_since(t0) / repeat;
+}
+
+static void report(const char* name, double megapixels, double reference_ms, double ms, double max_diff) {
+    if (reference_ms > 0) {
+        printf("%-24s %10.1f MP/s %10.1f MP/s %8.1fx   max diff %g\n",
+               name, megapixels / reference_ms * 1000, megapixels / ms * 1000, reference_ms / ms, max_diff);
+    } else {
+        printf("%-24s %10s      %10.1f MP/s\n", name, "-", megapixels / ms * 1000);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    int width     = argc > 1 ? atoi(argv[1]) : 2048;
+    int height    = argc > 2 ? atoi(argv[2]) : 2048;
+    int n_threads = argc > 3 ? atoi(argv[3]) : 0;
+    int repeat    = argc > 4 ? std::max(1, atoi(argv[4])) : 5;
+    int channels  = 3;
+
+    size_t n = (size_t)width * height * channels;
+    std::vector<uint8_t> image(n);
+    std::mt19937 gen(42);
+    for (auto& value : image) {
+        value = (uint8_t)(gen() % 256);
+    }
+
+    struct ggml_init_params params;
+    params.mem_size   = n * sizeof(float) * 2 + 2 * ggml_tensor_overhead();
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* ctx = ggml_init(params);
+    if (!ctx) {
+        fprintf(stderr, "ggml_init() failed\n");
+        return 1;
+    }
+    ggml_tensor* reference_tensor = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, width, height, channels, 1);
+    ggml_tensor* tensor           = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, width, height, channels, 1);
+    double megapixels             = width * (double)height / 1e6;
+    double max_diff;
+
+    printf("%dx%d, %d repeats\n", width, height, repeat);
+    printf("%-24s %15s %15s %9s\n", "", "reference", "image_ops", "speedup");
+
+    // u8 HWC -> f32 CHW
+    float a[3] = {1.0f / 255.0f, 1.0f / 255.0f, 1.0f / 255.0f};
+    float b[3] = {0.0f, 0.0f, 0.0f};
+    double reference_ms = time_ms(repeat, [&]() { reference_image_to_tensor(image.data(), reference_tensor); });
+    double ms           = time_ms(repeat, [&]() {
+        sd_image_u8_to_f32_planar(image.data(), (float*)tensor->data, width, height, channels, a, b, n_threads);
+    });
+    max_diff            = 0;
+    for (size_t i = 0; i < n; i++) {
+        max_diff = std::max(max_diff, (double)fabsf(((float*)tensor->data)[i] - ((float*)reference_tensor->data)[i]));
+    }
+    report("u8 -> f32 planar", megapixels, reference_ms, ms, max_diff);
+
+    // f32 CHW -> u8 HWC
+    std::vector<uint8_t> reference_out(n);
+    std::vector<uint8_t> out(n);
+    reference_ms = time_ms(repeat, [&]() { reference_tensor_to_image(reference_tensor, reference_out.data()); });
+    ms           = time_ms(repeat, [&]() {
+        sd_image_f32_planar_to_u8((float*)tensor->data, out.data(), width, height, channels, 255.0f, 0.0f, n_threads);
+    });
+    max_diff     = 0;
+    for (size_t i = 0; i < n; i++) {
+        max_diff = std::max(max_diff, (double)abs(out[i] - reference_out[i]));
+    }
+    report("f32 planar -> u8", megapixels, reference_ms, ms, max_diff);
+
+    // resize to 1.5x, in megapixels of output
+    std::vector<float> image_f32(n);
+    sd_u8_to_f32_row(image.data(), image_f32.data(), n, 1.0f, 0.0f);
+    int target_width  = width * 3 / 2;
+    int target_height = height * 3 / 2;
+    double target_mp  = target_width * (double)target_height / 1e6;
+    std::vector<float> reference_resized((size_t)target_width * target_height * channels);
+    std::vector<float> resized(reference_resized.size());
+    reference_ms = time_ms(repeat, [&]() {
+        reference_resize(image_f32.data(), width, height, reference_resized.data(), target_width, target_height, channels);
+    });
+    ms           = time_ms(repeat, [&]() {
+        sd_image_f32_resize_bilinear(image_f32.data(), width, height, resized.data(), target_width, target_height, channels, n_threads);
+    });
+    max_diff     = 0;
+    for (size_t i = 0; i < resized.size(); i++) {
+        max_diff = std::max(max_diff, (double)fabsf(resized[i] - reference_resized[i]));
+    }
+    report("bilinear resize 1.5x", target_mp, reference_ms, ms, max_diff);
+
+    ms = time_ms(repeat, [&]() {
+        sd_image_f32_resize_bicubic(image_f32.data(), width, height, resized.data(), target_width, target_height, channels, n_threads);
+    });
+    report("bicubic resize 1.5x", target_mp, 0, ms, 0);
+
+    // normalization, in place so the inputs drift between repeats, only the time matters here
+    const float means[3] = {0.48145466f, 0.4578275f, 0.40821073f};
+    const float stds[3]  = {0.26862954f, 0.26130258f, 0.27577711f};
+    std::vector<float> reference_normalized(image_f32);
+    std::vector<float> normalized(image_f32);
+    reference_ms = time_ms(repeat, [&]() { reference_normalize(reference_normalized.data(), width, height, channels, means, stds); });
+    ms           = time_ms(repeat, [&]() { sd_image_f32_normalize(normalized.data(), width, height, channels, means, stds, n_threads); });
+    report("normalize", megapixels, reference_ms, ms, 0);
+
+    // canny control image, preprocess_canny takes ownership of its input
+    ms = time_ms(repeat, [&]() {
+        uint8_t* input = (uint8_t*)malloc(n);
+        memcpy(input, image.data(), n);
+        free(preprocess_canny(input, width, height, 0.08f, 0.08f, 0.8f, 1.0f, false));
+    });
+    report("canny", megapixels, 0, ms, 0);
+
+    ggml_free(ctx);
+    return 0;
+}
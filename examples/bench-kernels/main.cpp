@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "denoiser.hpp"
+#include "ggml_extend.hpp"
+#include "latent-preview.h"
+#include "model.h"
+#include "rng_philox.hpp"
+
+// Micro-benchmarks of the host side kernels around the model graphs: CFG combine, sampler updates, tile split and
+// merge, noise generation, image to tensor, latent preview and the weight conversions of the loader.
+// Every benchmark runs its body until it takes at least --min-time seconds, like Google Benchmark, and reports
+// the time per iteration and the throughput. Sizes are those of real runs, 128x128 latents are 1024x1024 images.
+//
+// usage: sd-bench-kernels [--filter REGEX] [--min-time SECONDS] [--list]
+
+/*=================================================== Harness ====================================================*/
+
+struct Benchmark {
+    std::string name;
+    double items;      // per iteration, for the throughput
+    const char* unit;  // of the items
+    // allocates the inputs and returns the measured body, called only for the benchmarks that run
+    std::function<std::function<void()>()> setup;
+};
+
+static std::vector<Benchmark>& benchmarks() {
+    static std::vector<Benchmark> list;
+    return list;
+}
+
+static void add_benchmark(const std::string& name, double items, const char* unit, std::function<std::function<void()>()> setup) {
+    Benchmark benchmark;
+    benchmark.name  = name;
+    benchmark.items = items;
+    benchmark.unit  = unit;
+    benchmark.setup = setup;
+    benchmarks().push_back(benchmark);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void run_benchmark(const Benchmark& benchmark, double min_time) {
+    std::function<void()> body = benchmark.setup();
+    body();  // warm up
+
+    // grows the iteration count until a run takes min_time, the last run is the measurement
+    int64_t iterations = 1;
+    double elapsed     = 0;
+    while (true) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < iterations; i++) {
+            body();
+        }
+        elapsed = seconds_since(t0);
+        if (elapsed >= min_time || iterations >= 1000000000) {
+            break;
+        }
+        double multiplier = elapsed > 0 ? std::min(10.0, min_time * 1.4 / elapsed) : 10.0;
+        iterations        = std::max(iterations + 1, (int64_t)(iterations * multiplier));
+    }
+    double per_iteration = elapsed / iterations;
+    printf("%-52s %12.1f us %12lld %10.1f M%s/s\n",
+           benchmark.name.c_str(),
+           per_iteration * 1e6,
+           (long long)iterations,
+           benchmark.items / per_iteration / 1e6,
+           benchmark.unit);
+    fflush(stdout);
+}
+
+/*==================================================== Inputs ====================================================*/
+
+static std::shared_ptr<ggml_context> new_context(size_t mem_size) {
+    struct ggml_init_params params;
+    params.mem_size   = mem_size + 16 * ggml_tensor_overhead();
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+    return std::shared_ptr<ggml_context>(ggml_init(params), ggml_free);
+}
+
+static void fill_randn(float* data, size_t n, uint32_t offset) {
+    PhiloxRNG::randn(42, offset, 0, n, data);
+}
+
+struct LatentSize {
+    const char* name;
+    int width;
+    int height;
+    int channels;
+
+    int64_t nelements() const {
+        return (int64_t)width * height * channels;
+    }
+
+    std::string str() const {
+        return std::to_string(width) + "x" + std::to_string(height) + "x" + std::to_string(channels);
+    }
+};
+
+// sd1 512x512, sdxl and sd3/flux 1024x1024
+static const LatentSize latent_sizes[] = {
+    {"sd1", 64, 64, 4},
+    {"sdxl", 128, 128, 4},
+    {"flux", 128, 128, 16},
+};
+
+/*================================================== Benchmarks ==================================================*/
+
+static sd_guidance_params_t default_guidance() {
+    sd_guidance_params_t guidance;
+    memset(&guidance, 0, sizeof(guidance));
+    guidance.txt_cfg = 7.0f;
+    guidance.img_cfg = 7.0f;
+    guidance.min_cfg = 7.0f;
+    guidance.apg.eta = 1.0f;
+    return guidance;
+}
+
+static void add_cfg_benchmarks() {
+    struct Variant {
+        const char* name;
+        bool negative;
+        bool img_cond;
+        bool skip_layer;
+        bool apg;
+    };
+    const Variant variants[] = {
+        {"classic", true, false, false, false},
+        {"apg", true, false, false, true},
+        {"img_cfg", true, true, false, false},
+        {"slg", true, false, true, false},
+    };
+    for (const LatentSize& size : latent_sizes) {
+        for (const Variant& variant : variants) {
+            add_benchmark("cfg_combine/" + std::string(variant.name) + "/" + size.str(), (double)size.nelements(), "elem", [=]() {
+                int64_t n = size.nelements();
+                auto data = std::make_shared<std::vector<float>>(7 * n);
+                fill_randn(data->data(), data->size(), 0);
+                sd_guidance_params_t guidance = default_guidance();
+                float img_cfg_scale           = guidance.img_cfg;
+                if (variant.img_cond) {
+                    img_cfg_scale = 1.5f;
+                }
+                if (variant.skip_layer) {
+                    guidance.slg.scale = 2.5f;
+                }
+                if (variant.apg) {
+                    guidance.apg.eta           = 0.0f;
+                    guidance.apg.momentum      = -0.5f;
+                    guidance.apg.norm_treshold = 15.0f;
+                }
+                return [=]() {
+                    float* p = data->data();
+                    cfg_combine(p,
+                                p + n,
+                                p + 2 * n,
+                                variant.negative ? p + 3 * n : NULL,
+                                variant.img_cond ? p + 4 * n : NULL,
+                                variant.skip_layer ? p + 5 * n : NULL,
+                                p + 6 * n,
+                                (int)n,
+                                1,
+                                guidance,
+                                img_cfg_scale,
+                                -0.5f,
+                                1.0f);
+                };
+            });
+        }
+    }
+}
+
+static void add_sampler_benchmarks() {
+    const char* names[] = {"euler_a", "euler", "heun", "dpm2", "dpm++2s_a", "dpm++2m", "dpm++2mv2", "ipndm", "ipndm_v", "lcm", "ddim_trailing", "tcd"};
+    const int steps        = 20;
+    const LatentSize& size = latent_sizes[1];
+    for (int method = 0; method < N_SAMPLE_METHODS; method++) {
+        // items are latent elements times steps
+        add_benchmark("sampler/" + std::string(names[method]) + "/" + size.str() + "/" + std::to_string(steps) + " steps",
+                      (double)size.nelements() * steps, "elem", [=]() {
+                          int64_t n        = size.nelements();
+                          auto ctx         = new_context(2 * n * sizeof(float));
+                          ggml_tensor* x0  = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, size.width, size.height, size.channels);
+                          ggml_tensor* out = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, size.width, size.height, size.channels);
+                          fill_randn((float*)x0->data, n, 0);
+                          auto model_output = std::make_shared<std::vector<float>>(n);
+                          fill_randn(model_output->data(), n, 1);
+
+                          // geometric sigmas from 14.6 to 0.03, then 0
+                          std::vector<float> sigmas;
+                          for (int i = 0; i < steps; i++) {
+                              sigmas.push_back(14.6f * powf(0.03f / 14.6f, i / (float)(steps - 1)));
+                          }
+                          sigmas.push_back(0.0f);
+                          std::shared_ptr<RNG> rng = std::make_shared<PhiloxRNG>(42);
+
+                          // the model is a copy of a fixed output, all the measured work is the sampler's
+                          denoise_cb_t denoise = [=](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
+                              memcpy(out->data, model_output->data(), n * sizeof(float));
+                              return out;
+                          };
+                          return [ctx, x0, n, denoise, sigmas, rng, method]() {
+                              // the samplers allocate their buffers in work_ctx
+                              auto work_ctx  = new_context(16 * n * sizeof(float));
+                              ggml_tensor* x = ggml_dup_tensor(work_ctx.get(), x0);
+                              memcpy(x->data, x0->data, n * sizeof(float));
+                              rng->manual_seed(42);
+                              sample_k_diffusion((sample_method_t)method, denoise, work_ctx.get(), x, sigmas, rng, 0.0f);
+                          };
+                      });
+    }
+}
+
+static void add_tiling_benchmarks() {
+    // VAE decode of a 1024x1024 image with the default 32x32 latent tiles and 0.5 overlap
+    const int latent_size     = 128;
+    const int scale           = 8;
+    const int image_size      = latent_size * scale;
+    sd_tiling_layout_t layout = sd_tiling_get_layout(latent_size, latent_size, image_size, image_size, scale, 32, 32, 0.5f);
+
+    add_benchmark("split_tensor_2d/" + std::to_string(latent_size) + "x" + std::to_string(latent_size) + "x4/" + std::to_string(layout.tiles.size()) + " tiles",
+                  (double)layout.tiles.size() * layout.input_tile_size_x * layout.input_tile_size_y, "px", [=]() {
+                      auto ctx            = new_context((latent_size * latent_size + layout.input_tile_size_x * layout.input_tile_size_y) * 4 * sizeof(float));
+                      ggml_tensor* input  = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, latent_size, latent_size, 4);
+                      ggml_tensor* tile   = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, layout.input_tile_size_x, layout.input_tile_size_y, 4);
+                      fill_randn((float*)input->data, ggml_nelements(input), 0);
+                      return [ctx, input, tile, layout]() {
+                          for (const sd_tile_t& t : layout.tiles) {
+                              ggml_split_tensor_2d(input, tile, t.x_in, t.y_in);
+                          }
+                      };
+                  });
+
+    add_benchmark("merge_tensor_2d/" + std::to_string(image_size) + "x" + std::to_string(image_size) + "x3/" + std::to_string(layout.tiles.size()) + " tiles",
+                  (double)layout.tiles.size() * layout.output_tile_size_x * layout.output_tile_size_y, "px", [=]() {
+                      auto ctx            = new_context(((size_t)image_size * image_size + layout.output_tile_size_x * layout.output_tile_size_y) * 3 * sizeof(float));
+                      ggml_tensor* output = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, image_size, image_size, 3);
+                      ggml_tensor* tile   = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, layout.output_tile_size_x, layout.output_tile_size_y, 3);
+                      fill_randn((float*)tile->data, ggml_nelements(tile), 0);
+                      return [ctx, output, tile, layout]() {
+                          for (const sd_tile_t& t : layout.tiles) {
+                              ggml_merge_tensor_2d(tile, output, t.x_out, t.y_out, layout.overlap_x_out, layout.overlap_y_out, t.dx, t.dy);
+                          }
+                      };
+                  });
+}
+
+static void add_noise_benchmarks() {
+    for (const LatentSize& size : latent_sizes) {
+        for (int philox = 0; philox < 2; philox++) {
+            add_benchmark("set_f32_randn/" + std::string(philox ? "philox" : "std_default") + "/" + size.str(), (double)size.nelements(), "elem", [=]() {
+                auto ctx            = new_context(size.nelements() * sizeof(float));
+                ggml_tensor* tensor = ggml_new_tensor_3d(ctx.get(), GGML_TYPE_F32, size.width, size.height, size.channels);
+                std::shared_ptr<RNG> rng;
+                if (philox) {
+                    rng = std::make_shared<PhiloxRNG>(42);
+                } else {
+                    rng = std::make_shared<STDDefaultRNG>();
+                }
+                return [ctx, tensor, rng]() {
+                    ggml_tensor_set_f32_randn(tensor, rng);
+                };
+            });
+        }
+    }
+}
+
+static void add_image_benchmarks() {
+    const int image_sizes[] = {512, 1024};
+    for (int image_size : image_sizes) {
+        add_benchmark("image_to_tensor/" + std::to_string(image_size) + "x" + std::to_string(image_size), (double)image_size * image_size, "px", [=]() {
+            size_t n            = (size_t)image_size * image_size * 3;
+            auto ctx            = new_context(n * sizeof(float));
+            ggml_tensor* tensor = ggml_new_tensor_4d(ctx.get(), GGML_TYPE_F32, image_size, image_size, 3, 1);
+            auto image          = std::make_shared<std::vector<uint8_t>>(n);
+            for (size_t i = 0; i < n; i++) {
+                (*image)[i] = (uint8_t)(i * 2654435761u >> 24);
+            }
+            return [ctx, tensor, image]() {
+                sd_image_to_tensor(image->data(), tensor);
+            };
+        });
+    }
+
+    for (const LatentSize& size : latent_sizes) {
+        const float(*proj)[3] = size.channels == 16 ? flux_latent_rgb_proj : sd_latent_rgb_proj;
+        add_benchmark("preview_latent_image/" + size.str(), (double)size.width * size.height, "px", [=]() {
+            auto ctx             = new_context(size.nelements() * sizeof(float));
+            ggml_tensor* latents = ggml_new_tensor_4d(ctx.get(), GGML_TYPE_F32, size.width, size.height, size.channels, 1);
+            fill_randn((float*)latents->data, size.nelements(), 0);
+            auto buffer = std::make_shared<std::vector<uint8_t>>((size_t)size.width * size.height * 3);
+            return [ctx, latents, buffer, proj, size]() {
+                preview_latent_image(buffer->data(), latents, proj, size.width, size.height, size.channels);
+            };
+        });
+    }
+}
+
+static void add_conversion_benchmarks() {
+    // a 3072x3072 weight, the size of the Flux attention projections
+    const int n_per_row = 3072;
+    const int nrows     = 3072;
+    const int64_t n     = (int64_t)n_per_row * nrows;
+
+    struct Conversion {
+        ggml_type src;
+        ggml_type dst;
+    };
+    const Conversion conversions[] = {
+        {GGML_TYPE_F32, GGML_TYPE_F16},
+        {GGML_TYPE_F16, GGML_TYPE_F32},
+        {GGML_TYPE_F32, GGML_TYPE_Q8_0},
+        {GGML_TYPE_F32, GGML_TYPE_Q4_0},
+        {GGML_TYPE_F32, GGML_TYPE_Q4_K},
+        {GGML_TYPE_F16, GGML_TYPE_Q8_0},
+        {GGML_TYPE_Q8_0, GGML_TYPE_F32},
+    };
+    for (const Conversion& conversion : conversions) {
+        std::string name = "convert_tensor/" + std::string(ggml_type_name(conversion.src)) + "->" + ggml_type_name(conversion.dst) +
+                           "/" + std::to_string(nrows) + "x" + std::to_string(n_per_row);
+        add_benchmark(name, (double)n, "elem", [=]() {
+            auto values = std::make_shared<std::vector<float>>(n);
+            fill_randn(values->data(), n, 0);
+            auto src = std::make_shared<std::vector<uint8_t>>(ggml_row_size(conversion.src, n_per_row) * nrows);
+            auto dst = std::make_shared<std::vector<uint8_t>>(ggml_row_size(conversion.dst, n_per_row) * nrows);
+            convert_tensor(values->data(), GGML_TYPE_F32, src->data(), conversion.src, nrows, n_per_row);
+            return [=]() {
+                convert_tensor(src->data(), conversion.src, dst->data(), conversion.dst, nrows, n_per_row);
+            };
+        });
+    }
+
+    add_benchmark("bf16_to_f32_vec/" + std::to_string(n), (double)n, "elem", [=]() {
+        auto src = std::make_shared<std::vector<uint16_t>>(n);
+        auto dst = std::make_shared<std::vector<float>>(n);
+        for (int64_t i = 0; i < n; i++) {
+            (*src)[i] = (uint16_t)(0x3f80 + (i & 0x7f));  // 1.0 .. 1.99
+        }
+        return [=]() {
+            bf16_to_f32_vec(src->data(), dst->data(), n);
+        };
+    });
+}
+
+int main(int argc, const char* argv[]) {
+    std::string filter = ".*";
+    double min_time    = 0.5;
+    bool list          = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (arg == "--list") {
+            list = true;
+        } else {
+            printf("usage: %s [--filter REGEX] [--min-time SECONDS] [--list]\n", argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    add_cfg_benchmarks();
+    add_sampler_benchmarks();
+    add_tiling_benchmarks();
+    add_noise_benchmarks();
+    add_image_benchmarks();
+    add_conversion_benchmarks();
+
+    std::regex re(filter);
+    if (!list) {
+        printf("%-52s %15s %12s %15s\n", "benchmark", "time", "iterations", "throughput");
+    }
+    for (const Benchmark& benchmark : benchmarks()) {
+        if (!std::regex_search(benchmark.name, re)) {
+            continue;
+        }
+        if (list) {
+            printf("%s\n", benchmark.name.c_str());
+        } else {
+            run_benchmark(benchmark, min_time);
+        }
+    }
+    return 0;
+}
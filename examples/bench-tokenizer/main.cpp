@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "clip.hpp"
+
+// Micro-benchmark of CLIPTokenizer::encode.
+// Compares the token ids against the regex based reference implementation (the openai simple_tokenizer.py port
+// CLIPTokenizer used to be) and reports the time per prompt of both.
+//
+// usage: sd-bench-tokenizer [prompts.txt] [repeat]
+//   prompts.txt: one prompt per line, built-in prompts are used if not given
+
+/*================================================ Reference tokenizer ===============================================*/
+
+class ReferenceTokenizer {
+    std::map<int, std::u32string> byte_encoder;
+    std::map<std::u32string, int> encoder;
+    std::map<std::pair<std::u32string, std::u32string>, int> bpe_ranks;
+
+    static std::set<std::pair<std::u32string, std::u32string>> get_pairs(const std::vector<std::u32string>& subwords) {
+        std::set<std::pair<std::u32string, std::u32string>> pairs;
+        for (size_t i = 1; i < subwords.size(); i++) {
+            pairs.insert(std::make_pair(subwords[i - 1], subwords[i]));
+        }
+        return pairs;
+    }
+
+    std::u32string bpe(const std::u32string& token) {
+        std::vector<std::u32string> word;
+        for (size_t i = 0; i < token.size() - 1; i++) {
+            word.emplace_back(1, token[i]);
+        }
+        word.push_back(token.substr(token.size() - 1) + utf8_to_utf32("</w>"));
+
+        std::set<std::pair<std::u32string, std::u32string>> pairs = get_pairs(word);
+        if (pairs.empty()) {
+            return token + utf8_to_utf32("</w>");
+        }
+
+        while (true) {
+            auto bigram = std::min_element(pairs.begin(),
+                                           pairs.end(),
+                                           [&](const std::pair<std::u32string, std::u32string>& a,
+                                               const std::pair<std::u32string, std::u32string>& b) {
+                                               if (bpe_ranks.find(a) == bpe_ranks.end()) {
+                                                   return false;
+                                               } else if (bpe_ranks.find(b) == bpe_ranks.end()) {
+                                                   return true;
+                                               }
+                                               return bpe_ranks.at(a) < bpe_ranks.at(b);
+                                           });
+            if (bpe_ranks.find(*bigram) == bpe_ranks.end()) {
+                break;
+            }
+            std::u32string first  = bigram->first;
+            std::u32string second = bigram->second;
+            std::vector<std::u32string> new_word;
+            size_t i = 0;
+            while (i < word.size()) {
+                auto it = std::find(word.begin() + i, word.end(), first);
+                if (it == word.end()) {
+                    new_word.insert(new_word.end(), word.begin() + i, word.end());
+                    break;
+                }
+                new_word.insert(new_word.end(), word.begin() + i, it);
+                i = std::distance(word.begin(), it);
+                if (i + 1 < word.size() && word[i + 1] == second) {
+                    new_word.push_back(first + second);
+                    i += 2;
+                } else {
+                    new_word.push_back(word[i]);
+                    i += 1;
+                }
+            }
+            word = new_word;
+            if (word.size() == 1) {
+                break;
+            }
+            pairs = get_pairs(word);
+        }
+
+        std::u32string result;
+        for (size_t i = 0; i < word.size(); i++) {
+            result += word[i];
+            if (i != word.size() - 1) {
+                result += utf8_to_utf32(" ");
+            }
+        }
+        return result;
+    }
+
+public:
+    ReferenceTokenizer(const std::string& merges_utf8_str) {
+        auto byte_unicode_pairs = bytes_to_unicode();
+        byte_encoder            = std::map<int, std::u32string>(byte_unicode_pairs.begin(), byte_unicode_pairs.end());
+
+        std::vector<std::u32string> merges;
+        size_t start = 0;
+        size_t pos;
+        std::u32string merges_utf32_str = utf8_to_utf32(merges_utf8_str);
+        while ((pos = merges_utf32_str.find('\n', start)) != std::string::npos) {
+            merges.push_back(merges_utf32_str.substr(start, pos - start));
+            start = pos + 1;
+        }
+        merges = std::vector<std::u32string>(merges.begin() + 1, merges.end());
+
+        std::vector<std::u32string> vocab;
+        for (const auto& pair : byte_unicode_pairs) {
+            vocab.push_back(pair.second);
+        }
+        for (const auto& pair : byte_unicode_pairs) {
+            vocab.push_back(pair.second + utf8_to_utf32("</w>"));
+        }
+        int rank = 0;
+        for (const auto& merge : merges) {
+            size_t space_pos = merge.find(' ');
+            auto merge_pair  = std::make_pair(merge.substr(0, space_pos), merge.substr(space_pos + 1));
+            vocab.push_back(merge_pair.first + merge_pair.second);
+            bpe_ranks[merge_pair] = rank++;
+        }
+        vocab.push_back(utf8_to_utf32("<|startoftext|>"));
+        vocab.push_back(utf8_to_utf32("<|endoftext|>"));
+        for (size_t i = 0; i < vocab.size(); i++) {
+            encoder[vocab[i]] = (int)i;
+        }
+    }
+
+    std::vector<int> encode(std::string text) {
+        std::vector<int> bpe_tokens;
+        text = std::regex_replace(text, std::regex(R"(\s+)"), " ");
+        text = trim(text);
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        std::regex pat(R"(<\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+)",
+                       std::regex::icase);
+        std::smatch matches;
+        std::string str = text;
+        while (std::regex_search(str, matches, pat)) {
+            std::string token_str = matches[0].str();
+            std::u32string utf32_token;
+            for (size_t i = 0; i < token_str.length(); i++) {
+                utf32_token += byte_encoder[(unsigned char)token_str[i]];
+            }
+            auto bpe_strs = bpe(utf32_token);
+            size_t start  = 0;
+            size_t pos;
+            while ((pos = bpe_strs.find(' ', start)) != std::u32string::npos) {
+                bpe_tokens.push_back(encoder[bpe_strs.substr(start, pos - start)]);
+                start = pos + 1;
+            }
+            bpe_tokens.push_back(encoder[bpe_strs.substr(start)]);
+            str = matches.suffix();
+        }
+        return bpe_tokens;
+    }
+};
+
+/*==================================================== Benchmark =====================================================*/
+
+const char* builtin_prompts[] = {
+    "a lovely cat",
+    "masterpiece, best quality, (photorealistic:1.4), a portrait of an old fisherman, weathered face, "
+    "dramatic lighting, 85mm lens, f/1.8, bokeh, film grain, kodak portra 400, highly detailed skin texture",
+    "a photo of an astronaut riding a horse on mars, 4k, trending on artstation, octane render, volumetric light",
+    "(((best quality))), [[[worst quality]]], 1girl, solo, long hair, looking at viewer, smile, blue eyes, "
+    "outdoors, sky, day, cloud, tree, blue sky, grass, building, scenery, city, cityscape, skyscraper, sunset",
+    "it's a cat's world, they're everywhere; we'll see 1234567890 of them, don't we? <|endoftext|>",
+    "ultra wide angle shot of a cyberpunk street at night, neon signs in japanese, 日本語, rain, reflections, "
+    "café, naïve art style, crowded, bladerunner 2049 color grading, cinematic, anamorphic lens flare",
+};
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, const char* argv[]) {
+    std::vector<std::string> prompts;
+    int repeat = 20;
+    if (argc > 1) {
+        std::ifstream file(argv[1]);
+        if (!file.is_open()) {
+            fprintf(stderr, "failed to open %s\n", argv[1]);
+            return 1;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            prompts.push_back(line);
+        }
+    } else {
+        for (const char* prompt : builtin_prompts) {
+            prompts.push_back(prompt);
+        }
+        // a long prompt of many chunks and random bytes for the edge cases of the pre-tokenizer
+        std::string long_prompt;
+        for (int i = 0; i < 8; i++) {
+            long_prompt += std::string(builtin_prompts[i % 6]) + ", ";
+        }
+        prompts.push_back(long_prompt);
+        std::mt19937 gen(42);
+        for (int i = 0; i < 200; i++) {
+            std::string random_prompt;
+            int n = gen() % 64;
+            for (int j = 0; j < n; j++) {
+                random_prompt += (char)(gen() % 256);
+            }
+            prompts.push_back(random_prompt);
+        }
+    }
+    if (argc > 2) {
+        repeat = std::max(1, atoi(argv[2]));
+    }
+
+    std::string merges = ModelLoader::load_merges();
+    ReferenceTokenizer reference(merges);
+    CLIPTokenizer tokenizer;
+    auto on_new_token_cb = [&](std::string& str, std::vector<int32_t>& bpe_tokens) -> bool {
+        return false;
+    };
+
+    // correctness
+    size_t mismatches = 0;
+    size_t n_tokens   = 0;
+    for (const auto& prompt : prompts) {
+        std::vector<int> expected = reference.encode(prompt);
+        std::vector<int> tokens   = tokenizer.encode(prompt, on_new_token_cb);
+        n_tokens += tokens.size();
+        if (tokens != expected) {
+            mismatches++;
+            fprintf(stderr, "token mismatch for prompt \"%s\" (%zu vs %zu tokens)\n",
+                    prompt.c_str(), tokens.size(), expected.size());
+        }
+    }
+    printf("%zu prompts, %zu tokens, %zu mismatches\n", prompts.size(), n_tokens, mismatches);
+
+    // speed, the first pass of CLIPTokenizer fills its word cache
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        for (const auto& prompt : prompts) {
+            reference.encode(prompt);
+        }
+    }
+    double reference_ms = ms_since(t0) / repeat;
+
+    CLIPTokenizer cold_tokenizer;
+    t0 = std::chrono::steady_clock::now();
+    for (const auto& prompt : prompts) {
+        cold_tokenizer.encode(prompt, on_new_token_cb);
+    }
+    double cold_ms = ms_since(t0);
+
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        for (const auto& prompt : prompts) {
+            tokenizer.encode(prompt, on_new_token_cb);
+        }
+    }
+    double warm_ms = ms_since(t0) / repeat;
+
+    printf("reference:           %10.3f ms\n", reference_ms);
+    printf("CLIPTokenizer cold:  %10.3f ms\n", cold_ms);
+    printf("CLIPTokenizer warm:  %10.3f ms\n", warm_ms);
+
+    return mismatches == 0 ? 0 : 1;
+}
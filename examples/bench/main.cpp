@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "json.hpp"
+#include "stable-diffusion.h"
+
+// End-to-end benchmark of txt2img.
+// Loads the model once per thread count and runs every combination of resolution, batch size, sampler,
+// step count and VAE tiling. Each combination gets warmup runs that are not measured, then repeat measured
+// runs with the same seed. Stage times and compute buffer sizes come from sd_get_generation_stats,
+// the results go to stdout as a table and optionally to JSON and CSV files.
+//
+// usage: sd-bench -m model [options], see print_usage
+
+using json = nlohmann::json;
+
+// Names of the sampler method, same order as enum sample_method in stable-diffusion.h
+const char* sample_method_str[] = {
+    "euler_a",
+    "euler",
+    "heun",
+    "dpm2",
+    "dpm++2s_a",
+    "dpm++2m",
+    "dpm++2mv2",
+    "ipndm",
+    "ipndm_v",
+    "lcm",
+    "ddim_trailing",
+    "tcd",
+};
+
+struct BenchParams {
+    std::string model_path;
+    std::string clip_l_path;
+    std::string clip_g_path;
+    std::string t5xxl_path;
+    std::string diffusion_model_path;
+    std::string vae_path;
+    std::string taesd_path;
+    sd_type_t wtype           = SD_TYPE_COUNT;
+    bool clip_on_cpu          = false;
+    bool vae_on_cpu           = false;
+    bool diffusion_flash_attn = false;
+    bool use_mmap             = false;
+
+    std::string prompt          = "a lovely cat sitting on a windowsill, highly detailed";
+    std::string negative_prompt = "";
+    float cfg_scale             = 7.0f;
+    float guidance              = 3.5f;
+    int64_t seed                = 42;
+
+    std::vector<std::pair<int, int>> resolutions = {{512, 512}};
+    std::vector<int> batch_sizes                 = {1};
+    std::vector<sample_method_t> samplers        = {EULER_A};
+    std::vector<int> steps                       = {20};
+    std::vector<int> threads                     = {-1};
+    std::vector<bool> tiling                     = {false};
+
+    int warmup = 1;
+    int repeat = 3;
+    std::string json_path;
+    std::string csv_path;
+    bool verbose = false;
+};
+
+void print_usage(int argc, const char* argv[]) {
+    printf("usage: %s -m MODEL [options]\n", argv[0]);
+    printf("\n");
+    printf("model:\n");
+    printf("  -m, --model [MODEL]                path to full model\n");
+    printf("  --diffusion-model [PATH]           path to the standalone diffusion model\n");
+    printf("  --clip_l [PATH], --clip_g [PATH], --t5xxl [PATH], --vae [PATH], --taesd [PATH]\n");
+    printf("  --type [TYPE]                      weight type (examples: f32, f16, q4_0, q8_0)\n");
+    printf("  --clip-on-cpu, --vae-on-cpu, --diffusion-fa\n");
+    printf("  --mmap                             use the cpu weights in place from the mapped model files\n");
+    printf("\n");
+    printf("generation:\n");
+    printf("  -p, --prompt [PROMPT]              the prompt to render\n");
+    printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
+    printf("  --cfg-scale SCALE                  (default: 7.0)\n");
+    printf("  --guidance SCALE                   distilled guidance scale (default: 3.5)\n");
+    printf("  -s, --seed SEED                    the same for every run (default: 42)\n");
+    printf("\n");
+    printf("sweep, comma separated lists:\n");
+    printf("  --resolutions WxH,...              (default: 512x512)\n");
+    printf("  --batch-sizes N,...                (default: 1)\n");
+    printf("  --samplers NAME,...                (default: euler_a)\n");
+    printf("  --steps N,...                      (default: 20)\n");
+    printf("  -t, --threads N,...                the model is loaded once per thread count (default: physical cores)\n");
+    printf("  --tiling off,on                    VAE tiling (default: off)\n");
+    printf("\n");
+    printf("runs and output:\n");
+    printf("  --warmup N                         unmeasured runs per combination (default: 1)\n");
+    printf("  --repeat N                         measured runs per combination (default: 3)\n");
+    printf("  --json FILE                        write the results as JSON\n");
+    printf("  --csv FILE                         write the results as CSV\n");
+    printf("                                     peak MB* is the peak RSS of the process up to that row, not of\n");
+    printf("                                     the row alone, run one combination per process to isolate it\n");
+    printf("  -v, --verbose                      print the library logs\n");
+    printf("  -h, --help                         show this help message and exit\n");
+}
+
+static std::vector<std::string> split_list(const std::string& str) {
+    std::vector<std::string> items;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static bool parse_int_list(const std::string& str, std::vector<int>& out) {
+    out.clear();
+    for (auto& item : split_list(str)) {
+        char* end;
+        long value = strtol(item.c_str(), &end, 10);
+        if (*end != '\0') {
+            return false;
+        }
+        out.push_back((int)value);
+    }
+    return !out.empty();
+}
+
+bool parse_args(int argc, const char* argv[], BenchParams& params) {
+    bool invalid_arg = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        // the value of the current option, "" if it is missing
+        auto value = [&]() -> const char* {
+            if (++i >= argc) {
+                invalid_arg = true;
+                return "";
+            }
+            return argv[i];
+        };
+
+        if (arg == "-m" || arg == "--model") {
+            params.model_path = value();
+        } else if (arg == "--diffusion-model") {
+            params.diffusion_model_path = value();
+        } else if (arg == "--clip_l") {
+            params.clip_l_path = value();
+        } else if (arg == "--clip_g") {
+            params.clip_g_path = value();
+        } else if (arg == "--t5xxl") {
+            params.t5xxl_path = value();
+        } else if (arg == "--vae") {
+            params.vae_path = value();
+        } else if (arg == "--taesd") {
+            params.taesd_path = value();
+        } else if (arg == "--type") {
+            std::string type = value();
+            for (int t = 0; t < SD_TYPE_COUNT; t++) {
+                const char* name = sd_type_name((sd_type_t)t);
+                if (name != NULL && type == name) {
+                    params.wtype = (sd_type_t)t;
+                }
+            }
+            if (!invalid_arg && params.wtype == SD_TYPE_COUNT) {
+                fprintf(stderr, "error: invalid weight type %s\n", type.c_str());
+                return false;
+            }
+        } else if (arg == "--clip-on-cpu") {
+            params.clip_on_cpu = true;
+        } else if (arg == "--vae-on-cpu") {
+            params.vae_on_cpu = true;
+        } else if (arg == "--diffusion-fa") {
+            params.diffusion_flash_attn = true;
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "-p" || arg == "--prompt") {
+            params.prompt = value();
+        } else if (arg == "-n" || arg == "--negative-prompt") {
+            params.negative_prompt = value();
+        } else if (arg == "--cfg-scale") {
+            params.cfg_scale = (float)atof(value());
+        } else if (arg == "--guidance") {
+            params.guidance = (float)atof(value());
+        } else if (arg == "-s" || arg == "--seed") {
+            params.seed = atoll(value());
+        } else if (arg == "--resolutions") {
+            std::vector<std::string> items = split_list(value());
+            params.resolutions.clear();
+            for (auto& item : items) {
+                int width, height;
+                if (sscanf(item.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                    fprintf(stderr, "error: invalid resolution %s\n", item.c_str());
+                    return false;
+                }
+                params.resolutions.push_back(std::make_pair(width, height));
+            }
+        } else if (arg == "--batch-sizes") {
+            invalid_arg = !parse_int_list(value(), params.batch_sizes);
+        } else if (arg == "--samplers") {
+            std::vector<std::string> items = split_list(value());
+            params.samplers.clear();
+            for (auto& item : items) {
+                int sampler = -1;
+                for (int m = 0; m < N_SAMPLE_METHODS; m++) {
+                    if (item == sample_method_str[m]) {
+                        sampler = m;
+                    }
+                }
+                if (sampler < 0) {
+                    fprintf(stderr, "error: invalid sampler %s\n", item.c_str());
+                    return false;
+                }
+                params.samplers.push_back((sample_method_t)sampler);
+            }
+        } else if (arg == "--steps") {
+            invalid_arg = !parse_int_list(value(), params.steps);
+        } else if (arg == "-t" || arg == "--threads") {
+            invalid_arg = !parse_int_list(value(), params.threads);
+        } else if (arg == "--tiling") {
+            std::vector<std::string> items = split_list(value());
+            params.tiling.clear();
+            for (auto& item : items) {
+                if (item != "on" && item != "off") {
+                    fprintf(stderr, "error: invalid tiling value %s, expected on or off\n", item.c_str());
+                    return false;
+                }
+                params.tiling.push_back(item == "on");
+            }
+        } else if (arg == "--warmup") {
+            params.warmup = std::max(0, atoi(value()));
+        } else if (arg == "--repeat") {
+            params.repeat = std::max(1, atoi(value()));
+        } else if (arg == "--json") {
+            params.json_path = value();
+        } else if (arg == "--csv") {
+            params.csv_path = value();
+        } else if (arg == "-v" || arg == "--verbose") {
+            params.verbose = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+        if (invalid_arg) {
+            fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+    }
+    if (params.resolutions.empty() || params.samplers.empty() || params.tiling.empty()) {
+        fprintf(stderr, "error: empty sweep list\n");
+        return false;
+    }
+    if (params.model_path.empty() && params.diffusion_model_path.empty()) {
+        fprintf(stderr, "error: the following arguments are required: model_path/diffusion_model\n");
+        print_usage(argc, argv);
+        return false;
+    }
+    return true;
+}
+
+/*================================================= Measurements =================================================*/
+
+// peak resident set of the whole process so far, it never goes down: a row shows the largest
+// footprint of its own combination and of every combination that ran before it
+static double cumulative_peak_rss_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024.0 / 1024.0;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024.0 / 1024.0;  // bytes
+#else
+    return usage.ru_maxrss / 1024.0;  // KB
+#endif
+#endif
+}
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// nearest rank percentile, q in [0, 1]
+static double percentile(std::vector<double> values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(q * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+static double mean(const std::vector<double>& values) {
+    double sum = 0;
+    for (double value : values) {
+        sum += value;
+    }
+    return values.empty() ? 0 : sum / values.size();
+}
+
+static void log_callback(enum sd_log_level_t level, const char* text, void* data) {
+    bool verbose = *(bool*)data;
+    if (text != NULL && (verbose || level >= SD_LOG_WARN)) {
+        fputs(text, stderr);
+    }
+}
+
+/*=================================================== Benchmark ==================================================*/
+
+struct BenchResult {
+    int threads;
+    int width;
+    int height;
+    int batch;
+    sample_method_t sampler;
+    int steps;
+    bool tiling;
+    double load_ms;
+    bool ok = true;
+    std::vector<double> total_ms;
+    std::vector<double> text_encode_ms;
+    std::vector<double> sampling_ms;
+    std::vector<double> vae_decode_ms;
+    std::vector<double> step_ms;
+    std::map<std::string, double> compute_buffers_mb;
+    double cumulative_peak_rss_mb = 0;
+};
+
+static bool run_txt2img(sd_ctx_t* sd_ctx, const BenchParams& params, const BenchResult& config, sd_generation_stats_t& stats, double& total_ms) {
+    sd_guidance_params_t guidance     = {params.cfg_scale, params.cfg_scale, 1.0f, params.guidance, {NULL, 0, 0.01f, 0.2f, 0.0f, false}, {1.0f, 0.0f, 0.0f, 0.0f}};
+    sd_tiling_params_t tiling_params = {config.tiling, 0, 0, 0.5f, 0.0f, 0.0f, 1, 0, 0};
+
+    auto t0            = std::chrono::steady_clock::now();
+    sd_image_t* images = txt2img(sd_ctx,
+                                 params.prompt.c_str(),
+                                 params.negative_prompt.c_str(),
+                                 -1,
+                                 guidance,
+                                 0.0f,
+                                 config.width,
+                                 config.height,
+                                 config.sampler,
+                                 config.steps,
+                                 params.seed,
+                                 config.batch,
+                                 NULL,
+                                 0.9f,
+                                 20.0f,
+                                 false,
+                                 "",
+                                 tiling_params);
+    total_ms = ms_since(t0);
+    if (images == NULL) {
+        return false;
+    }
+    for (int i = 0; i < config.batch; i++) {
+        free(images[i].data);
+    }
+    free(images);
+    return sd_get_generation_stats(sd_ctx, &stats);
+}
+
+static json result_to_json(const BenchResult& r) {
+    json j;
+    j["threads"]                = r.threads;
+    j["width"]                  = r.width;
+    j["height"]                 = r.height;
+    j["batch"]                  = r.batch;
+    j["sampler"]                = sample_method_str[r.sampler];
+    j["steps"]                  = r.steps;
+    j["tiling"]                 = r.tiling;
+    j["ok"]                     = r.ok;
+    j["runs"]                   = r.total_ms.size();
+    j["load_ms"]                = r.load_ms;
+    j["total_ms_mean"]          = mean(r.total_ms);
+    j["total_ms_p50"]           = percentile(r.total_ms, 0.5);
+    j["text_encode_ms"]         = mean(r.text_encode_ms);
+    j["sampling_ms"]            = mean(r.sampling_ms);
+    j["step_ms_mean"]           = mean(r.step_ms);
+    j["step_ms_p50"]            = percentile(r.step_ms, 0.5);
+    j["step_ms_p95"]            = percentile(r.step_ms, 0.95);
+    j["vae_decode_ms"]          = mean(r.vae_decode_ms);
+    j["cumulative_peak_rss_mb"] = r.cumulative_peak_rss_mb;
+    j["compute_buffers_mb"]     = r.compute_buffers_mb;
+    return j;
+}
+
+static bool write_csv(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "threads,width,height,batch,sampler,steps,tiling,ok,runs,load_ms,total_ms_mean,total_ms_p50,"
+           "text_encode_ms,sampling_ms,step_ms_mean,step_ms_p50,step_ms_p95,vae_decode_ms,cumulative_peak_rss_mb,compute_buffers_mb\n";
+    for (auto& r : results) {
+        std::string buffers;
+        for (auto& kv : r.compute_buffers_mb) {
+            buffers += (buffers.empty() ? "" : ";") + kv.first + "=" + std::to_string(kv.second);
+        }
+        char line[1024];
+        snprintf(line, sizeof(line), "%d,%d,%d,%d,%s,%d,%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%.2f,%.2f,%.1f,%.1f,\"%s\"\n",
+                 r.threads, r.width, r.height, r.batch, sample_method_str[r.sampler], r.steps,
+                 r.tiling ? "on" : "off", r.ok ? "true" : "false", r.total_ms.size(), r.load_ms,
+                 mean(r.total_ms), percentile(r.total_ms, 0.5), mean(r.text_encode_ms), mean(r.sampling_ms),
+                 mean(r.step_ms), percentile(r.step_ms, 0.5), percentile(r.step_ms, 0.95), mean(r.vae_decode_ms),
+                 r.cumulative_peak_rss_mb, buffers.c_str());
+        out << line;
+    }
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    BenchParams params;
+    if (!parse_args(argc, argv, params)) {
+        return 1;
+    }
+
+    bool verbose = params.verbose;
+    sd_set_log_callback(log_callback, &verbose);
+
+    printf("%-7s %-10s %5s %-10s %5s %6s %10s %10s %10s %10s %10s %10s\n",
+           "threads", "size", "batch", "sampler", "steps", "tiling",
+           "total ms", "encode ms", "step ms", "step p95", "decode ms", "peak MB*");
+
+    std::vector<BenchResult> results;
+    for (int threads : params.threads) {
+        int n_threads = threads > 0 ? threads : get_num_physical_cores();
+        auto t0       = std::chrono::steady_clock::now();
+        // params are kept between runs, and the VAE only decodes
+        sd_ctx_t* sd_ctx = new_sd_ctx(params.model_path.c_str(),
+                                      params.clip_l_path.c_str(),
+                                      params.clip_g_path.c_str(),
+                                      params.t5xxl_path.c_str(),
+                                      params.diffusion_model_path.c_str(),
+                                      params.vae_path.c_str(),
+                                      params.taesd_path.c_str(),
+                                      "",
+                                      "",
+                                      "",
+                                      "",
+                                      true,
+                                      false,
+                                      false,
+                                      n_threads,
+                                      params.wtype,
+                                      CUDA_RNG,
+                                      DEFAULT,
+                                      params.clip_on_cpu,
+                                      false,
+                                      params.vae_on_cpu,
+                                      params.diffusion_flash_attn,
+                                      false,
+                                      params.use_mmap);
+        double load_ms = ms_since(t0);
+        if (sd_ctx == NULL) {
+            fprintf(stderr, "new_sd_ctx_t failed\n");
+            return 1;
+        }
+
+        for (auto& resolution : params.resolutions) {
+            for (int batch : params.batch_sizes) {
+                for (sample_method_t sampler : params.samplers) {
+                    for (int steps : params.steps) {
+                        for (bool tiling : params.tiling) {
+                            BenchResult r;
+                            r.threads = n_threads;
+                            r.width   = resolution.first;
+                            r.height  = resolution.second;
+                            r.batch   = batch;
+                            r.sampler = sampler;
+                            r.steps   = steps;
+                            r.tiling  = tiling;
+                            r.load_ms = load_ms;
+
+                            double total_ms;
+                            sd_generation_stats_t stats;
+                            for (int i = 0; i < params.warmup && r.ok; i++) {
+                                r.ok = run_txt2img(sd_ctx, params, r, stats, total_ms);
+                            }
+                            for (int i = 0; i < params.repeat && r.ok; i++) {
+                                r.ok = run_txt2img(sd_ctx, params, r, stats, total_ms);
+                                if (!r.ok) {
+                                    break;
+                                }
+                                r.total_ms.push_back(total_ms);
+                                r.text_encode_ms.push_back(stats.tokenize_ms + stats.text_encoder_ms);
+                                r.sampling_ms.push_back(stats.sampling_ms);
+                                r.vae_decode_ms.push_back(stats.vae_decode_ms);
+                                r.step_ms.insert(r.step_ms.end(), stats.step_ms, stats.step_ms + stats.step_count);
+                                for (int j = 0; j < stats.runner_count; j++) {
+                                    double& size = r.compute_buffers_mb[stats.runners[j].name];
+                                    size         = std::max(size, stats.runners[j].compute_buffer_size / 1024.0 / 1024.0);
+                                }
+                            }
+                            r.cumulative_peak_rss_mb = cumulative_peak_rss_mb();
+
+                            char size[32];
+                            snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+                            if (r.ok) {
+                                printf("%-7d %-10s %5d %-10s %5d %6s %10.1f %10.1f %10.2f %10.2f %10.1f %10.1f\n",
+                                       r.threads, size, r.batch, sample_method_str[r.sampler], r.steps, r.tiling ? "on" : "off",
+                                       mean(r.total_ms), mean(r.text_encode_ms), mean(r.step_ms), percentile(r.step_ms, 0.95),
+                                       mean(r.vae_decode_ms), r.cumulative_peak_rss_mb);
+                            } else {
+                                printf("%-7d %-10s %5d %-10s %5d %6s %10s\n",
+                                       r.threads, size, r.batch, sample_method_str[r.sampler], r.steps, r.tiling ? "on" : "off", "failed");
+                            }
+                            fflush(stdout);
+                            results.push_back(r);
+                        }
+                    }
+                }
+            }
+        }
+        free_sd_ctx(sd_ctx);
+    }
+
+    if (!params.json_path.empty()) {
+        json j;
+        j["system_info"] = sd_get_system_info();
+        j["model"]       = params.model_path.empty() ? params.diffusion_model_path : params.model_path;
+        j["wtype"]       = params.wtype < SD_TYPE_COUNT ? sd_type_name(params.wtype) : "default";
+        j["prompt"]      = params.prompt;
+        j["seed"]        = params.seed;
+        j["cfg_scale"]   = params.cfg_scale;
+        j["warmup"]      = params.warmup;
+        j["repeat"]      = params.repeat;
+        j["results"]     = json::array();
+        for (auto& r : results) {
+            j["results"].push_back(result_to_json(r));
+        }
+        std::ofstream out(params.json_path);
+        if (!out) {
+            fprintf(stderr, "failed to write %s\n", params.json_path.c_str());
+            return 1;
+        }
+        out << j.dump(2) << "\n";
+    }
+    if (!params.csv_path.empty() && !write_csv(params.csv_path, results)) {
+        fprintf(stderr, "failed to write %s\n", params.csv_path.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 
 // #include "preprocessing.hpp"
 #include "flux.hpp"
+#include "miniz_api.h"
 #include "stable-diffusion.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -59,6 +60,7 @@ const char* modes_str[] = {
     "img2vid",
     "edit",
     "convert",
+    "upscale",
 };
 
 const char* previews_str[] = {
@@ -74,6 +76,7 @@ enum SDMode {
     IMG2VID,
     EDIT,
     CONVERT,
+    UPSCALE,
     MODE_COUNT
 };
 
@@ -132,8 +135,11 @@ struct SDParams {
     bool clip_on_cpu              = false;
     bool vae_on_cpu               = false;
     bool diffusion_flash_attn     = false;
+    bool use_mmap                 = false;
     bool canny_preprocess         = false;
     bool color                    = false;
+    bool stream_decode            = false;
+    bool print_stats              = false;
     int upscale_repeats           = 1;
 
     std::vector<int> skip_layers = {7, 8, 9};
@@ -147,6 +153,9 @@ struct SDParams {
     float apg_norm_threshold = 0.0f;
     float apg_norm_smoothing = 0.0f;
 
+    sd_tiling_params_t vae_tiling_params     = {false, 0, 0, 0.5f, 0.0f, 0.0f, 1, 0, 0};
+    sd_tiling_params_t upscale_tiling_params = {true, 0, 0, 0.25f, 0.0f, 0.0f, 1, 0, 0};
+
     sd_preview_t preview_method = SD_PREVIEW_NONE;
     int preview_interval        = 1;
     std::string preview_path    = "preview.png";
@@ -190,6 +199,7 @@ void print_params(SDParams params) {
     printf("    controlnet cpu:    %s\n", params.control_net_cpu ? "true" : "false");
     printf("    vae decoder on cpu:%s\n", params.vae_on_cpu ? "true" : "false");
     printf("    diffusion flash attention:%s\n", params.diffusion_flash_attn ? "true" : "false");
+    printf("    mmap:              %s\n", params.use_mmap ? "true" : "false");
     printf("    strength(control): %.2f\n", params.control_strength);
     printf("    prompt:            %s\n", params.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.negative_prompt.c_str());
@@ -210,7 +220,18 @@ void print_params(SDParams params) {
     printf("    seed:              %lld\n", params.seed);
     printf("    batch_count:       %d\n", params.batch_count);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
+    printf("    vae_tile_size:     %dx%d\n", params.vae_tiling_params.tile_size_x, params.vae_tiling_params.tile_size_y);
+    printf("    vae_tile_overlap:  %.2f\n", params.vae_tiling_params.target_overlap);
+    printf("    vae_tile_batch:    %d\n", params.vae_tiling_params.batch_size);
+    printf("    vae_tile_memory:   %zu MB\n", params.vae_tiling_params.memory_budget_mb);
+    printf("    vae_latent_batch:  %d\n", params.vae_tiling_params.latent_batch_size);
+    printf("    stream_decode:     %s\n", params.stream_decode ? "true" : "false");
+    printf("    print_stats:       %s\n", params.print_stats ? "true" : "false");
     printf("    upscale_repeats:   %d\n", params.upscale_repeats);
+    printf("    upscale_tile_size: %dx%d\n", params.upscale_tiling_params.tile_size_x, params.upscale_tiling_params.tile_size_y);
+    printf("    upscale_overlap:   %.2f\n", params.upscale_tiling_params.target_overlap);
+    printf("    upscale_batch:     %d\n", params.upscale_tiling_params.batch_size);
+    printf("    upscale_memory:    %zu MB\n", params.upscale_tiling_params.memory_budget_mb);
     printf("    preview_mode:      %s\n", previews_str[params.preview_method]);
     printf("    preview_interval:  %d\n", params.preview_interval);
 }
@@ -220,7 +241,7 @@ void print_usage(int argc, const char* argv[]) {
     printf("\n");
     printf("arguments:\n");
     printf("  -h, --help                         show this help message and exit\n");
-    printf("  -M, --mode [MODE]                  run mode (txt2img or img2img or convert, default: txt2img)\n");
+    printf("  -M, --mode [MODE]                  run mode (txt2img or img2img or convert or upscale, default: txt2img)\n");
     printf("  -t, --threads N                    number of threads to use during computation (default: -1)\n");
     printf("                                     If threads <= 0, then threads will be set to the number of CPU physical cores\n");
     printf("  -m, --model [MODEL]                path to full model\n");
@@ -238,6 +259,10 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --normalize-input                  normalize PHOTOMAKER input id images\n");
     printf("  --upscale-model [ESRGAN_PATH]      path to esrgan model. Upscale images after generate, just RealESRGAN_x4plus_anime_6B supported by now\n");
     printf("  --upscale-repeats                  Run the ESRGAN upscaler this many times (default 1)\n");
+    printf("  --upscale-tile-size [X]x[Y]        upscaler tile size in input pixels (default: the model's, 128x128)\n");
+    printf("  --upscale-tile-overlap OVERLAP     fraction of the upscaler tiles that overlap, [0, 0.5] (default: 0.25)\n");
+    printf("  --upscale-tile-batch N             number of upscaler tiles computed together (default: 1)\n");
+    printf("  --upscale-tile-memory MB           upscaler compute buffer budget, lowers the tile batch until it fits (default: 0, no budget)\n");
     printf("  --type [TYPE]                      weight type (examples: f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_K, q3_K, q4_K)\n");
     printf("                                     If not specified, the default is the type of the weight file\n");
     printf("  --imat-out [PATH]                  If set, compute the imatrix for this run and save it to the provided path\n");
@@ -284,17 +309,31 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --clip-skip N                      ignore last layers of CLIP network; 1 ignores none, 2 ignores one layer (default: -1)\n");
     printf("                                     <= 0 represents unspecified, will be 1 for SD1.x, 2 for SD2.x\n");
     printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
+    printf("  --vae-tile-size [X]x[Y]            vae tile size in latent pixels (default: 32x32)\n");
+    printf("  --vae-relative-tile-size [X]x[Y]   relative vae tile size, <= 1 is a fraction of the image, > 1 is the number of tiles\n");
+    printf("                                     per dimension (overrides --vae-tile-size)\n");
+    printf("  --vae-tile-overlap OVERLAP         fraction of the vae tiles that overlap, [0, 0.5] (default: 0.5)\n");
+    printf("  --vae-tile-batch N                 number of vae tiles computed together (default: 1)\n");
+    printf("  --vae-tile-memory MB               vae compute buffer budget, picks no tiling or the largest tile that fits\n");
+    printf("                                     when no tile size is given (default: 0, no budget)\n");
+    printf("  --vae-latent-batch N               number of images the vae decodes together when not tiling\n");
+    printf("                                     (default: 0, as many as fit --vae-tile-memory, 1 without it)\n");
+    printf("  --stream-decode                    decode the image in tiles and write the png as its rows are done,\n");
+    printf("                                     keeps only a band of the image in memory (png output, no upscale)\n");
     printf("  --vae-on-cpu                       keep vae in cpu (for low vram)\n");
     printf("  --clip-on-cpu                      keep clip in cpu (for low vram)\n");
     printf("  --diffusion-fa                     use flash attention in the diffusion model (for low vram)\n");
     printf("                                     Might lower quality, since it implies converting k and v to f16.\n");
     printf("                                     This might crash if it is not supported by the backend.\n");
     printf("  --control-net-cpu                  keep controlnet in cpu (for low vram)\n");
+    printf("  --mmap                             map gguf/safetensors model files, weights that need no conversion\n");
+    printf("                                     are used in place by the cpu backend instead of being copied\n");
     printf("  --canny                            apply canny preprocessor (edge detection)\n");
     printf("  --preview {%s,%s,%s,%s}            preview method. (default is %s(disabled))\n", previews_str[0], previews_str[1], previews_str[2], previews_str[3], previews_str[SD_PREVIEW_NONE]);
     printf("                                     %s is the fastest\n", previews_str[SD_PREVIEW_PROJ]);
     printf("  --preview-interval [N]             How often to save the image preview");
     printf("  --preview-path [PATH}              path to write preview image to (default: ./preview.png)\n");
+    printf("  --stats                            print where the generation spent its time and memory\n");
     printf("  --color                            colors the logging tags according to level\n");
     printf("  -v, --verbose                      print extra info\n");
 }
@@ -326,7 +365,7 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             }
             if (mode_found == -1) {
                 fprintf(stderr,
-                        "error: invalid mode %s, must be one of [txt2img, img2img, img2vid, convert]\n",
+                        "error: invalid mode %s, must be one of [txt2img, img2img, img2vid, convert, upscale]\n",
                         mode_selected);
                 exit(1);
             }
@@ -455,6 +494,37 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 fprintf(stderr, "error: upscale multiplier must be at least 1\n");
                 exit(1);
             }
+        } else if (arg == "--upscale-tile-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            // format is AxB, or just A (equivalent to AxA)
+            std::string tile_size_str = argv[i];
+            size_t x_pos              = tile_size_str.find('x');
+            int tile_x                = std::stoi(tile_size_str.substr(0, x_pos));
+            int tile_y                = x_pos != std::string::npos ? std::stoi(tile_size_str.substr(x_pos + 1)) : tile_x;
+
+            params.upscale_tiling_params.tile_size_x = tile_x;
+            params.upscale_tiling_params.tile_size_y = tile_y;
+        } else if (arg == "--upscale-tile-overlap") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tiling_params.target_overlap = std::stof(argv[i]);
+        } else if (arg == "--upscale-tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tiling_params.batch_size = std::stoi(argv[i]);
+        } else if (arg == "--upscale-tile-memory") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tiling_params.memory_budget_mb = std::stoull(argv[i]);
         } else if (arg == "-n" || arg == "--negative-prompt") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -529,6 +599,47 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.clip_skip = std::stoi(argv[i]);
         } else if (arg == "--vae-tiling") {
             params.vae_tiling = true;
+        } else if (arg == "--vae-tile-size" || arg == "--vae-relative-tile-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            // format is AxB, or just A (equivalent to AxA)
+            std::string tile_size_str = argv[i];
+            size_t x_pos              = tile_size_str.find('x');
+            float tile_x              = std::stof(tile_size_str.substr(0, x_pos));
+            float tile_y              = x_pos != std::string::npos ? std::stof(tile_size_str.substr(x_pos + 1)) : tile_x;
+            if (arg == "--vae-tile-size") {
+                params.vae_tiling_params.tile_size_x = (int)tile_x;
+                params.vae_tiling_params.tile_size_y = (int)tile_y;
+            } else {
+                params.vae_tiling_params.rel_size_x = tile_x;
+                params.vae_tiling_params.rel_size_y = tile_y;
+            }
+        } else if (arg == "--vae-tile-overlap") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_tiling_params.target_overlap = std::stof(argv[i]);
+        } else if (arg == "--vae-tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_tiling_params.batch_size = std::stoi(argv[i]);
+        } else if (arg == "--vae-tile-memory") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_tiling_params.memory_budget_mb = std::stoull(argv[i]);
+        } else if (arg == "--vae-latent-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_tiling_params.latent_batch_size = std::stoi(argv[i]);
         } else if (arg == "--control-net-cpu") {
             params.control_net_cpu = true;
         } else if (arg == "--normalize-input") {
@@ -539,6 +650,12 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.vae_on_cpu = true;  // will slow down latent decoding but necessary for low MEM GPUs
         } else if (arg == "--diffusion-fa") {
             params.diffusion_flash_attn = true;  // can reduce MEM significantly
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "--stream-decode") {
+            params.stream_decode = true;
+        } else if (arg == "--stats") {
+            params.print_stats = true;
         } else if (arg == "--canny") {
             params.canny_preprocess = true;
         } else if (arg == "--taesd-preview-only") {
@@ -789,13 +906,13 @@ void parse_args(int argc, const char** argv, SDParams& params) {
         params.n_threads = get_num_physical_cores();
     }
 
-    if (params.mode != CONVERT && params.mode != IMG2VID && params.prompt.length() == 0) {
+    if (params.mode != CONVERT && params.mode != IMG2VID && params.mode != UPSCALE && params.prompt.length() == 0) {
         fprintf(stderr, "error: the following arguments are required: prompt\n");
         print_usage(argc, argv);
         exit(1);
     }
 
-    if (params.model_path.length() == 0 && params.diffusion_model_path.length() == 0) {
+    if (params.mode != UPSCALE && params.model_path.length() == 0 && params.diffusion_model_path.length() == 0) {
         fprintf(stderr, "error: the following arguments are required: model_path/diffusion_model\n");
         print_usage(argc, argv);
         exit(1);
@@ -807,6 +924,12 @@ void parse_args(int argc, const char** argv, SDParams& params) {
         exit(1);
     }
 
+    if (params.mode == UPSCALE && (params.input_path.length() == 0 || params.esrgan_path.length() == 0)) {
+        fprintf(stderr, "error: when using the upscale mode, the following arguments are required: init-img, upscale-model\n");
+        print_usage(argc, argv);
+        exit(1);
+    }
+
     if (params.mode == EDIT && params.ref_image_paths.size() == 0) {
         fprintf(stderr, "error: when using the edit mode, the following arguments are required: ref-image\n");
         print_usage(argc, argv);
@@ -961,6 +1084,272 @@ void step_callback(int step, sd_image_t image) {
     stbi_write_png(preview_path, image.width, image.height, image.channel, image.data, 0);
 }
 
+void print_generation_stats(sd_ctx_t* sd_ctx) {
+    sd_generation_stats_t stats;
+    if (!sd_get_generation_stats(sd_ctx, &stats)) {
+        return;
+    }
+    printf("generation stats:\n");
+    printf("    load:              %.2f ms\n", stats.load_ms);
+    printf("    lora apply:        %.2f ms\n", stats.lora_apply_ms);
+    printf("    tokenize:          %.2f ms\n", stats.tokenize_ms);
+    printf("    text encoder:      %.2f ms\n", stats.text_encoder_ms);
+    printf("    sampling:          %.2f ms (control net %.2f ms)\n", stats.sampling_ms, stats.control_net_ms);
+    printf("    vae encode:        %.2f ms\n", stats.vae_encode_ms);
+    printf("    vae decode:        %.2f ms\n", stats.vae_decode_ms);
+    printf("    preview:           %.2f ms\n", stats.preview_ms);
+    printf("    total:             %.2f ms\n", stats.total_ms);
+    printf("    steps (ms):       ");
+    for (int i = 0; i < stats.step_count; i++) {
+        printf(" %.2f", stats.step_ms[i]);
+    }
+    printf("\n");
+    printf("    work ctx:          %.2f MB\n", stats.work_ctx_size / 1024.0 / 1024.0);
+    for (int i = 0; i < stats.runner_count; i++) {
+        const sd_runner_stats_t& runner = stats.runners[i];
+        printf("    %-18s params %.2f MB, compute %.2f MB (%s)\n",
+               (std::string(runner.name) + ":").c_str(),
+               runner.params_buffer_size / 1024.0 / 1024.0,
+               runner.compute_buffer_size / 1024.0 / 1024.0,
+               runner.on_cpu ? "RAM" : "VRAM");
+    }
+}
+
+/*================================================== Streaming PNG ===================================================*/
+
+// writes a png band by band, the rows are deflated as they come in
+struct PNGRowWriter {
+    FILE* file       = NULL;
+    uint32_t width   = 0;
+    uint32_t height  = 0;
+    uint32_t channel = 0;
+    uint32_t rows    = 0;
+    mz_stream stream;
+    std::vector<uint8_t> prev_row;
+    std::vector<uint8_t> filtered_row;
+    std::vector<uint8_t> out;
+
+    static void put_u32(uint8_t* p, uint32_t v) {
+        p[0] = (uint8_t)(v >> 24);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 8);
+        p[3] = (uint8_t)v;
+    }
+
+    void write_chunk(const char* type, const uint8_t* data, uint32_t len) {
+        uint8_t buf[8];
+        put_u32(buf, len);
+        memcpy(buf + 4, type, 4);
+        fwrite(buf, 1, 8, file);
+        fwrite(data, 1, len, file);
+        mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const uint8_t*)type, 4);
+        crc          = mz_crc32(crc, data, len);
+        put_u32(buf, (uint32_t)crc);
+        fwrite(buf, 1, 4, file);
+    }
+
+    // deflates the pending input, every filled output buffer becomes an IDAT chunk
+    bool compress_pending(int flush) {
+        while (true) {
+            stream.next_out  = out.data();
+            stream.avail_out = (unsigned int)out.size();
+            int status       = mz_deflate(&stream, flush);
+            if (status != MZ_OK && status != MZ_STREAM_END && status != MZ_BUF_ERROR) {
+                return false;
+            }
+            size_t len = out.size() - stream.avail_out;
+            if (len > 0) {
+                write_chunk("IDAT", out.data(), (uint32_t)len);
+            }
+            if (flush == MZ_FINISH ? status == MZ_STREAM_END : (stream.avail_in == 0 && stream.avail_out != 0)) {
+                return true;
+            }
+        }
+    }
+
+    bool open(const std::string& path, uint32_t w, uint32_t h, uint32_t c, const std::string& parameters) {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        static const uint8_t color_type[] = {0, 0, 4, 2, 6};
+
+        file = fopen(path.c_str(), "wb");
+        if (file == NULL) {
+            return false;
+        }
+        width   = w;
+        height  = h;
+        channel = c;
+        rows    = 0;
+        prev_row.assign(width * channel, 0);
+        filtered_row.resize(width * channel + 1);
+        out.resize(1 << 20);
+        memset(&stream, 0, sizeof(stream));
+        if (mz_deflateInit(&stream, MZ_DEFAULT_COMPRESSION) != MZ_OK) {
+            fclose(file);
+            file = NULL;
+            return false;
+        }
+
+        fwrite(signature, 1, 8, file);
+        uint8_t ihdr[13];
+        put_u32(ihdr, width);
+        put_u32(ihdr + 4, height);
+        ihdr[8]  = 8;  // bit depth
+        ihdr[9]  = color_type[channel];
+        ihdr[10] = 0;
+        ihdr[11] = 0;
+        ihdr[12] = 0;
+        write_chunk("IHDR", ihdr, 13);
+        if (!parameters.empty()) {
+            std::string text = std::string("parameters") + '\0' + parameters;
+            write_chunk("tEXt", (const uint8_t*)text.data(), (uint32_t)text.size());
+        }
+        return true;
+    }
+
+    // closes the file after the last row
+    bool write_rows(const uint8_t* data, uint32_t num_rows) {
+        size_t row_size = width * channel;
+        for (uint32_t r = 0; r < num_rows; r++) {
+            const uint8_t* row = data + r * row_size;
+            filtered_row[0]    = 2;  // up filter
+            for (size_t i = 0; i < row_size; i++) {
+                filtered_row[i + 1] = row[i] - prev_row[i];
+            }
+            memcpy(prev_row.data(), row, row_size);
+            stream.next_in  = filtered_row.data();
+            stream.avail_in = (unsigned int)filtered_row.size();
+            if (!compress_pending(MZ_NO_FLUSH)) {
+                return false;
+            }
+        }
+        rows += num_rows;
+        if (rows >= height) {
+            bool ok = compress_pending(MZ_FINISH);
+            mz_deflateEnd(&stream);
+            write_chunk("IEND", NULL, 0);
+            ok   = fclose(file) == 0 && ok;
+            file = NULL;
+            return ok;
+        }
+        return true;
+    }
+};
+
+struct StreamedImages {
+    SDParams* params;
+    std::string dummy_name;
+    std::string ext;
+    std::vector<PNGRowWriter> writers;
+};
+
+void image_rows_callback(int index, uint32_t y, sd_image_t rows, void* data) {
+    StreamedImages* streamed = (StreamedImages*)data;
+    if (index >= (int)streamed->writers.size()) {
+        streamed->writers.resize(index + 1);
+    }
+    PNGRowWriter& writer         = streamed->writers[index];
+    std::string final_image_path = index > 0 ? streamed->dummy_name + "_" + std::to_string(index + 1) + streamed->ext : streamed->dummy_name + streamed->ext;
+    if (y == 0) {
+        SDParams& params = *streamed->params;
+        if (!writer.open(final_image_path, rows.width, params.height, rows.channel, get_image_params(params, params.seed + index))) {
+            printf("failed to open '%s'\n", final_image_path.c_str());
+            return;
+        }
+    }
+    if (writer.file == NULL) {
+        return;
+    }
+    if (!writer.write_rows(rows.data, rows.height)) {
+        printf("failed to write '%s'\n", final_image_path.c_str());
+    } else if (writer.file == NULL) {
+        printf("save result PNG image to '%s'\n", final_image_path.c_str());
+    }
+}
+
+// upscale mode output, a png or raw rgb rows written as they come in
+struct UpscaledFile {
+    std::string path;
+    bool is_png;
+    uint32_t input_width;
+    uint32_t input_height;
+    PNGRowWriter png;
+    FILE* raw   = NULL;
+    bool failed = false;
+};
+
+void upscale_rows_callback(int index, uint32_t y, sd_image_t rows, void* data) {
+    UpscaledFile* output = (UpscaledFile*)data;
+    if (output->failed) {
+        return;
+    }
+    if (y == 0) {
+        uint32_t height = output->input_height * (rows.width / output->input_width);
+        printf("writing %ux%u image to '%s'\n", rows.width, height, output->path.c_str());
+        if (output->is_png) {
+            output->failed = !output->png.open(output->path, rows.width, height, rows.channel, "");
+        } else {
+            output->raw    = fopen(output->path.c_str(), "wb");
+            output->failed = output->raw == NULL;
+        }
+        if (output->failed) {
+            printf("failed to open '%s'\n", output->path.c_str());
+            return;
+        }
+    }
+    size_t size = (size_t)rows.width * rows.height * rows.channel;
+    if (output->is_png) {
+        output->failed = !output->png.write_rows(rows.data, rows.height);
+    } else {
+        output->failed = fwrite(rows.data, 1, size, output->raw) != size;
+    }
+    if (output->failed) {
+        printf("failed to write '%s'\n", output->path.c_str());
+    }
+}
+
+// upscales init-img into output without holding the upscaled image in memory
+int upscale_file(const SDParams& params) {
+    int c              = 0;
+    int width          = 0;
+    int height         = 0;
+    uint8_t* image_buf = stbi_load(params.input_path.c_str(), &width, &height, &c, 3);
+    if (image_buf == NULL) {
+        fprintf(stderr, "load image from '%s' failed\n", params.input_path.c_str());
+        return 1;
+    }
+    upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx(params.esrgan_path.c_str(), params.n_threads);
+    if (upscaler_ctx == NULL) {
+        fprintf(stderr, "new_upscaler_ctx failed\n");
+        free(image_buf);
+        return 1;
+    }
+
+    // anything but png is written as raw rgb bytes, ready to be memory mapped
+    std::string lc_path = params.output_path;
+    std::transform(lc_path.begin(), lc_path.end(), lc_path.begin(), ::tolower);
+    UpscaledFile output;
+    output.path         = params.output_path;
+    output.is_png       = lc_path.size() >= 4 && lc_path.substr(lc_path.size() - 4) == ".png";
+    output.input_width  = (uint32_t)width;
+    output.input_height = (uint32_t)height;
+
+    int upscale_factor     = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
+    sd_image_t input_image = {(uint32_t)width, (uint32_t)height, 3, image_buf};
+    bool success           = upscale_rows(upscaler_ctx, input_image, upscale_factor, params.upscale_tiling_params,
+                                          upscale_rows_callback, &output);
+    if (output.raw != NULL) {
+        output.failed = fclose(output.raw) != 0 || output.failed;
+    }
+    free_upscaler_ctx(upscaler_ctx);
+    free(image_buf);
+    if (!success || output.failed) {
+        fprintf(stderr, "upscale '%s' to '%s' failed\n", params.input_path.c_str(), params.output_path.c_str());
+        return 1;
+    }
+    printf("upscale '%s' to '%s' success\n", params.input_path.c_str(), params.output_path.c_str());
+    return 0;
+}
+
 int main(int argc, const char* argv[]) {
     SDParams params;
 
@@ -1021,6 +1410,10 @@ int main(int argc, const char* argv[]) {
         }
     }
 
+    if (params.mode == UPSCALE) {
+        return upscale_file(params);
+    }
+
     if (params.mode == IMG2VID) {
         fprintf(stderr, "SVD support is broken, do not use it!!!\n");
         return 1;
@@ -1137,7 +1530,8 @@ int main(int argc, const char* argv[]) {
                                   params.control_net_cpu,
                                   params.vae_on_cpu,
                                   params.diffusion_flash_attn,
-                                  params.taesd_preview);
+                                  params.taesd_preview,
+                                  params.use_mmap);
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
@@ -1180,6 +1574,36 @@ int main(int argc, const char* argv[]) {
                              1,
                              mask_image_buffer};
 
+    std::string dummy_name, ext, lc_ext;
+    bool is_jpg;
+    size_t last      = params.output_path.find_last_of(".");
+    size_t last_path = std::min(params.output_path.find_last_of("/"),
+                                params.output_path.find_last_of("\\"));
+    if (last != std::string::npos  // filename has extension
+        && (last_path == std::string::npos || last > last_path)) {
+        dummy_name = params.output_path.substr(0, last);
+        ext = lc_ext = params.output_path.substr(last);
+        std::transform(ext.begin(), ext.end(), lc_ext.begin(), ::tolower);
+        is_jpg = lc_ext == ".jpg" || lc_ext == ".jpeg" || lc_ext == ".jpe";
+    } else {
+        dummy_name = params.output_path;
+        ext = lc_ext = "";
+        is_jpg       = false;
+    }
+    // appending ".png" to absent or unknown extension
+    if (!is_jpg && lc_ext != ".png") {
+        dummy_name += ext;
+        ext = ".png";
+    }
+    StreamedImages streamed_images = {&params, dummy_name, ext};
+    if (params.stream_decode) {
+        if (is_jpg || (params.esrgan_path.size() > 0 && params.upscale_repeats > 0)) {
+            printf("--stream-decode needs png output without upscaling, decoding the whole image\n");
+        } else {
+            sd_set_image_rows_callback(image_rows_callback, &streamed_images);
+        }
+    }
+
     sd_image_t* results;
     if (params.mode == TXT2IMG) {
         results = txt2img(sd_ctx,
@@ -1198,7 +1622,8 @@ int main(int argc, const char* argv[]) {
                           params.control_strength,
                           params.style_ratio,
                           params.normalize_input,
-                          params.input_id_images_path.c_str());
+                          params.input_id_images_path.c_str(),
+                          params.vae_tiling_params);
     } else if (params.mode == IMG2IMG || params.mode == IMG2VID) {
         sd_image_t input_image = {(uint32_t)params.width,
                                   (uint32_t)params.height,
@@ -1218,14 +1643,17 @@ int main(int argc, const char* argv[]) {
                               params.sample_method,
                               params.sample_steps,
                               params.strength,
-                              params.seed);
+                              params.seed,
+                              params.vae_tiling_params);
             if (results == NULL) {
                 printf("generate failed\n");
                 free_sd_ctx(sd_ctx);
                 return 1;
             }
-            size_t last            = params.output_path.find_last_of(".");
-            std::string dummy_name = last != std::string::npos ? params.output_path.substr(0, last) : params.output_path;
+            if (params.print_stats) {
+                print_generation_stats(sd_ctx);
+            }
+            // frames are always png, dummy_name keeps an extension that is neither png nor jpg
             for (int i = 0; i < params.video_frames; i++) {
                 if (results[i].data == NULL) {
                     continue;
@@ -1260,7 +1688,8 @@ int main(int argc, const char* argv[]) {
                               params.control_strength,
                               params.style_ratio,
                               params.normalize_input,
-                              params.input_id_images_path.c_str());
+                              params.input_id_images_path.c_str(),
+                              params.vae_tiling_params);
         }
     } else {  // EDIT
         results = edit(sd_ctx,
@@ -1281,7 +1710,8 @@ int main(int argc, const char* argv[]) {
                        params.control_strength,
                        params.style_ratio,
                        params.normalize_input,
-                       params.input_id_images_path.c_str());
+                       params.input_id_images_path.c_str(),
+                       params.vae_tiling_params);
     }
 
     if (results == NULL) {
@@ -1289,6 +1719,9 @@ int main(int argc, const char* argv[]) {
         free_sd_ctx(sd_ctx);
         return 1;
     }
+    if (params.print_stats) {
+        print_generation_stats(sd_ctx);
+    }
 
     int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
     if (params.esrgan_path.size() > 0 && params.upscale_repeats > 0) {
@@ -1304,7 +1737,7 @@ int main(int argc, const char* argv[]) {
                 }
                 sd_image_t current_image = results[i];
                 for (int u = 0; u < params.upscale_repeats; ++u) {
-                    sd_image_t upscaled_image = upscale(upscaler_ctx, current_image, upscale_factor);
+                    sd_image_t upscaled_image = upscale(upscaler_ctx, current_image, upscale_factor, params.upscale_tiling_params);
                     if (upscaled_image.data == NULL) {
                         printf("upscale failed\n");
                         break;
@@ -1317,27 +1750,6 @@ int main(int argc, const char* argv[]) {
         }
     }
 
-    std::string dummy_name, ext, lc_ext;
-    bool is_jpg;
-    size_t last      = params.output_path.find_last_of(".");
-    size_t last_path = std::min(params.output_path.find_last_of("/"),
-                                params.output_path.find_last_of("\\"));
-    if (last != std::string::npos  // filename has extension
-        && (last_path == std::string::npos || last > last_path)) {
-        dummy_name = params.output_path.substr(0, last);
-        ext = lc_ext = params.output_path.substr(last);
-        std::transform(ext.begin(), ext.end(), lc_ext.begin(), ::tolower);
-        is_jpg = lc_ext == ".jpg" || lc_ext == ".jpeg" || lc_ext == ".jpe";
-    } else {
-        dummy_name = params.output_path;
-        ext = lc_ext = "";
-        is_jpg       = false;
-    }
-    // appending ".png" to absent or unknown extension
-    if (!is_jpg && lc_ext != ".png") {
-        dummy_name += ext;
-        ext = ".png";
-    }
     for (int i = 0; i < params.batch_count; i++) {
         if (results[i].data == NULL) {
             continue;
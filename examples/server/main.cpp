@@ -109,6 +109,7 @@ struct SDCtxParams {
     bool vae_on_cpu      = false;
 
     bool diffusion_flash_attn = false;
+    bool use_mmap             = false;
 };
 
 struct SDRequestParams {
@@ -147,6 +148,8 @@ struct SDRequestParams {
     float apg_norm_threshold = 0.0f;
     float apg_norm_smoothing = 0.0f;
 
+    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0.0f, 0.0f, 1, 0, 0};
+
     sd_preview_t preview_method = SD_PREVIEW_NONE;
     int preview_interval        = 1;
 };
@@ -216,6 +219,7 @@ void print_params(SDParams params) {
     printf("    controlnet cpu:    %s\n", params.ctxParams.control_net_cpu ? "true" : "false");
     printf("    vae decoder on cpu:%s\n", params.ctxParams.vae_on_cpu ? "true" : "false");
     printf("    diffusion flash attention:%s\n", params.ctxParams.diffusion_flash_attn ? "true" : "false");
+    printf("    mmap:              %s\n", params.ctxParams.use_mmap ? "true" : "false");
     printf("    strength(control): %.2f\n", params.lastRequest.control_strength);
     printf("    prompt:            %s\n", params.lastRequest.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.lastRequest.negative_prompt.c_str());
@@ -293,6 +297,8 @@ void print_usage(int argc, const char* argv[]) {
     printf("                                     Might lower quality, since it implies converting k and v to f16.\n");
     printf("                                     This might crash if it is not supported by the backend.\n");
     printf("  --control-net-cpu                  keep controlnet in cpu (for low vram)\n");
+    printf("  --mmap                             map gguf/safetensors model files, weights that need no conversion\n");
+    printf("                                     are used in place by the cpu backend instead of being copied\n");
     printf("  --canny                            apply canny preprocessor (edge detection)\n");
     printf("  --color                            Colors the logging tags according to level\n");
     printf("  -v, --verbose                      print extra info\n");
@@ -519,6 +525,8 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.ctxParams.vae_on_cpu = true;  // will slow down latent decoding but necessary for low MEM GPUs
         } else if (arg == "--diffusion-fa") {
             params.ctxParams.diffusion_flash_attn = true;  // can reduce MEM significantly
+        } else if (arg == "--mmap") {
+            params.ctxParams.use_mmap = true;
         } else if (arg == "-b" || arg == "--batch-count") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -1212,6 +1220,32 @@ bool parseJsonPrompt(std::string json_str, SDParams* params) {
         params->lastRequest.preview_interval = interval;
     } catch (...) {
     }
+    try {
+        int tile_size                                     = payload["vae_tile_size"];
+        params->lastRequest.vae_tiling_params.tile_size_x = tile_size;
+        params->lastRequest.vae_tiling_params.tile_size_y = tile_size;
+    } catch (...) {
+    }
+    try {
+        float tile_overlap                                   = payload["vae_tile_overlap"];
+        params->lastRequest.vae_tiling_params.target_overlap = tile_overlap;
+    } catch (...) {
+    }
+    try {
+        int tile_batch                                   = payload["vae_tile_batch"];
+        params->lastRequest.vae_tiling_params.batch_size = tile_batch;
+    } catch (...) {
+    }
+    try {
+        size_t tile_memory                                     = payload["vae_tile_memory"];
+        params->lastRequest.vae_tiling_params.memory_budget_mb = tile_memory;
+    } catch (...) {
+    }
+    try {
+        int latent_batch                                        = payload["vae_latent_batch"];
+        params->lastRequest.vae_tiling_params.latent_batch_size = latent_batch;
+    } catch (...) {
+    }
     try {
         std::string type = payload["type"];
         if (type != "") {
@@ -1326,6 +1360,36 @@ void update_progress_cb(int step, int steps, float time, void* _data) {
     }
 }
 
+// the timings and buffer sizes of the last generation of sd_ctx, attached to the task result
+nlohmann::json generation_stats_json(sd_ctx_t* sd_ctx) {
+    using json = nlohmann::json;
+    sd_generation_stats_t stats;
+    if (!sd_get_generation_stats(sd_ctx, &stats)) {
+        return json();
+    }
+    json stats_json               = json::object();
+    stats_json["load_ms"]         = stats.load_ms;
+    stats_json["lora_apply_ms"]   = stats.lora_apply_ms;
+    stats_json["tokenize_ms"]     = stats.tokenize_ms;
+    stats_json["text_encoder_ms"] = stats.text_encoder_ms;
+    stats_json["sampling_ms"]     = stats.sampling_ms;
+    stats_json["control_net_ms"]  = stats.control_net_ms;
+    stats_json["vae_encode_ms"]   = stats.vae_encode_ms;
+    stats_json["vae_decode_ms"]   = stats.vae_decode_ms;
+    stats_json["preview_ms"]      = stats.preview_ms;
+    stats_json["total_ms"]        = stats.total_ms;
+    stats_json["step_ms"]         = std::vector<float>(stats.step_ms, stats.step_ms + stats.step_count);
+    stats_json["work_ctx_size"]   = stats.work_ctx_size;
+    stats_json["runners"]         = json::array();
+    for (int i = 0; i < stats.runner_count; i++) {
+        stats_json["runners"].push_back({{"name", stats.runners[i].name},
+                                         {"params_buffer_size", stats.runners[i].params_buffer_size},
+                                         {"compute_buffer_size", stats.runners[i].compute_buffer_size},
+                                         {"on_cpu", stats.runners[i].on_cpu}});
+    }
+    return stats_json;
+}
+
 bool is_model_file(const std::string& path) {
     size_t name_start = path.find_last_of("/\\");
     if (name_start == std::string::npos) {
@@ -1462,7 +1526,8 @@ void start_server(SDParams params) {
                                     params.ctxParams.vae_on_cpu,
                                     params.ctxParams.diffusion_flash_attn,
                                     // keep all autoencoders loaded just in case
-                                    params.taesd_preview);
+                                    params.taesd_preview,
+                                    params.ctxParams.use_mmap);
                 if (sd_ctx == NULL) {
                     printf("new_sd_ctx_t failed\n");
                     std::lock_guard<std::mutex> results_lock(results_mutex);
@@ -1516,7 +1581,8 @@ void start_server(SDParams params) {
                                   1,
                                   params.lastRequest.style_ratio,
                                   params.lastRequest.normalize_input,
-                                  params.input_id_images_path.c_str());
+                                  params.input_id_images_path.c_str(),
+                                  params.lastRequest.vae_tiling_params);
 
                 if (results == NULL) {
                     printf("generate failed\n");
@@ -1564,6 +1630,7 @@ void start_server(SDParams params) {
                 end_task_json["step"]   = -1;
                 end_task_json["steps"]  = 0;
                 end_task_json["eta"]    = "?";
+                end_task_json["stats"]  = generation_stats_json(sd_ctx);
                 std::lock_guard<std::mutex> results_lock(results_mutex);
                 task_results[task_id] = end_task_json;
             }
@@ -1592,6 +1659,11 @@ void start_server(SDParams params) {
         params_json["seed"]            = params.lastRequest.seed;
         params_json["batch_count"]     = params.lastRequest.batch_count;
         params_json["normalize_input"] = params.lastRequest.normalize_input;
+        params_json["vae_tile_size"]    = params.lastRequest.vae_tiling_params.tile_size_x;
+        params_json["vae_tile_overlap"] = params.lastRequest.vae_tiling_params.target_overlap;
+        params_json["vae_tile_batch"]   = params.lastRequest.vae_tiling_params.batch_size;
+        params_json["vae_tile_memory"]  = params.lastRequest.vae_tiling_params.memory_budget_mb;
+        params_json["vae_latent_batch"] = params.lastRequest.vae_tiling_params.latent_batch_size;
         // params_json["input_id_images_path"] = params.input_id_images_path;
 
         json context_params = json::object();
@@ -1616,6 +1688,7 @@ void start_server(SDParams params) {
         context_params["control_net_cpu"]      = params.ctxParams.control_net_cpu;
         context_params["vae_on_cpu"]           = params.ctxParams.vae_on_cpu;
         context_params["diffusion_flash_attn"] = params.ctxParams.diffusion_flash_attn;
+        context_params["use_mmap"]             = params.ctxParams.use_mmap;
 
         response["taesd_preview"]       = params.taesd_preview;
         params_json["preview_method"]   = previews_str[params.lastRequest.preview_method];
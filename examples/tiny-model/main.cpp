@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "stable-diffusion.h"
+
+// Writes a GGUF model of random weights with the tensor names and shapes of a real architecture, only with fewer
+// blocks. The file loads like a downloaded checkpoint and runs the real UNet, MMDiT, Flux, CLIP, T5 and VAE code,
+// so benchmarks and tests work without network access. The same arguments always give the same file.
+//
+// usage: sd-tiny-model -a ARCH -o OUTPUT [options], see print_usage
+
+struct TinyModelParams {
+    std::string arch;
+    std::string output_path;
+    int depth       = 1;
+    bool with_t5    = false;
+    uint64_t seed   = 42;
+    sd_type_t wtype = SD_TYPE_F16;
+    bool verbose    = false;
+};
+
+void print_usage(int argc, const char* argv[]) {
+    printf("usage: %s -a ARCH -o OUTPUT [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -a, --arch [ARCH]                  sd1, sd2, sdxl, sd3, flux or flux-schnell\n");
+    printf("  -o, --output [PATH]                path of the GGUF file to write\n");
+    printf("  --depth [N]                        blocks per stack (default: 1). UNet levels get min(N, 2) res blocks\n");
+    printf("                                     and N transformer blocks at most, MMDiT is 64 * N wide\n");
+    printf("  --t5                               also write a T5-XXL encoder of N blocks for sd3 and flux (large)\n");
+    printf("  --type [TYPE]                      weight type (default: f16, examples: f32, q8_0, q4_0)\n");
+    printf("  -s, --seed [SEED]                  seed of the weights (default: 42)\n");
+    printf("  -v, --verbose                      print the library log\n");
+    printf("  -h, --help                         show this help message and exit\n");
+}
+
+bool parse_args(int argc, const char* argv[], TinyModelParams& params) {
+    bool invalid_arg = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        // the value of the current option, "" if it is missing
+        auto value = [&]() -> const char* {
+            if (++i >= argc) {
+                invalid_arg = true;
+                return "";
+            }
+            return argv[i];
+        };
+
+        if (arg == "-a" || arg == "--arch") {
+            params.arch = value();
+        } else if (arg == "-o" || arg == "--output") {
+            params.output_path = value();
+        } else if (arg == "--depth") {
+            params.depth = atoi(value());
+            if (!invalid_arg && params.depth < 1) {
+                fprintf(stderr, "error: the depth must be at least 1\n");
+                return false;
+            }
+        } else if (arg == "--t5") {
+            params.with_t5 = true;
+        } else if (arg == "--type") {
+            std::string type = value();
+            params.wtype     = SD_TYPE_COUNT;
+            for (int t = 0; t < SD_TYPE_COUNT; t++) {
+                const char* name = sd_type_name((sd_type_t)t);
+                if (name != NULL && type == name) {
+                    params.wtype = (sd_type_t)t;
+                }
+            }
+            if (!invalid_arg && params.wtype == SD_TYPE_COUNT) {
+                fprintf(stderr, "error: invalid weight type %s\n", type.c_str());
+                return false;
+            }
+        } else if (arg == "-s" || arg == "--seed") {
+            params.seed = strtoull(value(), NULL, 10);
+        } else if (arg == "-v" || arg == "--verbose") {
+            params.verbose = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+        if (invalid_arg) {
+            fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            return false;
+        }
+    }
+    if (params.arch.empty() || params.output_path.empty()) {
+        fprintf(stderr, "error: the following arguments are required: arch, output\n");
+        print_usage(argc, argv);
+        return false;
+    }
+    return true;
+}
+
+static void log_callback(enum sd_log_level_t level, const char* text, void* data) {
+    bool verbose = *(bool*)data;
+    if (text != NULL && (verbose || level >= SD_LOG_INFO)) {
+        fputs(text, stderr);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    TinyModelParams params;
+    if (!parse_args(argc, argv, params)) {
+        return 1;
+    }
+    sd_set_log_callback(log_callback, &params.verbose);
+
+    if (!generate_tiny_model(params.arch.c_str(),
+                             params.depth,
+                             params.with_t5,
+                             params.seed,
+                             params.output_path.c_str(),
+                             params.wtype)) {
+        fprintf(stderr, "generating %s failed\n", params.output_path.c_str());
+        return 1;
+    }
+    printf("%s model written to %s\n", params.arch.c_str(), params.output_path.c_str());
+    return 0;
+}
@@ -10,8 +10,10 @@
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <map>
 #include <memory>
+#include <queue>
 #include <random>
 #include <regex>
 #include <set>
@@ -26,6 +28,7 @@
 #include "ggml.h"
 #include "ggml/src/ggml-impl.h"
 
+#include "image_ops.h"
 #include "model.h"
 #include "util.h"
 
@@ -121,7 +124,13 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_kronecker(ggml_context* ctx, struct g
 }
 
 __STATIC_INLINE__ void ggml_tensor_set_f32_randn(struct ggml_tensor* tensor, std::shared_ptr<RNG> rng) {
-    uint32_t n                        = (uint32_t)ggml_nelements(tensor);
+    uint32_t n = (uint32_t)ggml_nelements(tensor);
+    if (tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor) &&
+        (tensor->buffer == NULL || ggml_backend_buffer_is_host(tensor->buffer))) {
+        // straight into the tensor memory
+        rng->randn((float*)tensor->data, n);
+        return;
+    }
     std::vector<float> random_numbers = rng->randn(n);
     for (uint32_t i = 0; i < n; i++) {
         ggml_set_f32_1d(tensor, i, random_numbers[i]);
@@ -297,58 +306,40 @@ __STATIC_INLINE__ float sigmoid(float x) {
 
 // SPECIAL OPERATIONS WITH TENSORS
 
-__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input) {
-    int64_t width    = input->ne[0];
-    int64_t height   = input->ne[1];
-    int64_t channels = input->ne[2];
-    GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32);
-    uint8_t* image_data = (uint8_t*)malloc(width * height * channels);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_tensor_get_f32(input, ix, iy, k);
-                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
-            }
-        }
-    }
-    return image_data;
+// the image conversions below work on the data of host tensors directly, plane by plane
+__STATIC_INLINE__ float* sd_image_tensor_data(struct ggml_tensor* tensor, int idx = 0) {
+    GGML_ASSERT(tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor));
+    GGML_ASSERT(tensor->buffer == NULL || ggml_backend_buffer_is_host(tensor->buffer));
+    return (float*)((char*)tensor->data + idx * tensor->nb[3]);
 }
 
 __STATIC_INLINE__ uint8_t* sd_tensor_to_mul_image(struct ggml_tensor* input, int idx) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
-    GGML_ASSERT(channels == 3 && input->type == GGML_TYPE_F32);
+    GGML_ASSERT(channels == 3);
     uint8_t* image_data = (uint8_t*)malloc(width * height * channels);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_tensor_get_f32(input, ix, iy, k, idx);
-                *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
-            }
-        }
-    }
+    sd_image_f32_planar_to_u8(sd_image_tensor_data(input, idx), image_data, (int)width, (int)height, (int)channels, 255.0f, 0.0f);
     return image_data;
 }
 
+__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input) {
+    return sd_tensor_to_mul_image(input, 0);
+}
+
 __STATIC_INLINE__ void sd_image_to_tensor(const uint8_t* image_data,
                                           struct ggml_tensor* output,
                                           bool scale = true) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                float value = *(image_data + iy * width * channels + ix * channels + k);
-                if (scale) {
-                    value /= 255.f;
-                }
-                ggml_tensor_set_f32(output, value, ix, iy, k);
-            }
-        }
+    GGML_ASSERT(channels == 3);
+    float a[3] = {1.0f, 1.0f, 1.0f};
+    float b[3] = {0.0f, 0.0f, 0.0f};
+    if (scale) {
+        a[0] = a[1] = a[2] = 1.0f / 255.0f;
     }
+    sd_image_u8_to_f32_planar(image_data, sd_image_tensor_data(output), (int)width, (int)height, (int)channels, a, b);
 }
 
 __STATIC_INLINE__ void sd_mask_to_tensor(const uint8_t* image_data,
@@ -357,16 +348,10 @@ __STATIC_INLINE__ void sd_mask_to_tensor(const uint8_t* image_data,
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 1 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            float value = *(image_data + iy * width * channels + ix);
-            if (scale) {
-                value /= 255.f;
-            }
-            ggml_tensor_set_f32(output, value, ix, iy);
-        }
-    }
+    GGML_ASSERT(channels == 1);
+    float a = scale ? 1.0f / 255.0f : 1.0f;
+    float b = 0.0f;
+    sd_image_u8_to_f32_planar(image_data, sd_image_tensor_data(output), (int)width, (int)height, 1, &a, &b);
 }
 
 __STATIC_INLINE__ void sd_apply_mask(struct ggml_tensor* image_data,
@@ -410,18 +395,16 @@ __STATIC_INLINE__ void sd_mul_images_to_tensor(const uint8_t* image_data,
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                int value       = *(image_data + iy * width * channels + ix * channels + k);
-                float pixel_val = value / 255.0f;
-                if (mean != NULL && std != NULL)
-                    pixel_val = (pixel_val - mean[k]) / std[k];
-                ggml_tensor_set_f32(output, pixel_val, ix, iy, k, idx);
-            }
-        }
-    }
+    GGML_ASSERT(channels == 3);
+    // (value / 255 - mean) / std folded into value * a + b
+    float a[3];
+    float b[3];
+    for (int k = 0; k < 3; k++) {
+        bool normalize = mean != NULL && std != NULL;
+        a[k]           = normalize ? 1.0f / (255.0f * std[k]) : 1.0f / 255.0f;
+        b[k]           = normalize ? -mean[k] / std[k] : 0.0f;
+    }
+    sd_image_u8_to_f32_planar(image_data, sd_image_tensor_data(output, idx), (int)width, (int)height, (int)channels, a, b);
 }
 
 __STATIC_INLINE__ void sd_image_f32_to_tensor(const float* image_data,
@@ -430,24 +413,20 @@ __STATIC_INLINE__ void sd_image_f32_to_tensor(const float* image_data,
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
-    GGML_ASSERT(channels == 3 && output->type == GGML_TYPE_F32);
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            for (int k = 0; k < channels; k++) {
-                int value = *(image_data + iy * width * channels + ix * channels + k);
-                if (scale) {
-                    value /= 255.f;
-                }
-                ggml_tensor_set_f32(output, value, ix, iy, k);
-            }
-        }
+    GGML_ASSERT(channels == 3);
+    float a[3] = {1.0f, 1.0f, 1.0f};
+    float b[3] = {0.0f, 0.0f, 0.0f};
+    if (scale) {
+        a[0] = a[1] = a[2] = 1.0f / 255.0f;
     }
+    sd_image_f32_to_f32_planar(image_data, sd_image_tensor_data(output), (int)width, (int)height, (int)channels, a, b);
 }
 
 __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
-                                            int y) {
+                                            int y,
+                                            int output_n = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
@@ -456,7 +435,7 @@ __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
                 float value = ggml_tensor_get_f32(input, ix + x, iy + y, k);
-                ggml_tensor_set_f32(output, value, ix, iy, k);
+                ggml_tensor_set_f32(output, value, ix, iy, k, output_n);
             }
         }
     }
@@ -468,28 +447,32 @@ __STATIC_INLINE__ float ggml_smootherstep_f32(const float x) {
     return x * x * x * (x * (6.0f * x - 15.0f) + 10.0f);
 }
 
+// output may hold only the rows [band_y, band_y + output->ne[1]) of an image of band_img_height rows
 __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
                                             int y,
                                             int overlap_x,
                                             int overlap_y,
-                                            int x_skip = 0,
-                                            int y_skip = 0) {
+                                            int x_skip              = 0,
+                                            int y_skip              = 0,
+                                            int input_n             = 0,
+                                            int band_y              = 0,
+                                            int64_t band_img_height = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
 
     int64_t img_width  = output->ne[0];
-    int64_t img_height = output->ne[1];
+    int64_t img_height = band_img_height > 0 ? band_img_height : output->ne[1];
 
     GGML_ASSERT(input->type == GGML_TYPE_F32 && output->type == GGML_TYPE_F32);
     for (int iy = y_skip; iy < height; iy++) {
         for (int ix = x_skip; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
-                float new_value = ggml_tensor_get_f32(input, ix, iy, k);
+                float new_value = ggml_tensor_get_f32(input, ix, iy, k, input_n);
                 if (overlap_x > 0 || overlap_y > 0) {  // blend colors in overlapped area
-                    float old_value = ggml_tensor_get_f32(output, x + ix, y + iy, k);
+                    float old_value = ggml_tensor_get_f32(output, x + ix, y + iy - band_y, k);
 
                     const float x_f_0 = (overlap_x > 0 && x > 0) ? (ix - x_skip) / float(overlap_x) : 1;
                     const float x_f_1 = (overlap_x > 0 && x < (img_width - width)) ? (width - ix) / float(overlap_x) : 1;
@@ -502,9 +485,9 @@ __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
                     ggml_tensor_set_f32(
                         output,
                         old_value + new_value * ggml_smootherstep_f32(y_f) * ggml_smootherstep_f32(x_f),
-                        x + ix, y + iy, k);
+                        x + ix, y + iy - band_y, k);
                 } else {
-                    ggml_tensor_set_f32(output, new_value, x + ix, y + iy, k);
+                    ggml_tensor_set_f32(output, new_value, x + ix, y + iy - band_y, k);
                 }
             }
         }
@@ -635,17 +618,21 @@ sd_tiling_calc_tiles(int &num_tiles_dim, float& tile_overlap_factor_dim, int sma
 }
 
 // Tiling
-__STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input, ggml_tensor* output, const int scale,
-                                            const int p_tile_size_x, const int p_tile_size_y,
-                                            const float tile_overlap_factor, on_tile_process on_processing) {
-
-    output = ggml_set_f32(output, 0);
+struct sd_tile_t {
+    int x_in, y_in, x_out, y_out, dx, dy;
+};
 
-    int input_width   = (int)input->ne[0];
-    int input_height  = (int)input->ne[1];
-    int output_width  = (int)output->ne[0];
-    int output_height = (int)output->ne[1];
+struct sd_tiling_layout_t {
+    int input_tile_size_x, input_tile_size_y;
+    int output_tile_size_x, output_tile_size_y;
+    int overlap_x_out, overlap_y_out;
+    std::vector<sd_tile_t> tiles;  // in raster order
+};
 
+__STATIC_INLINE__ sd_tiling_layout_t sd_tiling_get_layout(int input_width, int input_height,
+                                                         int output_width, int output_height, const int scale,
+                                                         const int p_tile_size_x, const int p_tile_size_y,
+                                                         const float tile_overlap_factor) {
     GGML_ASSERT(input_width / output_width == input_height / output_height && output_width / input_width == output_height / input_height);
     GGML_ASSERT(input_width / output_width == scale || output_width / input_width == scale);
 
@@ -681,44 +668,24 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input, ggml_tensor* out
     int tile_size_x = p_tile_size_x < small_width ? p_tile_size_x : small_width;
     int tile_size_y = p_tile_size_y < small_height ? p_tile_size_y : small_height;
 
-    int input_tile_size_x  = tile_size_x;
-    int input_tile_size_y  = tile_size_y;
-    int output_tile_size_x = tile_size_x;
-    int output_tile_size_y = tile_size_y;
+    sd_tiling_layout_t layout;
+    layout.input_tile_size_x  = tile_size_x;
+    layout.input_tile_size_y  = tile_size_y;
+    layout.output_tile_size_x = tile_size_x;
+    layout.output_tile_size_y = tile_size_y;
 
     if (big_out) {
-        output_tile_size_x *= scale;
-        output_tile_size_y *= scale;
+        layout.output_tile_size_x *= scale;
+        layout.output_tile_size_y *= scale;
     } else {
-        input_tile_size_x *= scale;
-        input_tile_size_y *= scale;
+        layout.input_tile_size_x *= scale;
+        layout.input_tile_size_y *= scale;
     }
 
-    struct ggml_init_params params = {};
-    params.mem_size += input_tile_size_x * input_tile_size_y * input->ne[2] * sizeof(float);     // input chunk
-    params.mem_size += output_tile_size_x * output_tile_size_y * output->ne[2] * sizeof(float);  // output chunk
-    params.mem_size += 3 * ggml_tensor_overhead();
-    params.mem_buffer = NULL;
-    params.no_alloc   = false;
-
-    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
-
-    // draft context
-    struct ggml_context* tiles_ctx = ggml_init(params);
-    if (!tiles_ctx) {
-        LOG_ERROR("ggml_init() failed");
-        return;
-    }
+    layout.overlap_x_out = big_out ? tile_overlap_x * scale : tile_overlap_x;
+    layout.overlap_y_out = big_out ? tile_overlap_y * scale : tile_overlap_y;
 
-    // tiling
-    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, input_tile_size_x, input_tile_size_y, input->ne[2], 1);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, output_tile_size_x, output_tile_size_y, output->ne[2], 1);
-    int num_tiles            = num_tiles_x * num_tiles_y;
-    LOG_DEBUG("processing %i tiles", num_tiles);
-    pretty_progress(0, num_tiles, 0.0f);
-    int tile_count = 1;
     bool last_y = false, last_x = false;
-    float last_time = 0.0f;
     for (int y = 0; y < small_height && !last_y; y += non_tile_overlap_y) {
         int dy = 0;
         if (y + tile_size_y >= small_height) {
@@ -742,35 +709,166 @@ __STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input, ggml_tensor* out
                 last_x = true;
             }
 
-            int x_in  = big_out ? x : scale * x;
-            int y_in  = big_out ? y : scale * y;
-            int x_out = big_out ? x * scale : x;
-            int y_out = big_out ? y * scale : y;
+            sd_tile_t tile;
+            tile.x_in  = big_out ? x : scale * x;
+            tile.y_in  = big_out ? y : scale * y;
+            tile.x_out = big_out ? x * scale : x;
+            tile.y_out = big_out ? y * scale : y;
+            tile.dx    = dx;
+            tile.dy    = dy;
+            layout.tiles.push_back(tile);
+        }
+        last_x = false;
+    }
+    return layout;
+}
 
-            int overlap_x_out = big_out ? tile_overlap_x * scale : tile_overlap_x;
-            int overlap_y_out = big_out ? tile_overlap_y * scale : tile_overlap_y;
+// runs the tiles of layout through on_processing, tile_batch_size tiles are stacked along ne[3] and
+// handed over at once, the last batch may hold fewer tiles. on_merge(output_tiles, n, tile) takes each result.
+typedef std::function<void(ggml_tensor*, int, const sd_tile_t&)> on_tile_merge;
 
-            int64_t t1 = ggml_time_ms();
-            ggml_split_tensor_2d(input, input_tile, x_in, y_in);
-            on_processing(input_tile, output_tile, false);
-            ggml_merge_tensor_2d(output_tile, output, x_out, y_out, overlap_x_out, overlap_y_out, dx, dy);
+// on_split(input_tiles, n, x, y) fills input tile n from the input at (x, y), for inputs that are not in memory
+typedef std::function<void(ggml_tensor*, int, int, int)> on_tile_split;
 
-            int64_t t2 = ggml_time_ms();
-            last_time  = (t2 - t1) / 1000.0f;
-            pretty_progress(tile_count, num_tiles, last_time);
-            tile_count++;
-        }
-        last_x = false;
+__STATIC_INLINE__ void sd_tiling_process(ggml_tensor* input, int64_t output_channels, const sd_tiling_layout_t& layout,
+                                         on_tile_process on_processing, on_tile_merge on_merge, int tile_batch_size,
+                                         on_tile_split on_split = nullptr) {
+    int num_tiles   = (int)layout.tiles.size();
+    tile_batch_size = std::max(1, std::min(tile_batch_size, num_tiles));
+
+    struct ggml_init_params params = {};
+    params.mem_size += layout.input_tile_size_x * layout.input_tile_size_y * input->ne[2] * tile_batch_size * sizeof(float);       // input chunks
+    params.mem_size += layout.output_tile_size_x * layout.output_tile_size_y * output_channels * tile_batch_size * sizeof(float);  // output chunks
+    params.mem_size += 5 * ggml_tensor_overhead();
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    LOG_DEBUG("tile work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
+
+    // draft context
+    struct ggml_context* tiles_ctx = ggml_init(params);
+    if (!tiles_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return;
     }
-    if (tile_count < num_tiles) {
-        pretty_progress(num_tiles, num_tiles, last_time);
+
+    // tiling
+    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, layout.input_tile_size_x, layout.input_tile_size_y, input->ne[2], tile_batch_size);
+    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, layout.output_tile_size_x, layout.output_tile_size_y, output_channels, tile_batch_size);
+    LOG_DEBUG("processing %i tiles, %i per batch", num_tiles, tile_batch_size);
+    pretty_progress(0, num_tiles, 0.0f);
+    float last_time = 0.0f;
+    for (int i = 0; i < num_tiles; i += tile_batch_size) {
+        int n = std::min(tile_batch_size, num_tiles - i);
+
+        ggml_tensor* in  = input_tile;
+        ggml_tensor* out = output_tile;
+        if (n < tile_batch_size) {
+            // the leading n tiles of the batch tensors
+            in  = ggml_view_4d(tiles_ctx, input_tile, input_tile->ne[0], input_tile->ne[1], input_tile->ne[2], n,
+                               input_tile->nb[1], input_tile->nb[2], input_tile->nb[3], 0);
+            out = ggml_view_4d(tiles_ctx, output_tile, output_tile->ne[0], output_tile->ne[1], output_tile->ne[2], n,
+                               output_tile->nb[1], output_tile->nb[2], output_tile->nb[3], 0);
+        }
+
+        int64_t t1 = ggml_time_ms();
+        for (int j = 0; j < n; j++) {
+            if (on_split) {
+                on_split(in, j, layout.tiles[i + j].x_in, layout.tiles[i + j].y_in);
+            } else {
+                ggml_split_tensor_2d(input, in, layout.tiles[i + j].x_in, layout.tiles[i + j].y_in, j);
+            }
+        }
+        on_processing(in, out, false);
+        for (int j = 0; j < n; j++) {
+            on_merge(out, j, layout.tiles[i + j]);
+        }
+
+        int64_t t2 = ggml_time_ms();
+        last_time  = (t2 - t1) / 1000.0f / n;
+        pretty_progress(i + n, num_tiles, last_time);
     }
     ggml_free(tiles_ctx);
 }
 
+__STATIC_INLINE__ void sd_tiling_non_square(ggml_tensor* input, ggml_tensor* output, const int scale,
+                                            const int p_tile_size_x, const int p_tile_size_y,
+                                            const float tile_overlap_factor, on_tile_process on_processing,
+                                            int tile_batch_size = 1) {
+    output = ggml_set_f32(output, 0);
+
+    sd_tiling_layout_t layout = sd_tiling_get_layout((int)input->ne[0], (int)input->ne[1],
+                                                     (int)output->ne[0], (int)output->ne[1], scale,
+                                                     p_tile_size_x, p_tile_size_y, tile_overlap_factor);
+
+    auto on_merge = [&](ggml_tensor* out, int n, const sd_tile_t& tile) {
+        ggml_merge_tensor_2d(out, output, tile.x_out, tile.y_out, layout.overlap_x_out, layout.overlap_y_out, tile.dx, tile.dy, n);
+    };
+    sd_tiling_process(input, output->ne[2], layout, on_processing, on_merge, tile_batch_size);
+}
+
+// on_rows(band, y, num_rows): the first num_rows rows of band are the finished output rows [y, y + num_rows)
+typedef std::function<void(ggml_tensor*, int, int)> on_tile_rows;
+
+// Streaming tiling for scale up (decode): the output is never materialized, the tiles are merged
+// into a band of one tile row and the rows no later tile touches are handed to on_rows.
+// With on_split the input only gives the shape and its data may be NULL.
+__STATIC_INLINE__ void sd_tiling_stream(ggml_tensor* input, int output_width, int output_height, int64_t output_channels,
+                                        const int scale, const int p_tile_size_x, const int p_tile_size_y,
+                                        const float tile_overlap_factor, on_tile_process on_processing,
+                                        on_tile_rows on_rows, int tile_batch_size = 1, on_tile_split on_split = nullptr) {
+    GGML_ASSERT(output_width > input->ne[0]);
+
+    sd_tiling_layout_t layout = sd_tiling_get_layout((int)input->ne[0], (int)input->ne[1],
+                                                     output_width, output_height, scale,
+                                                     p_tile_size_x, p_tile_size_y, tile_overlap_factor);
+
+    // overlap is at most half a tile and the last tile row skips the rows above its regular position,
+    // so a band of one tile row holds every row that can still change
+    std::vector<float> band_data(output_width * layout.output_tile_size_y * output_channels);
+
+    struct ggml_init_params params = {};
+    params.mem_size                = ggml_tensor_overhead();
+    params.mem_buffer              = NULL;
+    params.no_alloc                = true;
+    struct ggml_context* band_ctx  = ggml_init(params);
+    if (!band_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return;
+    }
+    ggml_tensor* band = ggml_new_tensor_3d(band_ctx, GGML_TYPE_F32, output_width, layout.output_tile_size_y, output_channels);
+    band->data        = band_data.data();
+    int band_y        = 0;
+
+    // hands the rows above y to on_rows and moves the band down to y
+    auto flush = [&](int y) {
+        int num_rows = y - band_y;
+        if (num_rows <= 0) {
+            return;
+        }
+        on_rows(band, band_y, num_rows);
+        size_t row_size = output_width * sizeof(float);
+        for (int c = 0; c < output_channels; c++) {
+            char* plane = (char*)band->data + c * band->nb[2];
+            memmove(plane, plane + num_rows * row_size, (band->ne[1] - num_rows) * row_size);
+            memset(plane + (band->ne[1] - num_rows) * row_size, 0, num_rows * row_size);
+        }
+        band_y = y;
+    };
+
+    auto on_merge = [&](ggml_tensor* out, int n, const sd_tile_t& tile) {
+        flush(tile.y_out + tile.dy);
+        ggml_merge_tensor_2d(out, band, tile.x_out, tile.y_out, layout.overlap_x_out, layout.overlap_y_out,
+                             tile.dx, tile.dy, n, band_y, output_height);
+    };
+    sd_tiling_process(input, output_channels, layout, on_processing, on_merge, tile_batch_size, on_split);
+    flush(output_height);
+    ggml_free(band_ctx);
+}
+
 __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const int scale,
-    const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
-    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing);
+    const int tile_size, const float tile_overlap_factor, on_tile_process on_processing, int tile_batch_size = 1) {
+    sd_tiling_non_square(input, output, scale, tile_size, tile_size, tile_overlap_factor, on_processing, tile_batch_size);
 }
 
 __STATIC_INLINE__ struct ggml_tensor* ggml_group_norm_32(struct ggml_context* ctx,
@@ -813,6 +911,114 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_nn_conv_2d(struct ggml_context* ctx,
     return x;
 }
 
+// LoRA applied in the forward pass instead of being merged into the weights:
+// the layer owning `weight` adds scale * up(mid(down(x))) to its output
+struct LoraAdapter {
+    struct ggml_tensor* down = NULL;
+    struct ggml_tensor* up   = NULL;
+    struct ggml_tensor* mid  = NULL;  // tucker decomposition, conv only
+    float scale              = 1.0f;
+};
+
+typedef std::unordered_map<const struct ggml_tensor*, std::vector<LoraAdapter>> LoraAdapterMap;
+
+// makes `adapters` visible to the Linear/Conv2d blocks of the graphs built on this thread
+struct LoraAdapterScope {
+    const LoraAdapterMap* prev;
+
+    static const LoraAdapterMap*& current() {
+        static thread_local const LoraAdapterMap* adapters = NULL;
+        return adapters;
+    }
+
+    LoraAdapterScope(const LoraAdapterMap* adapters)
+        : prev(current()) {
+        current() = adapters;
+    }
+
+    ~LoraAdapterScope() {
+        current() = prev;
+    }
+};
+
+__STATIC_INLINE__ const std::vector<LoraAdapter>* ggml_nn_get_lora_adapters(const struct ggml_tensor* w) {
+    const LoraAdapterMap* adapters = LoraAdapterScope::current();
+    if (adapters == NULL) {
+        return NULL;
+    }
+    auto it = adapters->find(w);
+    if (it == adapters->end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+// w: [OC, IC]
+// out = x * w + b
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_linear_lora(struct ggml_context* ctx,
+                                                          struct ggml_tensor* x,
+                                                          struct ggml_tensor* out,
+                                                          struct ggml_tensor* w) {
+    const std::vector<LoraAdapter>* adapters = ggml_nn_get_lora_adapters(w);
+    if (adapters == NULL) {
+        return out;
+    }
+    for (const LoraAdapter& adapter : *adapters) {
+        // lora_down: [R, IC], lora_up: [OC, R]
+        auto down = ggml_reshape_2d(ctx, adapter.down, w->ne[0], ggml_nelements(adapter.down) / w->ne[0]);
+        auto up   = ggml_reshape_2d(ctx, adapter.up, ggml_nelements(adapter.up) / w->ne[1], w->ne[1]);
+        auto h    = ggml_mul_mat(ctx, down, x);
+        h         = ggml_mul_mat(ctx, up, h);
+        out       = ggml_add(ctx, out, ggml_scale(ctx, h, adapter.scale));
+    }
+    return out;
+}
+
+// w: [OC，IC, KH, KW]
+// out = conv_2d(x, w) + b
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_conv_2d_lora(struct ggml_context* ctx,
+                                                           struct ggml_tensor* x,
+                                                           struct ggml_tensor* out,
+                                                           struct ggml_tensor* w,
+                                                           int s0 = 1,
+                                                           int s1 = 1,
+                                                           int p0 = 0,
+                                                           int p1 = 0,
+                                                           int d0 = 1,
+                                                           int d1 = 1) {
+    const std::vector<LoraAdapter>* adapters = ggml_nn_get_lora_adapters(w);
+    if (adapters == NULL) {
+        return out;
+    }
+    // im2col only handles f16/f32 kernels
+    auto conv_kernel = [&](struct ggml_tensor* t, int64_t kw, int64_t kh, int64_t ic) {
+        if (t->type != GGML_TYPE_F16 && t->type != GGML_TYPE_F32) {
+            t = ggml_cast(ctx, t, GGML_TYPE_F32);
+        }
+        return ggml_reshape_4d(ctx, t, kw, kh, ic, ggml_nelements(t) / (kw * kh * ic));
+    };
+    for (const LoraAdapter& adapter : *adapters) {
+        struct ggml_tensor* h = NULL;
+        if (adapter.mid == NULL) {
+            // lora_down: [R, IC, KH, KW], lora_up: [OC, R, 1, 1]
+            auto down = conv_kernel(adapter.down, w->ne[0], w->ne[1], w->ne[2]);
+            auto up   = conv_kernel(adapter.up, 1, 1, down->ne[3]);
+            h         = ggml_nn_conv_2d(ctx, x, down, NULL, s0, s1, p0, p1, d0, d1);
+            h         = ggml_nn_conv_2d(ctx, h, up, NULL);
+        } else {
+            // lora_down: [R, IC, 1, 1], lora_mid: [R, R, KH, KW], lora_up: [OC, R, 1, 1]
+            auto down = conv_kernel(adapter.down, 1, 1, w->ne[2]);
+            auto mid  = conv_kernel(adapter.mid, w->ne[0], w->ne[1], down->ne[3]);
+            auto up   = conv_kernel(adapter.up, 1, 1, mid->ne[3]);
+            h         = ggml_nn_conv_2d(ctx, x, down, NULL);
+            h         = ggml_nn_conv_2d(ctx, h, mid, NULL, s0, s1, p0, p1, d0, d1);
+            h         = ggml_nn_conv_2d(ctx, h, up, NULL);
+        }
+        out = ggml_add(ctx, out, ggml_scale(ctx, h, adapter.scale));
+    }
+    return out;
+}
+
 // w: [OC，IC, KD, 1 * 1]
 // x: [N, IC, IH, IW]
 // b: [OC,]
@@ -1192,6 +1398,7 @@ protected:
 
     struct ggml_context* compute_ctx    = NULL;
     struct ggml_gallocr* compute_allocr = NULL;
+    size_t max_compute_buffer_size      = 0;
 
     std::map<struct ggml_tensor*, const void*> backend_tensor_data_map;
 
@@ -1249,6 +1456,7 @@ protected:
 
         // compute the required memory
         size_t compute_buffer_size = ggml_gallocr_get_buffer_size(compute_allocr, 0);
+        max_compute_buffer_size    = std::max(max_compute_buffer_size, compute_buffer_size);
         LOG_DEBUG("%s compute buffer size: %.2f MB(%s)",
                   get_desc().c_str(),
                   compute_buffer_size / 1024.0 / 1024.0,
@@ -1289,7 +1497,18 @@ public:
 
     bool alloc_params_buffer() {
         size_t num_tensors = ggml_tensor_num(params_ctx);
-        params_buffer      = ggml_backend_alloc_ctx_tensors(params_ctx, backend);
+        size_t num_bound   = 0;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+            if (t->data != NULL) {
+                num_bound++;
+            }
+        }
+        if (num_tensors > 0 && num_bound == num_tensors) {
+            // every weight is bound to a mapped model file, see ModelLoader::bind_mapped_tensors
+            LOG_DEBUG("%s params are all mapped (%i tensors)", get_desc().c_str(), num_tensors);
+            return true;
+        }
+        params_buffer = ggml_backend_alloc_ctx_tensors(params_ctx, backend);
         if (params_buffer == NULL) {
             LOG_ERROR("%s alloc params backend buffer failed, num_tensors = %i",
                       get_desc().c_str(),
@@ -1324,6 +1543,26 @@ public:
         return 0;
     }
 
+    // largest compute buffer allocated since the last reset_max_compute_buffer_size()
+    size_t get_max_compute_buffer_size() {
+        return max_compute_buffer_size;
+    }
+
+    void reset_max_compute_buffer_size() {
+        max_compute_buffer_size = 0;
+    }
+
+    ggml_backend_t get_backend() {
+        return backend;
+    }
+
+    // computes on another backend of the same device from now on, the params stay where they were loaded.
+    // Two runners with backends of their own can compute at the same time from different threads.
+    void set_compute_backend(ggml_backend_t compute_backend) {
+        free_compute_buffer();
+        backend = compute_backend;
+    }
+
     void free_compute_buffer() {
         if (compute_allocr != NULL) {
             ggml_gallocr_free(compute_allocr);
@@ -1353,6 +1592,21 @@ public:
         }
     }
 
+    // size of the compute buffer the graph needs, the buffer is released right away
+    size_t get_compute_buffer_size(get_graph_cb_t get_graph) {
+        reset_compute_ctx();
+        struct ggml_cgraph* gf = get_graph();
+        backend_tensor_data_map.clear();
+        ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+
+        size_t compute_buffer_size = SIZE_MAX;
+        if (ggml_gallocr_reserve(allocr, gf)) {
+            compute_buffer_size = ggml_gallocr_get_buffer_size(allocr, 0);
+        }
+        ggml_gallocr_free(allocr);
+        return compute_buffer_size;
+    }
+
     bool compute(get_graph_cb_t get_graph,
                  int n_threads,
                  bool free_compute_buffer_immediately = true,
@@ -1529,7 +1783,8 @@ public:
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_linear(ctx, x, w, b);
+        auto out = ggml_nn_linear(ctx, x, w, b);
+        return ggml_nn_linear_lora(ctx, x, out, w);
     }
 };
 
@@ -1608,7 +1863,8 @@ public:
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_conv_2d(ctx, x, w, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        auto out = ggml_nn_conv_2d(ctx, x, w, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        return ggml_nn_conv_2d_lora(ctx, x, out, w, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
     }
 };
 
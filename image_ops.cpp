@@ -0,0 +1,386 @@
+#include "image_ops.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SD_IMAGE_OPS_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SD_IMAGE_OPS_NEON
+#endif
+
+/*================================================== Threading ===================================================*/
+
+void sd_parallel_rows(int rows, size_t row_cost, int n_threads, const std::function<void(int, int)>& fn) {
+    // below this many units of work (bytes touched, roughly) per thread a new thread costs more than it saves
+    const size_t min_cost_per_thread = 1 << 18;
+
+    if (n_threads <= 0) {
+        n_threads = (int)std::thread::hardware_concurrency();
+    }
+    size_t max_threads = std::max<size_t>(1, (size_t)rows * row_cost / min_cost_per_thread);
+    n_threads          = (int)std::min<size_t>(std::min<size_t>(std::max(n_threads, 1), max_threads), std::max(rows, 1));
+    if (n_threads <= 1) {
+        fn(0, rows);
+        return;
+    }
+
+    int rows_per_thread = (rows + n_threads - 1) / n_threads;
+    std::vector<std::thread> threads;
+    for (int begin = rows_per_thread; begin < rows; begin += rows_per_thread) {
+        threads.emplace_back(fn, begin, std::min(rows, begin + rows_per_thread));
+    }
+    fn(0, std::min(rows, rows_per_thread));
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/*================================================= Row kernels ==================================================*/
+
+void sd_u8_to_f32_row(const uint8_t* src, float* dst, size_t n, float a, float b) {
+    size_t i = 0;
+#if defined(SD_IMAGE_OPS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 va    = _mm_set1_ps(a);
+    const __m128 vb    = _mm_set1_ps(b);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), va), vb));
+        _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), va), vb));
+        _mm_storeu_ps(dst + i + 8, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), va), vb));
+        _mm_storeu_ps(dst + i + 12, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), va), vb));
+    }
+#elif defined(SD_IMAGE_OPS_NEON)
+    const float32x4_t va = vdupq_n_f32(a);
+    const float32x4_t vb = vdupq_n_f32(b);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v  = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_f32(dst + i, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), va), vb));
+        vst1q_f32(dst + i + 4, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), va), vb));
+        vst1q_f32(dst + i + 8, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), va), vb));
+        vst1q_f32(dst + i + 12, vaddq_f32(vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), va), vb));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = src[i] * a + b;
+    }
+}
+
+void sd_f32_to_u8_row(const float* src, uint8_t* dst, size_t n, float a, float b) {
+    size_t i = 0;
+#if defined(SD_IMAGE_OPS_SSE2)
+    const __m128 va   = _mm_set1_ps(a);
+    const __m128 vb   = _mm_set1_ps(b);
+    const __m128 vmin = _mm_setzero_ps();
+    const __m128 vmax = _mm_set1_ps(255.0f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + j * 4), va), vb);
+            // max first, so that NaN ends up as 0
+            v    = _mm_min_ps(_mm_max_ps(v, vmin), vmax);
+            q[j] = _mm_cvttps_epi32(v);
+        }
+        __m128i lo = _mm_packs_epi32(q[0], q[1]);
+        __m128i hi = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(SD_IMAGE_OPS_NEON)
+    const float32x4_t va   = vdupq_n_f32(a);
+    const float32x4_t vb   = vdupq_n_f32(b);
+    const float32x4_t vmin = vdupq_n_f32(0.0f);
+    const float32x4_t vmax = vdupq_n_f32(255.0f);
+    for (; i + 16 <= n; i += 16) {
+        uint16x4_t q[4];
+        for (int j = 0; j < 4; j++) {
+            float32x4_t v = vaddq_f32(vmulq_f32(vld1q_f32(src + i + j * 4), va), vb);
+            v             = vminq_f32(vmaxq_f32(v, vmin), vmax);
+            q[j]          = vmovn_u32(vcvtq_u32_f32(v));
+        }
+        uint8x8_t lo = vmovn_u16(vcombine_u16(q[0], q[1]));
+        uint8x8_t hi = vmovn_u16(vcombine_u16(q[2], q[3]));
+        vst1q_u8(dst + i, vcombine_u8(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        float value = src[i] * a + b;
+        value       = value > 0.0f ? value : 0.0f;  // NaN -> 0, like the vector path
+        dst[i]      = (uint8_t)std::min(value, 255.0f);
+    }
+}
+
+/*============================================= Layout conversions ===============================================*/
+
+// plane c = src[x * channels + c] * a[c] + b[c], three channel images get their own loop that the compiler vectorizes
+static void deinterleave_row(const float* src, float* dst, size_t plane_size, int width, int channels,
+                             const float* a, const float* b) {
+    if (channels == 3) {
+        const float a0 = a[0], a1 = a[1], a2 = a[2];
+        const float b0 = b[0], b1 = b[1], b2 = b[2];
+        float* d0      = dst;
+        float* d1      = dst + plane_size;
+        float* d2      = dst + 2 * plane_size;
+        for (int x = 0; x < width; x++) {
+            d0[x] = src[x * 3] * a0 + b0;
+            d1[x] = src[x * 3 + 1] * a1 + b1;
+            d2[x] = src[x * 3 + 2] * a2 + b2;
+        }
+        return;
+    }
+    for (int c = 0; c < channels; c++) {
+        const float ac = a[c], bc = b[c];
+        float* d       = dst + c * plane_size;
+        for (int x = 0; x < width; x++) {
+            d[x] = src[x * channels + c] * ac + bc;
+        }
+    }
+}
+
+// dst[x * channels + c] = plane c[x]
+static void interleave_row(const uint8_t* src, size_t plane_size, uint8_t* dst, int width, int channels) {
+    if (channels == 3) {
+        const uint8_t* p0 = src;
+        const uint8_t* p1 = src + plane_size;
+        const uint8_t* p2 = src + 2 * plane_size;
+        for (int x = 0; x < width; x++) {
+            dst[x * 3]     = p0[x];
+            dst[x * 3 + 1] = p1[x];
+            dst[x * 3 + 2] = p2[x];
+        }
+        return;
+    }
+    for (int c = 0; c < channels; c++) {
+        const uint8_t* p = src + c * plane_size;
+        for (int x = 0; x < width; x++) {
+            dst[x * channels + c] = p[x];
+        }
+    }
+}
+
+void sd_image_u8_to_f32_planar(const uint8_t* src, float* dst, int width, int height, int channels,
+                               const float* a, const float* b, int n_threads) {
+    const size_t plane_size = (size_t)width * height;
+    sd_parallel_rows(height, (size_t)width * channels * 5, n_threads, [&](int begin, int end) {
+        // widened with simd first, then split into the planes
+        std::vector<float> row(width * channels);
+        for (int y = begin; y < end; y++) {
+            sd_u8_to_f32_row(src + (size_t)y * width * channels, row.data(), row.size(), 1.0f, 0.0f);
+            deinterleave_row(row.data(), dst + (size_t)y * width, plane_size, width, channels, a, b);
+        }
+    });
+}
+
+void sd_image_f32_planar_to_u8(const float* src, uint8_t* dst, int width, int height, int channels,
+                               float a, float b, int n_threads, size_t plane_size) {
+    if (plane_size == 0) {
+        plane_size = (size_t)width * height;
+    }
+    sd_parallel_rows(height, (size_t)width * channels * 5, n_threads, [&](int begin, int end) {
+        // narrowed with simd plane by plane, then interleaved
+        std::vector<uint8_t> planes(width * channels);
+        for (int y = begin; y < end; y++) {
+            for (int c = 0; c < channels; c++) {
+                sd_f32_to_u8_row(src + c * plane_size + (size_t)y * width, planes.data() + c * width, width, a, b);
+            }
+            interleave_row(planes.data(), width, dst + (size_t)y * width * channels, width, channels);
+        }
+    });
+}
+
+void sd_image_f32_to_f32_planar(const float* src, float* dst, int width, int height, int channels,
+                                const float* a, const float* b, int n_threads) {
+    const size_t plane_size = (size_t)width * height;
+    sd_parallel_rows(height, (size_t)width * channels * 8, n_threads, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            deinterleave_row(src + (size_t)y * width * channels, dst + (size_t)y * width, plane_size, width, channels, a, b);
+        }
+    });
+}
+
+void sd_image_f32_normalize(float* data, int width, int height, int channels,
+                            const float* mean, const float* std, int n_threads) {
+    // the coefficients repeated over 4 pixels, so that a block is a whole number of simd vectors,
+    // a single pixel for more than 4 channels
+    const int block_size = channels <= 4 ? channels * 4 : channels;
+    std::vector<float> a(block_size);
+    std::vector<float> b(block_size);
+    for (int j = 0; j < block_size; j++) {
+        a[j] = 1.0f / std[j % channels];
+        b[j] = -mean[j % channels] / std[j % channels];
+    }
+    sd_parallel_rows(height, (size_t)width * channels * 8, n_threads, [&](int begin, int end) {
+        size_t n   = (size_t)(end - begin) * width * channels;
+        float* row = data + (size_t)begin * width * channels;
+        if (block_size > 16) {
+            for (size_t i = 0; i < n; i++) {
+                row[i] = row[i] * a[i % channels] + b[i % channels];
+            }
+            return;
+        }
+        // local copies, the compiler knows that the stores to row leave them alone
+        float block_a[16];
+        float block_b[16];
+        std::copy(a.begin(), a.end(), block_a);
+        std::copy(b.begin(), b.end(), block_b);
+        size_t i = 0;
+        for (; i + block_size <= n; i += block_size) {
+            for (int j = 0; j < block_size; j++) {
+                row[i + j] = row[i + j] * block_a[j] + block_b[j];
+            }
+        }
+        for (; i < n; i++) {
+            row[i] = row[i] * block_a[i % channels] + block_b[i % channels];
+        }
+    });
+}
+
+/*==================================================== Resize ====================================================*/
+
+// Both resizes are separable: source rows are filtered horizontally into dst_width wide rows, which are then
+// blended vertically. The filtered rows are cached, neighbouring output rows mostly share their source rows.
+struct FilteredRows {
+    int num_taps;
+    size_t row_size;
+    std::vector<float> data;
+    std::vector<int> src_y;  // source row held by each slot, -1 for none
+    std::function<void(int, float*)> filter;
+
+    FilteredRows(int num_taps, size_t row_size, std::function<void(int, float*)> filter)
+        : num_taps(num_taps), row_size(row_size), data(num_taps * row_size), src_y(num_taps, -1), filter(filter) {
+    }
+
+    // the filtered rows of taps[0..num_taps), the slot of a row still in use is never reused
+    void get(const int* taps, const float** rows) {
+        bool used[8] = {false};
+        int slots[8];
+        for (int k = 0; k < num_taps; k++) {
+            slots[k] = -1;
+            for (int s = 0; s < num_taps; s++) {
+                if (src_y[s] == taps[k]) {
+                    slots[k] = s;
+                    used[s]  = true;
+                    break;
+                }
+            }
+        }
+        for (int k = 0; k < num_taps; k++) {
+            if (slots[k] < 0) {
+                int s = 0;
+                while (used[s]) {
+                    s++;
+                }
+                filter(taps[k], data.data() + s * row_size);
+                src_y[s] = taps[k];
+                used[s]  = true;
+                slots[k] = s;
+            }
+            rows[k] = data.data() + slots[k] * row_size;
+        }
+    }
+};
+
+void sd_image_f32_resize_bilinear(const float* src, int src_width, int src_height,
+                                  float* dst, int dst_width, int dst_height, int channels, int n_threads) {
+    // the horizontal taps are the same for every row
+    std::vector<int> x_offsets(dst_width * 2);
+    std::vector<float> x_ratios(dst_width);
+    for (int x = 0; x < dst_width; x++) {
+        float original_x     = (float)x * src_width / dst_width;
+        int x1               = std::min((int)original_x, src_width - 1);
+        x_offsets[x * 2]     = x1 * channels;
+        x_offsets[x * 2 + 1] = std::min(x1 + 1, src_width - 1) * channels;
+        x_ratios[x]          = original_x - x1;
+    }
+    const size_t row_size = (size_t)dst_width * channels;
+    auto filter           = [&](int y, float* row) {
+        const float* src_row = src + (size_t)y * src_width * channels;
+        for (int x = 0; x < dst_width; x++) {
+            const float* v1 = src_row + x_offsets[x * 2];
+            const float* v2 = src_row + x_offsets[x * 2 + 1];
+            float x_ratio   = x_ratios[x];
+            for (int c = 0; c < channels; c++) {
+                row[x * channels + c] = v1[c] * (1 - x_ratio) + v2[c] * x_ratio;
+            }
+        }
+    };
+
+    sd_parallel_rows(dst_height, row_size * 16, n_threads, [&](int begin, int end) {
+        FilteredRows filtered(2, row_size, filter);
+        for (int y = begin; y < end; y++) {
+            float original_y = (float)y * src_height / dst_height;
+            int taps[2];
+            taps[0]       = std::min((int)original_y, src_height - 1);
+            taps[1]       = std::min(taps[0] + 1, src_height - 1);
+            float y_ratio = original_y - taps[0];
+            const float* rows[2];
+            filtered.get(taps, rows);
+            float* dst_row = dst + (size_t)y * row_size;
+            for (size_t i = 0; i < row_size; i++) {
+                dst_row[i] = rows[0][i] * (1 - y_ratio) + rows[1][i] * y_ratio;
+            }
+        }
+    });
+}
+
+static void cubic_taps(float original, int size, int* taps, float* weights) {
+    const float a = -0.5f;
+    int i0        = (int)floorf(original);
+    float t       = original - i0;
+    for (int k = 0; k < 4; k++) {
+        float d = fabsf(t - (k - 1));
+        if (d <= 1.0f) {
+            weights[k] = ((a + 2) * d - (a + 3)) * d * d + 1;
+        } else {
+            weights[k] = ((a * d - 5 * a) * d + 8 * a) * d - 4 * a;
+        }
+        taps[k] = std::max(0, std::min(i0 + k - 1, size - 1));
+    }
+}
+
+void sd_image_f32_resize_bicubic(const float* src, int src_width, int src_height,
+                                 float* dst, int dst_width, int dst_height, int channels, int n_threads) {
+    std::vector<int> x_taps(dst_width * 4);
+    std::vector<float> x_weights(dst_width * 4);
+    for (int x = 0; x < dst_width; x++) {
+        cubic_taps((float)x * src_width / dst_width, src_width, &x_taps[x * 4], &x_weights[x * 4]);
+        for (int k = 0; k < 4; k++) {
+            x_taps[x * 4 + k] *= channels;
+        }
+    }
+    const size_t row_size = (size_t)dst_width * channels;
+    auto filter           = [&](int y, float* row) {
+        const float* src_row = src + (size_t)y * src_width * channels;
+        for (int x = 0; x < dst_width; x++) {
+            const int* taps      = &x_taps[x * 4];
+            const float* weights = &x_weights[x * 4];
+            for (int c = 0; c < channels; c++) {
+                row[x * channels + c] = src_row[taps[0] + c] * weights[0] + src_row[taps[1] + c] * weights[1] +
+                                        src_row[taps[2] + c] * weights[2] + src_row[taps[3] + c] * weights[3];
+            }
+        }
+    };
+
+    sd_parallel_rows(dst_height, row_size * 40, n_threads, [&](int begin, int end) {
+        FilteredRows filtered(4, row_size, filter);
+        for (int y = begin; y < end; y++) {
+            int taps[4];
+            float weights[4];
+            cubic_taps((float)y * src_height / dst_height, src_height, taps, weights);
+            const float* rows[4];
+            filtered.get(taps, rows);
+            float* dst_row = dst + (size_t)y * row_size;
+            for (size_t i = 0; i < row_size; i++) {
+                dst_row[i] = rows[0][i] * weights[0] + rows[1][i] * weights[1] + rows[2][i] * weights[2] + rows[3][i] * weights[3];
+            }
+        }
+    });
+}
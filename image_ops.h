@@ -0,0 +1,49 @@
+#ifndef __IMAGE_OPS_H__
+#define __IMAGE_OPS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Image conversion and resize kernels. Images are 8 bit or f32 with interleaved channels (HWC, the layout
+// of sd_image_t and sd_image_f32_t), tensors are f32 planes (CHW, the layout of a contiguous ggml tensor).
+// The row kernels use SSE2 or NEON where available, whole images are split into row ranges over threads.
+// n_threads <= 0 picks the thread count from the image size and the number of cores.
+
+// runs fn(begin, end) over [0, rows) in ranges, on up to n_threads threads,
+// small jobs (rows * row_cost) stay on the calling thread
+void sd_parallel_rows(int rows, size_t row_cost, int n_threads, const std::function<void(int, int)>& fn);
+
+// dst[i] = src[i] * a + b
+void sd_u8_to_f32_row(const uint8_t* src, float* dst, size_t n, float a, float b);
+
+// dst[i] = (uint8_t)clamp(src[i] * a + b, 0, 255), truncating like a plain cast
+void sd_f32_to_u8_row(const float* src, uint8_t* dst, size_t n, float a, float b);
+
+// HWC u8 -> CHW f32, plane c = src * a[c] + b[c] (a = 1/255, b = 0 scales to [0, 1],
+// a = 1 / (255 * std), b = -mean / std also normalizes)
+void sd_image_u8_to_f32_planar(const uint8_t* src, float* dst, int width, int height, int channels,
+                               const float* a, const float* b, int n_threads = 0);
+
+// CHW f32 -> HWC u8, dst = clamp(plane c * a + b, 0, 255). The planes are plane_size floats apart,
+// 0 for width * height, more to take the first rows of taller planes.
+void sd_image_f32_planar_to_u8(const float* src, uint8_t* dst, int width, int height, int channels,
+                               float a, float b, int n_threads = 0, size_t plane_size = 0);
+
+// HWC f32 -> CHW f32, plane c = src * a[c] + b[c]
+void sd_image_f32_to_f32_planar(const float* src, float* dst, int width, int height, int channels,
+                                const float* a, const float* b, int n_threads = 0);
+
+// HWC f32 in place, x = (x - mean[c]) / std[c]
+void sd_image_f32_normalize(float* data, int width, int height, int channels,
+                            const float* mean, const float* std, int n_threads = 0);
+
+// HWC f32 resize, the source pixel of x is x * src_width / dst_width (top left aligned), edges are clamped
+void sd_image_f32_resize_bilinear(const float* src, int src_width, int src_height,
+                                  float* dst, int dst_width, int dst_height, int channels, int n_threads = 0);
+
+// same sampling as sd_image_f32_resize_bilinear with a 4x4 cubic convolution kernel (a = -0.5)
+void sd_image_f32_resize_bicubic(const float* src, int src_width, int src_height,
+                                 float* dst, int dst_width, int dst_height, int channels, int n_threads = 0);
+
+#endif  // __IMAGE_OPS_H__
@@ -6,8 +6,18 @@
 #include "ggml.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SD_IMATRIX_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SD_IMATRIX_NEON
+#endif
+
 // remove any prefix and suffixes from the name
 // CUDA0#blk.0.attn_k.weight#0 => blk.0.attn_k.weight
 static std::string filter_tensor_name(const char* name) {
@@ -27,38 +37,167 @@ static std::string filter_tensor_name(const char* name) {
     return wname;
 }
 
+// values[j] += sum of x[r][j]^2 over the rows, rows are row_stride floats apart
+static void accumulate_squares(float* values, const float* x, int n, int rows, size_t row_stride) {
+    int r = 0;
+    for (; r + 4 <= rows; r += 4) {
+        const float* x0 = x + r * row_stride;
+        const float* x1 = x0 + row_stride;
+        const float* x2 = x1 + row_stride;
+        const float* x3 = x2 + row_stride;
+        int j           = 0;
+#if defined(SD_IMATRIX_SSE2)
+        for (; j + 4 <= n; j += 4) {
+            __m128 a   = _mm_loadu_ps(x0 + j);
+            __m128 b   = _mm_loadu_ps(x1 + j);
+            __m128 c   = _mm_loadu_ps(x2 + j);
+            __m128 d   = _mm_loadu_ps(x3 + j);
+            __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)), _mm_add_ps(_mm_mul_ps(c, c), _mm_mul_ps(d, d)));
+            _mm_storeu_ps(values + j, _mm_add_ps(_mm_loadu_ps(values + j), sum));
+        }
+#elif defined(SD_IMATRIX_NEON)
+        for (; j + 4 <= n; j += 4) {
+            float32x4_t a   = vld1q_f32(x0 + j);
+            float32x4_t b   = vld1q_f32(x1 + j);
+            float32x4_t c   = vld1q_f32(x2 + j);
+            float32x4_t d   = vld1q_f32(x3 + j);
+            float32x4_t sum = vaddq_f32(vmlaq_f32(vmulq_f32(a, a), b, b), vmlaq_f32(vmulq_f32(c, c), d, d));
+            vst1q_f32(values + j, vaddq_f32(vld1q_f32(values + j), sum));
+        }
+#endif
+        for (; j < n; j++) {
+            values[j] += (x0[j] * x0[j] + x1[j] * x1[j]) + (x2[j] * x2[j] + x3[j] * x3[j]);
+        }
+    }
+    for (; r < rows; r++) {
+        const float* x0 = x + r * row_stride;
+        int j           = 0;
+#if defined(SD_IMATRIX_SSE2)
+        for (; j + 4 <= n; j += 4) {
+            __m128 a = _mm_loadu_ps(x0 + j);
+            _mm_storeu_ps(values + j, _mm_add_ps(_mm_loadu_ps(values + j), _mm_mul_ps(a, a)));
+        }
+#elif defined(SD_IMATRIX_NEON)
+        for (; j + 4 <= n; j += 4) {
+            float32x4_t a = vld1q_f32(x0 + j);
+            vst1q_f32(values + j, vmlaq_f32(vld1q_f32(values + j), a, a));
+        }
+#endif
+        for (; j < n; j++) {
+            values[j] += x0[j] * x0[j];
+        }
+    }
+}
+
+// index of the first non finite value, -1 if there is none
+static int find_non_finite(const float* values, int n) {
+    for (int j = 0; j < n; j++) {
+        if (!std::isfinite(values[j])) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static std::atomic<uint64_t> imatrix_instances(0);
+
+IMatrixCollector::IMatrixCollector()
+    : m_instance(++imatrix_instances) {
+}
+
+IMatrixThreadStats& IMatrixCollector::get_thread_stats() {
+    // threads can outlive a collector and a new one can get the same address, so they are told apart by instance.
+    // the collector owns the stats, entries of destroyed collectors expire and are dropped here
+    thread_local std::vector<std::pair<uint64_t, std::weak_ptr<IMatrixThreadStats>>> local_stats;
+    for (size_t i = 0; i < local_stats.size();) {
+        std::shared_ptr<IMatrixThreadStats> local = local_stats[i].second.lock();
+        if (local == NULL) {
+            local_stats.erase(local_stats.begin() + i);
+            continue;
+        }
+        if (local_stats[i].first == m_instance) {
+            return *local;
+        }
+        i++;
+    }
+    auto local = std::make_shared<IMatrixThreadStats>();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_thread_stats.push_back(local);
+    }
+    local_stats.push_back(std::make_pair(m_instance, std::weak_ptr<IMatrixThreadStats>(local)));
+    return *local;
+}
+
+const IMatrixThreadStats::TensorId& IMatrixCollector::get_tensor_id(IMatrixThreadStats& local, const struct ggml_tensor* src0, bool any_name) {
+    // graphs are rebuilt for every run but the weights stay, the name check catches a tensor reusing an address
+    auto it = local.tensor_ids.find(src0);
+    if (it != local.tensor_ids.end() && it->second.name == src0->name) {
+        return it->second;
+    }
+
+    IMatrixThreadStats::TensorId tensor_id;
+    tensor_id.name  = src0->name;
+    tensor_id.wname = filter_tensor_name(src0->name);
+    tensor_id.id    = -1;
+    const std::string& wname = tensor_id.wname;
+    if (any_name || wname.substr(0, 6) == "model." || wname.substr(0, 17) == "cond_stage_model." || wname.substr(0, 14) == "text_encoders.") {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto id = m_tensor_ids.find(wname);
+        if (id == m_tensor_ids.end()) {
+            tensor_id.id         = (int)m_tensor_names.size();
+            m_tensor_ids[wname] = tensor_id.id;
+            m_tensor_names.push_back(wname);
+        } else {
+            tensor_id.id = id->second;
+        }
+    }
+    auto& cached = local.tensor_ids[src0];
+    cached       = tensor_id;
+    return cached;
+}
+
 bool IMatrixCollector::collect_imatrix(struct ggml_tensor* t, bool ask, void* user_data) {
     GGML_UNUSED(user_data);
+    // collect all indirect matrix multiplications
+    if (t->op != GGML_OP_MUL_MAT && t->op != GGML_OP_MUL_MAT_ID) {
+        return false;
+    }
     const struct ggml_tensor* src0 = t->src[0];
     const struct ggml_tensor* src1 = t->src[1];
-    std::string wname              = filter_tensor_name(src0->name);
+
+    IMatrixThreadStats& local                  = get_thread_stats();
+    const IMatrixThreadStats::TensorId& tensor = get_tensor_id(local, src0, t->op == GGML_OP_MUL_MAT_ID);
+    const std::string& wname                   = tensor.wname;
 
     // when ask is true, the scheduler wants to know if we are interested in data from this tensor
     // if we return true, a follow-up call will be made with ask=false in which we can do the actual collection
     if (ask) {
-        if (t->op == GGML_OP_MUL_MAT_ID)
-            return true;  // collect all indirect matrix multiplications
-        if (t->op != GGML_OP_MUL_MAT)
-            return false;
         // why are small batches ignored (<16 tokens)?
         // if (src1->ne[1] < 16 || src1->type != GGML_TYPE_F32) return false;
-        if (!(wname.substr(0, 6) == "model." || wname.substr(0, 17) == "cond_stage_model." || wname.substr(0, 14) == "text_encoders."))
-            return false;
+        return tensor.id >= 0;
+    }
+    if (tensor.id < 0) {
         return true;
     }
     // LOG_DEBUG("%s", wname.c_str());
 
-    std::lock_guard<std::mutex> lock(m_mutex);
+    std::lock_guard<std::mutex> lock(local.mutex);
+    if (local.stats.size() <= (size_t)tensor.id) {
+        local.stats.resize(tensor.id + 1);
+    }
+    auto& e = local.stats[tensor.id];
 
     // copy the data from the GPU memory if needed
     const bool is_host = src1->buffer == NULL || ggml_backend_buffer_is_host(src1->buffer);
 
     if (!is_host) {
-        m_src1_data.resize(ggml_nelements(src1));
-        ggml_backend_tensor_get(src1, m_src1_data.data(), 0, ggml_nbytes(src1));
+        local.src1_data.resize(ggml_nelements(src1));
+        ggml_backend_tensor_get(src1, local.src1_data.data(), 0, ggml_nbytes(src1));
     }
 
-    const float* data = is_host ? (const float*)src1->data : m_src1_data.data();
+    const float* data = is_host ? (const float*)src1->data : local.src1_data.data();
+    const int n       = (int)src1->ne[0];
 
     // this has been adapted to the new format of storing merged experts in a single 3d tensor
     // ref: https://github.com/ggml-org/llama.cpp/pull/6387
@@ -75,10 +214,8 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor* t, bool ask, void* us
 
         GGML_ASSERT(ids->ne[1] == src1->ne[2]);
 
-        m_ids.resize(ggml_nbytes(ids));
-        ggml_backend_tensor_get(ids, m_ids.data(), 0, ggml_nbytes(ids));
-
-        auto& e = m_stats[wname];
+        local.ids.resize(ggml_nbytes(ids));
+        ggml_backend_tensor_get(ids, local.ids.data(), 0, ggml_nbytes(ids));
 
         ++e.ncall;
 
@@ -90,37 +227,30 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor* t, bool ask, void* us
             exit(1);  // GGML_ABORT("fatal error");
         }
         // LOG_DEBUG("%s[%d]: %32s, %s, %5d x %5d, %d\n", m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
-        // loop over all possible experts, regardless if they are used or not in the batch
-        for (int ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex * src1->ne[0];
-
-            for (int idx = 0; idx < n_ids; ++idx) {
-                for (int row = 0; row < (int)src1->ne[2]; ++row) {
-                    const int excur = *(const int32_t*)(m_ids.data() + row * ids->nb[1] + idx * ids->nb[0]);
-
-                    GGML_ASSERT(excur >= 0 && excur < n_as);  // sanity check
-
-                    if (excur != ex)
-                        continue;
-
-                    const int64_t i11 = idx % src1->ne[1];
-                    const int64_t i12 = row;
-                    const float* x    = (const float*)((const char*)data + i11 * src1->nb[1] + i12 * src1->nb[2]);
-
-                    for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                        e.values[e_start + j] += x[j] * x[j];
-                        e.counts[e_start + j]++;
-                        if (!std::isfinite(e.values[e_start + j])) {
-                            printf("\n");
-                            LOG_ERROR("%f detected in %s\n", e.values[e_start + j], wname.c_str());
-                            exit(1);
-                        }
-                    }
+        for (int idx = 0; idx < n_ids; ++idx) {
+            for (int row = 0; row < (int)src1->ne[2]; ++row) {
+                const int excur = *(const int32_t*)(local.ids.data() + row * ids->nb[1] + idx * ids->nb[0]);
+
+                GGML_ASSERT(excur >= 0 && excur < n_as);  // sanity check
+
+                const int64_t i11 = idx % src1->ne[1];
+                const int64_t i12 = row;
+                const float* x    = (const float*)((const char*)data + i11 * src1->nb[1] + i12 * src1->nb[2]);
+                size_t e_start    = (size_t)excur * n;
+
+                accumulate_squares(e.values.data() + e_start, x, n, 1, 0);
+                for (int j = 0; j < n; ++j) {
+                    e.counts[e_start + j]++;
                 }
             }
         }
+        int bad = find_non_finite(e.values.data(), (int)e.values.size());
+        if (bad >= 0) {
+            printf("\n");
+            LOG_ERROR("%f detected in %s\n", e.values[bad], wname.c_str());
+            exit(1);
+        }
     } else {
-        auto& e = m_stats[wname];
         if (e.values.empty()) {
             e.values.resize(src1->ne[0], 0);
             e.counts.resize(src1->ne[0], 0);
@@ -131,23 +261,66 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor* t, bool ask, void* us
 
         ++e.ncall;
         // LOG_DEBUG("%s[%d]: %32s, %s, %5d x %5d, %d\n", m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->type);
-        for (int row = 0; row < (int)src1->ne[1]; ++row) {
-            const float* x = data + row * src1->ne[0];
-            for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                e.values[j] += x[j] * x[j];
-                e.counts[j]++;
-                if (!std::isfinite(e.values[j])) {
-                    LOG_WARN("%f detected in %s\n", e.values[j], wname.c_str());
-                    exit(1);
-                }
-            }
+        const int rows = (int)src1->ne[1];
+        accumulate_squares(e.values.data(), data, n, rows, n);
+        for (int j = 0; j < n; ++j) {
+            e.counts[j] += rows;
+        }
+        int bad = find_non_finite(e.values.data(), n);
+        if (bad >= 0) {
+            LOG_WARN("%f detected in %s\n", e.values[bad], wname.c_str());
+            exit(1);
         }
     }
     return true;
 }
 
-void IMatrixCollector::save_imatrix(std::string fname, int ncall) const {
+void IMatrixCollector::merge_thread_stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& local : m_thread_stats) {
+        std::lock_guard<std::mutex> local_lock(local->mutex);
+        for (size_t id = 0; id < local->stats.size(); id++) {
+            Stats& src = local->stats[id];
+            if (src.ncall == 0) {
+                continue;
+            }
+            const std::string& wname = m_tensor_names[id];
+            Stats& dst               = m_stats[wname];
+            if (dst.values.empty()) {
+                dst.values.resize(src.values.size(), 0);
+                dst.counts.resize(src.counts.size(), 0);
+            } else if (dst.values.size() != src.values.size()) {
+                LOG_ERROR("inconsistent size for %s (%d vs %d)\n", wname.c_str(), (int)dst.values.size(), (int)src.values.size());
+                exit(1);  // GGML_ABORT("fatal error");
+            }
+            for (size_t i = 0; i < src.values.size(); i++) {
+                dst.values[i] += src.values[i];
+                dst.counts[i] += src.counts[i];
+            }
+            dst.ncall += src.ncall;
+
+            std::fill(src.values.begin(), src.values.end(), 0.f);
+            std::fill(src.counts.begin(), src.counts.end(), 0);
+            src.ncall = 0;
+        }
+    }
+}
+
+std::vector<float> IMatrixCollector::get_values(const std::string& key) {
+    merge_thread_stats();
+    // loader workers call this concurrently, their merges write m_stats
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_stats.find(key);
+    if (it != m_stats.end()) {
+        return it->second.values;
+    } else {
+        return {};
+    }
+}
+
+void IMatrixCollector::save_imatrix(std::string fname, int ncall) {
     LOG_INFO("SAVING_IMATRIX to %s\n", fname.c_str());
+    merge_thread_stats();
 
     if (ncall > 0) {
         fname += ".at_";
@@ -278,4 +451,25 @@ bool IMatrixCollector::load_imatrix(const char* fname) {
         e.ncall += ncall;
     }
     return true;
+}
+
+uint64_t IMatrixCollector::get_hash() {
+    merge_thread_stats();
+    if (m_stats.empty()) {
+        return 0;
+    }
+    std::vector<std::string> keys;
+    for (const auto& kv : m_stats) {
+        keys.push_back(kv.first);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    uint64_t hash = fnv1a_64(NULL, 0);  // offset basis
+    for (const auto& key : keys) {
+        const auto& stat = m_stats.at(key);
+        hash             = fnv1a_64(key, hash);
+        hash             = fnv1a_64(stat.values.data(), stat.values.size() * sizeof(float), hash);
+        hash             = fnv1a_64(stat.counts.data(), stat.counts.size() * sizeof(int), hash);
+    }
+    return hash;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef IMATRIX_HPP
 #define IMATRIX_HPP
 #include <fstream>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <string>
@@ -14,26 +15,45 @@ struct Stats {
     int ncall = 0;
 };
 
+// what one thread collected, indexed by tensor id. Only the owning thread writes to it,
+// the mutex is contended only while the collector merges it.
+struct IMatrixThreadStats {
+    struct TensorId {
+        std::string name;   // name of the src0 tensor the id was made for
+        std::string wname;  // weight name without prefix and suffixes
+        int id;             // -1 for weights that are not collected
+    };
+
+    std::mutex mutex;
+    std::vector<Stats> stats;
+    std::unordered_map<const struct ggml_tensor*, TensorId> tensor_ids;
+    std::vector<float> src1_data;
+    std::vector<char> ids;  // the expert ids from ggml_mul_mat_id
+};
+
 class IMatrixCollector {
 public:
-    IMatrixCollector() = default;
+    IMatrixCollector();
     bool collect_imatrix(struct ggml_tensor* t, bool ask, void* user_data);
-    void save_imatrix(std::string fname, int ncall = -1) const;
+    void save_imatrix(std::string fname, int ncall = -1);
     bool load_imatrix(const char* fname);
-    std::vector<float> get_values(const std::string& key) const {
-        auto it = m_stats.find(key);
-        if (it != m_stats.end()) {
-            return it->second.values;
-        } else {
-            return {};
-        }
-    }
+    // identifies the collected data, 0 if there is none
+    uint64_t get_hash();
+    std::vector<float> get_values(const std::string& key);
+
 private:
+    IMatrixThreadStats& get_thread_stats();
+    const IMatrixThreadStats::TensorId& get_tensor_id(IMatrixThreadStats& local, const struct ggml_tensor* src0, bool any_name);
+    // adds the per thread stats to m_stats
+    void merge_thread_stats();
+
     std::unordered_map<std::string, Stats> m_stats = {};
-    std::mutex m_mutex;
+    std::mutex m_mutex;  // tensor ids, the thread list and merging
     int m_last_call = 0;
-    std::vector<float> m_src1_data;
-    std::vector<char> m_ids;  // the expert ids from ggml_mul_mat_id
+    uint64_t m_instance;
+    std::unordered_map<std::string, int> m_tensor_ids;
+    std::vector<std::string> m_tensor_names;
+    std::vector<std::shared_ptr<IMatrixThreadStats>> m_thread_stats;
 };
 
 #endif
\ No newline at end of file
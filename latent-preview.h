@@ -1,3 +1,6 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 // https://github.com/comfyanonymous/ComfyUI/blob/master/comfy/latent_formats.py#L152-L169
 const float flux_latent_rgb_proj[16][3] = {
@@ -52,32 +55,116 @@ const float sd_latent_rgb_proj[4][3]{
     {-0.2829f, 0.1762f, 0.2721f},
     {-0.2120f, -0.2616f, -0.7177f}};
 
+// rgb = latent . latent_rgb_proj at the latent resolution, one pass over each latent plane per row
 void preview_latent_image(uint8_t* buffer, struct ggml_tensor* latents, const float (*latent_rgb_proj)[3], int width, int height, int dim) {
-    size_t buffer_head = 0;
+    std::vector<float> rgb(3 * width);
+    std::vector<uint8_t> planes(3 * width);
     for (int j = 0; j < height; j++) {
+        std::fill(rgb.begin(), rgb.end(), 0.0f);
+        for (int d = 0; d < dim; d++) {
+            const float* row = (const float*)((char*)latents->data + j * latents->nb[1] + d * latents->nb[2]);
+            for (int c = 0; c < 3; c++) {
+                float* out = rgb.data() + c * width;
+                float w    = latent_rgb_proj[d][c];
+                for (int i = 0; i < width; i++) {
+                    out[i] += row[i] * w;
+                }
+            }
+        }
+
+        // [-1, 1] to [0, 255], clamped
+        sd_f32_to_u8_row(rgb.data(), planes.data(), 3 * width, 127.5f, 127.5f);
+        uint8_t* dst = buffer + (size_t)j * width * 3;
         for (int i = 0; i < width; i++) {
-            size_t latent_id = (i * latents->nb[0] + j * latents->nb[1]);
-            float r = 0, g = 0, b = 0;
-            for (int d = 0; d < dim; d++) {
-                float value = *(float*)((char*)latents->data + latent_id + d * latents->nb[2]);
-                r += value * latent_rgb_proj[d][0];
-                g += value * latent_rgb_proj[d][1];
-                b += value * latent_rgb_proj[d][2];
+            dst[i * 3]     = planes[i];
+            dst[i * 3 + 1] = planes[width + i];
+            dst[i * 3 + 2] = planes[2 * width + i];
+        }
+    }
+}
+
+// Renders the previews of a sampling run on a thread of its own, so the sampler never waits for them.
+// submit() copies the latents into a pending snapshot and returns. A newer snapshot replaces a pending one
+// that has not started rendering yet, a slow preview skips steps instead of holding up sampling.
+// The destructor renders the pending snapshot too, so the last submitted step is always shown, then runs on_stop.
+class PreviewWorker {
+public:
+    typedef std::function<void(int, ggml_tensor*)> render_cb_t;
+
+private:
+    render_cb_t render;
+    std::function<void()> on_stop;
+
+    struct ggml_context* ctx = NULL;
+    ggml_tensor* pending     = NULL;
+    ggml_tensor* current     = NULL;
+    int pending_step         = -1;
+    int skipped              = 0;
+    bool stopping            = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+
+    void run() {
+        sd_suppress_progress(true);
+        while (true) {
+            int step;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return stopping || pending_step >= 0; });
+                // a stop still drains the pending snapshot
+                if (pending_step < 0) {
+                    break;
+                }
+                std::swap(pending, current);
+                step         = pending_step;
+                pending_step = -1;
             }
+            render(step, current);
+        }
+    }
 
-            // change range
-            r = r * .5f + .5f;
-            g = g * .5f + .5f;
-            b = b * .5f + .5f;
+public:
+    PreviewWorker(ggml_tensor* latents, render_cb_t render, std::function<void()> on_stop = nullptr)
+        : render(render), on_stop(on_stop) {
+        struct ggml_init_params params;
+        params.mem_size   = 2 * ggml_nbytes(latents) + 2 * ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
 
-            // clamp rgb values to [0,1] range
-            r = r >= 0 ? r <= 1 ? r : 1 : 0;
-            g = g >= 0 ? g <= 1 ? g : 1 : 0;
-            b = b >= 0 ? b <= 1 ? b : 1 : 0;
+        ctx = ggml_init(params);
+        GGML_ASSERT(ctx != NULL);
+        pending = ggml_dup_tensor(ctx, latents);
+        current = ggml_dup_tensor(ctx, latents);
+        thread  = std::thread(&PreviewWorker::run, this);
+    }
+
+    ~PreviewWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+        if (skipped > 0) {
+            LOG_DEBUG("%d previews skipped while the previous one was rendering", skipped);
+        }
+        if (on_stop) {
+            on_stop();
+        }
+        ggml_free(ctx);
+    }
 
-            buffer[buffer_head++] = (uint8_t)(r * 255);
-            buffer[buffer_head++] = (uint8_t)(g * 255);
-            buffer[buffer_head++] = (uint8_t)(b * 255);
+    void submit(int step, ggml_tensor* latents) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending_step >= 0) {
+                skipped++;
+            }
+            memcpy(pending->data, latents->data, ggml_nbytes(pending));
+            pending_step = step;
         }
+        cv.notify_one();
     }
-}
\ No newline at end of file
+};
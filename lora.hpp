@@ -1,9 +1,16 @@
 #ifndef __LORA_HPP__
 #define __LORA_HPP__
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include "ggml_extend.hpp"
+#include "miniz_api.h"
 
 #define LORA_GRAPH_SIZE 40960
+// rough bound of the compute buffer of one LoraMerger group
+#define LORA_MERGE_BUDGET (512 * 1024 * 1024)
 
 struct LoraModel : public GGMLRunner {
     enum lora_t {
@@ -100,6 +107,10 @@ struct LoraModel : public GGMLRunner {
     ggml_tensor* zero_index         = NULL;
     enum lora_t type                = REGULAR;
 
+    // model tensor name => lora keys that have tensors in this lora, see get_lora_keys
+    std::map<std::string, std::vector<std::string>> lora_keys_cache;
+    SDVersion lora_keys_version = VERSION_COUNT;
+
     LoraModel(ggml_backend_t backend,
               const std::string& file_path = "",
               const std::string prefix     = "")
@@ -237,577 +248,606 @@ struct LoraModel : public GGMLRunner {
         return ret;
     }
 
-    struct ggml_cgraph* build_lora_graph(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
+    bool has_lora_tensors_with_prefix(const std::string& prefix) {
+        auto it = lora_tensors.lower_bound(prefix);
+        return it != lora_tensors.end() && starts_with(it->first, prefix);
+    }
 
-        zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
-        set_backend_tensor_data(zero_index, zero_index_vec.data());
-        ggml_build_forward_expand(gf, zero_index);
+    // to_lora_keys, memoized and reduced to the keys this lora actually provides tensors for,
+    // so that graphs built again (a cached lora, the reserve pass) skip the name mapping
+    std::vector<std::string> get_lora_keys(const std::string& blk_name, SDVersion version) {
+        if (version != lora_keys_version) {
+            lora_keys_cache.clear();
+            lora_keys_version = version;
+        }
+        auto it = lora_keys_cache.find(blk_name);
+        if (it != lora_keys_cache.end()) {
+            return it->second;
+        }
+        std::vector<std::string> keys;
+        for (auto& key : to_lora_keys(blk_name, version)) {
+            std::string k = key;
+            if (starts_with(k, "SPLIT|")) {
+                k = k.substr(sizeof("SPLIT|") - 1);
+            } else if (starts_with(k, "SPLIT_L|")) {
+                k = k.substr(sizeof("SPLIT_L|") - 1);
+            }
+            if (has_lora_tensors_with_prefix(lora_pre[type] + k)) {
+                keys.push_back(key);
+            }
+        }
+        lora_keys_cache[blk_name] = keys;
+        return keys;
+    }
 
-        std::set<std::string> applied_lora_tensors;
-        for (auto it : model_tensors) {
-            std::string k_tensor       = it.first;
-            struct ggml_tensor* weight = model_tensors[it.first];
+    // the delta of this lora for the model weight named k_tensor, scaled by the multiplier and shaped like
+    // weight, NULL if the lora has nothing for it. The lora tensors it uses are added to applied_lora_tensors.
+    // to_f32 needs zero_index set in ctx.
+    ggml_tensor* build_weight_diff(ggml_context* ctx,
+                                   const std::string& k_tensor,
+                                   ggml_tensor* weight,
+                                   SDVersion version,
+                                   std::set<std::string>& applied_lora_tensors) {
+        std::vector<std::string> keys = get_lora_keys(k_tensor, version);
+        for (auto& key : keys) {
+            bool is_qkv_split = starts_with(key, "SPLIT|");
+            if (is_qkv_split) {
+                key = key.substr(sizeof("SPLIT|") - 1);
+            }
+            bool is_qkvm_split = starts_with(key, "SPLIT_L|");
+            if (is_qkvm_split) {
+                key = key.substr(sizeof("SPLIT_L|") - 1);
+            }
+            struct ggml_tensor* updown = NULL;
+            float scale_value          = 1.0f;
+            std::string fk             = lora_pre[type] + key;
+            if (lora_tensors.find(fk + ".hada_w1_a") != lora_tensors.end()) {
+                // LoHa mode
+
+                // TODO: split qkv convention for LoHas (is it ever used?)
+                if (is_qkv_split || is_qkvm_split) {
+                    LOG_ERROR("Split qkv isn't supported for LoHa models.");
+                    return NULL;
+                }
+                std::string alpha_name = "";
 
-            std::vector<std::string> keys = to_lora_keys(k_tensor, version);
-            if (keys.size() == 0)
-                continue;
+                ggml_tensor* hada_1_mid  = NULL;  // tau for tucker decomposition
+                ggml_tensor* hada_1_up   = NULL;
+                ggml_tensor* hada_1_down = NULL;
 
-            for (auto& key : keys) {
-                bool is_qkv_split = starts_with(key, "SPLIT|");
-                if (is_qkv_split) {
-                    key = key.substr(sizeof("SPLIT|") - 1);
+                ggml_tensor* hada_2_mid  = NULL;  // tau for tucker decomposition
+                ggml_tensor* hada_2_up   = NULL;
+                ggml_tensor* hada_2_down = NULL;
+
+                std::string hada_1_mid_name  = "";
+                std::string hada_1_down_name = "";
+                std::string hada_1_up_name   = "";
+
+                std::string hada_2_mid_name  = "";
+                std::string hada_2_down_name = "";
+                std::string hada_2_up_name   = "";
+
+
+                hada_1_down_name = fk + ".hada_w1_b";
+                hada_1_up_name   = fk + ".hada_w1_a";
+                hada_1_mid_name  = fk + ".hada_t1";
+                if (lora_tensors.find(hada_1_down_name) != lora_tensors.end()) {
+                    hada_1_down = to_f32(ctx, lora_tensors[hada_1_down_name]);
                 }
-                bool is_qkvm_split = starts_with(key, "SPLIT_L|");
-                if (is_qkvm_split) {
-                    key = key.substr(sizeof("SPLIT_L|") - 1);
+                if (lora_tensors.find(hada_1_up_name) != lora_tensors.end()) {
+                    hada_1_up = to_f32(ctx, lora_tensors[hada_1_up_name]);
+                }
+                if (lora_tensors.find(hada_1_mid_name) != lora_tensors.end()) {
+                    hada_1_mid = to_f32(ctx, lora_tensors[hada_1_mid_name]);
+                    applied_lora_tensors.insert(hada_1_mid_name);
+                    hada_1_up = ggml_cont(ctx, ggml_transpose(ctx, hada_1_up));
                 }
-                struct ggml_tensor* updown = NULL;
-                float scale_value          = 1.0f;
-                std::string fk             = lora_pre[type] + key;
-                if (lora_tensors.find(fk + ".hada_w1_a") != lora_tensors.end()) {
-                    // LoHa mode
 
-                    // TODO: split qkv convention for LoHas (is it ever used?)
-                    if (is_qkv_split || is_qkvm_split) {
-                        LOG_ERROR("Split qkv isn't supported for LoHa models.");
-                        break;
-                    }
-                    std::string alpha_name = "";
+                hada_2_down_name = fk + ".hada_w2_b";
+                hada_2_up_name   = fk + ".hada_w2_a";
+                hada_2_mid_name  = fk + ".hada_t2";
+                if (lora_tensors.find(hada_2_down_name) != lora_tensors.end()) {
+                    hada_2_down = to_f32(ctx, lora_tensors[hada_2_down_name]);
+                }
+                if (lora_tensors.find(hada_2_up_name) != lora_tensors.end()) {
+                    hada_2_up = to_f32(ctx, lora_tensors[hada_2_up_name]);
+                }
+                if (lora_tensors.find(hada_2_mid_name) != lora_tensors.end()) {
+                    hada_2_mid = to_f32(ctx, lora_tensors[hada_2_mid_name]);
+                    applied_lora_tensors.insert(hada_2_mid_name);
+                    hada_2_up = ggml_cont(ctx, ggml_transpose(ctx, hada_2_up));
+                }
 
-                    ggml_tensor* hada_1_mid  = NULL;  // tau for tucker decomposition
-                    ggml_tensor* hada_1_up   = NULL;
-                    ggml_tensor* hada_1_down = NULL;
+                alpha_name = fk + ".alpha";
 
-                    ggml_tensor* hada_2_mid  = NULL;  // tau for tucker decomposition
-                    ggml_tensor* hada_2_up   = NULL;
-                    ggml_tensor* hada_2_down = NULL;
+                applied_lora_tensors.insert(hada_1_down_name);
+                applied_lora_tensors.insert(hada_1_up_name);
+                applied_lora_tensors.insert(hada_2_down_name);
+                applied_lora_tensors.insert(hada_2_up_name);
 
-                    std::string hada_1_mid_name  = "";
-                    std::string hada_1_down_name = "";
-                    std::string hada_1_up_name   = "";
+                applied_lora_tensors.insert(alpha_name);
+                if (hada_1_up == NULL || hada_1_down == NULL || hada_2_up == NULL || hada_2_down == NULL) {
+                    continue;
+                }
 
-                    std::string hada_2_mid_name  = "";
-                    std::string hada_2_down_name = "";
-                    std::string hada_2_up_name   = "";
+                struct ggml_tensor* updown_1 = ggml_merge_lora(ctx, hada_1_down, hada_1_up, hada_1_mid);
+                struct ggml_tensor* updown_2 = ggml_merge_lora(ctx, hada_2_down, hada_2_up, hada_2_mid);
+                updown                       = ggml_mul_inplace(ctx, updown_1, updown_2);
 
+                // calc_scale
+                // TODO: .dora_scale?
+                int64_t rank = hada_1_down->ne[ggml_n_dims(hada_1_down) - 1];
+                if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                    float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                    scale_value = alpha / rank;
+                }
+            } else if (lora_tensors.find(fk + ".lokr_w1") != lora_tensors.end() || lora_tensors.find(fk + ".lokr_w1_a") != lora_tensors.end()) {
+                // LoKr mode
 
-                    hada_1_down_name = fk + ".hada_w1_b";
-                    hada_1_up_name   = fk + ".hada_w1_a";
-                    hada_1_mid_name  = fk + ".hada_t1";
-                    if (lora_tensors.find(hada_1_down_name) != lora_tensors.end()) {
-                        hada_1_down = to_f32(compute_ctx, lora_tensors[hada_1_down_name]);
-                    }
-                    if (lora_tensors.find(hada_1_up_name) != lora_tensors.end()) {
-                        hada_1_up = to_f32(compute_ctx, lora_tensors[hada_1_up_name]);
-                    }
-                    if (lora_tensors.find(hada_1_mid_name) != lora_tensors.end()) {
-                        hada_1_mid = to_f32(compute_ctx, lora_tensors[hada_1_mid_name]);
-                        applied_lora_tensors.insert(hada_1_mid_name);
-                        hada_1_up = ggml_cont(compute_ctx, ggml_transpose(compute_ctx, hada_1_up));
-                    }
+                // TODO: split qkv convention for LoKrs (is it ever used?)
+                if (is_qkv_split || is_qkvm_split) {
+                    LOG_ERROR("Split qkv isn't supported for LoKr models.");
+                    return NULL;
+                }
+
+                std::string alpha_name = fk + ".alpha";
+
+                ggml_tensor* lokr_w1 = NULL;
+                ggml_tensor* lokr_w2 = NULL;
+
+                std::string lokr_w1_name = "";
+                std::string lokr_w2_name = "";
 
-                    hada_2_down_name = fk + ".hada_w2_b";
-                    hada_2_up_name   = fk + ".hada_w2_a";
-                    hada_2_mid_name  = fk + ".hada_t2";
-                    if (lora_tensors.find(hada_2_down_name) != lora_tensors.end()) {
-                        hada_2_down = to_f32(compute_ctx, lora_tensors[hada_2_down_name]);
+                lokr_w1_name = fk + ".lokr_w1";
+                lokr_w2_name = fk + ".lokr_w2";
+
+                if (lora_tensors.find(lokr_w1_name) != lora_tensors.end()) {
+                    lokr_w1 = to_f32(ctx, lora_tensors[lokr_w1_name]);
+                    applied_lora_tensors.insert(lokr_w1_name);
+                } else {
+                    ggml_tensor* down     = NULL;
+                    ggml_tensor* up       = NULL;
+                    std::string down_name = lokr_w1_name + "_b";
+                    std::string up_name   = lokr_w1_name + "_a";
+                    if (lora_tensors.find(down_name) != lora_tensors.end()) {
+                        // w1 should not be low rank normally, sometimes w1 and w2 are swapped
+                        down = to_f32(ctx, lora_tensors[down_name]);
+                        applied_lora_tensors.insert(down_name);
+
+                        int64_t rank = down->ne[ggml_n_dims(down) - 1];
+                        if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                            float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                            scale_value = alpha / rank;
+                        }
+                    }
+                    if (lora_tensors.find(up_name) != lora_tensors.end()) {
+                        up = to_f32(ctx, lora_tensors[up_name]);
+                        applied_lora_tensors.insert(up_name);
                     }
-                    if (lora_tensors.find(hada_2_up_name) != lora_tensors.end()) {
-                        hada_2_up = to_f32(compute_ctx, lora_tensors[hada_2_up_name]);
+                    lokr_w1 = ggml_merge_lora(ctx, down, up);
+                }
+                if (lora_tensors.find(lokr_w2_name) != lora_tensors.end()) {
+                    lokr_w2 = to_f32(ctx, lora_tensors[lokr_w2_name]);
+                    applied_lora_tensors.insert(lokr_w2_name);
+                } else {
+                    ggml_tensor* down     = NULL;
+                    ggml_tensor* up       = NULL;
+                    std::string down_name = lokr_w2_name + "_b";
+                    std::string up_name   = lokr_w2_name + "_a";
+                    if (lora_tensors.find(down_name) != lora_tensors.end()) {
+                        down = to_f32(ctx, lora_tensors[down_name]);
+                        applied_lora_tensors.insert(down_name);
+
+                        int64_t rank = down->ne[ggml_n_dims(down) - 1];
+                        if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                            float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                            scale_value = alpha / rank;
+                        }
                     }
-                    if (lora_tensors.find(hada_2_mid_name) != lora_tensors.end()) {
-                        hada_2_mid = to_f32(compute_ctx, lora_tensors[hada_2_mid_name]);
-                        applied_lora_tensors.insert(hada_2_mid_name);
-                        hada_2_up = ggml_cont(compute_ctx, ggml_transpose(compute_ctx, hada_2_up));
+                    if (lora_tensors.find(up_name) != lora_tensors.end()) {
+                        up = to_f32(ctx, lora_tensors[up_name]);
+                        applied_lora_tensors.insert(up_name);
                     }
+                    lokr_w2 = ggml_merge_lora(ctx, down, up);
+                }
+                
+                // Technically it might be unused, but I believe it's the expected behavior
+                applied_lora_tensors.insert(alpha_name);
 
-                    alpha_name = fk + ".alpha";
+                updown = ggml_kronecker(ctx, lokr_w1, lokr_w2);
 
-                    applied_lora_tensors.insert(hada_1_down_name);
-                    applied_lora_tensors.insert(hada_1_up_name);
-                    applied_lora_tensors.insert(hada_2_down_name);
-                    applied_lora_tensors.insert(hada_2_up_name);
+            } else {
+                // LoRA mode
+                ggml_tensor* lora_mid  = NULL;  // tau for tucker decomposition
+                ggml_tensor* lora_up   = NULL;
+                ggml_tensor* lora_down = NULL;
+
+                std::string alpha_name         = "";
+                std::string scale_name         = "";
+                std::string split_q_scale_name = "";
+                std::string lora_mid_name      = "";
+                std::string lora_down_name     = "";
+                std::string lora_up_name       = "";
 
-                    applied_lora_tensors.insert(alpha_name);
-                    if (hada_1_up == NULL || hada_1_down == NULL || hada_2_up == NULL || hada_2_down == NULL) {
-                        continue;
+                if (is_qkv_split) {
+                    std::string suffix  = "";
+                    auto split_q_d_name = fk + "q" + suffix + lora_downs[type] + ".weight";
+
+                    if (lora_tensors.find(split_q_d_name) == lora_tensors.end()) {
+                        suffix         = "_proj";
+                        split_q_d_name = fk + "q" + suffix + lora_downs[type] + ".weight";
                     }
+                    if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
+                        // print_ggml_tensor(it.second, true);  //[3072, 21504, 1, 1]
+                        // find qkv and mlp up parts in LoRA model
+                        auto split_k_d_name = fk + "k" + suffix + lora_downs[type] + ".weight";
+                        auto split_v_d_name = fk + "v" + suffix + lora_downs[type] + ".weight";
+
+                        auto split_q_u_name = fk + "q" + suffix + lora_ups[type] + ".weight";
+                        auto split_k_u_name = fk + "k" + suffix + lora_ups[type] + ".weight";
+                        auto split_v_u_name = fk + "v" + suffix + lora_ups[type] + ".weight";
+
+                        auto split_q_scale_name = fk + "q" + suffix + ".scale";
+                        auto split_k_scale_name = fk + "k" + suffix + ".scale";
+                        auto split_v_scale_name = fk + "v" + suffix + ".scale";
+
+                        auto split_q_alpha_name = fk + "q" + suffix + ".alpha";
+                        auto split_k_alpha_name = fk + "k" + suffix + ".alpha";
+                        auto split_v_alpha_name = fk + "v" + suffix + ".alpha";
+
+                        ggml_tensor* lora_q_down = NULL;
+                        ggml_tensor* lora_q_up   = NULL;
+                        ggml_tensor* lora_k_down = NULL;
+                        ggml_tensor* lora_k_up   = NULL;
+                        ggml_tensor* lora_v_down = NULL;
+                        ggml_tensor* lora_v_up   = NULL;
+
+                        lora_q_down = to_f32(ctx, lora_tensors[split_q_d_name]);
+
+                        if (lora_tensors.find(split_q_u_name) != lora_tensors.end()) {
+                            lora_q_up = to_f32(ctx, lora_tensors[split_q_u_name]);
+                        }
 
-                    struct ggml_tensor* updown_1 = ggml_merge_lora(compute_ctx, hada_1_down, hada_1_up, hada_1_mid);
-                    struct ggml_tensor* updown_2 = ggml_merge_lora(compute_ctx, hada_2_down, hada_2_up, hada_2_mid);
-                    updown                       = ggml_mul_inplace(compute_ctx, updown_1, updown_2);
+                        if (lora_tensors.find(split_k_d_name) != lora_tensors.end()) {
+                            lora_k_down = to_f32(ctx, lora_tensors[split_k_d_name]);
+                        }
 
-                    // calc_scale
-                    // TODO: .dora_scale?
-                    int64_t rank = hada_1_down->ne[ggml_n_dims(hada_1_down) - 1];
-                    if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
-                        float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
-                        scale_value = alpha / rank;
-                    }
-                } else if (lora_tensors.find(fk + ".lokr_w1") != lora_tensors.end() || lora_tensors.find(fk + ".lokr_w1_a") != lora_tensors.end()) {
-                    // LoKr mode
+                        if (lora_tensors.find(split_k_u_name) != lora_tensors.end()) {
+                            lora_k_up = to_f32(ctx, lora_tensors[split_k_u_name]);
+                        }
 
-                    // TODO: split qkv convention for LoKrs (is it ever used?)
-                    if (is_qkv_split || is_qkvm_split) {
-                        LOG_ERROR("Split qkv isn't supported for LoKr models.");
-                        break;
-                    }
+                        if (lora_tensors.find(split_v_d_name) != lora_tensors.end()) {
+                            lora_v_down = to_f32(ctx, lora_tensors[split_v_d_name]);
+                        }
 
-                    std::string alpha_name = fk + ".alpha";
-
-                    ggml_tensor* lokr_w1 = NULL;
-                    ggml_tensor* lokr_w2 = NULL;
-
-                    std::string lokr_w1_name = "";
-                    std::string lokr_w2_name = "";
-
-                    lokr_w1_name = fk + ".lokr_w1";
-                    lokr_w2_name = fk + ".lokr_w2";
-
-                    if (lora_tensors.find(lokr_w1_name) != lora_tensors.end()) {
-                        lokr_w1 = to_f32(compute_ctx, lora_tensors[lokr_w1_name]);
-                        applied_lora_tensors.insert(lokr_w1_name);
-                    } else {
-                        ggml_tensor* down     = NULL;
-                        ggml_tensor* up       = NULL;
-                        std::string down_name = lokr_w1_name + "_b";
-                        std::string up_name   = lokr_w1_name + "_a";
-                        if (lora_tensors.find(down_name) != lora_tensors.end()) {
-                            // w1 should not be low rank normally, sometimes w1 and w2 are swapped
-                            down = to_f32(compute_ctx, lora_tensors[down_name]);
-                            applied_lora_tensors.insert(down_name);
-
-                            int64_t rank = down->ne[ggml_n_dims(down) - 1];
-                            if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
-                                float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
-                                scale_value = alpha / rank;
-                            }
+                        if (lora_tensors.find(split_v_u_name) != lora_tensors.end()) {
+                            lora_v_up = to_f32(ctx, lora_tensors[split_v_u_name]);
                         }
-                        if (lora_tensors.find(up_name) != lora_tensors.end()) {
-                            up = to_f32(compute_ctx, lora_tensors[up_name]);
-                            applied_lora_tensors.insert(up_name);
+
+                        float q_rank = lora_q_up->ne[0];
+                        float k_rank = lora_k_up->ne[0];
+                        float v_rank = lora_v_up->ne[0];
+
+                        float lora_q_scale = 1;
+                        float lora_k_scale = 1;
+                        float lora_v_scale = 1;
+
+                        if (lora_tensors.find(split_q_scale_name) != lora_tensors.end()) {
+                            lora_q_scale = ggml_backend_tensor_get_f32(lora_tensors[split_q_scale_name]);
+                            applied_lora_tensors.insert(split_q_scale_name);
                         }
-                        lokr_w1 = ggml_merge_lora(compute_ctx, down, up);
-                    }
-                    if (lora_tensors.find(lokr_w2_name) != lora_tensors.end()) {
-                        lokr_w2 = to_f32(compute_ctx, lora_tensors[lokr_w2_name]);
-                        applied_lora_tensors.insert(lokr_w2_name);
-                    } else {
-                        ggml_tensor* down     = NULL;
-                        ggml_tensor* up       = NULL;
-                        std::string down_name = lokr_w2_name + "_b";
-                        std::string up_name   = lokr_w2_name + "_a";
-                        if (lora_tensors.find(down_name) != lora_tensors.end()) {
-                            down = to_f32(compute_ctx, lora_tensors[down_name]);
-                            applied_lora_tensors.insert(down_name);
-
-                            int64_t rank = down->ne[ggml_n_dims(down) - 1];
-                            if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
-                                float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
-                                scale_value = alpha / rank;
-                            }
+                        if (lora_tensors.find(split_k_scale_name) != lora_tensors.end()) {
+                            lora_k_scale = ggml_backend_tensor_get_f32(lora_tensors[split_k_scale_name]);
+                            applied_lora_tensors.insert(split_k_scale_name);
                         }
-                        if (lora_tensors.find(up_name) != lora_tensors.end()) {
-                            up = to_f32(compute_ctx, lora_tensors[up_name]);
-                            applied_lora_tensors.insert(up_name);
+                        if (lora_tensors.find(split_v_scale_name) != lora_tensors.end()) {
+                            lora_v_scale = ggml_backend_tensor_get_f32(lora_tensors[split_v_scale_name]);
+                            applied_lora_tensors.insert(split_v_scale_name);
                         }
-                        lokr_w2 = ggml_merge_lora(compute_ctx, down, up);
+
+                        if (lora_tensors.find(split_q_alpha_name) != lora_tensors.end()) {
+                            float lora_q_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_q_alpha_name]);
+                            applied_lora_tensors.insert(split_q_alpha_name);
+                            lora_q_scale = lora_q_alpha / q_rank;
+                        }
+                        if (lora_tensors.find(split_k_alpha_name) != lora_tensors.end()) {
+                            float lora_k_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_k_alpha_name]);
+                            applied_lora_tensors.insert(split_k_alpha_name);
+                            lora_k_scale = lora_k_alpha / k_rank;
+                        }
+                        if (lora_tensors.find(split_v_alpha_name) != lora_tensors.end()) {
+                            float lora_v_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_v_alpha_name]);
+                            applied_lora_tensors.insert(split_v_alpha_name);
+                            lora_v_scale = lora_v_alpha / v_rank;
+                        }
+
+                        ggml_scale_inplace(ctx, lora_q_down, lora_q_scale);
+                        ggml_scale_inplace(ctx, lora_k_down, lora_k_scale);
+                        ggml_scale_inplace(ctx, lora_v_down, lora_v_scale);
+
+                        // print_ggml_tensor(lora_q_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_k_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_v_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_q_up, true);    //[R, 3072, 1, 1]
+                        // print_ggml_tensor(lora_k_up, true);    //[R, 3072, 1, 1]
+                        // print_ggml_tensor(lora_v_up, true);    //[R, 3072, 1, 1]
+
+                        // these need to be stitched together this way:
+                        //                          |q_up,0   ,0   |
+                        //                          |0   ,k_up,0   |
+                        //                          |0   ,0   ,v_up|
+                        // (q_down,k_down,v_down) . (q   ,k   ,v)
+
+                        // up_concat will be [9216, R*3, 1, 1]
+                        // down_concat will be [R*3, 3072, 1, 1]
+                        ggml_tensor* lora_down_concat = ggml_concat(ctx, ggml_concat(ctx, lora_q_down, lora_k_down, 1), lora_v_down, 1);
+
+                        ggml_tensor* z = ggml_dup_tensor(ctx, lora_q_up);
+                        ggml_scale(ctx, z, 0);
+                        ggml_tensor* zz = ggml_concat(ctx, z, z, 1);
+
+                        ggml_tensor* q_up = ggml_concat(ctx, lora_q_up, zz, 1);
+                        ggml_tensor* k_up = ggml_concat(ctx, ggml_concat(ctx, z, lora_k_up, 1), z, 1);
+                        ggml_tensor* v_up = ggml_concat(ctx, zz, lora_v_up, 1);
+                        // print_ggml_tensor(q_up, true);  //[R, 9216, 1, 1]
+                        // print_ggml_tensor(k_up, true);  //[R, 9216, 1, 1]
+                        // print_ggml_tensor(v_up, true);  //[R, 9216, 1, 1]
+                        ggml_tensor* lora_up_concat = ggml_concat(ctx, ggml_concat(ctx, q_up, k_up, 0), v_up, 0);
+                        // print_ggml_tensor(lora_up_concat, true);  //[R*3, 9216, 1, 1]
+
+                        lora_down = ggml_cont(ctx, lora_down_concat);
+                        lora_up   = ggml_cont(ctx, lora_up_concat);
+
+                        applied_lora_tensors.insert(split_q_u_name);
+                        applied_lora_tensors.insert(split_k_u_name);
+                        applied_lora_tensors.insert(split_v_u_name);
+
+                        applied_lora_tensors.insert(split_q_d_name);
+                        applied_lora_tensors.insert(split_k_d_name);
+                        applied_lora_tensors.insert(split_v_d_name);
                     }
-                    
-                    // Technically it might be unused, but I believe it's the expected behavior
-                    applied_lora_tensors.insert(alpha_name);
+                } else if (is_qkvm_split) {
+                    auto split_q_d_name = fk + "attn.to_q" + lora_downs[type] + ".weight";
+                    if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
+                        // print_ggml_tensor(it.second, true);  //[3072, 21504, 1, 1]
+                        // find qkv and mlp up parts in LoRA model
+                        auto split_k_d_name = fk + "attn.to_k" + lora_downs[type] + ".weight";
+                        auto split_v_d_name = fk + "attn.to_v" + lora_downs[type] + ".weight";
+
+                        auto split_q_u_name = fk + "attn.to_q" + lora_ups[type] + ".weight";
+                        auto split_k_u_name = fk + "attn.to_k" + lora_ups[type] + ".weight";
+                        auto split_v_u_name = fk + "attn.to_v" + lora_ups[type] + ".weight";
+
+                        auto split_m_d_name = fk + "proj_mlp" + lora_downs[type] + ".weight";
+                        auto split_m_u_name = fk + "proj_mlp" + lora_ups[type] + ".weight";
+
+                        auto split_q_scale_name = fk + "attn.to_q" + ".scale";
+                        auto split_k_scale_name = fk + "attn.to_k" + ".scale";
+                        auto split_v_scale_name = fk + "attn.to_v" + ".scale";
+                        auto split_m_scale_name = fk + "proj_mlp" + ".scale";
+
+                        auto split_q_alpha_name = fk + "attn.to_q" + ".alpha";
+                        auto split_k_alpha_name = fk + "attn.to_k" + ".alpha";
+                        auto split_v_alpha_name = fk + "attn.to_v" + ".alpha";
+                        auto split_m_alpha_name = fk + "proj_mlp" + ".alpha";
+
+                        ggml_tensor* lora_q_down = NULL;
+                        ggml_tensor* lora_q_up   = NULL;
+                        ggml_tensor* lora_k_down = NULL;
+                        ggml_tensor* lora_k_up   = NULL;
+                        ggml_tensor* lora_v_down = NULL;
+                        ggml_tensor* lora_v_up   = NULL;
+
+                        ggml_tensor* lora_m_down = NULL;
+                        ggml_tensor* lora_m_up   = NULL;
+
+                        lora_q_up = to_f32(ctx, lora_tensors[split_q_u_name]);
 
-                    updown = ggml_kronecker(compute_ctx, lokr_w1, lokr_w2);
+                        if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
+                            lora_q_down = to_f32(ctx, lora_tensors[split_q_d_name]);
+                        }
 
-                } else {
-                    // LoRA mode
-                    ggml_tensor* lora_mid  = NULL;  // tau for tucker decomposition
-                    ggml_tensor* lora_up   = NULL;
-                    ggml_tensor* lora_down = NULL;
-
-                    std::string alpha_name         = "";
-                    std::string scale_name         = "";
-                    std::string split_q_scale_name = "";
-                    std::string lora_mid_name      = "";
-                    std::string lora_down_name     = "";
-                    std::string lora_up_name       = "";
-
-                    if (is_qkv_split) {
-                        std::string suffix  = "";
-                        auto split_q_d_name = fk + "q" + suffix + lora_downs[type] + ".weight";
-
-                        if (lora_tensors.find(split_q_d_name) == lora_tensors.end()) {
-                            suffix         = "_proj";
-                            split_q_d_name = fk + "q" + suffix + lora_downs[type] + ".weight";
+                        if (lora_tensors.find(split_q_u_name) != lora_tensors.end()) {
+                            lora_q_up = to_f32(ctx, lora_tensors[split_q_u_name]);
                         }
-                        if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
-                            // print_ggml_tensor(it.second, true);  //[3072, 21504, 1, 1]
-                            // find qkv and mlp up parts in LoRA model
-                            auto split_k_d_name = fk + "k" + suffix + lora_downs[type] + ".weight";
-                            auto split_v_d_name = fk + "v" + suffix + lora_downs[type] + ".weight";
-
-                            auto split_q_u_name = fk + "q" + suffix + lora_ups[type] + ".weight";
-                            auto split_k_u_name = fk + "k" + suffix + lora_ups[type] + ".weight";
-                            auto split_v_u_name = fk + "v" + suffix + lora_ups[type] + ".weight";
-
-                            auto split_q_scale_name = fk + "q" + suffix + ".scale";
-                            auto split_k_scale_name = fk + "k" + suffix + ".scale";
-                            auto split_v_scale_name = fk + "v" + suffix + ".scale";
-
-                            auto split_q_alpha_name = fk + "q" + suffix + ".alpha";
-                            auto split_k_alpha_name = fk + "k" + suffix + ".alpha";
-                            auto split_v_alpha_name = fk + "v" + suffix + ".alpha";
-
-                            ggml_tensor* lora_q_down = NULL;
-                            ggml_tensor* lora_q_up   = NULL;
-                            ggml_tensor* lora_k_down = NULL;
-                            ggml_tensor* lora_k_up   = NULL;
-                            ggml_tensor* lora_v_down = NULL;
-                            ggml_tensor* lora_v_up   = NULL;
-
-                            lora_q_down = to_f32(compute_ctx, lora_tensors[split_q_d_name]);
-
-                            if (lora_tensors.find(split_q_u_name) != lora_tensors.end()) {
-                                lora_q_up = to_f32(compute_ctx, lora_tensors[split_q_u_name]);
-                            }
-
-                            if (lora_tensors.find(split_k_d_name) != lora_tensors.end()) {
-                                lora_k_down = to_f32(compute_ctx, lora_tensors[split_k_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_k_u_name) != lora_tensors.end()) {
-                                lora_k_up = to_f32(compute_ctx, lora_tensors[split_k_u_name]);
-                            }
-
-                            if (lora_tensors.find(split_v_d_name) != lora_tensors.end()) {
-                                lora_v_down = to_f32(compute_ctx, lora_tensors[split_v_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_v_u_name) != lora_tensors.end()) {
-                                lora_v_up = to_f32(compute_ctx, lora_tensors[split_v_u_name]);
-                            }
-
-                            float q_rank = lora_q_up->ne[0];
-                            float k_rank = lora_k_up->ne[0];
-                            float v_rank = lora_v_up->ne[0];
-
-                            float lora_q_scale = 1;
-                            float lora_k_scale = 1;
-                            float lora_v_scale = 1;
-
-                            if (lora_tensors.find(split_q_scale_name) != lora_tensors.end()) {
-                                lora_q_scale = ggml_backend_tensor_get_f32(lora_tensors[split_q_scale_name]);
-                                applied_lora_tensors.insert(split_q_scale_name);
-                            }
-                            if (lora_tensors.find(split_k_scale_name) != lora_tensors.end()) {
-                                lora_k_scale = ggml_backend_tensor_get_f32(lora_tensors[split_k_scale_name]);
-                                applied_lora_tensors.insert(split_k_scale_name);
-                            }
-                            if (lora_tensors.find(split_v_scale_name) != lora_tensors.end()) {
-                                lora_v_scale = ggml_backend_tensor_get_f32(lora_tensors[split_v_scale_name]);
-                                applied_lora_tensors.insert(split_v_scale_name);
-                            }
-
-                            if (lora_tensors.find(split_q_alpha_name) != lora_tensors.end()) {
-                                float lora_q_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_q_alpha_name]);
-                                applied_lora_tensors.insert(split_q_alpha_name);
-                                lora_q_scale = lora_q_alpha / q_rank;
-                            }
-                            if (lora_tensors.find(split_k_alpha_name) != lora_tensors.end()) {
-                                float lora_k_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_k_alpha_name]);
-                                applied_lora_tensors.insert(split_k_alpha_name);
-                                lora_k_scale = lora_k_alpha / k_rank;
-                            }
-                            if (lora_tensors.find(split_v_alpha_name) != lora_tensors.end()) {
-                                float lora_v_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_v_alpha_name]);
-                                applied_lora_tensors.insert(split_v_alpha_name);
-                                lora_v_scale = lora_v_alpha / v_rank;
-                            }
-
-                            ggml_scale_inplace(compute_ctx, lora_q_down, lora_q_scale);
-                            ggml_scale_inplace(compute_ctx, lora_k_down, lora_k_scale);
-                            ggml_scale_inplace(compute_ctx, lora_v_down, lora_v_scale);
-
-                            // print_ggml_tensor(lora_q_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_k_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_v_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_q_up, true);    //[R, 3072, 1, 1]
-                            // print_ggml_tensor(lora_k_up, true);    //[R, 3072, 1, 1]
-                            // print_ggml_tensor(lora_v_up, true);    //[R, 3072, 1, 1]
-
-                            // these need to be stitched together this way:
-                            //                          |q_up,0   ,0   |
-                            //                          |0   ,k_up,0   |
-                            //                          |0   ,0   ,v_up|
-                            // (q_down,k_down,v_down) . (q   ,k   ,v)
-
-                            // up_concat will be [9216, R*3, 1, 1]
-                            // down_concat will be [R*3, 3072, 1, 1]
-                            ggml_tensor* lora_down_concat = ggml_concat(compute_ctx, ggml_concat(compute_ctx, lora_q_down, lora_k_down, 1), lora_v_down, 1);
-
-                            ggml_tensor* z = ggml_dup_tensor(compute_ctx, lora_q_up);
-                            ggml_scale(compute_ctx, z, 0);
-                            ggml_tensor* zz = ggml_concat(compute_ctx, z, z, 1);
-
-                            ggml_tensor* q_up = ggml_concat(compute_ctx, lora_q_up, zz, 1);
-                            ggml_tensor* k_up = ggml_concat(compute_ctx, ggml_concat(compute_ctx, z, lora_k_up, 1), z, 1);
-                            ggml_tensor* v_up = ggml_concat(compute_ctx, zz, lora_v_up, 1);
-                            // print_ggml_tensor(q_up, true);  //[R, 9216, 1, 1]
-                            // print_ggml_tensor(k_up, true);  //[R, 9216, 1, 1]
-                            // print_ggml_tensor(v_up, true);  //[R, 9216, 1, 1]
-                            ggml_tensor* lora_up_concat = ggml_concat(compute_ctx, ggml_concat(compute_ctx, q_up, k_up, 0), v_up, 0);
-                            // print_ggml_tensor(lora_up_concat, true);  //[R*3, 9216, 1, 1]
-
-                            lora_down = ggml_cont(compute_ctx, lora_down_concat);
-                            lora_up   = ggml_cont(compute_ctx, lora_up_concat);
-
-                            applied_lora_tensors.insert(split_q_u_name);
-                            applied_lora_tensors.insert(split_k_u_name);
-                            applied_lora_tensors.insert(split_v_u_name);
-
-                            applied_lora_tensors.insert(split_q_d_name);
-                            applied_lora_tensors.insert(split_k_d_name);
-                            applied_lora_tensors.insert(split_v_d_name);
+
+                        if (lora_tensors.find(split_k_d_name) != lora_tensors.end()) {
+                            lora_k_down = to_f32(ctx, lora_tensors[split_k_d_name]);
                         }
-                    } else if (is_qkvm_split) {
-                        auto split_q_d_name = fk + "attn.to_q" + lora_downs[type] + ".weight";
-                        if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
-                            // print_ggml_tensor(it.second, true);  //[3072, 21504, 1, 1]
-                            // find qkv and mlp up parts in LoRA model
-                            auto split_k_d_name = fk + "attn.to_k" + lora_downs[type] + ".weight";
-                            auto split_v_d_name = fk + "attn.to_v" + lora_downs[type] + ".weight";
-
-                            auto split_q_u_name = fk + "attn.to_q" + lora_ups[type] + ".weight";
-                            auto split_k_u_name = fk + "attn.to_k" + lora_ups[type] + ".weight";
-                            auto split_v_u_name = fk + "attn.to_v" + lora_ups[type] + ".weight";
-
-                            auto split_m_d_name = fk + "proj_mlp" + lora_downs[type] + ".weight";
-                            auto split_m_u_name = fk + "proj_mlp" + lora_ups[type] + ".weight";
-
-                            auto split_q_scale_name = fk + "attn.to_q" + ".scale";
-                            auto split_k_scale_name = fk + "attn.to_k" + ".scale";
-                            auto split_v_scale_name = fk + "attn.to_v" + ".scale";
-                            auto split_m_scale_name = fk + "proj_mlp" + ".scale";
-
-                            auto split_q_alpha_name = fk + "attn.to_q" + ".alpha";
-                            auto split_k_alpha_name = fk + "attn.to_k" + ".alpha";
-                            auto split_v_alpha_name = fk + "attn.to_v" + ".alpha";
-                            auto split_m_alpha_name = fk + "proj_mlp" + ".alpha";
-
-                            ggml_tensor* lora_q_down = NULL;
-                            ggml_tensor* lora_q_up   = NULL;
-                            ggml_tensor* lora_k_down = NULL;
-                            ggml_tensor* lora_k_up   = NULL;
-                            ggml_tensor* lora_v_down = NULL;
-                            ggml_tensor* lora_v_up   = NULL;
-
-                            ggml_tensor* lora_m_down = NULL;
-                            ggml_tensor* lora_m_up   = NULL;
-
-                            lora_q_up = to_f32(compute_ctx, lora_tensors[split_q_u_name]);
-
-                            if (lora_tensors.find(split_q_d_name) != lora_tensors.end()) {
-                                lora_q_down = to_f32(compute_ctx, lora_tensors[split_q_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_q_u_name) != lora_tensors.end()) {
-                                lora_q_up = to_f32(compute_ctx, lora_tensors[split_q_u_name]);
-                            }
-
-                            if (lora_tensors.find(split_k_d_name) != lora_tensors.end()) {
-                                lora_k_down = to_f32(compute_ctx, lora_tensors[split_k_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_k_u_name) != lora_tensors.end()) {
-                                lora_k_up = to_f32(compute_ctx, lora_tensors[split_k_u_name]);
-                            }
-
-                            if (lora_tensors.find(split_v_d_name) != lora_tensors.end()) {
-                                lora_v_down = to_f32(compute_ctx, lora_tensors[split_v_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_v_u_name) != lora_tensors.end()) {
-                                lora_v_up = to_f32(compute_ctx, lora_tensors[split_v_u_name]);
-                            }
-
-                            if (lora_tensors.find(split_m_d_name) != lora_tensors.end()) {
-                                lora_m_down = to_f32(compute_ctx, lora_tensors[split_m_d_name]);
-                            }
-
-                            if (lora_tensors.find(split_m_u_name) != lora_tensors.end()) {
-                                lora_m_up = to_f32(compute_ctx, lora_tensors[split_m_u_name]);
-                            }
-
-                            float q_rank = lora_q_up->ne[0];
-                            float k_rank = lora_k_up->ne[0];
-                            float v_rank = lora_v_up->ne[0];
-                            float m_rank = lora_v_up->ne[0];
-
-                            float lora_q_scale = 1;
-                            float lora_k_scale = 1;
-                            float lora_v_scale = 1;
-                            float lora_m_scale = 1;
-
-                            if (lora_tensors.find(split_q_scale_name) != lora_tensors.end()) {
-                                lora_q_scale = ggml_backend_tensor_get_f32(lora_tensors[split_q_scale_name]);
-                                applied_lora_tensors.insert(split_q_scale_name);
-                            }
-                            if (lora_tensors.find(split_k_scale_name) != lora_tensors.end()) {
-                                lora_k_scale = ggml_backend_tensor_get_f32(lora_tensors[split_k_scale_name]);
-                                applied_lora_tensors.insert(split_k_scale_name);
-                            }
-                            if (lora_tensors.find(split_v_scale_name) != lora_tensors.end()) {
-                                lora_v_scale = ggml_backend_tensor_get_f32(lora_tensors[split_v_scale_name]);
-                                applied_lora_tensors.insert(split_v_scale_name);
-                            }
-                            if (lora_tensors.find(split_m_scale_name) != lora_tensors.end()) {
-                                lora_m_scale = ggml_backend_tensor_get_f32(lora_tensors[split_m_scale_name]);
-                                applied_lora_tensors.insert(split_m_scale_name);
-                            }
-
-                            if (lora_tensors.find(split_q_alpha_name) != lora_tensors.end()) {
-                                float lora_q_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_q_alpha_name]);
-                                applied_lora_tensors.insert(split_q_alpha_name);
-                                lora_q_scale = lora_q_alpha / q_rank;
-                            }
-                            if (lora_tensors.find(split_k_alpha_name) != lora_tensors.end()) {
-                                float lora_k_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_k_alpha_name]);
-                                applied_lora_tensors.insert(split_k_alpha_name);
-                                lora_k_scale = lora_k_alpha / k_rank;
-                            }
-                            if (lora_tensors.find(split_v_alpha_name) != lora_tensors.end()) {
-                                float lora_v_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_v_alpha_name]);
-                                applied_lora_tensors.insert(split_v_alpha_name);
-                                lora_v_scale = lora_v_alpha / v_rank;
-                            }
-                            if (lora_tensors.find(split_m_alpha_name) != lora_tensors.end()) {
-                                float lora_m_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_m_alpha_name]);
-                                applied_lora_tensors.insert(split_m_alpha_name);
-                                lora_m_scale = lora_m_alpha / m_rank;
-                            }
-
-                            ggml_scale_inplace(compute_ctx, lora_q_down, lora_q_scale);
-                            ggml_scale_inplace(compute_ctx, lora_k_down, lora_k_scale);
-                            ggml_scale_inplace(compute_ctx, lora_v_down, lora_v_scale);
-                            ggml_scale_inplace(compute_ctx, lora_m_down, lora_m_scale);
-
-                            // print_ggml_tensor(lora_q_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_k_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_v_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_m_down, true);  //[3072, R, 1, 1]
-                            // print_ggml_tensor(lora_q_up, true);  //[R, 3072, 1, 1]
-                            // print_ggml_tensor(lora_k_up, true);  //[R, 3072, 1, 1]
-                            // print_ggml_tensor(lora_v_up, true);  //[R, 3072, 1, 1]
-                            // print_ggml_tensor(lora_m_up, true);  //[R, 12288, 1, 1]
-
-                            // these need to be stitched together this way:
-                            //                                 |q_up,0   ,0   ,0   |
-                            //                                 |0   ,k_up,0   ,0   |
-                            //                                 |0   ,0   ,v_up,0   |
-                            //                                 |0   ,0   ,0   ,m_up|
-                            // (q_down,k_down,v_down,m_down) . (q   ,k   ,v   ,m)
-
-                            // up_concat will be [21504, R*4, 1, 1]
-                            // down_concat will be [R*4, 3072, 1, 1]
-
-                            ggml_tensor* lora_down_concat = ggml_concat(compute_ctx, ggml_concat(compute_ctx, lora_q_down, lora_k_down, 1), ggml_concat(compute_ctx, lora_v_down, lora_m_down, 1), 1);
-                            // print_ggml_tensor(lora_down_concat, true);  //[3072, R*4, 1, 1]
-
-                            // this also means that if rank is bigger than 672, it is less memory efficient to do it this way (should be fine)
-                            // print_ggml_tensor(lora_q_up, true);  //[3072, R, 1, 1]
-                            ggml_tensor* z     = ggml_dup_tensor(compute_ctx, lora_q_up);
-                            ggml_tensor* mlp_z = ggml_dup_tensor(compute_ctx, lora_m_up);
-                            ggml_scale(compute_ctx, z, 0);
-                            ggml_scale(compute_ctx, mlp_z, 0);
-                            ggml_tensor* zz = ggml_concat(compute_ctx, z, z, 1);
-
-                            ggml_tensor* q_up = ggml_concat(compute_ctx, ggml_concat(compute_ctx, lora_q_up, zz, 1), mlp_z, 1);
-                            ggml_tensor* k_up = ggml_concat(compute_ctx, ggml_concat(compute_ctx, z, lora_k_up, 1), ggml_concat(compute_ctx, z, mlp_z, 1), 1);
-                            ggml_tensor* v_up = ggml_concat(compute_ctx, ggml_concat(compute_ctx, zz, lora_v_up, 1), mlp_z, 1);
-                            ggml_tensor* m_up = ggml_concat(compute_ctx, ggml_concat(compute_ctx, zz, z, 1), lora_m_up, 1);
-                            // print_ggml_tensor(q_up, true);  //[R, 21504, 1, 1]
-                            // print_ggml_tensor(k_up, true);  //[R, 21504, 1, 1]
-                            // print_ggml_tensor(v_up, true);  //[R, 21504, 1, 1]
-                            // print_ggml_tensor(m_up, true);  //[R, 21504, 1, 1]
-
-                            ggml_tensor* lora_up_concat = ggml_concat(compute_ctx, ggml_concat(compute_ctx, q_up, k_up, 0), ggml_concat(compute_ctx, v_up, m_up, 0), 0);
-                            // print_ggml_tensor(lora_up_concat, true);  //[R*4, 21504, 1, 1]
-
-                            lora_down = ggml_cont(compute_ctx, lora_down_concat);
-                            lora_up   = ggml_cont(compute_ctx, lora_up_concat);
-
-                            applied_lora_tensors.insert(split_q_u_name);
-                            applied_lora_tensors.insert(split_k_u_name);
-                            applied_lora_tensors.insert(split_v_u_name);
-                            applied_lora_tensors.insert(split_m_u_name);
-
-                            applied_lora_tensors.insert(split_q_d_name);
-                            applied_lora_tensors.insert(split_k_d_name);
-                            applied_lora_tensors.insert(split_v_d_name);
-                            applied_lora_tensors.insert(split_m_d_name);
+
+                        if (lora_tensors.find(split_k_u_name) != lora_tensors.end()) {
+                            lora_k_up = to_f32(ctx, lora_tensors[split_k_u_name]);
                         }
-                    } else {
-                        lora_up_name   = fk + lora_ups[type] + ".weight";
-                        lora_down_name = fk + lora_downs[type] + ".weight";
-                        lora_mid_name  = fk + ".lora_mid.weight";
 
-                        alpha_name = fk + ".alpha";
-                        scale_name = fk + ".scale";
+                        if (lora_tensors.find(split_v_d_name) != lora_tensors.end()) {
+                            lora_v_down = to_f32(ctx, lora_tensors[split_v_d_name]);
+                        }
 
-                        if (lora_tensors.find(lora_up_name) != lora_tensors.end()) {
-                            lora_up = to_f32(compute_ctx, lora_tensors[lora_up_name]);
+                        if (lora_tensors.find(split_v_u_name) != lora_tensors.end()) {
+                            lora_v_up = to_f32(ctx, lora_tensors[split_v_u_name]);
                         }
 
-                        if (lora_tensors.find(lora_down_name) != lora_tensors.end()) {
-                            lora_down = to_f32(compute_ctx, lora_tensors[lora_down_name]);
+                        if (lora_tensors.find(split_m_d_name) != lora_tensors.end()) {
+                            lora_m_down = to_f32(ctx, lora_tensors[split_m_d_name]);
                         }
 
-                        if (lora_tensors.find(lora_mid_name) != lora_tensors.end()) {
-                            lora_mid = to_f32(compute_ctx, lora_tensors[lora_mid_name]);
-                            applied_lora_tensors.insert(lora_mid_name);
+                        if (lora_tensors.find(split_m_u_name) != lora_tensors.end()) {
+                            lora_m_up = to_f32(ctx, lora_tensors[split_m_u_name]);
                         }
 
-                        applied_lora_tensors.insert(lora_up_name);
-                        applied_lora_tensors.insert(lora_down_name);
-                        applied_lora_tensors.insert(alpha_name);
-                        applied_lora_tensors.insert(scale_name);
+                        float q_rank = lora_q_up->ne[0];
+                        float k_rank = lora_k_up->ne[0];
+                        float v_rank = lora_v_up->ne[0];
+                        float m_rank = lora_v_up->ne[0];
+
+                        float lora_q_scale = 1;
+                        float lora_k_scale = 1;
+                        float lora_v_scale = 1;
+                        float lora_m_scale = 1;
+
+                        if (lora_tensors.find(split_q_scale_name) != lora_tensors.end()) {
+                            lora_q_scale = ggml_backend_tensor_get_f32(lora_tensors[split_q_scale_name]);
+                            applied_lora_tensors.insert(split_q_scale_name);
+                        }
+                        if (lora_tensors.find(split_k_scale_name) != lora_tensors.end()) {
+                            lora_k_scale = ggml_backend_tensor_get_f32(lora_tensors[split_k_scale_name]);
+                            applied_lora_tensors.insert(split_k_scale_name);
+                        }
+                        if (lora_tensors.find(split_v_scale_name) != lora_tensors.end()) {
+                            lora_v_scale = ggml_backend_tensor_get_f32(lora_tensors[split_v_scale_name]);
+                            applied_lora_tensors.insert(split_v_scale_name);
+                        }
+                        if (lora_tensors.find(split_m_scale_name) != lora_tensors.end()) {
+                            lora_m_scale = ggml_backend_tensor_get_f32(lora_tensors[split_m_scale_name]);
+                            applied_lora_tensors.insert(split_m_scale_name);
+                        }
+
+                        if (lora_tensors.find(split_q_alpha_name) != lora_tensors.end()) {
+                            float lora_q_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_q_alpha_name]);
+                            applied_lora_tensors.insert(split_q_alpha_name);
+                            lora_q_scale = lora_q_alpha / q_rank;
+                        }
+                        if (lora_tensors.find(split_k_alpha_name) != lora_tensors.end()) {
+                            float lora_k_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_k_alpha_name]);
+                            applied_lora_tensors.insert(split_k_alpha_name);
+                            lora_k_scale = lora_k_alpha / k_rank;
+                        }
+                        if (lora_tensors.find(split_v_alpha_name) != lora_tensors.end()) {
+                            float lora_v_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_v_alpha_name]);
+                            applied_lora_tensors.insert(split_v_alpha_name);
+                            lora_v_scale = lora_v_alpha / v_rank;
+                        }
+                        if (lora_tensors.find(split_m_alpha_name) != lora_tensors.end()) {
+                            float lora_m_alpha = ggml_backend_tensor_get_f32(lora_tensors[split_m_alpha_name]);
+                            applied_lora_tensors.insert(split_m_alpha_name);
+                            lora_m_scale = lora_m_alpha / m_rank;
+                        }
+
+                        ggml_scale_inplace(ctx, lora_q_down, lora_q_scale);
+                        ggml_scale_inplace(ctx, lora_k_down, lora_k_scale);
+                        ggml_scale_inplace(ctx, lora_v_down, lora_v_scale);
+                        ggml_scale_inplace(ctx, lora_m_down, lora_m_scale);
+
+                        // print_ggml_tensor(lora_q_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_k_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_v_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_m_down, true);  //[3072, R, 1, 1]
+                        // print_ggml_tensor(lora_q_up, true);  //[R, 3072, 1, 1]
+                        // print_ggml_tensor(lora_k_up, true);  //[R, 3072, 1, 1]
+                        // print_ggml_tensor(lora_v_up, true);  //[R, 3072, 1, 1]
+                        // print_ggml_tensor(lora_m_up, true);  //[R, 12288, 1, 1]
+
+                        // these need to be stitched together this way:
+                        //                                 |q_up,0   ,0   ,0   |
+                        //                                 |0   ,k_up,0   ,0   |
+                        //                                 |0   ,0   ,v_up,0   |
+                        //                                 |0   ,0   ,0   ,m_up|
+                        // (q_down,k_down,v_down,m_down) . (q   ,k   ,v   ,m)
+
+                        // up_concat will be [21504, R*4, 1, 1]
+                        // down_concat will be [R*4, 3072, 1, 1]
+
+                        ggml_tensor* lora_down_concat = ggml_concat(ctx, ggml_concat(ctx, lora_q_down, lora_k_down, 1), ggml_concat(ctx, lora_v_down, lora_m_down, 1), 1);
+                        // print_ggml_tensor(lora_down_concat, true);  //[3072, R*4, 1, 1]
+
+                        // this also means that if rank is bigger than 672, it is less memory efficient to do it this way (should be fine)
+                        // print_ggml_tensor(lora_q_up, true);  //[3072, R, 1, 1]
+                        ggml_tensor* z     = ggml_dup_tensor(ctx, lora_q_up);
+                        ggml_tensor* mlp_z = ggml_dup_tensor(ctx, lora_m_up);
+                        ggml_scale(ctx, z, 0);
+                        ggml_scale(ctx, mlp_z, 0);
+                        ggml_tensor* zz = ggml_concat(ctx, z, z, 1);
+
+                        ggml_tensor* q_up = ggml_concat(ctx, ggml_concat(ctx, lora_q_up, zz, 1), mlp_z, 1);
+                        ggml_tensor* k_up = ggml_concat(ctx, ggml_concat(ctx, z, lora_k_up, 1), ggml_concat(ctx, z, mlp_z, 1), 1);
+                        ggml_tensor* v_up = ggml_concat(ctx, ggml_concat(ctx, zz, lora_v_up, 1), mlp_z, 1);
+                        ggml_tensor* m_up = ggml_concat(ctx, ggml_concat(ctx, zz, z, 1), lora_m_up, 1);
+                        // print_ggml_tensor(q_up, true);  //[R, 21504, 1, 1]
+                        // print_ggml_tensor(k_up, true);  //[R, 21504, 1, 1]
+                        // print_ggml_tensor(v_up, true);  //[R, 21504, 1, 1]
+                        // print_ggml_tensor(m_up, true);  //[R, 21504, 1, 1]
+
+                        ggml_tensor* lora_up_concat = ggml_concat(ctx, ggml_concat(ctx, q_up, k_up, 0), ggml_concat(ctx, v_up, m_up, 0), 0);
+                        // print_ggml_tensor(lora_up_concat, true);  //[R*4, 21504, 1, 1]
+
+                        lora_down = ggml_cont(ctx, lora_down_concat);
+                        lora_up   = ggml_cont(ctx, lora_up_concat);
+
+                        applied_lora_tensors.insert(split_q_u_name);
+                        applied_lora_tensors.insert(split_k_u_name);
+                        applied_lora_tensors.insert(split_v_u_name);
+                        applied_lora_tensors.insert(split_m_u_name);
+
+                        applied_lora_tensors.insert(split_q_d_name);
+                        applied_lora_tensors.insert(split_k_d_name);
+                        applied_lora_tensors.insert(split_v_d_name);
+                        applied_lora_tensors.insert(split_m_d_name);
+                    }
+                } else {
+                    lora_up_name   = fk + lora_ups[type] + ".weight";
+                    lora_down_name = fk + lora_downs[type] + ".weight";
+                    lora_mid_name  = fk + ".lora_mid.weight";
+
+                    alpha_name = fk + ".alpha";
+                    scale_name = fk + ".scale";
+
+                    if (lora_tensors.find(lora_up_name) != lora_tensors.end()) {
+                        lora_up = to_f32(ctx, lora_tensors[lora_up_name]);
                     }
 
-                    if (lora_up == NULL || lora_down == NULL) {
-                        continue;
+                    if (lora_tensors.find(lora_down_name) != lora_tensors.end()) {
+                        lora_down = to_f32(ctx, lora_tensors[lora_down_name]);
                     }
-                    // calc_scale
-                    // TODO: .dora_scale?
-                    int64_t rank = lora_down->ne[ggml_n_dims(lora_down) - 1];
-                    if (lora_tensors.find(scale_name) != lora_tensors.end()) {
-                        scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
-                    } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
-                        float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
-                        scale_value = alpha / rank;
+
+                    if (lora_tensors.find(lora_mid_name) != lora_tensors.end()) {
+                        lora_mid = to_f32(ctx, lora_tensors[lora_mid_name]);
+                        applied_lora_tensors.insert(lora_mid_name);
                     }
 
-                    updown = ggml_merge_lora(compute_ctx, lora_down, lora_up, lora_mid);
+                    applied_lora_tensors.insert(lora_up_name);
+                    applied_lora_tensors.insert(lora_down_name);
+                    applied_lora_tensors.insert(alpha_name);
+                    applied_lora_tensors.insert(scale_name);
+                }
+
+                if (lora_up == NULL || lora_down == NULL) {
+                    continue;
                 }
-                scale_value *= multiplier;
-                updown = ggml_reshape(compute_ctx, updown, weight);
-                GGML_ASSERT(ggml_nelements(updown) == ggml_nelements(weight));
-                updown = ggml_scale_inplace(compute_ctx, updown, scale_value);
-                ggml_tensor* final_weight;
-                if (weight->type != GGML_TYPE_F32 && weight->type != GGML_TYPE_F16) {
-                    // final_weight = ggml_new_tensor(compute_ctx, GGML_TYPE_F32, ggml_n_dims(weight), weight->ne);
-                    // final_weight = ggml_cpy(compute_ctx, weight, final_weight);
-                    final_weight = to_f32(compute_ctx, weight);
-                    final_weight = ggml_add_inplace(compute_ctx, final_weight, updown);
-                    final_weight = ggml_cpy(compute_ctx, final_weight, weight);
-                } else {
-                    final_weight = ggml_add_inplace(compute_ctx, weight, updown);
+                // calc_scale
+                // TODO: .dora_scale?
+                int64_t rank = lora_down->ne[ggml_n_dims(lora_down) - 1];
+                if (lora_tensors.find(scale_name) != lora_tensors.end()) {
+                    scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
+                } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                    float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                    scale_value = alpha / rank;
                 }
-                // final_weight = ggml_add_inplace(compute_ctx, weight, updown);  // apply directly
-                ggml_build_forward_expand(gf, final_weight);
-                break;
+
+                updown = ggml_merge_lora(ctx, lora_down, lora_up, lora_mid);
             }
+            scale_value *= multiplier;
+            updown = ggml_reshape(ctx, updown, weight);
+            GGML_ASSERT(ggml_nelements(updown) == ggml_nelements(weight));
+            updown = ggml_scale_inplace(ctx, updown, scale_value);
+            return updown;
+        }
+        return NULL;
+    }
+
+    // weight += diff, through f32 for the quantized types
+    ggml_tensor* build_weight_update(ggml_context* ctx, ggml_tensor* weight, ggml_tensor* diff) {
+        ggml_tensor* final_weight;
+        if (weight->type != GGML_TYPE_F32 && weight->type != GGML_TYPE_F16) {
+            final_weight = to_f32(ctx, weight);
+            final_weight = ggml_add_inplace(ctx, final_weight, diff);
+            final_weight = ggml_cpy(ctx, final_weight, weight);
+        } else {
+            final_weight = ggml_add_inplace(ctx, weight, diff);
         }
+        return final_weight;
+    }
+
+    void log_applied_tensors(const std::set<std::string>& applied_lora_tensors) {
         size_t total_lora_tensors_count   = 0;
         size_t applied_lora_tensors_count = 0;
 
@@ -821,9 +861,6 @@ struct LoraModel : public GGMLRunner {
                 applied_lora_tensors_count++;
             }
         }
-        /* Don't worry if this message shows up twice in the logs per LoRA,
-         * this function is called once to calculate the required buffer size
-         * and then again to actually generate a graph to be used */
         if (applied_lora_tensors_count != total_lora_tensors_count) {
             LOG_WARN("Only (%lu / %lu) LoRA tensors have been applied",
                      applied_lora_tensors_count, total_lora_tensors_count);
@@ -831,11 +868,95 @@ struct LoraModel : public GGMLRunner {
             LOG_DEBUG("(%lu / %lu) LoRA tensors applied successfully",
                       applied_lora_tensors_count, total_lora_tensors_count);
         }
+    }
+
+    struct ggml_cgraph* build_lora_graph(const std::map<std::string, struct ggml_tensor*>& model_tensors, SDVersion version) {
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
+
+        zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
+        set_backend_tensor_data(zero_index, zero_index_vec.data());
+        ggml_build_forward_expand(gf, zero_index);
+
+        std::set<std::string> applied_lora_tensors;
+        for (auto& kv : model_tensors) {
+            ggml_tensor* diff = build_weight_diff(compute_ctx, kv.first, kv.second, version, applied_lora_tensors);
+            if (diff != NULL) {
+                ggml_build_forward_expand(gf, build_weight_update(compute_ctx, kv.second, diff));
+            }
+        }
+        /* Don't worry if this message shows up twice in the logs per LoRA,
+         * this function is called once to calculate the required buffer size
+         * and then again to actually generate a graph to be used */
+        log_applied_tensors(applied_lora_tensors);
 
         return gf;
     }
 
-    bool apply(std::map<std::string, struct ggml_tensor*> model_tensors, SDVersion version, int n_threads) {
+    // collects the plain LoRA pairs of this lora as runtime adapters of the model weights (see LoraAdapter),
+    // returns the number of model weights whose lora can only be merged (LoHa, LoKr, split qkv, other backend)
+    size_t get_runtime_adapters(const std::map<std::string, struct ggml_tensor*>& model_tensors, SDVersion version, LoraAdapterMap& adapters) {
+        size_t unsupported = 0;
+        for (auto& kv : model_tensors) {
+            struct ggml_tensor* weight = kv.second;
+
+            std::vector<std::string> keys = get_lora_keys(kv.first, version);
+            if (keys.size() == 0)
+                continue;
+
+            if (weight->buffer != NULL && params_buffer != NULL &&
+                ggml_backend_buffer_is_host(weight->buffer) != ggml_backend_buffer_is_host(params_buffer)) {
+                unsupported++;
+                continue;
+            }
+
+            for (auto& key : keys) {
+                if (starts_with(key, "SPLIT|") || starts_with(key, "SPLIT_L|")) {
+                    unsupported++;
+                    break;
+                }
+                std::string fk             = lora_pre[type] + key;
+                std::string lora_up_name   = fk + lora_ups[type] + ".weight";
+                std::string lora_down_name = fk + lora_downs[type] + ".weight";
+                std::string lora_mid_name  = fk + ".lora_mid.weight";
+                std::string alpha_name     = fk + ".alpha";
+                std::string scale_name     = fk + ".scale";
+
+                if (lora_tensors.find(lora_up_name) == lora_tensors.end() ||
+                    lora_tensors.find(lora_down_name) == lora_tensors.end()) {
+                    if (lora_tensors.find(fk + ".hada_w1_a") != lora_tensors.end() ||
+                        lora_tensors.find(fk + ".lokr_w1") != lora_tensors.end() ||
+                        lora_tensors.find(fk + ".lokr_w1_a") != lora_tensors.end()) {
+                        unsupported++;
+                        break;
+                    }
+                    continue;
+                }
+
+                LoraAdapter adapter;
+                adapter.up   = lora_tensors[lora_up_name];
+                adapter.down = lora_tensors[lora_down_name];
+                if (lora_tensors.find(lora_mid_name) != lora_tensors.end()) {
+                    adapter.mid = lora_tensors[lora_mid_name];
+                }
+
+                float scale_value = 1.0f;
+                int64_t rank      = adapter.down->ne[ggml_n_dims(adapter.down) - 1];
+                if (lora_tensors.find(scale_name) != lora_tensors.end()) {
+                    scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
+                } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+                    float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+                    scale_value = alpha / rank;
+                }
+                adapter.scale = scale_value * multiplier;
+
+                adapters[weight].push_back(adapter);
+                break;
+            }
+        }
+        return unsupported;
+    }
+
+    bool apply(const std::map<std::string, struct ggml_tensor*>& model_tensors, SDVersion version, int n_threads) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_lora_graph(model_tensors, version);
         };
@@ -843,4 +964,360 @@ struct LoraModel : public GGMLRunner {
     }
 };
 
+// Merges several loras into the model weights in one pass. The deltas of all loras of a weight are summed and
+// added once, so a quantized weight is dequantized and requantized once per switch instead of once per lora.
+// The weights go through in groups whose estimated compute buffer stays under memory_budget.
+struct LoraMerger : public GGMLRunner {
+    std::vector<std::shared_ptr<LoraModel>> loras;
+    std::vector<std::set<std::string>> applied_lora_tensors;  // one per lora
+    std::vector<int> zero_index_vec = {0};
+    size_t memory_budget;
+
+    LoraMerger(ggml_backend_t backend,
+               const std::vector<std::shared_ptr<LoraModel>>& loras,
+               size_t memory_budget = LORA_MERGE_BUDGET)
+        : GGMLRunner(backend), loras(loras), applied_lora_tensors(loras.size()), memory_budget(memory_budget) {
+    }
+
+    std::string get_desc() {
+        return "lora merge";
+    }
+
+    struct ggml_cgraph* build_graph(const std::vector<std::pair<std::string, struct ggml_tensor*>>& group, SDVersion version) {
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
+
+        ggml_tensor* zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
+        set_backend_tensor_data(zero_index, zero_index_vec.data());
+        ggml_build_forward_expand(gf, zero_index);
+        for (auto& lora : loras) {
+            lora->zero_index = zero_index;
+        }
+
+        for (auto& kv : group) {
+            ggml_tensor* diff = NULL;
+            for (size_t i = 0; i < loras.size(); i++) {
+                ggml_tensor* lora_diff = loras[i]->build_weight_diff(compute_ctx, kv.first, kv.second, version, applied_lora_tensors[i]);
+                if (lora_diff == NULL) {
+                    continue;
+                }
+                diff = diff == NULL ? lora_diff : ggml_add_inplace(compute_ctx, diff, lora_diff);
+            }
+            if (diff != NULL) {
+                ggml_build_forward_expand(gf, loras[0]->build_weight_update(compute_ctx, kv.second, diff));
+            }
+        }
+        return gf;
+    }
+
+    // number of loras that have tensors for the model weight
+    size_t count_loras(const std::string& name, SDVersion version) {
+        size_t n_loras = 0;
+        for (auto& lora : loras) {
+            if (!lora->get_lora_keys(name, version).empty()) {
+                n_loras++;
+            }
+        }
+        return n_loras;
+    }
+
+    bool merge(const std::map<std::string, struct ggml_tensor*>& model_tensors, SDVersion version, int n_threads) {
+        if (loras.empty()) {
+            return true;
+        }
+        std::vector<std::pair<std::string, struct ggml_tensor*>> group;
+        size_t group_size = 0;
+        size_t group_ops  = 0;
+        int n_groups      = 0;
+        bool ok           = true;
+
+        auto run_group = [&]() {
+            if (group.empty() || !ok) {
+                return;
+            }
+            auto get_graph = [&]() -> struct ggml_cgraph* {
+                return build_graph(group, version);
+            };
+            // the allocator grows its buffer when a later group needs more
+            ok         = GGMLRunner::compute(get_graph, n_threads, false);
+            group_size = 0;
+            group_ops  = 0;
+            group.clear();
+            n_groups++;
+        };
+
+        for (auto& kv : model_tensors) {
+            size_t n_loras = count_loras(kv.first, version);
+            if (n_loras == 0) {
+                continue;
+            }
+            // an f32 delta per lora and one f32 copy of the weight, a few dozen tensors per lora
+            size_t size = ggml_nelements(kv.second) * sizeof(float) * (n_loras + 1);
+            size_t ops  = 32 * n_loras + 8;
+            if (group_size + size > memory_budget || group_ops + ops > MAX_GRAPH_SIZE / 2) {
+                run_group();
+            }
+            group.push_back(kv);
+            group_size += size;
+            group_ops += ops;
+        }
+        run_group();
+        free_compute_buffer();
+
+        for (size_t i = 0; i < loras.size(); i++) {
+            loras[i]->log_applied_tensors(applied_lora_tensors[i]);
+        }
+        LOG_DEBUG("merged %lu loras in %d groups", loras.size(), n_groups);
+        return ok;
+    }
+};
+
+// Exact copies of the base weights loras are merged into. Unapplying restores the original bytes instead of
+// merging again with a negated multiplier, which drifts on quantized weights. A weight is saved the first time
+// a lora touches it, in host memory or deflated into a scratch file that is mapped for the restores.
+struct LoraWeightSnapshots {
+    struct Snapshot {
+        std::vector<uint8_t> data;  // in memory
+        size_t offset = 0;          // in the scratch file
+        size_t size   = 0;          // stored bytes in the scratch file
+        bool deflated = false;
+    };
+
+    std::string scratch_path;  // empty: keep the snapshots in memory
+    FILE* scratch_file  = NULL;
+    size_t scratch_size = 0;
+    std::map<std::string, Snapshot> snapshots;
+    std::set<std::string> modified;  // weights that differ from their snapshot
+    std::mutex mutex;
+
+    LoraWeightSnapshots(const std::string& scratch_path = "")
+        : scratch_path(scratch_path) {
+    }
+
+    ~LoraWeightSnapshots() {
+        if (scratch_file != NULL) {
+            fclose(scratch_file);
+            remove(scratch_path.c_str());
+        }
+    }
+
+    size_t stored_size() {
+        size_t size = scratch_size;
+        for (auto& kv : snapshots) {
+            size += kv.second.data.size();
+        }
+        return size;
+    }
+
+    // the bytes of a weight split into planes of byte b of every element, the sign and exponent
+    // bytes of f16/f32 weights repeat a lot and deflate much better on their own
+    static size_t element_stride(ggml_type type) {
+        if (type == GGML_TYPE_F32) {
+            return 4;
+        } else if (type == GGML_TYPE_F16 || type == GGML_TYPE_BF16) {
+            return 2;
+        }
+        return 1;
+    }
+
+    static void split_bytes(const uint8_t* src, uint8_t* dst, size_t n, size_t stride) {
+        size_t count = n / stride;
+        for (size_t b = 0; b < stride; b++) {
+            uint8_t* plane = dst + b * count;
+            for (size_t i = 0; i < count; i++) {
+                plane[i] = src[i * stride + b];
+            }
+        }
+    }
+
+    static void join_bytes(const uint8_t* src, uint8_t* dst, size_t n, size_t stride) {
+        size_t count = n / stride;
+        for (size_t b = 0; b < stride; b++) {
+            const uint8_t* plane = src + b * count;
+            for (size_t i = 0; i < count; i++) {
+                dst[i * stride + b] = plane[i];
+            }
+        }
+    }
+
+    // runs fn(i) for i in [0, n) on n_threads threads that take the next index when done,
+    // weights differ a lot in size
+    static void for_each(size_t n, int n_threads, const std::function<void(size_t)>& fn) {
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < n; i = next++) {
+                fn(i);
+            }
+        };
+        size_t n_workers = std::min<size_t>(n, std::max(n_threads, 1));
+        if (n_workers <= 1) {
+            worker();
+        } else {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < n_workers; i++) {
+                workers.emplace_back(worker);
+            }
+            for (auto& t : workers) {
+                t.join();
+            }
+        }
+    }
+
+    Snapshot save_weight(struct ggml_tensor* weight) {
+        Snapshot snapshot;
+        size_t nbytes = ggml_nbytes(weight);
+        std::vector<uint8_t> bytes(nbytes);
+        if (ggml_backend_buffer_is_host(weight->buffer)) {
+            memcpy(bytes.data(), weight->data, nbytes);
+        } else {
+            std::lock_guard<std::mutex> lock(mutex);
+            ggml_backend_tensor_get(weight, bytes.data(), 0, nbytes);
+        }
+        if (scratch_path.empty()) {
+            snapshot.data.swap(bytes);
+            return snapshot;
+        }
+
+        size_t stride = element_stride(weight->type);
+        std::vector<uint8_t> planes;
+        const uint8_t* src = bytes.data();
+        if (stride > 1 && nbytes % stride == 0) {
+            planes.resize(nbytes);
+            split_bytes(bytes.data(), planes.data(), nbytes, stride);
+            src = planes.data();
+        }
+        std::vector<uint8_t> deflated;
+        unsigned long deflated_size = 0;
+        if (nbytes <= 0xFFFFFFFFu) {
+            deflated_size = mz_compressBound((unsigned long)nbytes);
+            deflated.resize(deflated_size);
+            if (mz_compress2(deflated.data(), &deflated_size, src, (unsigned long)nbytes, 1) != 0) {
+                deflated_size = 0;
+            }
+        }
+        snapshot.deflated = deflated_size > 0 && deflated_size < nbytes;
+        const uint8_t* data = snapshot.deflated ? deflated.data() : bytes.data();
+        snapshot.size       = snapshot.deflated ? deflated_size : nbytes;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshot.offset = scratch_size;
+        if (fwrite(data, 1, snapshot.size, scratch_file) != snapshot.size) {
+            snapshot.size = 0;
+            return snapshot;
+        }
+        scratch_size += snapshot.size;
+        return snapshot;
+    }
+
+    bool restore_weight(struct ggml_tensor* weight, const Snapshot& snapshot, const uint8_t* scratch) {
+        size_t nbytes = ggml_nbytes(weight);
+        const uint8_t* src;
+        std::vector<uint8_t> bytes;
+        if (scratch == NULL) {
+            src = snapshot.data.data();
+        } else if (!snapshot.deflated) {
+            src = scratch + snapshot.offset;
+        } else {
+            std::vector<uint8_t> planes(nbytes);
+            unsigned long size = (unsigned long)nbytes;
+            if (mz_uncompress(planes.data(), &size, scratch + snapshot.offset, (unsigned long)snapshot.size) != 0 || size != nbytes) {
+                return false;
+            }
+            size_t stride = element_stride(weight->type);
+            if (stride > 1 && nbytes % stride == 0) {
+                bytes.resize(nbytes);
+                join_bytes(planes.data(), bytes.data(), nbytes, stride);
+            } else {
+                bytes.swap(planes);
+            }
+            src = bytes.data();
+        }
+        if (ggml_backend_buffer_is_host(weight->buffer)) {
+            memcpy(weight->data, src, nbytes);
+        } else {
+            std::lock_guard<std::mutex> lock(mutex);
+            ggml_backend_tensor_set(weight, src, 0, nbytes);
+        }
+        return true;
+    }
+
+    // saves the weights that have no snapshot yet and marks all of them modified, call it before merging into them
+    bool save(const std::vector<std::pair<std::string, struct ggml_tensor*>>& weights, int n_threads) {
+        std::vector<std::pair<std::string, struct ggml_tensor*>> pending;
+        for (auto& kv : weights) {
+            if (snapshots.find(kv.first) == snapshots.end()) {
+                pending.push_back(kv);
+            }
+        }
+        if (!pending.empty() && !scratch_path.empty() && scratch_file == NULL) {
+            scratch_file = fopen(scratch_path.c_str(), "wb");
+            if (scratch_file == NULL) {
+                LOG_ERROR("failed to create the lora snapshot file %s", scratch_path.c_str());
+                return false;
+            }
+        }
+
+        int64_t t0 = ggml_time_ms();
+        std::vector<Snapshot> saved(pending.size());
+        for_each(pending.size(), n_threads, [&](size_t i) {
+            saved[i] = save_weight(pending[i].second);
+        });
+        if (scratch_file != NULL) {
+            fflush(scratch_file);
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (!scratch_path.empty() && saved[i].size == 0) {
+                LOG_ERROR("failed to write the lora snapshot of %s to %s", pending[i].first.c_str(), scratch_path.c_str());
+                return false;
+            }
+            snapshots[pending[i].first].data.swap(saved[i].data);
+            snapshots[pending[i].first].offset   = saved[i].offset;
+            snapshots[pending[i].first].size     = saved[i].size;
+            snapshots[pending[i].first].deflated = saved[i].deflated;
+        }
+        for (auto& kv : weights) {
+            modified.insert(kv.first);
+        }
+        if (!pending.empty()) {
+            LOG_DEBUG("saved %lu lora base weights, %.2f MB stored, taking %.2fs",
+                      pending.size(), stored_size() / 1024.0 / 1024.0, (ggml_time_ms() - t0) / 1000.f);
+        }
+        return true;
+    }
+
+    // puts the original bytes back into every modified weight
+    bool restore(const std::map<std::string, struct ggml_tensor*>& model_tensors, int n_threads) {
+        if (modified.empty()) {
+            return true;
+        }
+        MmapFile scratch;
+        if (!scratch_path.empty() && !scratch.open(scratch_path)) {
+            LOG_ERROR("failed to map the lora snapshot file %s", scratch_path.c_str());
+            return false;
+        }
+
+        std::vector<std::string> names(modified.begin(), modified.end());
+        std::vector<uint8_t> restored(names.size(), 0);
+        for_each(names.size(), n_threads, [&](size_t i) {
+            auto it       = model_tensors.find(names[i]);
+            auto snapshot = snapshots.find(names[i]);
+            if (it == model_tensors.end() || snapshot == snapshots.end() ||
+                !restore_weight(it->second, snapshot->second, scratch.data())) {
+                LOG_ERROR("failed to restore the lora base weight %s", names[i].c_str());
+                return;
+            }
+            restored[i] = 1;
+        });
+        // the weights that failed stay modified so the next restore retries them
+        bool ok = true;
+        for (size_t i = 0; i < names.size(); i++) {
+            if (restored[i]) {
+                modified.erase(names[i]);
+            } else {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+};
+
 #endif  // __LORA_HPP__
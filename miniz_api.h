@@ -0,0 +1,75 @@
+#ifndef __MINIZ_API_H__
+#define __MINIZ_API_H__
+
+#include <stddef.h>
+
+// declarations of the miniz api compiled into the zip target, miniz.h carries its
+// implementation so every other translation unit includes this instead
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned long mz_ulong;
+
+#define MZ_CRC32_INIT (0)
+
+enum {
+    MZ_DEFAULT_COMPRESSION = -1
+};
+
+enum {
+    MZ_NO_FLUSH = 0,
+    MZ_FINISH   = 4
+};
+
+enum {
+    MZ_OK         = 0,
+    MZ_STREAM_END = 1,
+    MZ_BUF_ERROR  = -5
+};
+
+typedef void* (*mz_alloc_func)(void* opaque, size_t items, size_t size);
+typedef void (*mz_free_func)(void* opaque, void* address);
+
+struct mz_internal_state;
+
+// same layout as in miniz.h
+typedef struct mz_stream_s {
+    const unsigned char* next_in;
+    unsigned int avail_in;
+    mz_ulong total_in;
+
+    unsigned char* next_out;
+    unsigned int avail_out;
+    mz_ulong total_out;
+
+    char* msg;
+    struct mz_internal_state* state;
+
+    mz_alloc_func zalloc;
+    mz_free_func zfree;
+    void* opaque;
+
+    int data_type;
+    mz_ulong adler;
+    mz_ulong reserved;
+} mz_stream;
+
+typedef mz_stream* mz_streamp;
+
+mz_ulong mz_crc32(mz_ulong crc, const unsigned char* ptr, size_t buf_len);
+
+int mz_deflateInit(mz_streamp pStream, int level);
+int mz_deflate(mz_streamp pStream, int flush);
+int mz_deflateEnd(mz_streamp pStream);
+
+mz_ulong mz_compressBound(mz_ulong source_len);
+int mz_compress2(unsigned char* pDest, mz_ulong* pDest_len, const unsigned char* pSource, mz_ulong source_len, int level);
+int mz_uncompress(unsigned char* pDest, mz_ulong* pDest_len, const unsigned char* pSource, mz_ulong source_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __MINIZ_API_H__
@@ -1,8 +1,12 @@
 #include <stdarg.h>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -19,6 +23,8 @@
 #include "imatrix.hpp"
 #include "stable-diffusion.h"
 
+#include <sys/stat.h>
+
 #ifdef SD_USE_METAL
 #include "ggml-metal.h"
 #endif
@@ -28,6 +34,9 @@
 #endif
 
 #define ST_HEADER_SIZE_LEN 8
+// host memory the load workers share for reading and converting tensors,
+// a tensor that needs more than this is still loaded, alone
+#define LOAD_SCRATCH_BUDGET ((size_t)1024 * 1024 * 1024)
 
 static IMatrixCollector imatrix_collector;
 
@@ -826,7 +835,7 @@ void convert_tensor(void* src,
                     ggml_type dst_type,
                     int nrows,
                     int n_per_row,
-                    std::vector<float> imatrix = {}) {
+                    std::vector<float> imatrix) {
     int n = nrows * n_per_row;
     if (src_type == dst_type) {
         size_t nbytes = n * ggml_type_size(src_type) / ggml_blck_size(src_type);
@@ -1026,6 +1035,10 @@ bool ModelLoader::init_from_gguf_file(const std::string& file_path, const std::s
         return false;
     }
 
+    if (gguf_find_key(ctx_gguf_, SD_TINY_MODEL_KEY) >= 0) {
+        tensor_storages_types[SD_TINY_MODEL_KEY] = GGML_TYPE_COUNT;
+    }
+
     int n_tensors = gguf_get_n_tensors(ctx_gguf_);
 
     size_t total_size  = 0;
@@ -1872,7 +1885,7 @@ std::vector<TensorStorage> remove_duplicates(const std::vector<TensorStorage>& v
     return res;
 }
 
-bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend) {
+std::vector<TensorStorage> ModelLoader::get_processed_tensor_storages() {
     std::vector<TensorStorage> processed_tensor_storages;
     for (auto& tensor_storage : tensor_storages) {
         // LOG_DEBUG("%s", name.c_str());
@@ -1883,8 +1896,171 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
 
         preprocess_tensor(tensor_storage, processed_tensor_storages);
     }
-    std::vector<TensorStorage> dedup = remove_duplicates(processed_tensor_storages);
-    processed_tensor_storages        = dedup;
+    return remove_duplicates(processed_tensor_storages);
+}
+
+/*================================================= Mapped model files ==================================================*/
+
+MappedModelFile::~MappedModelFile() {
+    if (buffer != NULL) {
+        ggml_backend_buffer_free(buffer);
+    }
+}
+
+bool ModelLoader::is_mmap_enabled() {
+    bool enable_mmap        = use_mmap;
+    const char* SD_USE_MMAP = getenv("SD_USE_MMAP");
+    if (SD_USE_MMAP != nullptr) {
+        std::string sd_use_mmap_str = SD_USE_MMAP;
+        if (sd_use_mmap_str == "ON" || sd_use_mmap_str == "TRUE") {
+            enable_mmap = true;
+        } else if (sd_use_mmap_str == "OFF" || sd_use_mmap_str == "FALSE") {
+            enable_mmap = false;
+        } else {
+            LOG_WARN("SD_USE_MMAP environment variable has unexpected value. Ignoring it. (Expected \"ON\"/\"TRUE\" or\"OFF\"/\"FALSE\", got \"%s\")", SD_USE_MMAP);
+        }
+    }
+    return enable_mmap;
+}
+
+std::shared_ptr<MappedModelFile> ModelLoader::get_mapped_file(size_t file_index) {
+    auto it = mapped_files_.find(file_index);
+    if (it != mapped_files_.end()) {
+        return it->second;
+    }
+
+    // gguf and safetensors store raw tensor data, the zip entries of ckpt files can't be used in place
+    bool is_zip = false;
+    for (auto& tensor_storage : tensor_storages) {
+        if (tensor_storage.file_index == file_index && tensor_storage.index_in_zip >= 0) {
+            is_zip = true;
+            break;
+        }
+    }
+
+    std::shared_ptr<MappedModelFile> mapped_file;
+    if (file_index < file_paths_.size() && !is_zip && is_mmap_enabled()) {
+        const std::string& file_path = file_paths_[file_index];
+        mapped_file                  = std::make_shared<MappedModelFile>();
+        mapped_file->file            = std::make_shared<MmapFile>();
+        if (mapped_file->file->open(file_path)) {
+            LOG_DEBUG("using mmap for %s", file_path.c_str());
+        } else {
+            LOG_WARN("failed to mmap '%s', falling back to buffered reads", file_path.c_str());
+            mapped_file.reset();
+        }
+    }
+    mapped_files_[file_index] = mapped_file;
+    return mapped_file;
+}
+
+bool ModelLoader::is_bound_tensor(const ggml_tensor* tensor) {
+    if (tensor->buffer == NULL) {
+        return false;
+    }
+    for (auto& kv : mapped_files_) {
+        if (kv.second && kv.second->buffer == tensor->buffer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t ModelLoader::bind_mapped_tensors(const std::map<std::string, struct ggml_tensor*>& tensors) {
+    if (!is_mmap_enabled()) {
+        return 0;
+    }
+    size_t bound_size = 0;
+    int n_bound       = 0;
+    int n_unaligned   = 0;
+    for (auto& tensor_storage : get_processed_tensor_storages()) {
+        auto it = tensors.find(tensor_storage.name);
+        if (it == tensors.end()) {
+            continue;
+        }
+        ggml_tensor* tensor = it->second;
+        // converted, bf16 and f8 tensors need memory of their own
+        if (tensor->buffer != NULL || tensor->data != NULL || tensor->view_src != NULL ||
+            tensor->type != tensor_storage.type ||
+            tensor_storage.is_bf16 || tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2 ||
+            tensor->ne[0] != tensor_storage.ne[0] || tensor->ne[1] != tensor_storage.ne[1] ||
+            tensor->ne[2] != tensor_storage.ne[2] || tensor->ne[3] != tensor_storage.ne[3]) {
+            continue;
+        }
+        std::shared_ptr<MappedModelFile> mapped_file = get_mapped_file(tensor_storage.file_index);
+        size_t nbytes                                = ggml_nbytes(tensor);
+        if (!mapped_file || tensor_storage.offset + nbytes > mapped_file->file->size()) {
+            continue;
+        }
+        if (mapped_file->buffer == NULL) {
+            mapped_file->buffer = ggml_backend_cpu_buffer_from_ptr(mapped_file->file->data(), mapped_file->file->size());
+            if (mapped_file->buffer == NULL) {
+                continue;
+            }
+        }
+        uint8_t* data = mapped_file->file->data() + tensor_storage.offset;
+        // safetensors does not align its tensor data, those tensors are copied
+        if ((uintptr_t)data % ggml_backend_buffer_get_alignment(mapped_file->buffer) != 0) {
+            n_unaligned++;
+            continue;
+        }
+        ggml_backend_tensor_alloc(mapped_file->buffer, tensor, data);
+        mapped_file->has_bound_tensors = true;
+        bound_size += nbytes;
+        n_bound++;
+    }
+    LOG_DEBUG("%d tensors (%.2f MB) bound to the mapped model files, %d unaligned ones are copied",
+              n_bound, bound_size / (1024.0 * 1024.0), n_unaligned);
+    return bound_size;
+}
+
+std::vector<std::shared_ptr<MappedModelFile>> ModelLoader::get_mapped_files() {
+    std::vector<std::shared_ptr<MappedModelFile>> files;
+    for (auto& kv : mapped_files_) {
+        if (kv.second && kv.second->has_bound_tensors) {
+            files.push_back(kv.second);
+        }
+    }
+    return files;
+}
+
+// bytes of read and convert buffers the load workers hold together, a worker keeps its buffers
+// between tensors unless another one is waiting for room
+class LoadScratchBudget {
+public:
+    explicit LoadScratchBudget(size_t limit)
+        : limit(limit) {}
+
+    // blocks until n more bytes fit, a request over the limit waits until nothing else is held
+    void acquire(size_t n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting++;
+        cv.wait(lock, [&]() { return used == 0 || used + n <= limit; });
+        waiting--;
+        used += n;
+    }
+
+    void release(size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= n;
+        cv.notify_all();
+    }
+
+    bool has_waiters() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return waiting > 0;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t limit;
+    size_t used = 0;
+    int waiting = 0;
+};
+
+bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend) {
+    std::vector<TensorStorage> processed_tensor_storages = get_processed_tensor_storages();
 
     bool success = true;
     for (size_t file_index = 0; file_index < file_paths_.size(); file_index++) {
@@ -1917,10 +2093,18 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
         }
 
-        std::vector<uint8_t> read_buffer;
-        std::vector<uint8_t> convert_buffer;
+        // tensor data is used straight from the page cache when the file is mapped
+        std::shared_ptr<MappedModelFile> mapped_file = get_mapped_file(file_index);
+
+        // returns NULL if the tensor is not available from the mapping
+        auto mapped_data = [&](const TensorStorage& tensor_storage, size_t n) -> uint8_t* {
+            if (!mapped_file || tensor_storage.offset + n > mapped_file->file->size()) {
+                return NULL;
+            }
+            return mapped_file->file->data() + tensor_storage.offset;
+        };
 
-        auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
+        auto read_data = [&](const TensorStorage& tensor_storage, std::ifstream& file, std::vector<uint8_t>& read_buffer, char* buf, size_t n) {
             if (zip != NULL) {
                 zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
                 size_t entry_size = zip_entry_size(zip);
@@ -1932,6 +2116,8 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
                     zip_entry_noallocread(zip, (void*)buf, n);
                 }
                 zip_entry_close(zip);
+            } else if (uint8_t* src = mapped_data(tensor_storage, n)) {
+                memcpy((void*)buf, (void*)src, n);
             } else {
                 file.seekg(tensor_storage.offset);
                 file.read(buf, n);
@@ -1942,84 +2128,76 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
             return true;
         };
-        int tensor_count = 0;
-        int64_t t1       = ggml_time_ms();
-        for (auto& tensor_storage : processed_tensor_storages) {
-            if (tensor_storage.file_index != file_index) {
-                ++tensor_count;
-                continue;
-            }
-            ggml_tensor* dst_tensor = NULL;
 
-            success = on_new_tensor_cb(tensor_storage, &dst_tensor);
-            if (!success) {
-                LOG_WARN("process tensor failed: '%s'", tensor_storage.name.c_str());
-                break;
-            }
+        // bf16 and f8 tensors are expanded inplace, so they always need a writable copy
+        auto needs_expansion = [](const TensorStorage& tensor_storage) {
+            return tensor_storage.is_bf16 || tensor_storage.is_f8_e4m3 || tensor_storage.is_f8_e5m2;
+        };
 
-            if (dst_tensor == NULL) {
-                ++tensor_count;
-                continue;
+        auto expand_inplace = [](const TensorStorage& tensor_storage, void* data) {
+            if (tensor_storage.is_bf16) {
+                bf16_to_f32_vec((uint16_t*)data, (float*)data, tensor_storage.nelements());
+            } else if (tensor_storage.is_f8_e4m3) {
+                f8_e4m3_to_f16_vec((uint8_t*)data, (uint16_t*)data, tensor_storage.nelements());
+            } else if (tensor_storage.is_f8_e5m2) {
+                f8_e5m2_to_f16_vec((uint8_t*)data, (uint16_t*)data, tensor_storage.nelements());
             }
+        };
 
+        // the backend may not support concurrent uploads
+        std::mutex backend_mutex;
+
+        auto load_tensor = [&](const TensorStorage& tensor_storage,
+                               ggml_tensor* dst_tensor,
+                               std::ifstream& file,
+                               std::vector<uint8_t>& read_buffer,
+                               std::vector<uint8_t>& convert_buffer) -> bool {
             size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+            uint8_t* src_data     = needs_expansion(tensor_storage) ? NULL : mapped_data(tensor_storage, nbytes_to_read);
+            if (src_data != NULL && dst_tensor->data == src_data) {
+                // bound by bind_mapped_tensors, the data is already in place
+                return true;
+            }
 
             if (dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer)) {
                 // for the CPU and Metal backend, we can copy directly into the tensor
                 if (tensor_storage.type == dst_tensor->type) {
                     GGML_ASSERT(ggml_nbytes(dst_tensor) == tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)dst_tensor->data, nbytes_to_read);
-
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e4m3) {
-                        // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e5m2) {
-                        // inplace op
-                        f8_e5m2_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements());
+                    if (!read_data(tensor_storage, file, read_buffer, (char*)dst_tensor->data, nbytes_to_read)) {
+                        return false;
                     }
+                    expand_inplace(tensor_storage, dst_tensor->data);
                 } else {
-                    read_buffer.resize(tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e4m3) {
-                        // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                    } else if (tensor_storage.is_f8_e5m2) {
-                        // inplace op
-                        f8_e5m2_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
+                    if (src_data == NULL) {
+                        read_buffer.resize(tensor_storage.nbytes());
+                        if (!read_data(tensor_storage, file, read_buffer, (char*)read_buffer.data(), nbytes_to_read)) {
+                            return false;
+                        }
+                        src_data = read_buffer.data();
+                        expand_inplace(tensor_storage, src_data);
                     }
 
                     auto processed_name = convert_tensor_name(tensor_storage.name);
                     // LOG_DEBUG("%s",processed_name.c_str());
                     std::vector<float> imatrix = imatrix_collector.get_values(processed_name);
 
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type, dst_tensor->data,
+                    convert_tensor((void*)src_data, tensor_storage.type, dst_tensor->data,
                                    dst_tensor->type, (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0], imatrix);
                 }
             } else {
-                read_buffer.resize(tensor_storage.nbytes());
-                read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
-                if (tensor_storage.is_bf16) {
-                    // inplace op
-                    bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
-                } else if (tensor_storage.is_f8_e4m3) {
-                    // inplace op
-                    f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
-                } else if (tensor_storage.is_f8_e5m2) {
-                    // inplace op
-                    f8_e5m2_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
+                if (src_data == NULL) {
+                    read_buffer.resize(tensor_storage.nbytes());
+                    if (!read_data(tensor_storage, file, read_buffer, (char*)read_buffer.data(), nbytes_to_read)) {
+                        return false;
+                    }
+                    src_data = read_buffer.data();
+                    expand_inplace(tensor_storage, src_data);
                 }
 
                 if (tensor_storage.type == dst_tensor->type) {
                     // copy to device memory
-                    ggml_backend_tensor_set(dst_tensor, read_buffer.data(), 0, ggml_nbytes(dst_tensor));
+                    std::lock_guard<std::mutex> lock(backend_mutex);
+                    ggml_backend_tensor_set(dst_tensor, src_data, 0, ggml_nbytes(dst_tensor));
                 } else {
                     // convert first, then copy to device memory
                     auto processed_name = convert_tensor_name(tensor_storage.name);
@@ -2027,15 +2205,134 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
                     std::vector<float> imatrix = imatrix_collector.get_values(processed_name);
 
                     convert_buffer.resize(ggml_nbytes(dst_tensor));
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type,
+                    convert_tensor((void*)src_data, tensor_storage.type,
                                    (void*)convert_buffer.data(), dst_tensor->type,
                                    (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0], imatrix);
+                    std::lock_guard<std::mutex> lock(backend_mutex);
                     ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
                 }
             }
-            int64_t t2 = ggml_time_ms();
-            pretty_progress(++tensor_count, processed_tensor_storages.size(), (t2 - t1) / 1000.0f);
-            t1 = t2;
+            return true;
+        };
+
+        // host memory load_tensor needs besides the destination, the zip path is single threaded and not counted
+        auto scratch_size = [&](const TensorStorage& tensor_storage, ggml_tensor* dst_tensor) -> size_t {
+            size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+            uint8_t* src_data     = needs_expansion(tensor_storage) ? NULL : mapped_data(tensor_storage, nbytes_to_read);
+            bool on_host          = dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer);
+            if (on_host && tensor_storage.type == dst_tensor->type) {
+                return 0;
+            }
+            size_t size = src_data == NULL ? tensor_storage.nbytes() : 0;
+            if (!on_host && tensor_storage.type != dst_tensor->type) {
+                size += ggml_nbytes(dst_tensor);
+            }
+            return size;
+        };
+
+        // resolve the destination tensors first, callbacks are not required to be thread safe
+        std::vector<std::pair<const TensorStorage*, ggml_tensor*>> tensors_to_load;
+        int tensor_count = 0;
+        for (auto& tensor_storage : processed_tensor_storages) {
+            if (tensor_storage.file_index != file_index) {
+                ++tensor_count;
+                continue;
+            }
+            ggml_tensor* dst_tensor = NULL;
+
+            success = on_new_tensor_cb(tensor_storage, &dst_tensor);
+            if (!success) {
+                LOG_WARN("process tensor failed: '%s'", tensor_storage.name.c_str());
+                break;
+            }
+
+            if (dst_tensor == NULL) {
+                ++tensor_count;
+                continue;
+            }
+            tensors_to_load.push_back(std::make_pair(&tensor_storage, dst_tensor));
+        }
+
+        if (success) {
+            // zip entries have to be read sequentially
+            int n_workers = n_threads > 0 ? n_threads : get_num_physical_cores();
+            if (zip != NULL || n_workers < 1) {
+                n_workers = 1;
+            }
+            n_workers = std::min(n_workers, (int)tensors_to_load.size());
+
+            std::atomic<size_t> next_tensor(0);
+            std::atomic<bool> failed(false);
+            std::mutex progress_mutex;
+            LoadScratchBudget scratch_budget(LOAD_SCRATCH_BUDGET);
+            int64_t t1 = ggml_time_ms();
+
+            auto worker = [&]() {
+                std::ifstream worker_file;
+                if (zip == NULL) {
+                    worker_file.open(file_path, std::ios::binary);
+                    if (!worker_file.is_open()) {
+                        LOG_ERROR("failed to open '%s'", file_path.c_str());
+                        failed = true;
+                        return;
+                    }
+                }
+                std::vector<uint8_t> read_buffer;
+                std::vector<uint8_t> convert_buffer;
+                size_t reserved   = 0;
+                auto free_scratch = [&]() {
+                    std::vector<uint8_t>().swap(read_buffer);
+                    std::vector<uint8_t>().swap(convert_buffer);
+                    scratch_budget.release(reserved);
+                    reserved = 0;
+                };
+                while (!failed) {
+                    size_t i = next_tensor++;
+                    if (i >= tensors_to_load.size()) {
+                        break;
+                    }
+                    const TensorStorage& tensor_storage = *tensors_to_load[i].first;
+                    size_t scratch                      = scratch_size(tensor_storage, tensors_to_load[i].second);
+                    if (scratch > reserved) {
+                        free_scratch();
+                        scratch_budget.acquire(scratch);
+                        reserved = scratch;
+                    }
+                    try {
+                        if (!load_tensor(tensor_storage, tensors_to_load[i].second, worker_file, read_buffer, convert_buffer)) {
+                            failed = true;
+                            break;
+                        }
+                    } catch (const std::exception& e) {
+                        LOG_ERROR("load tensor '%s' failed: %s", tensor_storage.name.c_str(), e.what());
+                        failed = true;
+                        break;
+                    }
+                    if (reserved > 0 && scratch_budget.has_waiters()) {
+                        free_scratch();
+                    }
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    int64_t t2 = ggml_time_ms();
+                    pretty_progress(++tensor_count, processed_tensor_storages.size(), (t2 - t1) / 1000.0f);
+                    t1 = t2;
+                }
+                free_scratch();
+            };
+
+            if (n_workers <= 1) {
+                worker();
+            } else {
+                std::vector<std::thread> workers;
+                for (int i = 0; i < n_workers; i++) {
+                    workers.emplace_back(worker);
+                }
+                for (auto& t : workers) {
+                    t.join();
+                }
+            }
+            if (failed) {
+                success = false;
+            }
         }
 
         if (zip != NULL) {
@@ -2049,10 +2346,173 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
     return success;
 }
 
+/*================================================= Converted weights cache ==================================================*/
+
+// size, mtime and a sampled content hash, cheap enough for multi-GB checkpoints
+static bool get_file_fingerprint(const std::string& file_path, uint64_t& fingerprint) {
+    struct stat st;
+    if (stat(file_path.c_str(), &st) != 0) {
+        return false;
+    }
+    std::ifstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    uint64_t file_size  = (uint64_t)st.st_size;
+    int64_t mtime       = (int64_t)st.st_mtime;
+    uint64_t hash       = fnv1a_64(&file_size, sizeof(file_size));
+    hash                = fnv1a_64(&mtime, sizeof(mtime), hash);
+    const size_t header = 1024 * 1024;  // covers the gguf/safetensors metadata
+    const size_t block  = 64 * 1024;
+    const int n_blocks  = 16;
+    std::vector<char> buf(header);
+    file.read(buf.data(), std::min<uint64_t>(header, file_size));
+    hash = fnv1a_64(buf.data(), (size_t)file.gcount(), hash);
+    if (file_size > header + block) {
+        for (int i = 1; i <= n_blocks; i++) {
+            uint64_t offset = header + (file_size - header - block) / n_blocks * i;
+            file.clear();
+            file.seekg(offset);
+            file.read(buf.data(), block);
+            hash = fnv1a_64(buf.data(), (size_t)file.gcount(), hash);
+        }
+    }
+    fingerprint = hash;
+    return true;
+}
+
+std::string ModelLoader::get_cache_file_path(const std::map<std::string, struct ggml_tensor*>& tensors) {
+    std::string dir = cache_dir;
+    if (dir.empty()) {
+        const char* SD_WEIGHT_CACHE_DIR = getenv("SD_WEIGHT_CACHE_DIR");
+        if (SD_WEIGHT_CACHE_DIR != nullptr) {
+            dir = SD_WEIGHT_CACHE_DIR;
+        }
+    }
+    if (dir.empty()) {
+        return "";
+    }
+    if (!is_directory(dir)) {
+        LOG_WARN("weight cache directory '%s' does not exist, caching disabled", dir.c_str());
+        return "";
+    }
+
+    uint64_t hash = fnv1a_64("sd-weight-cache-v1", 18);
+    for (auto& file_path : file_paths_) {
+        uint64_t fingerprint;
+        if (!get_file_fingerprint(file_path, fingerprint)) {
+            return "";
+        }
+        hash = fnv1a_64(&fingerprint, sizeof(fingerprint), hash);
+    }
+    // destination names carry the prefixes, destination types the wtype overrides
+    for (auto& pair : tensors) {
+        const ggml_tensor* tensor = pair.second;
+        hash                      = fnv1a_64(pair.first, hash);
+        int32_t type              = tensor->type;
+        hash                      = fnv1a_64(&type, sizeof(type), hash);
+        hash                      = fnv1a_64(tensor->ne, sizeof(tensor->ne), hash);
+    }
+    uint64_t imatrix_hash = imatrix_collector.get_hash();
+    hash                  = fnv1a_64(&imatrix_hash, sizeof(imatrix_hash), hash);
+
+    return path_join(dir, format("%016llx.gguf", (unsigned long long)hash));
+}
+
+bool ModelLoader::save_tensors_to_cache(const std::string& file_path,
+                                        const std::map<std::string, struct ggml_tensor*>& tensors,
+                                        const std::set<std::string>& tensor_names) {
+    std::vector<std::pair<std::string, ggml_tensor*>> tensors_to_save;
+    for (auto& pair : tensors) {
+        if (tensor_names.find(pair.first) == tensor_names.end()) {
+            continue;
+        }
+        // tensors like alphas_cumprod live in a plain ggml context, not in a backend buffer
+        if (pair.second->buffer == NULL && pair.second->data == NULL) {
+            LOG_DEBUG("tensor '%s' has no data, not cached", pair.first.c_str());
+            continue;
+        }
+        tensors_to_save.push_back(pair);
+    }
+
+    // tensors in the runners are not named, so write the metadata from named copies
+    ggml_context* meta_ctx = ggml_init({tensors_to_save.size() * ggml_tensor_overhead(), NULL, true});
+    gguf_context* gguf_ctx = gguf_init_empty();
+    for (auto& pair : tensors_to_save) {
+        ggml_tensor* real   = pair.second;
+        ggml_tensor* tensor = ggml_new_tensor(meta_ctx, real->type, ggml_n_dims(real), real->ne);
+        ggml_set_name(tensor, pair.first.c_str());
+        gguf_add_tensor(gguf_ctx, tensor);
+    }
+
+    // write to a temporary file first, so that a concurrent start never sees a partial cache
+    std::string tmp_path = file_path + format(".%lld.tmp", (long long)ggml_time_us());
+    bool success         = gguf_write_to_file(gguf_ctx, tmp_path.c_str(), true);
+    gguf_free(gguf_ctx);
+    ggml_free(meta_ctx);
+
+    if (success) {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::app);
+        std::vector<char> buf;
+        for (auto& pair : tensors_to_save) {
+            ggml_tensor* real = pair.second;
+            size_t nbytes     = ggml_nbytes(real);
+            buf.resize(GGML_PAD(nbytes, GGUF_DEFAULT_ALIGNMENT));
+            if (real->buffer != NULL) {
+                ggml_backend_tensor_get(real, buf.data(), 0, nbytes);
+            } else {
+                memcpy(buf.data(), real->data, nbytes);
+            }
+            memset(buf.data() + nbytes, 0, buf.size() - nbytes);
+            file.write(buf.data(), buf.size());
+        }
+        file.close();
+        success = !file.fail();
+    }
+
+    if (success) {
+        std::remove(file_path.c_str());
+        success = std::rename(tmp_path.c_str(), file_path.c_str()) == 0;
+    }
+    if (!success) {
+        LOG_WARN("failed to write weight cache '%s'", file_path.c_str());
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    LOG_INFO("converted weights cached to '%s'", file_path.c_str());
+    return true;
+}
+
 bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                                ggml_backend_t backend,
                                std::set<std::string> ignore_tensors) {
+    std::string cache_file_path = get_cache_file_path(tensors);
+    if (!cache_file_path.empty() && file_exists(cache_file_path)) {
+        LOG_INFO("loading converted weights from cache '%s'", cache_file_path.c_str());
+        ModelLoader cache_loader;
+        cache_loader.set_use_mmap(use_mmap);
+        cache_loader.set_n_threads(n_threads);
+        // tensors bound to the model files already hold the same bytes, they are skipped quietly
+        std::map<std::string, struct ggml_tensor*> cached_tensors;
+        std::set<std::string> cache_ignore_tensors = ignore_tensors;
+        for (auto& pair : tensors) {
+            if (is_bound_tensor(pair.second)) {
+                cache_ignore_tensors.insert(pair.first);
+            } else {
+                cached_tensors.insert(pair);
+            }
+        }
+        if (cache_loader.init_from_file(cache_file_path) &&
+            cache_loader.load_tensors(cached_tensors, backend, cache_ignore_tensors)) {
+            return true;
+        }
+        LOG_WARN("weight cache '%s' is unusable, removing it", cache_file_path.c_str());
+        std::remove(cache_file_path.c_str());
+        cache_file_path.clear();
+    }
+
     std::set<std::string> tensor_names_in_file;
+    bool needs_conversion = false;
     auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
         // LOG_DEBUG("%s", tensor_storage.to_string().c_str());
@@ -2085,6 +2545,10 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
             return false;
         }
 
+        if (real->type != tensor_storage.type) {
+            needs_conversion = true;
+        }
+
         *dst_tensor = real;
 
         return true;
@@ -2119,6 +2583,11 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
     if (some_tensor_not_init) {
         return false;
     }
+
+    // only worth it when the weights did not come out of the file as they are
+    if (!cache_file_path.empty() && needs_conversion) {
+        save_tensors_to_cache(cache_file_path, tensors, tensor_names_in_file);
+    }
     return true;
 }
 
@@ -2162,6 +2631,9 @@ bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type
     ggml_context* ggml_ctx = ggml_init({mem_size, NULL, false});
 
     gguf_context* gguf_ctx = gguf_init_empty();
+    if (is_tiny_model(tensor_storages_types)) {
+        gguf_set_val_bool(gguf_ctx, SD_TINY_MODEL_KEY, true);
+    }
 
     auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
@@ -17,6 +17,11 @@
 #include "zip.h"
 
 #define SD_MAX_DIMS 5
+// gguf key of the random weight models of sd-tiny-model. the loader puts it into tensor_storages_types,
+// only then the runners take their block counts from the tensor names
+#define SD_TINY_MODEL_KEY "sd.tiny_model"
+
+class MmapFile;
 
 enum SDVersion {
     VERSION_SD1,
@@ -99,6 +104,10 @@ static bool sd_version_use_concat(SDVersion version) {
     return sd_version_is_edit(version) || sd_version_is_inpaint(version)|| sd_version_is_control(version);
 }
 
+static inline bool is_tiny_model(const std::map<std::string, enum ggml_type>& tensor_types) {
+    return tensor_types.find(SD_TINY_MODEL_KEY) != tensor_types.end();
+}
+
 enum PMVersion {
     PM_VERSION_1,
     PM_VERSION_2,
@@ -207,11 +216,27 @@ struct TensorStorage {
 
 typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_cb_t;
 
+// a model file mapped copy-on-write, tensors of cpu runners can be bound straight into it.
+// whoever uses those tensors has to keep it alive, see ModelLoader::get_mapped_files
+struct MappedModelFile {
+    std::shared_ptr<MmapFile> file;
+    ggml_backend_buffer_t buffer = NULL;  // cpu buffer over the whole mapping
+    bool has_bound_tensors       = false;
+
+    ~MappedModelFile();
+};
+
 class ModelLoader {
 protected:
     std::vector<std::string> file_paths_;
     std::vector<TensorStorage> tensor_storages;
 
+    bool use_mmap = false;
+    int n_threads = 0;  // <= 0: number of physical cores
+    std::string cache_dir;
+    // by file index, opened on first use, NULL if the file can't be mapped
+    std::map<size_t, std::shared_ptr<MappedModelFile>> mapped_files_;
+
     bool parse_data_pkl(uint8_t* buffer,
                         size_t buffer_size,
                         zip_t* zip,
@@ -224,6 +249,16 @@ protected:
     bool init_from_ckpt_file(const std::string& file_path, const std::string& prefix = "");
     bool init_from_diffusers_file(const std::string& file_path, const std::string& prefix = "");
 
+    bool is_mmap_enabled();
+    std::shared_ptr<MappedModelFile> get_mapped_file(size_t file_index);
+    bool is_bound_tensor(const ggml_tensor* tensor);
+    std::vector<TensorStorage> get_processed_tensor_storages();
+
+    std::string get_cache_file_path(const std::map<std::string, struct ggml_tensor*>& tensors);
+    bool save_tensors_to_cache(const std::string& file_path,
+                               const std::map<std::string, struct ggml_tensor*>& tensors,
+                               const std::set<std::string>& tensor_names);
+
 public:
     std::map<std::string, enum ggml_type> tensor_storages_types;
 
@@ -235,6 +270,17 @@ public:
     ggml_type get_diffusion_model_wtype();
     ggml_type get_vae_wtype();
     void set_wtype_override(ggml_type wtype, std::string prefix = "");
+    void set_use_mmap(bool enable) { use_mmap = enable; }
+    // loader workers, each one holds read/convert buffers for the tensor it loads, together
+    // they are kept under LOAD_SCRATCH_BUDGET (model.cpp)
+    void set_n_threads(int n) { n_threads = n; }
+    // converted weights are cached as gguf in this directory, SD_WEIGHT_CACHE_DIR if empty
+    void set_cache_dir(const std::string& dir) { cache_dir = dir; }
+    // with mmap, points the tensors that need no conversion into the mapped files instead of a params
+    // buffer, call it before the params buffer is allocated. returns the number of bytes bound
+    size_t bind_mapped_tensors(const std::map<std::string, struct ggml_tensor*>& tensors);
+    // the mappings bound tensors point into, they have to outlive this loader as long as the tensors are used
+    std::vector<std::shared_ptr<MappedModelFile>> get_mapped_files();
     bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       ggml_backend_t backend,
@@ -249,4 +295,14 @@ public:
     static std::string load_t5_tokenizer_json();
 };
 
+// host side conversions of the loader, bf16_to_f32_vec works in place
+void bf16_to_f32_vec(uint16_t* src, float* dst, int64_t n);
+void convert_tensor(void* src,
+                    ggml_type src_type,
+                    void* dst,
+                    ggml_type dst_type,
+                    int nrows,
+                    int n_per_row,
+                    std::vector<float> imatrix = {});
+
 #endif  // __MODEL_H__
@@ -2,226 +2,213 @@
 #define __PREPROCESSING_HPP__
 
 #include "ggml_extend.hpp"
+#include "image_ops.h"
 #define M_PI_ 3.14159265358979323846
 
-void convolve(struct ggml_tensor* input, struct ggml_tensor* output, struct ggml_tensor* kernel, int padding) {
-    struct ggml_init_params params;
-    params.mem_size                 = 20 * 1024 * 1024;  // 10
-    params.mem_buffer               = NULL;
-    params.no_alloc                 = false;
-    struct ggml_context* ctx0       = ggml_init(params);
-    struct ggml_tensor* kernel_fp16 = ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, kernel->ne[0], kernel->ne[1], 1, 1);
-    ggml_fp32_to_fp16_row((float*)kernel->data, (ggml_fp16_t*)kernel_fp16->data, ggml_nelements(kernel));
-    ggml_tensor* h  = ggml_conv_2d(ctx0, kernel_fp16, input, 1, 1, padding, padding, 1, 1);
-    ggml_cgraph* gf = ggml_new_graph(ctx0);
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, h, output));
-    ggml_graph_compute_with_ctx(ctx0, gf, 1);
-    ggml_free(ctx0);
-}
-
-void gaussian_kernel(struct ggml_tensor* kernel) {
-    int ks_mid   = kernel->ne[0] / 2;
-    float sigma  = 1.4f;
-    float normal = 1.f / (2.0f * M_PI_ * powf(sigma, 2.0f));
-    for (int y = 0; y < kernel->ne[0]; y++) {
-        float gx = -ks_mid + y;
-        for (int x = 0; x < kernel->ne[1]; x++) {
-            float gy = -ks_mid + x;
-            float k_ = expf(-((gx * gx + gy * gy) / (2.0f * powf(sigma, 2.0f)))) * normal;
-            ggml_tensor_set_f32(kernel, k_, x, y);
-        }
+// Canny edge detection on planes of floats, row by row over threads. Borders are zero padded like the
+// convolutions it replaces, every stage writes a new plane so rows can be processed independently.
+
+// 5x5 gaussian (sigma 1.4) as two 1d passes, out of range pixels count as 0
+void canny_gaussian_blur(const float* input, float* output, int width, int height) {
+    const int radius = 2;
+    float sigma      = 1.4f;
+    float kernel[2 * radius + 1];
+    for (int i = -radius; i <= radius; i++) {
+        // the 2d kernel was normalized with 1 / (2 pi sigma^2), split evenly over both passes
+        kernel[i + radius] = expf(-(i * i) / (2.0f * sigma * sigma)) / sqrtf(2.0f * M_PI_ * sigma * sigma);
     }
-}
 
-void grayscale(struct ggml_tensor* rgb_img, struct ggml_tensor* grayscale) {
-    for (int iy = 0; iy < rgb_img->ne[1]; iy++) {
-        for (int ix = 0; ix < rgb_img->ne[0]; ix++) {
-            float r    = ggml_tensor_get_f32(rgb_img, ix, iy);
-            float g    = ggml_tensor_get_f32(rgb_img, ix, iy, 1);
-            float b    = ggml_tensor_get_f32(rgb_img, ix, iy, 2);
-            float gray = 0.2989f * r + 0.5870f * g + 0.1140f * b;
-            ggml_tensor_set_f32(grayscale, gray, ix, iy);
+    // horizontal pass into a buffer with radius zero rows above and below
+    std::vector<float> rows((size_t)width * (height + 2 * radius), 0.0f);
+    sd_parallel_rows(height, (size_t)width * 24, 0, [&](int begin, int end) {
+        std::vector<float> padded(width + 2 * radius, 0.0f);
+        for (int y = begin; y < end; y++) {
+            memcpy(padded.data() + radius, input + (size_t)y * width, width * sizeof(float));
+            float* row = rows.data() + (size_t)(y + radius) * width;
+            for (int x = 0; x < width; x++) {
+                const float* p = padded.data() + x;
+                row[x]         = p[0] * kernel[0] + p[1] * kernel[1] + p[2] * kernel[2] + p[3] * kernel[3] + p[4] * kernel[4];
+            }
         }
-    }
-}
-
-void prop_hypot(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = sqrtf(dx[i] * dx[i] + dy[i] * dy[i]);
-    }
-}
-
-void prop_arctan2(struct ggml_tensor* x, struct ggml_tensor* y, struct ggml_tensor* h) {
-    int n_elements = ggml_nelements(h);
-    float* dx      = (float*)x->data;
-    float* dy      = (float*)y->data;
-    float* dh      = (float*)h->data;
-    for (int i = 0; i < n_elements; i++) {
-        dh[i] = atan2f(dy[i], dx[i]);
-    }
-}
-
-void normalize_tensor(struct ggml_tensor* g) {
-    int n_elements = ggml_nelements(g);
-    float* dg      = (float*)g->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = dg[i] > max ? dg[i] : max;
-    }
-    max = 1.0f / max;
-    for (int i = 0; i < n_elements; i++) {
-        dg[i] *= max;
-    }
+    });
+    // vertical pass
+    sd_parallel_rows(height, (size_t)width * 24, 0, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const float* r0 = rows.data() + (size_t)y * width;
+            const float* r1 = r0 + width;
+            const float* r2 = r1 + width;
+            const float* r3 = r2 + width;
+            const float* r4 = r3 + width;
+            float* row      = output + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                row[x] = r0[x] * kernel[0] + r1[x] * kernel[1] + r2[x] * kernel[2] + r3[x] * kernel[3] + r4[x] * kernel[4];
+            }
+        }
+    });
 }
 
-void non_max_supression(struct ggml_tensor* result, struct ggml_tensor* G, struct ggml_tensor* D) {
-    for (int iy = 1; iy < result->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < result->ne[0] - 1; ix++) {
-            float angle = ggml_tensor_get_f32(D, ix, iy) * 180.0f / M_PI_;
-            angle       = angle < 0.0f ? angle += 180.0f : angle;
-            float q     = 1.0f;
-            float r     = 1.0f;
-
-            // angle 0
-            if ((0 >= angle && angle < 22.5f) || (157.5f >= angle && angle <= 180)) {
-                q = ggml_tensor_get_f32(G, ix, iy + 1);
-                r = ggml_tensor_get_f32(G, ix, iy - 1);
-            }
-            // angle 45
-            else if (22.5f >= angle && angle < 67.5f) {
-                q = ggml_tensor_get_f32(G, ix + 1, iy - 1);
-                r = ggml_tensor_get_f32(G, ix - 1, iy + 1);
+// sobel gradients fused with the magnitude and the direction, quantized to the neighbour pair
+// the non maximum suppression compares: 0 horizontal, 1 vertical, 2 down right diagonal, 3 up right diagonal
+void canny_gradient(const float* input, float* magnitude, uint8_t* direction, int width, int height) {
+    const float tan_22_5 = 0.41421356f;
+    sd_parallel_rows(height, (size_t)width * 40, 0, [&](int begin, int end) {
+        std::vector<float> padded(3 * (size_t)(width + 2), 0.0f);
+        std::vector<float> gx(width);
+        std::vector<float> gy(width);
+        for (int y = begin; y < end; y++) {
+            // rows y - 1, y, y + 1 with a zero column on each side
+            for (int k = 0; k < 3; k++) {
+                float* p = padded.data() + k * (width + 2);
+                int iy   = y + k - 1;
+                if (iy < 0 || iy >= height) {
+                    memset(p, 0, (width + 2) * sizeof(float));
+                } else {
+                    p[0]         = 0.0f;
+                    p[width + 1] = 0.0f;
+                    memcpy(p + 1, input + (size_t)iy * width, width * sizeof(float));
+                }
             }
-            // angle 90
-            else if (67.5f >= angle && angle < 112.5) {
-                q = ggml_tensor_get_f32(G, ix + 1, iy);
-                r = ggml_tensor_get_f32(G, ix - 1, iy);
+            const float* top    = padded.data();
+            const float* middle = top + width + 2;
+            const float* bottom = middle + width + 2;
+            for (int x = 0; x < width; x++) {
+                // x + 0 is the left neighbour in the padded rows
+                gx[x] = (top[x + 2] + 2 * middle[x + 2] + bottom[x + 2]) - (top[x] + 2 * middle[x] + bottom[x]);
+                gy[x] = (bottom[x] + 2 * bottom[x + 1] + bottom[x + 2]) - (top[x] + 2 * top[x + 1] + top[x + 2]);
             }
-            // angle 135
-            else if (112.5 >= angle && angle < 157.5f) {
-                q = ggml_tensor_get_f32(G, ix - 1, iy - 1);
-                r = ggml_tensor_get_f32(G, ix + 1, iy + 1);
+            float* m   = magnitude + (size_t)y * width;
+            uint8_t* d = direction + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                m[x]     = sqrtf(gx[x] * gx[x] + gy[x] * gy[x]);
+                float ax = fabsf(gx[x]);
+                float ay = fabsf(gy[x]);
+                if (ay <= tan_22_5 * ax) {
+                    d[x] = 0;
+                } else if (ax <= tan_22_5 * ay) {
+                    d[x] = 1;
+                } else {
+                    d[x] = (gx[x] > 0) == (gy[x] > 0) ? 2 : 3;
+                }
             }
+        }
+    });
+}
 
-            float cur = ggml_tensor_get_f32(G, ix, iy);
-            if ((cur >= q) && (cur >= r)) {
-                ggml_tensor_set_f32(result, cur, ix, iy);
-            } else {
-                ggml_tensor_set_f32(result, 0.0f, ix, iy);
+// keeps the pixels that are a maximum along the gradient, the outermost pixels are dropped
+void canny_non_max_suppression(const float* magnitude, const uint8_t* direction, float* output, int width, int height) {
+    const int offsets[4][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}};
+    memset(output, 0, (size_t)width * height * sizeof(float));
+    sd_parallel_rows(height, (size_t)width * 16, 0, [&](int begin, int end) {
+        for (int y = std::max(begin, 1); y < std::min(end, height - 1); y++) {
+            for (int x = 1; x < width - 1; x++) {
+                size_t i  = (size_t)y * width + x;
+                int dx    = offsets[direction[i]][0];
+                int dy    = offsets[direction[i]][1];
+                float cur = magnitude[i];
+                float q   = magnitude[i + dy * width + dx];
+                float r   = magnitude[i - dy * width - dx];
+                // a plateau of two equal pixels keeps one of them
+                output[i] = (cur >= q && cur > r) ? cur : 0.0f;
             }
         }
-    }
+    });
 }
 
-void threshold_hystersis(struct ggml_tensor* img, float high_threshold, float low_threshold, float weak, float strong) {
-    int n_elements = ggml_nelements(img);
-    float* imd     = (float*)img->data;
-    float max      = -INFINITY;
-    for (int i = 0; i < n_elements; i++) {
-        max = imd[i] > max ? imd[i] : max;
+// double threshold relative to the maximum, then weak pixels connected to a strong one through other weak pixels
+// become strong, the rest is dropped. The result only holds 0 and strong.
+void canny_hysteresis(float* img, int width, int height, float high_threshold, float low_threshold, float strong) {
+    size_t n  = (size_t)width * height;
+    float max = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        max = img[i] > max ? img[i] : max;
     }
     float ht = max * high_threshold;
     float lt = ht * low_threshold;
-    for (int i = 0; i < n_elements; i++) {
-        float img_v = imd[i];
-        if (img_v >= ht) {  // strong pixel
-            imd[i] = strong;
-        } else if (img_v <= ht && img_v >= lt) {  // strong pixel
-            imd[i] = weak;
-        }
-    }
 
-    for (int iy = 0; iy < img->ne[1]; iy++) {
-        for (int ix = 0; ix < img->ne[0]; ix++) {
-            if (ix >= 3 && ix <= img->ne[0] - 3 && iy >= 3 && iy <= img->ne[1] - 3) {
-                ggml_tensor_set_f32(img, ggml_tensor_get_f32(img, ix, iy), ix, iy);
-            } else {
-                ggml_tensor_set_f32(img, 0.0f, ix, iy);
+    // 2: strong, 1: weak, 0: none. The border is cleared like before.
+    const int border = 3;
+    std::vector<uint8_t> state(n, 0);
+    std::vector<size_t> stack;
+    for (int y = border; y <= height - border; y++) {
+        for (int x = border; x <= width - border; x++) {
+            size_t i = (size_t)y * width + x;
+            if (img[i] >= ht && max > 0.0f) {
+                state[i] = 2;
+                stack.push_back(i);
+            } else if (img[i] >= lt && max > 0.0f) {
+                state[i] = 1;
             }
         }
     }
-
-    // hysteresis
-    for (int iy = 1; iy < img->ne[1] - 1; iy++) {
-        for (int ix = 1; ix < img->ne[0] - 1; ix++) {
-            float imd_v = ggml_tensor_get_f32(img, ix, iy);
-            if (imd_v == weak) {
-                if (ggml_tensor_get_f32(img, ix + 1, iy - 1) == strong || ggml_tensor_get_f32(img, ix + 1, iy) == strong ||
-                    ggml_tensor_get_f32(img, ix, iy - 1) == strong || ggml_tensor_get_f32(img, ix, iy + 1) == strong ||
-                    ggml_tensor_get_f32(img, ix - 1, iy - 1) == strong || ggml_tensor_get_f32(img, ix - 1, iy) == strong) {
-                    ggml_tensor_set_f32(img, strong, ix, iy);
-                } else {
-                    ggml_tensor_set_f32(img, 0.0f, ix, iy);
+    while (!stack.empty()) {
+        size_t i = stack.back();
+        stack.pop_back();
+        int x = (int)(i % width);
+        int y = (int)(i / width);
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = x + dx;
+                int ny = y + dy;
+                if (nx < 0 || nx >= width || ny < 0 || ny >= height) {
+                    continue;
+                }
+                size_t j = (size_t)ny * width + nx;
+                if (state[j] == 1) {
+                    state[j] = 2;
+                    stack.push_back(j);
                 }
             }
         }
     }
+    for (size_t i = 0; i < n; i++) {
+        img[i] = state[i] == 2 ? strong : 0.0f;
+    }
 }
 
 uint8_t* preprocess_canny(uint8_t* img, int width, int height, float high_threshold, float low_threshold, float weak, float strong, bool inverse) {
-    struct ggml_init_params params;
-    params.mem_size               = static_cast<size_t>(10 * 1024 * 1024);  // 10
-    params.mem_buffer             = NULL;
-    params.no_alloc               = false;
-    struct ggml_context* work_ctx = ggml_init(params);
+    // weak pixels never reach the output, only their count towards the connectivity matters
+    (void)weak;
+    size_t n = (size_t)width * height;
+    std::vector<float> gray(n);
+    std::vector<float> blurred(n);
+    std::vector<float> magnitude(n);
+    std::vector<uint8_t> direction(n);
+
+    // grayscale in [0, 1]
+    sd_parallel_rows(height, (size_t)width * 12, 0, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const uint8_t* src = img + (size_t)y * width * 3;
+            float* dst         = gray.data() + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                dst[x] = (0.2989f * src[x * 3] + 0.5870f * src[x * 3 + 1] + 0.1140f * src[x * 3 + 2]) / 255.0f;
+            }
+        }
+    });
+    canny_gaussian_blur(gray.data(), blurred.data(), width, height);
+    canny_gradient(blurred.data(), magnitude.data(), direction.data(), width, height);
+    canny_non_max_suppression(magnitude.data(), direction.data(), gray.data(), width, height);
+    canny_hysteresis(gray.data(), width, height, high_threshold, low_threshold, strong);
+    free(img);
 
-    if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+    // to RGB channels
+    uint8_t* output = (uint8_t*)malloc(n * 3);
+    if (output == NULL) {
+        LOG_ERROR("failed to allocate the canny image");
         return NULL;
     }
-
-    float kX[9] = {
-        -1, 0, 1,
-        -2, 0, 2,
-        -1, 0, 1};
-
-    float kY[9] = {
-        1, 2, 1,
-        0, 0, 0,
-        -1, -2, -1};
-
-    // generate kernel
-    int kernel_size             = 5;
-    struct ggml_tensor* gkernel = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, kernel_size, kernel_size, 1, 1);
-    struct ggml_tensor* sf_kx   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_kx->data, kX, ggml_nbytes(sf_kx));
-    struct ggml_tensor* sf_ky = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 3, 3, 1, 1);
-    memcpy(sf_ky->data, kY, ggml_nbytes(sf_ky));
-    gaussian_kernel(gkernel);
-    struct ggml_tensor* image      = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
-    struct ggml_tensor* image_gray = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 1, 1);
-    struct ggml_tensor* iX         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* iY         = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* G          = ggml_dup_tensor(work_ctx, image_gray);
-    struct ggml_tensor* tetha      = ggml_dup_tensor(work_ctx, image_gray);
-    sd_image_to_tensor(img, image);
-    grayscale(image, image_gray);
-    convolve(image_gray, image_gray, gkernel, 2);
-    convolve(image_gray, iX, sf_kx, 1);
-    convolve(image_gray, iY, sf_ky, 1);
-    prop_hypot(iX, iY, G);
-    normalize_tensor(G);
-    prop_arctan2(iX, iY, tetha);
-    non_max_supression(image_gray, G, tetha);
-    threshold_hystersis(image_gray, high_threshold, low_threshold, weak, strong);
-    // to RGB channels
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            float gray = ggml_tensor_get_f32(image_gray, ix, iy);
-            gray       = inverse ? 1.0f - gray : gray;
-            ggml_tensor_set_f32(image, gray, ix, iy);
-            ggml_tensor_set_f32(image, gray, ix, iy, 1);
-            ggml_tensor_set_f32(image, gray, ix, iy, 2);
+    sd_parallel_rows(height, (size_t)width * 8, 0, [&](int begin, int end) {
+        std::vector<uint8_t> row(width);
+        for (int y = begin; y < end; y++) {
+            sd_f32_to_u8_row(gray.data() + (size_t)y * width, row.data(), width, inverse ? -255.0f : 255.0f, inverse ? 255.0f : 0.0f);
+            uint8_t* dst = output + (size_t)y * width * 3;
+            for (int x = 0; x < width; x++) {
+                dst[x * 3]     = row[x];
+                dst[x * 3 + 1] = row[x];
+                dst[x * 3 + 2] = row[x];
+            }
         }
-    }
-    free(img);
-    uint8_t* output = sd_tensor_to_image(image);
-    ggml_free(work_ctx);
+    });
     return output;
 }
 
-#endif  // __PREPROCESSING_HPP__
\ No newline at end of file
+#endif  // __PREPROCESSING_HPP__
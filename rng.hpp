@@ -6,8 +6,16 @@
 
 class RNG {
 public:
-    virtual void manual_seed(uint64_t seed)      = 0;
-    virtual std::vector<float> randn(uint32_t n) = 0;
+    virtual void manual_seed(uint64_t seed) = 0;
+
+    // writes the next n normally distributed numbers to out
+    virtual void randn(float* out, size_t n) = 0;
+
+    std::vector<float> randn(uint32_t n) {
+        std::vector<float> result(n);
+        randn(result.data(), n);
+        return result;
+    }
 };
 
 class STDDefaultRNG : public RNG {
@@ -15,21 +23,21 @@ private:
     std::default_random_engine generator;
 
 public:
+    using RNG::randn;
+
     void manual_seed(uint64_t seed) {
         generator.seed((unsigned int)seed);
     }
 
-    std::vector<float> randn(uint32_t n) {
-        std::vector<float> result;
+    // a sequential engine, the numbers of a seed depend on everything drawn before them
+    void randn(float* out, size_t n) {
         float mean   = 0.0;
         float stddev = 1.0;
         std::normal_distribution<float> distribution(mean, stddev);
-        for (uint32_t i = 0; i < n; i++) {
-            float random_number = distribution(generator);
-            result.push_back(random_number);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = distribution(generator);
         }
-        return result;
     }
 };
 
-#endif  // __RNG_H__
\ No newline at end of file
+#endif  // __RNG_H__
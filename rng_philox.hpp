@@ -4,90 +4,129 @@
 #include <cmath>
 #include <vector>
 
+#include "image_ops.h"
 #include "rng.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SD_PHILOX_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SD_PHILOX_NEON
+#endif
+
 // RNG imitiating torch cuda randn on CPU.
 // Port from: https://github.com/AUTOMATIC1111/stable-diffusion-webui/blob/5ef669de080814067961f28357256e8fe27544f4/modules/rng_philox.py
+//
+// Philox is counter based: number i of the draw `offset` only depends on (seed, offset, i), so any range of a
+// draw can be generated on its own. randn() splits a draw over threads and gives the same numbers as one thread.
 class PhiloxRNG : public RNG {
 private:
     uint64_t seed;
     uint32_t offset;
 
-private:
-    std::vector<uint32_t> philox_m = {0xD2511F53, 0xCD9E8D57};
-    std::vector<uint32_t> philox_w = {0x9E3779B9, 0xBB67AE85};
-    float two_pow32_inv            = 2.3283064e-10f;
-    float two_pow32_inv_2pi        = 2.3283064e-10f * 6.2831855f;
-
-    std::vector<uint32_t> uint32(uint64_t x) {
-        std::vector<uint32_t> result(2);
-        result[0] = static_cast<uint32_t>(x & 0xFFFFFFFF);
-        result[1] = static_cast<uint32_t>(x >> 32);
-        return result;
-    }
+    static const uint32_t philox_m0 = 0xD2511F53;
+    static const uint32_t philox_m1 = 0xCD9E8D57;
+    static const uint32_t philox_w0 = 0x9E3779B9;
+    static const uint32_t philox_w1 = 0xBB67AE85;
 
-    std::vector<std::vector<uint32_t>> uint32(const std::vector<uint64_t>& x) {
-        uint32_t N = (uint32_t)x.size();
-        std::vector<std::vector<uint32_t>> result(2, std::vector<uint32_t>(N));
+    static float box_muller(float x, float y) {
+        const float two_pow32_inv     = 2.3283064e-10f;
+        const float two_pow32_inv_2pi = 2.3283064e-10f * 6.2831855f;
 
-        for (uint32_t i = 0; i < N; ++i) {
-            result[0][i] = static_cast<uint32_t>(x[i] & 0xFFFFFFFF);
-            result[1][i] = static_cast<uint32_t>(x[i] >> 32);
-        }
+        float u = x * two_pow32_inv + two_pow32_inv / 2;
+        float v = y * two_pow32_inv_2pi + two_pow32_inv_2pi / 2;
 
-        return result;
-    }
+        float s = sqrt(-2.0f * log(u));
 
-    //  A single round of the Philox 4x32 random number generator.
-    void philox4_round(std::vector<std::vector<uint32_t>>& counter,
-                       const std::vector<std::vector<uint32_t>>& key) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (uint32_t i = 0; i < N; i++) {
-            std::vector<uint32_t> v1 = uint32(static_cast<uint64_t>(counter[0][i]) * static_cast<uint64_t>(philox_m[0]));
-            std::vector<uint32_t> v2 = uint32(static_cast<uint64_t>(counter[2][i]) * static_cast<uint64_t>(philox_m[1]));
-
-            counter[0][i] = v2[1] ^ counter[1][i] ^ key[0][i];
-            counter[1][i] = v2[0];
-            counter[2][i] = v1[1] ^ counter[3][i] ^ key[1][i];
-            counter[3][i] = v1[0];
-        }
+        float r1 = s * sin(v);
+        return r1;
     }
 
-    // Generates 32-bit random numbers using the Philox 4x32 random number generator.
-    // Parameters:
-    //     counter : A 4xN array of 32-bit integers representing the counter values (offset into generation).
-    //     key : A 2xN array of 32-bit integers representing the key values (seed).
-    //     rounds : The number of rounds to perform.
-    // Returns:
-    //     std::vector<std::vector<uint32_t>>: A 4xN array of 32-bit integers containing the generated random numbers.
-    std::vector<std::vector<uint32_t>> philox4_32(std::vector<std::vector<uint32_t>>& counter,
-                                                  std::vector<std::vector<uint32_t>>& key,
-                                                  int rounds = 10) {
-        uint32_t N = (uint32_t)counter[0].size();
-        for (int i = 0; i < rounds - 1; ++i) {
-            philox4_round(counter, key);
-
-            for (uint32_t j = 0; j < N; ++j) {
-                key[0][j] += philox_w[0];
-                key[1][j] += philox_w[1];
-            }
+    // Philox 4x32 with 10 rounds of the counter (offset, 0, index, 0) and the key (seed low, seed high),
+    // only the first two words are used
+    static void philox4_32(uint32_t offset, uint32_t index, uint32_t key0, uint32_t key1, uint32_t& x, uint32_t& y) {
+        uint32_t c0 = offset;
+        uint32_t c1 = 0;
+        uint32_t c2 = index;
+        uint32_t c3 = 0;
+        for (int round = 0; round < 10; round++) {
+            uint64_t v1 = (uint64_t)c0 * philox_m0;
+            uint64_t v2 = (uint64_t)c2 * philox_m1;
+            c0          = (uint32_t)(v2 >> 32) ^ c1 ^ key0;
+            c1          = (uint32_t)v2;
+            c2          = (uint32_t)(v1 >> 32) ^ c3 ^ key1;
+            c3          = (uint32_t)v1;
+            key0 += philox_w0;
+            key1 += philox_w1;
         }
-
-        philox4_round(counter, key);
-        return counter;
+        x = c0;
+        y = c1;
     }
 
-    float box_muller(float x, float y) {
-        float u = x * two_pow32_inv + two_pow32_inv / 2;
-        float v = y * two_pow32_inv_2pi + two_pow32_inv_2pi / 2;
-
-        float s = sqrt(-2.0f * log(u));
+#if defined(SD_PHILOX_SSE2)
+    // lo and hi 32 bits of the 4 products a * m
+    static void mulhilo(__m128i a, __m128i m, __m128i& lo, __m128i& hi) {
+        const __m128i low_mask = _mm_set_epi32(0, -1, 0, -1);
+        __m128i even           = _mm_mul_epu32(a, m);
+        __m128i odd            = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+        lo                     = _mm_or_si128(_mm_and_si128(even, low_mask), _mm_slli_epi64(odd, 32));
+        hi                     = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low_mask, odd));
+    }
 
-        float r1 = s * sin(v);
-        return r1;
+    // philox4_32 of the 4 indices index .. index + 3
+    static void philox4_32_x4(uint32_t offset, uint32_t index, uint32_t key0, uint32_t key1, uint32_t* x, uint32_t* y) {
+        const __m128i m0 = _mm_set1_epi32((int)philox_m0);
+        const __m128i m1 = _mm_set1_epi32((int)philox_m1);
+        __m128i c0       = _mm_set1_epi32((int)offset);
+        __m128i c1       = _mm_setzero_si128();
+        __m128i c2       = _mm_add_epi32(_mm_set1_epi32((int)index), _mm_set_epi32(3, 2, 1, 0));
+        __m128i c3       = _mm_setzero_si128();
+        for (int round = 0; round < 10; round++) {
+            __m128i lo1, hi1, lo2, hi2;
+            mulhilo(c0, m0, lo1, hi1);
+            mulhilo(c2, m1, lo2, hi2);
+            c0 = _mm_xor_si128(_mm_xor_si128(hi2, c1), _mm_set1_epi32((int)key0));
+            c1 = lo2;
+            c2 = _mm_xor_si128(_mm_xor_si128(hi1, c3), _mm_set1_epi32((int)key1));
+            c3 = lo1;
+            key0 += philox_w0;
+            key1 += philox_w1;
+        }
+        _mm_storeu_si128((__m128i*)x, c0);
+        _mm_storeu_si128((__m128i*)y, c1);
     }
+#elif defined(SD_PHILOX_NEON)
+    static void philox4_32_x4(uint32_t offset, uint32_t index, uint32_t key0, uint32_t key1, uint32_t* x, uint32_t* y) {
+        const uint32_t lanes[4] = {0, 1, 2, 3};
+        const uint32x2_t m0     = vdup_n_u32(philox_m0);
+        const uint32x2_t m1     = vdup_n_u32(philox_m1);
+        uint32x4_t c0           = vdupq_n_u32(offset);
+        uint32x4_t c1           = vdupq_n_u32(0);
+        uint32x4_t c2           = vaddq_u32(vdupq_n_u32(index), vld1q_u32(lanes));
+        uint32x4_t c3           = vdupq_n_u32(0);
+        for (int round = 0; round < 10; round++) {
+            uint64x2_t v1_low  = vmull_u32(vget_low_u32(c0), m0);
+            uint64x2_t v1_high = vmull_u32(vget_high_u32(c0), m0);
+            uint64x2_t v2_low  = vmull_u32(vget_low_u32(c2), m1);
+            uint64x2_t v2_high = vmull_u32(vget_high_u32(c2), m1);
+            uint32x4_t hi1     = vcombine_u32(vshrn_n_u64(v1_low, 32), vshrn_n_u64(v1_high, 32));
+            uint32x4_t hi2     = vcombine_u32(vshrn_n_u64(v2_low, 32), vshrn_n_u64(v2_high, 32));
+            c0                 = veorq_u32(veorq_u32(hi2, c1), vdupq_n_u32(key0));
+            c1                 = vcombine_u32(vmovn_u64(v2_low), vmovn_u64(v2_high));
+            c2                 = veorq_u32(veorq_u32(hi1, c3), vdupq_n_u32(key1));
+            c3                 = vcombine_u32(vmovn_u64(v1_low), vmovn_u64(v1_high));
+            key0 += philox_w0;
+            key1 += philox_w1;
+        }
+        vst1q_u32(x, c0);
+        vst1q_u32(y, c1);
+    }
+#endif
 
 public:
+    using RNG::randn;
+
     PhiloxRNG(uint64_t seed = 0) {
         this->seed   = seed;
         this->offset = 0;
@@ -98,28 +137,42 @@ public:
         this->offset = 0;
     }
 
-    std::vector<float> randn(uint32_t n) {
-        std::vector<std::vector<uint32_t>> counter(4, std::vector<uint32_t>(n, 0));
-        for (uint32_t i = 0; i < n; i++) {
-            counter[0][i] = this->offset;
+    // writes the numbers [index, index + n) of the draw `offset` of `seed` to out
+    static void randn(uint64_t seed, uint32_t offset, uint32_t index, size_t n, float* out) {
+        uint32_t key0 = (uint32_t)(seed & 0xFFFFFFFF);
+        uint32_t key1 = (uint32_t)(seed >> 32);
+        size_t i      = 0;
+#if defined(SD_PHILOX_SSE2) || defined(SD_PHILOX_NEON)
+        uint32_t x[4];
+        uint32_t y[4];
+        for (; i + 4 <= n; i += 4) {
+            philox4_32_x4(offset, index + (uint32_t)i, key0, key1, x, y);
+            for (int k = 0; k < 4; k++) {
+                out[i + k] = box_muller((float)x[k], (float)y[k]);
+            }
         }
-
-        for (uint32_t i = 0; i < n; i++) {
-            counter[2][i] = i;
+#endif
+        for (; i < n; i++) {
+            uint32_t x, y;
+            philox4_32(offset, index + (uint32_t)i, key0, key1, x, y);
+            out[i] = box_muller((float)x, (float)y);
         }
-        this->offset += 1;
-
-        std::vector<uint64_t> key(n, this->seed);
-        std::vector<std::vector<uint32_t>> key_uint32 = uint32(key);
-
-        std::vector<std::vector<uint32_t>> g = philox4_32(counter, key_uint32);
+    }
 
-        std::vector<float> result;
-        for (uint32_t i = 0; i < n; ++i) {
-            result.push_back(box_muller((float)g[0][i], (float)g[1][i]));
-        }
-        return result;
+    // every call is a new draw, like torch.randn on a cuda generator
+    void randn(float* out, size_t n) {
+        const int block = 4096;
+        int blocks      = (int)((n + block - 1) / block);
+        uint64_t seed   = this->seed;
+        uint32_t offset = this->offset;
+        sd_parallel_rows(blocks, block * 64, 0, [&](int begin, int end) {
+            for (int b = begin; b < end; b++) {
+                size_t index = (size_t)b * block;
+                randn(seed, offset, (uint32_t)index, std::min<size_t>(block, n - index), out + index);
+            }
+        });
+        this->offset += 1;
     }
 };
 
-#endif  // __RNG_PHILOX_H__
\ No newline at end of file
+#endif  // __RNG_PHILOX_H__
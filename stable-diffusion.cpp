@@ -75,13 +75,29 @@ void calculate_alphas_cumprod(float* alphas_cumprod,
     }
 }
 
-void suppress_pp(int step, int steps, float time, void* data) {
-    (void)step;
-    (void)steps;
-    (void)time;
-    (void)data;
-    return;
-}
+// where a generation spent its time and memory, see sd_get_generation_stats
+struct GenerationStats {
+    bool valid              = false;
+    int64_t start_us        = 0;
+    int64_t total_us        = 0;
+    int64_t lora_apply_us   = 0;
+    int64_t tokenize_us     = 0;
+    int64_t text_encoder_us = 0;
+    int64_t sampling_us     = 0;
+    int64_t control_net_us  = 0;
+    int64_t vae_encode_us   = 0;
+    int64_t vae_decode_us   = 0;
+    int64_t preview_us      = 0;  // written by the preview thread, read after it stopped
+    std::vector<float> step_ms;
+    size_t work_ctx_size = 0;
+    std::vector<GGMLRunner*> runners;  // those of the generation, in the order of runner_stats
+    std::vector<std::string> runner_names;
+    std::vector<sd_runner_stats_t> runner_stats;
+
+    void add_work_ctx(ggml_context* work_ctx) {
+        work_ctx_size = std::max(work_ctx_size, ggml_used_mem(work_ctx));
+    }
+};
 
 /*=============================================== StableDiffusionGGML ================================================*/
 
@@ -104,6 +120,10 @@ public:
     int n_threads            = -1;
     float scale_factor       = 0.18215f;
 
+    // model files the weights of cpu runners point into when loaded with mmap
+    std::vector<std::shared_ptr<MappedModelFile>> mapped_files;
+    size_t mapped_params_size = 0;
+
     std::shared_ptr<Conditioner> cond_stage_model;
     std::shared_ptr<FrozenCLIPVisionEmbedder> clip_vision;  // for svd
     std::shared_ptr<DiffusionModel> diffusion_model;
@@ -119,6 +139,8 @@ public:
     bool vae_tiling           = false;
     bool stacked_id           = false;
 
+    sd_tiling_params_t vae_tiling_params = {false, 0, 0, 0.5f, 0.f, 0.f, 1, 0, 0};  // set by each generation call
+
     bool is_using_v_parameterization     = false;
     bool is_using_edm_v_parameterization = false;
 
@@ -127,9 +149,21 @@ public:
     std::string lora_model_dir;
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
+    // loaded loras kept for fast switching, most recently used first
+    std::list<std::pair<std::string, std::shared_ptr<LoraModel>>> lora_cache;
+    size_t lora_cache_budget = 0;  // bytes, 0 disables the cache
+    // loras of the current generation in runtime mode, see set_runtime_loras
+    bool lora_runtime = false;
+    std::vector<std::pair<std::string, std::shared_ptr<LoraModel>>> runtime_loras;
+    LoraAdapterMap runtime_lora_adapters;
+    // original bytes of the weights merged loras touched, see LoraWeightSnapshots
+    std::shared_ptr<LoraWeightSnapshots> lora_snapshots;
 
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
+    int64_t load_time_us = 0;
+    GenerationStats stats;
+
     StableDiffusionGGML() = default;
 
     StableDiffusionGGML(int n_threads,
@@ -146,6 +180,40 @@ public:
         } else if (rng_type == CUDA_RNG) {
             rng = std::make_shared<PhiloxRNG>();
         }
+
+        const char* SD_LORA_CACHE_SIZE = getenv("SD_LORA_CACHE_SIZE");
+        if (SD_LORA_CACHE_SIZE != nullptr) {
+            std::string sd_lora_cache_size_str = SD_LORA_CACHE_SIZE;
+            try {
+                // in MB
+                lora_cache_budget = (size_t)std::stoull(sd_lora_cache_size_str) * 1024 * 1024;
+            } catch (const std::invalid_argument&) {
+                LOG_WARN("SD_LORA_CACHE_SIZE environment variable is not a valid integer (%s). LoRA cache disabled.", SD_LORA_CACHE_SIZE);
+            } catch (const std::out_of_range&) {
+                LOG_WARN("SD_LORA_CACHE_SIZE environment variable value is out of range (%s). LoRA cache disabled.", SD_LORA_CACHE_SIZE);
+            }
+        }
+
+        const char* SD_LORA_RUNTIME = getenv("SD_LORA_RUNTIME");
+        if (SD_LORA_RUNTIME != nullptr) {
+            std::string sd_lora_runtime_str = SD_LORA_RUNTIME;
+            if (sd_lora_runtime_str == "ON" || sd_lora_runtime_str == "TRUE") {
+                lora_runtime = true;
+            } else if (sd_lora_runtime_str != "OFF" && sd_lora_runtime_str != "FALSE") {
+                LOG_WARN("SD_LORA_RUNTIME environment variable has unexpected value. Assuming default (\"OFF\"). (Expected \"ON\"/\"TRUE\" or\"OFF\"/\"FALSE\", got \"%s\")", SD_LORA_RUNTIME);
+            }
+        }
+
+        // "RAM" keeps the snapshots in memory, anything else but "OFF" is the path of a scratch file
+        const char* SD_LORA_SNAPSHOT = getenv("SD_LORA_SNAPSHOT");
+        if (SD_LORA_SNAPSHOT != nullptr) {
+            std::string sd_lora_snapshot_str = SD_LORA_SNAPSHOT;
+            if (sd_lora_snapshot_str == "RAM") {
+                lora_snapshots = std::make_shared<LoraWeightSnapshots>();
+            } else if (sd_lora_snapshot_str != "OFF" && sd_lora_snapshot_str != "") {
+                lora_snapshots = std::make_shared<LoraWeightSnapshots>(sd_lora_snapshot_str);
+            }
+        }
     }
 
     ~StableDiffusionGGML() {
@@ -178,7 +246,8 @@ public:
                         bool control_net_cpu,
                         bool vae_on_cpu,
                         bool diffusion_flash_attn,
-                        bool tae_preview_only) {
+                        bool tae_preview_only,
+                        bool use_mmap) {
         use_tiny_autoencoder = taesd_path.size() > 0;
 #ifdef SD_USE_CUDA
         LOG_DEBUG("Using CUDA backend");
@@ -229,6 +298,8 @@ public:
         }
 
         ModelLoader model_loader;
+        model_loader.set_n_threads(n_threads);
+        model_loader.set_use_mmap(use_mmap);
 
         vae_tiling = vae_tiling_;
 
@@ -345,17 +416,17 @@ public:
 
         if (version == VERSION_SVD) {
             clip_vision = std::make_shared<FrozenCLIPVisionEmbedder>(backend, model_loader.tensor_storages_types);
+            add_param_tensors(model_loader, backend, [&](std::map<std::string, struct ggml_tensor*>& t) { clip_vision->get_param_tensors(t); });
             clip_vision->alloc_params_buffer();
-            clip_vision->get_param_tensors(tensors);
 
             diffusion_model = std::make_shared<UNetModel>(backend, model_loader.tensor_storages_types, version);
+            add_param_tensors(model_loader, backend, [&](std::map<std::string, struct ggml_tensor*>& t) { diffusion_model->get_param_tensors(t); });
             diffusion_model->alloc_params_buffer();
-            diffusion_model->get_param_tensors(tensors);
 
             first_stage_model = std::make_shared<AutoEncoderKL>(backend, model_loader.tensor_storages_types, "first_stage_model", vae_decode_only, true, version);
             LOG_DEBUG("vae_decode_only %d", vae_decode_only);
+            add_param_tensors(model_loader, backend, [&](std::map<std::string, struct ggml_tensor*>& t) { first_stage_model->get_param_tensors(t, "first_stage_model"); });
             first_stage_model->alloc_params_buffer();
-            first_stage_model->get_param_tensors(tensors, "first_stage_model");
         } else {
             clip_backend   = backend;
             bool use_t5xxl = false;
@@ -407,11 +478,11 @@ public:
                 diffusion_model = std::make_shared<UNetModel>(backend, model_loader.tensor_storages_types, version, diffusion_flash_attn);
             }
 
+            add_param_tensors(model_loader, clip_backend, [&](std::map<std::string, struct ggml_tensor*>& t) { cond_stage_model->get_param_tensors(t); });
             cond_stage_model->alloc_params_buffer();
-            cond_stage_model->get_param_tensors(tensors);
 
+            add_param_tensors(model_loader, backend, [&](std::map<std::string, struct ggml_tensor*>& t) { diffusion_model->get_param_tensors(t); });
             diffusion_model->alloc_params_buffer();
-            diffusion_model->get_param_tensors(tensors);
 
             if (!use_tiny_autoencoder || tae_preview_only) {
                 if (vae_on_cpu && !ggml_backend_is_cpu(backend)) {
@@ -421,8 +492,8 @@ public:
                     vae_backend = backend;
                 }
                 first_stage_model = std::make_shared<AutoEncoderKL>(vae_backend, model_loader.tensor_storages_types, "first_stage_model", vae_decode_only, false, version);
+                add_param_tensors(model_loader, vae_backend, [&](std::map<std::string, struct ggml_tensor*>& t) { first_stage_model->get_param_tensors(t, "first_stage_model"); });
                 first_stage_model->alloc_params_buffer();
-                first_stage_model->get_param_tensors(tensors, "first_stage_model");
             }
             if (use_tiny_autoencoder) {
                 tae_first_stage = std::make_shared<TinyAutoEncoder>(backend, model_loader.tensor_storages_types, "decoder.layers", vae_decode_only, version);
@@ -460,11 +531,11 @@ public:
                 }
             }
             if (stacked_id) {
+                add_param_tensors(model_loader, backend, [&](std::map<std::string, struct ggml_tensor*>& t) { pmid_model->get_param_tensors(t, "pmid"); });
                 if (!pmid_model->alloc_params_buffer()) {
                     LOG_ERROR(" pmid model params buffer allocation failed");
                     return false;
                 }
-                pmid_model->get_param_tensors(tensors, "pmid");
             }
         }
 
@@ -505,6 +576,11 @@ public:
             ggml_free(ctx);
             return false;
         }
+        // the bound weights point into the mappings, keep them after the loader is gone
+        mapped_files = model_loader.get_mapped_files();
+        if (mapped_params_size > 0) {
+            LOG_INFO("%.2fMB of the params are used in place from the mapped model files", mapped_params_size / 1024.0 / 1024.0);
+        }
 
         // LOG_DEBUG("model size = %.2fMB", total_size / 1024.0 / 1024.0);
 
@@ -711,36 +787,80 @@ public:
         return result < -1;
     }
 
-    void apply_lora(const std::string& lora_name, float multiplier) {
-        int64_t t0                 = ggml_time_ms();
+    std::shared_ptr<LoraModel> take_cached_lora(const std::string& file_path) {
+        for (auto it = lora_cache.begin(); it != lora_cache.end(); ++it) {
+            if (it->first == file_path) {
+                std::shared_ptr<LoraModel> lora = it->second;
+                lora_cache.erase(it);
+                return lora;
+            }
+        }
+        return NULL;
+    }
+
+    void cache_lora(const std::string& file_path, std::shared_ptr<LoraModel> lora) {
+        size_t lora_size = lora->get_params_buffer_size();
+        if (lora_size > lora_cache_budget) {
+            lora->free_params_buffer();
+            return;
+        }
+        lora_cache.push_front(std::make_pair(file_path, lora));
+
+        size_t cache_size = 0;
+        for (auto it = lora_cache.begin(); it != lora_cache.end();) {
+            cache_size += it->second->get_params_buffer_size();
+            if (cache_size > lora_cache_budget) {
+                LOG_DEBUG("evicting lora %s from cache", it->first.c_str());
+                cache_size -= it->second->get_params_buffer_size();
+                it = lora_cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::string get_lora_file_path(const std::string& lora_name) {
         std::string st_file_path   = path_join(lora_model_dir, lora_name + ".safetensors");
         std::string ckpt_file_path = path_join(lora_model_dir, lora_name + ".ckpt");
-        std::string file_path;
         if (file_exists(st_file_path)) {
-            file_path = st_file_path;
+            return st_file_path;
         } else if (file_exists(ckpt_file_path)) {
-            file_path = ckpt_file_path;
-        } else {
-            LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
-            return;
+            return ckpt_file_path;
         }
-        LoraModel lora(backend, file_path);
-        if (!lora.load_from_file()) {
-            LOG_WARN("load lora tensors from %s failed", file_path.c_str());
-            return;
-        }
-
-        lora.multiplier = multiplier;
-        // TODO: send version?
-        lora.apply(tensors, version, n_threads);
-        lora.free_params_buffer();
+        LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
+        return "";
+    }
 
-        int64_t t1 = ggml_time_ms();
+    // collects the weights of one runner, with mmap the ones of a cpu runner are bound into the mapped
+    // model files first, so its params buffer only has to hold the tensors that need a conversion
+    void add_param_tensors(ModelLoader& model_loader,
+                           ggml_backend_t runner_backend,
+                           std::function<void(std::map<std::string, struct ggml_tensor*>&)> get_param_tensors) {
+        std::map<std::string, struct ggml_tensor*> runner_tensors;
+        get_param_tensors(runner_tensors);
+        if (ggml_backend_is_cpu(runner_backend)) {
+            mapped_params_size += model_loader.bind_mapped_tensors(runner_tensors);
+        }
+        tensors.insert(runner_tensors.begin(), runner_tensors.end());
+    }
 
-        LOG_INFO("lora '%s' applied, taking %.2fs", lora_name.c_str(), (t1 - t0) * 1.0f / 1000);
+    std::shared_ptr<LoraModel> load_lora(const std::string& file_path) {
+        std::shared_ptr<LoraModel> lora = take_cached_lora(file_path);
+        if (lora != NULL) {
+            LOG_DEBUG("using cached lora tensors of %s", file_path.c_str());
+            return lora;
+        }
+        lora = std::make_shared<LoraModel>(backend, file_path);
+        lora->model_loader.set_n_threads(n_threads);
+        if (!lora->load_from_file()) {
+            LOG_WARN("load lora tensors from %s failed", file_path.c_str());
+            return NULL;
+        }
+        return lora;
     }
 
-    void apply_loras(const std::unordered_map<std::string, float>& lora_state) {
+    // false when the base weights could not be restored or the merge failed
+    bool apply_loras(const std::unordered_map<std::string, float>& lora_state) {
         if (lora_state.size() > 0 && model_wtype != GGML_TYPE_F16 && model_wtype != GGML_TYPE_F32) {
             LOG_WARN("In quantized models when applying LoRA, the images have poor quality.");
         }
@@ -763,11 +883,110 @@ public:
             LOG_INFO("Attempting to apply %lu LoRAs", lora_state.size());
         }
 
+        if (lora_snapshots != NULL && stacked_id) {
+            // PhotoMaker merges its own lora after the first apply, a restore would drop it
+            LOG_WARN("LoRA snapshots do not work with PhotoMaker, disabled");
+            lora_snapshots.reset();
+        }
+        // with snapshots the base weights are restored exactly and the whole new set is merged into them
+        int64_t t0         = ggml_time_ms();
+        bool use_snapshots = lora_snapshots != NULL;
+        if (use_snapshots) {
+            if (lora_state == curr_lora_state) {
+                return true;
+            }
+            if (!lora_snapshots->restore(tensors, n_threads)) {
+                // merging on top of partly restored weights would corrupt the model
+                LOG_ERROR("restoring the LoRA base weights failed");
+                return false;
+            }
+            lora_state_diff.clear();
+            lora_state_diff.insert(lora_state.begin(), lora_state.end());
+        }
+
+        // all changed loras are merged together, see LoraMerger
+        std::vector<std::string> file_paths;
+        std::vector<std::shared_ptr<LoraModel>> loras;
         for (auto& kv : lora_state_diff) {
-            apply_lora(kv.first, kv.second);
+            if (kv.second == 0.f) {
+                continue;
+            }
+            std::string file_path = get_lora_file_path(kv.first);
+            if (file_path.empty()) {
+                continue;
+            }
+            std::shared_ptr<LoraModel> lora = load_lora(file_path);
+            if (lora == NULL) {
+                continue;
+            }
+            lora->multiplier = kv.second;
+            file_paths.push_back(file_path);
+            loras.push_back(lora);
+        }
+
+        // TODO: send version?
+        LoraMerger merger(backend, loras);
+        if (use_snapshots) {
+            std::vector<std::pair<std::string, struct ggml_tensor*>> weights;
+            for (auto& kv : tensors) {
+                if (merger.count_loras(kv.first, version) > 0) {
+                    weights.push_back(kv);
+                }
+            }
+            if (!lora_snapshots->save(weights, n_threads)) {
+                // the weights are untouched so far, carry on without snapshots
+                LOG_WARN("LoRA snapshots disabled, removing LoRAs merges them again");
+                lora_snapshots.reset();
+            }
+        }
+        bool merged = merger.merge(tensors, version, n_threads);
+        for (size_t i = 0; i < loras.size(); i++) {
+            cache_lora(file_paths[i], loras[i]);
+        }
+        if (!merged) {
+            // curr_lora_state stays as it was, with snapshots the next apply restores the base weights
+            LOG_ERROR("merging %lu LoRAs failed", loras.size());
+            return false;
+        }
+
+        int64_t t1 = ggml_time_ms();
+        if (loras.size() > 0) {
+            LOG_INFO("%lu LoRAs merged, taking %.2fs", loras.size(), (t1 - t0) * 1.0f / 1000);
         }
 
         curr_lora_state = lora_state;
+        return true;
+    }
+
+    // runtime mode: the loras stay separate from the weights and are added by Linear/Conv2d
+    // in the forward pass, so switching them costs no merge and quantized weights stay exact
+    void set_runtime_loras(const std::unordered_map<std::string, float>& lora_state) {
+        for (auto& kv : runtime_loras) {
+            cache_lora(kv.first, kv.second);
+        }
+        runtime_loras.clear();
+        runtime_lora_adapters.clear();
+
+        if (lora_state.size() > 0) {
+            LOG_INFO("Attempting to use %lu LoRAs at runtime", lora_state.size());
+        }
+        for (auto& kv : lora_state) {
+            std::string file_path = get_lora_file_path(kv.first);
+            if (file_path.empty()) {
+                continue;
+            }
+            std::shared_ptr<LoraModel> lora = load_lora(file_path);
+            if (lora == NULL) {
+                continue;
+            }
+            lora->multiplier   = kv.second;
+            size_t unsupported = lora->get_runtime_adapters(tensors, version, runtime_lora_adapters);
+            if (unsupported > 0) {
+                LOG_WARN("lora '%s': %lu weights use a LoRA kind that can only be merged, they are skipped in runtime mode",
+                         kv.first.c_str(), unsupported);
+            }
+            runtime_loras.push_back(std::make_pair(file_path, lora));
+        }
     }
 
     ggml_tensor* id_encoder(ggml_context* work_ctx,
@@ -859,20 +1078,20 @@ public:
     }
 
     void silent_tiling(ggml_tensor* input, ggml_tensor* output, const int scale, const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
-        sd_progress_cb_t cb = sd_get_progress_callback();
-        void* cbd           = sd_get_progress_callback_data();
-        sd_set_progress_callback((sd_progress_cb_t)suppress_pp, NULL);
+        // the preview worker keeps its thread suppressed, don't undo that
+        bool was_suppressed = sd_suppress_progress(true);
         sd_tiling(input, output, scale, tile_size, tile_overlap_factor, on_processing);
-        sd_set_progress_callback(cb, cbd);
+        sd_suppress_progress(was_suppressed);
     }
 
-    void preview_image(ggml_context* work_ctx,
-                       int step,
+    // runs on the preview thread, the decoder keeps its compute buffer until the worker stops
+    void preview_image(int step,
                        struct ggml_tensor* latents,
                        enum SDVersion version,
                        sd_preview_t preview_mode,
                        ggml_tensor* result,
-                       std::function<void(int, sd_image_t)> step_callback) {
+                       std::function<void(int, sd_image_t)> step_callback,
+                       int n_threads) {
         const uint32_t channel = 3;
         uint32_t width         = latents->ne[0];
         uint32_t height        = latents->ne[1];
@@ -932,7 +1151,6 @@ public:
                 } else {
                     first_stage_model->compute(n_threads, latents, true, &result);
                 }
-                first_stage_model->free_compute_buffer();
                 ggml_tensor_scale(latents, scale_factor);
 
                 ggml_tensor_scale_output(result);
@@ -950,7 +1168,6 @@ public:
                 } else {
                     tae_first_stage->compute(n_threads, latents, true, &result);
                 }
-                tae_first_stage->free_compute_buffer();
             } else {
                 return;
             }
@@ -966,6 +1183,63 @@ public:
         }
     }
 
+    // starts the preview thread of a sampling run over latents, NULL if previews are off. The decoder of the
+    // VAE and TAE modes computes on a backend instance of its own while the worker runs, so it never waits
+    // for the diffusion model or the other way around.
+    std::unique_ptr<PreviewWorker> start_preview_worker(ggml_tensor* latents) {
+        sd_preview_cb_t preview_cb = sd_get_preview_callback();
+        sd_preview_t preview_mode  = sd_get_preview_mode();
+        if (preview_cb == NULL || preview_mode == SD_PREVIEW_NONE) {
+            return nullptr;
+        }
+
+        std::shared_ptr<GGMLRunner> decoder;
+        if (preview_mode == SD_PREVIEW_VAE) {
+            decoder = first_stage_model;
+        } else if (preview_mode == SD_PREVIEW_TAE) {
+            decoder = tae_first_stage;
+        }
+        ggml_backend_t decoder_backend = NULL;
+        ggml_backend_t preview_backend = NULL;
+        struct ggml_context* result_ctx = NULL;
+        ggml_tensor* result             = NULL;
+        if (decoder) {
+            decoder_backend = decoder->get_backend();
+            preview_backend = ggml_backend_dev_init(ggml_backend_get_device(decoder_backend), NULL);
+            if (preview_backend == NULL) {
+                LOG_WARN("failed to create a backend for the previews, previews disabled");
+                return nullptr;
+            }
+            decoder->set_compute_backend(preview_backend);
+
+            struct ggml_init_params params;
+            params.mem_size   = latents->ne[0] * 8 * latents->ne[1] * 8 * 3 * latents->ne[3] * sizeof(float) + ggml_tensor_overhead();
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+
+            result_ctx = ggml_init(params);
+            GGML_ASSERT(result_ctx != NULL);
+            result = ggml_new_tensor_4d(result_ctx, GGML_TYPE_F32, latents->ne[0] * 8, latents->ne[1] * 8, 3, latents->ne[3]);
+        }
+
+        // a quarter of the threads when the previews share the cpu with the diffusion model
+        int preview_threads = ggml_backend_is_cpu(backend) ? std::max(1, n_threads / 4) : n_threads;
+        auto render         = [=](int step, ggml_tensor* snapshot) {
+            int64_t t0 = ggml_time_us();
+            preview_image(step, snapshot, version, preview_mode, result, preview_cb, preview_threads);
+            stats.preview_us += ggml_time_us() - t0;
+        };
+        auto on_stop = [=]() {
+            if (decoder) {
+                decoder->free_compute_buffer();
+                decoder->set_compute_backend(decoder_backend);
+                ggml_backend_free(preview_backend);
+                ggml_free(result_ctx);
+            }
+        };
+        return std::unique_ptr<PreviewWorker>(new PreviewWorker(latents, render, on_stop));
+    }
+
     ggml_tensor* sample(ggml_context* work_ctx,
                         ggml_tensor* init_latent,
                         ggml_tensor* noise,
@@ -987,14 +1261,13 @@ public:
         float img_cfg_scale = guidance.img_cfg;
         float slg_scale     = guidance.slg.scale;
 
-        float min_cfg = guidance.min_cfg;
-
         if (img_cfg_scale != cfg_scale && !sd_version_use_concat(version)) {
             LOG_WARN("2-conditioning CFG is not supported with this model, disabling it for better performance...");
             img_cfg_scale = cfg_scale;
         }
 
         LOG_DEBUG("Sample");
+        int64_t sampling_start = ggml_time_us();
         struct ggml_init_params params;
         size_t data_size = ggml_row_size(init_latent->type, init_latent->ne[0]);
         for (int i = 1; i < 4; i++) {
@@ -1043,15 +1316,7 @@ public:
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
 
-        struct ggml_tensor* preview_tensor = NULL;
-        auto sd_preview_mode               = sd_get_preview_mode();
-        if (sd_preview_mode != SD_PREVIEW_NONE && sd_preview_mode != SD_PREVIEW_PROJ) {
-            preview_tensor = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32,
-                                                (denoised->ne[0] * 8),
-                                                (denoised->ne[1] * 8),
-                                                3,
-                                                denoised->ne[3]);
-        }
+        std::unique_ptr<PreviewWorker> preview_worker = start_preview_worker(denoised);
 
         std::vector<float> apg_momentum_buffer;
         if (guidance.apg.momentum != 0)
@@ -1082,8 +1347,10 @@ public:
             std::vector<struct ggml_tensor*> controls;
 
             if (control_hint != NULL && control_net != NULL) {
+                int64_t control_start = ggml_time_us();
                 control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
                 controls = control_net->controls;
+                stats.control_net_us += ggml_time_us() - control_start;
                 // print_ggml_tensor(controls[12]);
                 // GGML_ASSERT(0);
             }
@@ -1123,8 +1390,10 @@ public:
             if (has_unconditioned) {
                 // uncond
                 if (control_hint != NULL && control_net != NULL) {
+                    int64_t control_start = ggml_time_us();
                     control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
                     controls = control_net->controls;
+                    stats.control_net_us += ggml_time_us() - control_start;
                 }
                 if (is_skiplayer_step && guidance.slg.slg_uncond) {
                     LOG_DEBUG("Skipping layers at uncond step %d\n", step);
@@ -1196,15 +1465,6 @@ public:
                                          skip_layers);
                 skip_layer_data = (float*)out_skip->data;
             }
-            float* vec_denoised  = (float*)denoised->data;
-            float* vec_input     = (float*)input->data;
-            float* positive_data = (float*)out_cond->data;
-            int ne_elements      = (int)ggml_nelements(denoised);
-
-            float* deltas = vec_denoised;
-
-            // APG: https://arxiv.org/pdf/2410.02416
-
             bool log_cfg_norm                 = false;
             const char* SD_LOG_CFG_DELTA_NORM = getenv("SD_LOG_CFG_DELTA_NORM");
             if (SD_LOG_CFG_DELTA_NORM != nullptr) {
@@ -1215,102 +1475,22 @@ public:
                     LOG_WARN("SD_LOG_CFG_DELTA_NORM environment variable has unexpected value. Assuming default (\"OFF\"). (Expected \"ON\"/\"TRUE\" or\"OFF\"/\"FALSE\", got \"%s\")", SD_LOG_CFG_DELTA_NORM);
                 }
             }
-            float apg_scale_factor = 1.;
-            float diff_norm        = 0;
-            float cond_norm_sq     = 0;
-            float dot              = 0;
-            if (has_unconditioned || has_img_guidance) {
-                for (int i = 0; i < ne_elements; i++) {
-                    float delta;
-                    if (has_img_guidance) {
-                        if (cfg_scale == 1) {
-                            // Weird guidance (important: use img_cfg_scale instead of cfg_scale in the final formula)
-                            delta = img_cond_data[i] - negative_data[i];
-                        } else if (has_unconditioned) {
-                            // 2-conditioning CFG (img_cfg_scale != cfg_scale != 1)
-                            delta = positive_data[i] + (negative_data[i] * (1 - img_cfg_scale) + img_cond_data[i] * (img_cfg_scale - cfg_scale)) / (cfg_scale - 1);
-                        } else {
-                            // pure img CFG (img_cfg_scale == 1, cfg_scale !=1)
-                            delta = positive_data[i] - img_cond_data[i];
-                        }
-
-                    } else {
-                        // classic CFG (img_cfg_scale == cfg_scale != 1)
-                        delta = positive_data[i] - negative_data[i];
-                    }
-                    if (guidance.apg.momentum != 0) {
-                        delta += guidance.apg.momentum * apg_momentum_buffer[i];
-                        apg_momentum_buffer[i] = delta;
-                    }
-                    if (guidance.apg.norm_treshold > 0 || log_cfg_norm) {
-                        diff_norm += delta * delta;
-                    }
-                    if (guidance.apg.eta != 1.0f) {
-                        cond_norm_sq += positive_data[i] * positive_data[i];
-                        dot += positive_data[i] * delta;
-                    }
-                    deltas[i] = delta;
-                }
-                if (log_cfg_norm) {
-                    LOG_INFO("CFG Delta norm: %.2f", sqrtf(diff_norm));
-                }
-                if (guidance.apg.norm_treshold > 0) {
-                    diff_norm = sqrtf(diff_norm);
-                    if (guidance.apg.norm_treshold_smoothing <= 0) {
-                        apg_scale_factor = std::min(1.0f, guidance.apg.norm_treshold / diff_norm);
-                    } else {
-                        // Experimental: smooth saturate
-                        float x          = guidance.apg.norm_treshold / diff_norm;
-                        apg_scale_factor = x / std::pow(1 + std::pow(x, 1.0 / guidance.apg.norm_treshold_smoothing), guidance.apg.norm_treshold_smoothing);
-                    }
-                }
-                if (guidance.apg.eta != 1.0f) {
-                    dot *= apg_scale_factor;
-                    // pre-normalize (avoids one square root and ne_elements extra divs)
-                    dot /= cond_norm_sq;
-                }
-
-                for (int i = 0; i < ne_elements; i++) {
-                    deltas[i] *= apg_scale_factor;
-                    if (guidance.apg.eta != 1.0f) {
-                        float apg_parallel   = dot * positive_data[i];
-                        float apg_orthogonal = deltas[i] - apg_parallel;
-
-                        // tweak deltas
-                        deltas[i] = apg_orthogonal + guidance.apg.eta * apg_parallel;
-                    }
-                }
-            }
-
-            for (int i = 0; i < ne_elements; i++) {
-                float latent_result = positive_data[i];
-                if (has_unconditioned || has_img_guidance) {
-                    // out_uncond + cfg_scale * (out_cond - out_uncond)
-                    int64_t ne3 = out_cond->ne[3];
-                    if (min_cfg != cfg_scale && ne3 != 1) {
-                        int64_t i3  = i / out_cond->ne[0] * out_cond->ne[1] * out_cond->ne[2];
-                        float scale = min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / ne3);
-                    } else {
-                        float delta = deltas[i];
-                        if (cfg_scale != 1) {
-                            latent_result = positive_data[i] + (cfg_scale - 1) * delta;
-                        } else if (has_img_guidance) {
-                            // disables apg
-                            latent_result = positive_data[i] + (img_cfg_scale - 1) * delta;
-                        }
-                    }
-                } else if (has_img_guidance) {
-                    // img_cfg_scale == 1
-                    latent_result = img_cond_data[i] + cfg_scale * (positive_data[i] - img_cond_data[i]);
-                }
-                if (is_skiplayer_step && guidance.slg.scale != 0.0) {
-                    latent_result = latent_result + (positive_data[i] - skip_layer_data[i]) * guidance.slg.scale;
-                }
-                // v = latent_result, eps = latent_result
-                // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
-                vec_denoised[i] = latent_result * c_out + vec_input[i] * c_skip;
-            }
+            cfg_combine((float*)denoised->data,
+                        (float*)input->data,
+                        (float*)out_cond->data,
+                        negative_data,
+                        img_cond_data,
+                        skip_layer_data,
+                        apg_momentum_buffer.data(),
+                        (int)ggml_nelements(denoised),
+                        out_cond->ne[3],
+                        guidance,
+                        img_cfg_scale,
+                        c_out,
+                        c_skip,
+                        log_cfg_norm);
             int64_t t1 = ggml_time_us();
+            stats.step_ms.push_back((t1 - t0) / 1000.f);
             if (denoise_mask != nullptr) {
                 for (int64_t x = 0; x < denoised->ne[0]; x++) {
                     for (int64_t y = 0; y < denoised->ne[1]; y++) {
@@ -1327,12 +1507,8 @@ public:
                 pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
                 // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
             }
-            auto sd_preview_cb   = sd_get_preview_callback();
-            auto sd_preview_mode = sd_get_preview_mode();
-            if (sd_preview_cb != NULL) {
-                if (step % sd_get_preview_interval() == 0) {
-                    preview_image(work_ctx, step, denoised, version, sd_preview_mode, preview_tensor, sd_preview_cb);
-                }
+            if (preview_worker && step % sd_get_preview_interval() == 0) {
+                preview_worker->submit(step, denoised);
             }
             return denoised;
         };
@@ -1344,6 +1520,7 @@ public:
                 control_net->free_compute_buffer();
             }
             diffusion_model->free_compute_buffer();
+            stats.sampling_us += ggml_time_us() - sampling_start;
             return NULL;
         }
 
@@ -1354,6 +1531,7 @@ public:
             control_net->free_compute_buffer();
         }
         diffusion_model->free_compute_buffer();
+        stats.sampling_us += ggml_time_us() - sampling_start;
         return x;
     }
 
@@ -1414,7 +1592,116 @@ public:
         return latent;
     }
 
-    ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode) {
+    // compute buffer size of the first stage for a [w, h] latent, n of them at once
+    size_t get_first_stage_buffer_size(int w, int h, int64_t channels, bool decode, int64_t n) {
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = true;
+
+        struct ggml_context* probe_ctx = ggml_init(params);
+        if (!probe_ctx) {
+            LOG_ERROR("ggml_init() failed");
+            return SIZE_MAX;
+        }
+        ggml_tensor* z = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, decode ? w : w * 8, decode ? h : h * 8, channels, n);
+
+        size_t size;
+        if (use_tiny_autoencoder) {
+            size = tae_first_stage->get_compute_buffer_size([&]() -> struct ggml_cgraph* {
+                return tae_first_stage->build_graph(z, decode);
+            });
+        } else {
+            size = first_stage_model->get_compute_buffer_size([&]() -> struct ggml_cgraph* {
+                return first_stage_model->build_graph(z, decode);
+            });
+        }
+        ggml_free(probe_ctx);
+        LOG_DEBUG("VAE compute buffer for %dx%dx%" PRId64 ": %.2f MB", w, h, n, size / 1024.f / 1024.f);
+        return size;
+    }
+
+    // tile parameters of the first stage for x from vae_tiling_params, returns false if x is computed in one piece
+    bool get_first_stage_tiling(ggml_tensor* x, bool decode, int& tile_size_x, int& tile_size_y, float& tile_overlap, int& tile_batch_size) {
+        const sd_tiling_params_t& tiling = vae_tiling_params;
+
+        const int latent_x = x->ne[0] / (decode ? 1 : 8);
+        const int latent_y = x->ne[1] / (decode ? 1 : 8);
+
+        bool tiled      = vae_tiling || tiling.enabled;
+        tile_overlap    = std::max(0.f, std::min(tiling.target_overlap, 0.5f));
+        tile_batch_size = std::max(1, tiling.batch_size);
+        tile_size_x     = use_tiny_autoencoder ? 64 : 32;
+        tile_size_y     = tile_size_x;
+
+        bool auto_tile_size = false;
+
+        const int min_tile_dimension = 4;
+        if (tiling.tile_size_x > 0 || tiling.tile_size_y > 0) {
+            // a single size gets applied to both
+            int tmp_x   = tiling.tile_size_x > 0 ? tiling.tile_size_x : tiling.tile_size_y;
+            int tmp_y   = tiling.tile_size_y > 0 ? tiling.tile_size_y : tiling.tile_size_x;
+            tile_size_x = std::max(std::min(tmp_x, latent_x), min_tile_dimension);
+            tile_size_y = std::max(std::min(tmp_y, latent_y), min_tile_dimension);
+        } else if (tiling.rel_size_x > 0 || tiling.rel_size_y > 0) {
+            // <= 1 means simple fraction of the latent dimension
+            // > 1 means number of tiles across that dimension
+            auto get_tile_factor = [tile_overlap](float factor) {
+                if (factor > 1.0)
+                    factor = 1 / (factor - factor * tile_overlap + tile_overlap);
+                return factor;
+            };
+            float rel_x = tiling.rel_size_x > 0 ? tiling.rel_size_x : tiling.rel_size_y;
+            float rel_y = tiling.rel_size_y > 0 ? tiling.rel_size_y : tiling.rel_size_x;
+            int tmp_x   = std::round(latent_x * get_tile_factor(rel_x));
+            int tmp_y   = std::round(latent_y * get_tile_factor(rel_y));
+            tile_size_x = std::max(std::min(tmp_x, latent_x), min_tile_dimension);
+            tile_size_y = std::max(std::min(tmp_y, latent_y), min_tile_dimension);
+        } else if (tiling.memory_budget_mb > 0) {
+            // no tiling if the whole image fits in the budget, otherwise the largest tile that does
+            auto_tile_size = true;
+            size_t budget  = tiling.memory_budget_mb * 1024 * 1024;
+            if (get_first_stage_buffer_size(latent_x, latent_y, x->ne[2], decode, x->ne[3]) <= budget) {
+                tiled = false;
+            } else {
+                tiled = true;
+                // the compute buffer grows with the tile area, search in steps of 8 latent pixels
+                int lo   = 1;
+                int hi   = (std::max(latent_x, latent_y) + 7) / 8;
+                int best = 0;
+                while (lo <= hi) {
+                    int mid     = (lo + hi) / 2;
+                    size_t size = get_first_stage_buffer_size(std::min(mid * 8, latent_x),
+                                                              std::min(mid * 8, latent_y),
+                                                              x->ne[2],
+                                                              decode,
+                                                              tile_batch_size);
+                    if (size <= budget) {
+                        best = mid;
+                        lo   = mid + 1;
+                    } else {
+                        hi = mid - 1;
+                    }
+                }
+                if (best == 0) {
+                    LOG_WARN("VAE does not fit in %zu MB even with the smallest tiles", tiling.memory_budget_mb);
+                    best = 1;
+                }
+                tile_size_x = std::min(best * 8, latent_x);
+                tile_size_y = std::min(best * 8, latent_y);
+            }
+        }
+
+        if (!decode && !auto_tile_size && !use_tiny_autoencoder) {
+            // to keep the compute buffer size consistent
+            tile_size_x *= 1.30539;
+            tile_size_y *= 1.30539;
+        }
+        return tiled;
+    }
+
+    // keep_compute_buffer leaves the compute buffer allocated for the next call, free_first_stage_compute_buffer() releases it
+    ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode, bool keep_compute_buffer = false) {
         int64_t W = x->ne[0];
         int64_t H = x->ne[1];
         int64_t C = 8;
@@ -1432,88 +1719,13 @@ public:
                                                  decode ? (H * 8) : (H / 8),  // height
                                                  decode ? 3 : C,
                                                  x->ne[3]);  // channels
-        int64_t t0          = ggml_time_ms();
+        int64_t t0          = ggml_time_us();
 
-        // TODO: args instead of env for tile size / overlap?
-
-        float tile_overlap          = 0.5f;
-        const char* SD_TILE_OVERLAP = getenv("SD_TILE_OVERLAP");
-        if (SD_TILE_OVERLAP != nullptr) {
-            std::string sd_tile_overlap_str = SD_TILE_OVERLAP;
-            try {
-                tile_overlap = std::stof(sd_tile_overlap_str);
-                if (tile_overlap < 0.0) {
-                    LOG_WARN("SD_TILE_OVERLAP too low, setting it to 0.0");
-                    tile_overlap = 0.0;
-                } else if (tile_overlap > 0.5) {
-                    LOG_WARN("SD_TILE_OVERLAP too high, setting it to 0.5");
-                    tile_overlap = 0.5;
-                }
-            } catch (const std::invalid_argument&) {
-                LOG_WARN("SD_TILE_OVERLAP is invalid, keeping the default");
-            } catch (const std::out_of_range&) {
-                LOG_WARN("SD_TILE_OVERLAP is out of range, keeping the default");
-            }
-        }
-
-        int tile_size_x          = 32;
-        int tile_size_y          = 32;
-        const char* SD_TILE_SIZE = getenv("SD_TILE_SIZE");
-        if (SD_TILE_SIZE != nullptr) {
-            // format is AxB, or just A (equivalent to AxA)
-            // A and B can be integers (tile size) or floating point
-            // floating point <= 1 means simple fraction of the latent dimension
-            // floating point > 1 means number of tiles across that dimension
-            // a single number gets applied to both
-            auto get_tile_factor = [tile_overlap](const std::string& factor_str) {
-                float factor = std::stof(factor_str);
-                if (factor > 1.0)
-                    factor = 1 / (factor - factor * tile_overlap + tile_overlap);
-                return factor;
-            };
-            const int latent_x           = W / (decode ? 1 : 8);
-            const int latent_y           = H / (decode ? 1 : 8);
-            const int min_tile_dimension = 4;
-            std::string sd_tile_size_str = SD_TILE_SIZE;
-            size_t x_pos                 = sd_tile_size_str.find('x');
-            try {
-                int tmp_x = tile_size_x, tmp_y = tile_size_y;
-                if (x_pos != std::string::npos) {
-                    std::string tile_x_str = sd_tile_size_str.substr(0, x_pos);
-                    std::string tile_y_str = sd_tile_size_str.substr(x_pos + 1);
-                    if (tile_x_str.find('.') != std::string::npos) {
-                        tmp_x = std::round(latent_x * get_tile_factor(tile_x_str));
-                    } else {
-                        tmp_x = std::stoi(tile_x_str);
-                    }
-                    if (tile_y_str.find('.') != std::string::npos) {
-                        tmp_y = std::round(latent_y * get_tile_factor(tile_y_str));
-                    } else {
-                        tmp_y = std::stoi(tile_y_str);
-                    }
-                } else {
-                    if (sd_tile_size_str.find('.') != std::string::npos) {
-                        float tile_factor = get_tile_factor(sd_tile_size_str);
-                        tmp_x             = std::round(latent_x * tile_factor);
-                        tmp_y             = std::round(latent_y * tile_factor);
-                    } else {
-                        tmp_x = tmp_y = std::stoi(sd_tile_size_str);
-                    }
-                }
-                tile_size_x = std::max(std::min(tmp_x, latent_x), min_tile_dimension);
-                tile_size_y = std::max(std::min(tmp_y, latent_y), min_tile_dimension);
-            } catch (const std::invalid_argument&) {
-                LOG_WARN("SD_TILE_SIZE is invalid, keeping the default");
-            } catch (const std::out_of_range&) {
-                LOG_WARN("SD_TILE_SIZE is out of range, keeping the default");
-            }
-        }
-
-        if (!decode) {
-            // TODO: also use and arg for this one?
-            // to keep the compute buffer size consistent
-            tile_size_x *= 1.30539;
-            tile_size_y *= 1.30539;
+        int tile_size_x, tile_size_y, tile_batch_size;
+        float tile_overlap;
+        bool tiled = get_first_stage_tiling(x, decode, tile_size_x, tile_size_y, tile_overlap, tile_batch_size);
+        if (tiled) {
+            LOG_INFO("VAE tile size: %dx%d, overlap: %.2f, batch: %d", tile_size_x, tile_size_y, tile_overlap, tile_batch_size);
         }
         if (!use_tiny_autoencoder) {
             if (decode) {
@@ -1521,40 +1733,43 @@ public:
             } else {
                 ggml_tensor_scale_input(x);
             }
-            if (vae_tiling) {
-                if (SD_TILE_SIZE != nullptr) {
-                    LOG_INFO("VAE Tile size: %dx%d", tile_size_x, tile_size_y);
-                }
-                if (SD_TILE_OVERLAP != nullptr) {
-                    LOG_INFO("VAE Tile overlap: %.2f", tile_overlap);
-                }
-                // split latent in 32x32 tiles and compute in several steps
+            if (tiled) {
+                // split latent in tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     first_stage_model->compute(n_threads, in, decode, &out);
                 };
-                sd_tiling_non_square(x, result, 8, tile_size_x, tile_size_y, tile_overlap, on_tiling);
+                sd_tiling_non_square(x, result, 8, tile_size_x, tile_size_y, tile_overlap, on_tiling, tile_batch_size);
             } else {
                 first_stage_model->compute(n_threads, x, decode, &result);
             }
-            first_stage_model->free_compute_buffer();
+            if (!keep_compute_buffer) {
+                first_stage_model->free_compute_buffer();
+            }
             if (decode) {
                 ggml_tensor_scale_output(result);
             }
         } else {
-            if (vae_tiling) {
-                // split latent in 64x64 tiles and compute in several steps
+            if (tiled) {
+                // split latent in tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
                     tae_first_stage->compute(n_threads, in, decode, &out);
                 };
-                sd_tiling(x, result, 8, 64, 0.5f, on_tiling);
+                sd_tiling_non_square(x, result, 8, tile_size_x, tile_size_y, tile_overlap, on_tiling, tile_batch_size);
             } else {
                 tae_first_stage->compute(n_threads, x, decode, &result);
             }
-            tae_first_stage->free_compute_buffer();
+            if (!keep_compute_buffer) {
+                tae_first_stage->free_compute_buffer();
+            }
         }
 
-        int64_t t1 = ggml_time_ms();
-        LOG_DEBUG("computing vae [mode: %s] graph completed, taking %.2fs", decode ? "DECODE" : "ENCODE", (t1 - t0) * 1.0f / 1000);
+        int64_t t1 = ggml_time_us();
+        if (decode) {
+            stats.vae_decode_us += t1 - t0;
+        } else {
+            stats.vae_encode_us += t1 - t0;
+        }
+        LOG_DEBUG("computing vae [mode: %s] graph completed, taking %.2fs", decode ? "DECODE" : "ENCODE", (t1 - t0) * 1.0f / 1000000);
         if (decode) {
             ggml_tensor_clamp(result, 0.0f, 1.0f);
         }
@@ -1568,6 +1783,181 @@ public:
     ggml_tensor* decode_first_stage(ggml_context* work_ctx, ggml_tensor* x) {
         return compute_first_stage(work_ctx, x, true);
     }
+
+    void free_first_stage_compute_buffer() {
+        if (use_tiny_autoencoder) {
+            tae_first_stage->free_compute_buffer();
+        } else {
+            first_stage_model->free_compute_buffer();
+        }
+    }
+
+    // decodes all latents of a batch. Untiled, up to the tile batch size of them are stacked into one
+    // graph run (fewer if the memory budget asks for it), the compute buffer is kept until the last one.
+    std::vector<ggml_tensor*> decode_first_stage_batch(ggml_context* work_ctx, const std::vector<ggml_tensor*>& latents) {
+        std::vector<ggml_tensor*> images;
+        if (latents.empty()) {
+            return images;
+        }
+        ggml_tensor* x0 = latents[0];
+
+        int tile_size_x, tile_size_y, tile_batch_size;
+        float tile_overlap;
+        bool tiled          = get_first_stage_tiling(x0, true, tile_size_x, tile_size_y, tile_overlap, tile_batch_size);
+        int latents_per_run = 1;
+        if (!tiled) {
+            if (vae_tiling_params.latent_batch_size > 0) {
+                latents_per_run = std::min(vae_tiling_params.latent_batch_size, (int)latents.size());
+            } else if (vae_tiling_params.memory_budget_mb > 0) {
+                latents_per_run = (int)latents.size();
+            }
+        }
+        if (latents_per_run > 1 && vae_tiling_params.memory_budget_mb > 0) {
+            size_t budget = vae_tiling_params.memory_budget_mb * 1024 * 1024;
+            while (latents_per_run > 1 &&
+                   get_first_stage_buffer_size(x0->ne[0], x0->ne[1], x0->ne[2], true, latents_per_run) > budget) {
+                latents_per_run--;
+            }
+        }
+
+        for (size_t i = 0; i < latents.size(); i += latents_per_run) {
+            int64_t t1 = ggml_time_ms();
+            int n      = std::min(latents_per_run, (int)(latents.size() - i));
+            if (n == 1) {
+                images.push_back(compute_first_stage(work_ctx, latents[i], true, true));
+            } else {
+                // stack the latents along ne[3]
+                struct ggml_init_params params;
+                params.mem_size   = ggml_nbytes(x0) * n + ggml_tensor_overhead();
+                params.mem_buffer = NULL;
+                params.no_alloc   = false;
+
+                struct ggml_context* batch_ctx = ggml_init(params);
+                if (!batch_ctx) {
+                    LOG_ERROR("ggml_init() failed");
+                    break;
+                }
+                ggml_tensor* x = ggml_new_tensor_4d(batch_ctx, GGML_TYPE_F32, x0->ne[0], x0->ne[1], x0->ne[2], n);
+                for (int j = 0; j < n; j++) {
+                    memcpy((char*)x->data + j * x->nb[3], latents[i + j]->data, ggml_nbytes(latents[i + j]));
+                }
+                ggml_tensor* result = compute_first_stage(work_ctx, x, true, true);
+                for (int j = 0; j < n; j++) {
+                    images.push_back(ggml_view_3d(work_ctx, result, result->ne[0], result->ne[1], result->ne[2],
+                                                  result->nb[1], result->nb[2], j * result->nb[3]));
+                }
+                ggml_free(batch_ctx);
+            }
+            int64_t t2 = ggml_time_ms();
+            LOG_INFO("latents %zu-%zu decoded, taking %.2fs", i + 1, i + n, (t2 - t1) * 1.0f / 1000);
+        }
+        free_first_stage_compute_buffer();
+        return images;
+    }
+
+    // decodes x tile by tile in raster order, on_rows gets the finished rows as 8 bit rgb,
+    // only a band of one tile row of the image is held in memory
+    void decode_first_stage_rows(ggml_tensor* x, std::function<void(const uint8_t*, int, int)> on_rows, bool keep_compute_buffer = false) {
+        int64_t t0 = ggml_time_us();
+        int tile_size_x, tile_size_y, tile_batch_size;
+        float tile_overlap;
+        if (!get_first_stage_tiling(x, true, tile_size_x, tile_size_y, tile_overlap, tile_batch_size)) {
+            // a single tile over the whole latent
+            tile_size_x = (int)x->ne[0];
+            tile_size_y = (int)x->ne[1];
+        }
+        LOG_INFO("VAE tile size: %dx%d, overlap: %.2f, batch: %d", tile_size_x, tile_size_y, tile_overlap, tile_batch_size);
+
+        int width  = (int)x->ne[0] * 8;
+        int height = (int)x->ne[1] * 8;
+        std::vector<uint8_t> rows_data;
+        // the vae output is in [-1, 1], taesd's in [0, 1]
+        float a            = use_tiny_autoencoder ? 255.0f : 127.5f;
+        float b            = use_tiny_autoencoder ? 0.0f : 127.5f;
+        auto on_rows_ready = [&](ggml_tensor* band, int y, int num_rows) {
+            rows_data.resize(width * num_rows * 3);
+            sd_image_f32_planar_to_u8((const float*)band->data, rows_data.data(), width, num_rows, 3, a, b,
+                                      n_threads, band->ne[0] * band->ne[1]);
+            on_rows(rows_data.data(), y, num_rows);
+        };
+
+        if (!use_tiny_autoencoder) {
+            ggml_tensor_scale(x, 1.0f / scale_factor);
+            auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                first_stage_model->compute(n_threads, in, true, &out);
+            };
+            sd_tiling_stream(x, width, height, 3, 8, tile_size_x, tile_size_y, tile_overlap, on_tiling, on_rows_ready, tile_batch_size);
+        } else {
+            auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                tae_first_stage->compute(n_threads, in, true, &out);
+            };
+            sd_tiling_stream(x, width, height, 3, 8, tile_size_x, tile_size_y, tile_overlap, on_tiling, on_rows_ready, tile_batch_size);
+        }
+        if (!keep_compute_buffer) {
+            free_first_stage_compute_buffer();
+        }
+
+        int64_t t1 = ggml_time_us();
+        stats.vae_decode_us += t1 - t0;
+        LOG_DEBUG("computing vae [mode: DECODE, streamed] graph completed, taking %.2fs", (t1 - t0) * 1.0f / 1000000);
+    }
+
+    std::vector<GGMLRunner*> get_runners() {
+        std::vector<GGMLRunner*> runners;
+        if (cond_stage_model) {
+            cond_stage_model->get_runners(runners);
+        }
+        if (clip_vision) {
+            runners.push_back(clip_vision.get());
+        }
+        runners.push_back(diffusion_model->get_runner());
+        if (first_stage_model) {
+            runners.push_back(first_stage_model.get());
+        }
+        if (tae_first_stage) {
+            runners.push_back(tae_first_stage.get());
+        }
+        if (control_net) {
+            runners.push_back(control_net.get());
+        }
+        if (stacked_id) {
+            runners.push_back(pmid_model.get());
+        }
+        return runners;
+    }
+
+    // clears the stats and the compute buffer peaks of the runners. The params are counted now,
+    // free_params_immediately releases them during the generation.
+    void begin_generation_stats() {
+        stats          = GenerationStats();
+        stats.start_us = ggml_time_us();
+        if (cond_stage_model) {
+            cond_stage_model->tokenize_time_us = 0;
+        }
+        stats.runners = get_runners();
+        for (GGMLRunner* runner : stats.runners) {
+            runner->reset_max_compute_buffer_size();
+            sd_runner_stats_t runner_stats;
+            runner_stats.name                = NULL;
+            runner_stats.params_buffer_size  = runner->get_params_buffer_size();
+            runner_stats.compute_buffer_size = 0;
+            runner_stats.on_cpu              = ggml_backend_is_cpu(runner->get_backend());
+            stats.runner_names.push_back(runner->get_desc());
+            stats.runner_stats.push_back(runner_stats);
+        }
+    }
+
+    void end_generation_stats() {
+        stats.total_us = ggml_time_us() - stats.start_us;
+        if (cond_stage_model) {
+            stats.tokenize_us = cond_stage_model->tokenize_time_us;
+        }
+        for (size_t i = 0; i < stats.runners.size(); i++) {
+            stats.runner_stats[i].name                = stats.runner_names[i].c_str();
+            stats.runner_stats[i].compute_buffer_size = stats.runners[i]->get_max_compute_buffer_size();
+        }
+        stats.valid = true;
+    }
 };
 
 /*================================================= SD API ==================================================*/
@@ -1598,7 +1988,8 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      bool keep_control_net_cpu,
                      bool keep_vae_on_cpu,
                      bool diffusion_flash_attn,
-                     bool tae_preview_only) {
+                     bool tae_preview_only,
+                     bool use_mmap) {
     sd_ctx_t* sd_ctx = (sd_ctx_t*)malloc(sizeof(sd_ctx_t));
     if (sd_ctx == NULL) {
         return NULL;
@@ -1624,6 +2015,7 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
         return NULL;
     }
 
+    int64_t t0 = ggml_time_us();
     if (!sd_ctx->sd->load_from_file(model_path,
                                     clip_l_path,
                                     clip_g_path,
@@ -1641,12 +2033,14 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                                     keep_control_net_cpu,
                                     keep_vae_on_cpu,
                                     diffusion_flash_attn,
-                                    tae_preview_only)) {
+                                    tae_preview_only,
+                                    use_mmap)) {
         delete sd_ctx->sd;
         sd_ctx->sd = NULL;
         free(sd_ctx);
         return NULL;
     }
+    sd_ctx->sd->load_time_us = ggml_time_us() - t0;
     return sd_ctx;
 }
 
@@ -1707,8 +2101,15 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     LOG_DEBUG("prompt after extract and remove lora: \"%s\"", prompt.c_str());
 
     int64_t t0 = ggml_time_ms();
-    sd_ctx->sd->apply_loras(lora_f2m);
+    if (sd_ctx->sd->lora_runtime) {
+        sd_ctx->sd->set_runtime_loras(lora_f2m);
+    } else if (!sd_ctx->sd->apply_loras(lora_f2m)) {
+        ggml_free(work_ctx);
+        return NULL;
+    }
+    LoraAdapterScope lora_adapter_scope(&sd_ctx->sd->runtime_lora_adapters);
     int64_t t1 = ggml_time_ms();
+    sd_ctx->sd->stats.lora_apply_us += (t1 - t0) * 1000;
     LOG_INFO("apply_loras completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
 
     // Photo Maker
@@ -1722,6 +2123,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, sd_ctx->sd->version, sd_ctx->sd->n_threads);
             t1                             = ggml_time_ms();
             sd_ctx->sd->pmid_lora->applied = true;
+            sd_ctx->sd->stats.lora_apply_us += (t1 - t0) * 1000;
             LOG_INFO("pmid_lora apply completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
             if (sd_ctx->sd->free_params_immediately) {
                 sd_ctx->sd->pmid_lora->free_params_buffer();
@@ -1816,7 +2218,9 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         input_id_images.clear();
     }
 
-    // Get learned condition
+    // Get learned condition, the stats count the tokenizers apart
+    int64_t tokenize_us = sd_ctx->sd->cond_stage_model->tokenize_time_us;
+
     t0               = ggml_time_ms();
     SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
                                                                            sd_ctx->sd->n_threads,
@@ -1841,7 +2245,9 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                                                                      sd_ctx->sd->diffusion_model->get_adm_in_channels(),
                                                                      force_zero_embeddings);
     }
-    t1 = ggml_time_ms();
+    t1          = ggml_time_ms();
+    tokenize_us = sd_ctx->sd->cond_stage_model->tokenize_time_us - tokenize_us;
+    sd_ctx->sd->stats.text_encoder_us += (t1 - t0) * 1000 - tokenize_us;
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
 
     if (sd_ctx->sd->free_params_immediately) {
@@ -2007,15 +2413,22 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     // Decode to image
     LOG_INFO("decoding %zu latents", final_latents.size());
     std::vector<struct ggml_tensor*> decoded_images;  // collect decoded images
-    for (size_t i = 0; i < final_latents.size(); i++) {
-        t1                      = ggml_time_ms();
-        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents[i] /* x_0 */);
-        // print_ggml_tensor(img);
-        if (img != NULL) {
-            decoded_images.push_back(img);
+    auto image_rows_cb = sd_get_image_rows_callback();
+    if (image_rows_cb != NULL) {
+        for (size_t i = 0; i < final_latents.size(); i++) {
+            t1 = ggml_time_ms();
+            // hand the rows over as they are done instead of keeping the image
+            auto on_rows = [&](const uint8_t* rows, int y, int num_rows) {
+                sd_image_t rows_image = {(uint32_t)width, (uint32_t)num_rows, 3, (uint8_t*)rows};
+                image_rows_cb((int)i, (uint32_t)y, rows_image, sd_get_image_rows_callback_data());
+            };
+            sd_ctx->sd->decode_first_stage_rows(final_latents[i], on_rows, true);
+            int64_t t2 = ggml_time_ms();
+            LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
         }
-        int64_t t2 = ggml_time_ms();
-        LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
+        sd_ctx->sd->free_first_stage_compute_buffer();
+    } else {
+        decoded_images = sd_ctx->sd->decode_first_stage_batch(work_ctx, final_latents);
     }
 
     int64_t t4 = ggml_time_ms();
@@ -2029,12 +2442,20 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         return NULL;
     }
 
+    if (image_rows_cb != NULL) {
+        for (size_t i = 0; i < final_latents.size(); i++) {
+            result_images[i].width   = width;
+            result_images[i].height  = height;
+            result_images[i].channel = 3;
+        }
+    }
     for (size_t i = 0; i < decoded_images.size(); i++) {
         result_images[i].width   = width;
         result_images[i].height  = height;
         result_images[i].channel = 3;
         result_images[i].data    = sd_tensor_to_image(decoded_images[i]);
     }
+    sd_ctx->sd->stats.add_work_ctx(work_ctx);
     ggml_free(work_ctx);
 
     return result_images;
@@ -2056,11 +2477,14 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                     float control_strength,
                     float style_ratio,
                     bool normalize_input,
-                    const char* input_id_images_path_c_str) {
+                    const char* input_id_images_path_c_str,
+                    sd_tiling_params_t vae_tiling_params) {
     LOG_DEBUG("txt2img %dx%d", width, height);
     if (sd_ctx == NULL) {
         return NULL;
     }
+    sd_ctx->sd->vae_tiling_params = vae_tiling_params;
+    sd_ctx->sd->begin_generation_stats();
 
     struct ggml_init_params params;
     params.mem_size = static_cast<size_t>(20 * 1024 * 1024);  // 20 MB
@@ -2073,11 +2497,10 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
     if (sd_ctx->sd->stacked_id) {
         params.mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     }
-    auto sd_preview_mode = sd_get_preview_mode();
-    if (sd_preview_mode != SD_PREVIEW_NONE && sd_preview_mode != SD_PREVIEW_PROJ) {
-        params.mem_size *= 2;
+    if (sd_get_image_rows_callback() == NULL) {
+        // decoded images, streamed rows never materialize them
+        params.mem_size += width * height * 3 * sizeof(float);
     }
-    params.mem_size += width * height * 3 * sizeof(float);
     params.mem_size *= batch_count;
     params.mem_buffer = NULL;
     params.no_alloc   = false;
@@ -2135,6 +2558,7 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                                                input_id_images_path_c_str,
                                                {});
 
+    sd_ctx->sd->end_generation_stats();
     size_t t1 = ggml_time_ms();
 
     LOG_INFO("txt2img completed in %.2fs", (t1 - t0) * 1.0f / 1000);
@@ -2161,11 +2585,14 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                     float control_strength,
                     float style_ratio,
                     bool normalize_input,
-                    const char* input_id_images_path_c_str) {
+                    const char* input_id_images_path_c_str,
+                    sd_tiling_params_t vae_tiling_params) {
     LOG_DEBUG("img2img %dx%d", width, height);
     if (sd_ctx == NULL) {
         return NULL;
     }
+    sd_ctx->sd->vae_tiling_params = vae_tiling_params;
+    sd_ctx->sd->begin_generation_stats();
 
     struct ggml_init_params params;
     params.mem_size = static_cast<size_t>(20 * 1024 * 1024);  // 20 MB
@@ -2329,6 +2756,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                                                normalize_input,
                                                input_id_images_path_c_str, {}, concat_latent, denoise_mask);
 
+    sd_ctx->sd->end_generation_stats();
     size_t t2 = ggml_time_ms();
 
     LOG_INFO("img2img completed in %.2fs", (t1 - t0) * 1.0f / 1000);
@@ -2336,6 +2764,45 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     return result_images;
 }
 
+// the SVD conditions of init_image, allocated in work_ctx
+static void get_img2vid_conditions(sd_ctx_t* sd_ctx,
+                                   ggml_context* work_ctx,
+                                   sd_image_t init_image,
+                                   int width,
+                                   int height,
+                                   int motion_bucket_id,
+                                   int fps,
+                                   float augmentation_level,
+                                   SDCondition& cond,
+                                   SDCondition& uncond) {
+    int64_t t0 = ggml_time_ms();
+
+    cond = sd_ctx->sd->get_svd_condition(work_ctx,
+                                         init_image,
+                                         width,
+                                         height,
+                                         fps,
+                                         motion_bucket_id,
+                                         augmentation_level);
+
+    auto uc_crossattn = ggml_dup_tensor(work_ctx, cond.c_crossattn);
+    ggml_set_f32(uc_crossattn, 0.f);
+
+    auto uc_concat = ggml_dup_tensor(work_ctx, cond.c_concat);
+    ggml_set_f32(uc_concat, 0.f);
+
+    auto uc_vector = ggml_dup_tensor(work_ctx, cond.c_vector);
+
+    uncond = SDCondition(uc_crossattn, uc_vector, uc_concat);
+
+    int64_t t1 = ggml_time_ms();
+    sd_ctx->sd->stats.text_encoder_us += (t1 - t0) * 1000;
+    LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
+    if (sd_ctx->sd->free_params_immediately) {
+        sd_ctx->sd->clip_vision->free_params_buffer();
+    }
+}
+
 SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
                            int width,
@@ -2348,10 +2815,13 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            enum sample_method_t sample_method,
                            int sample_steps,
                            float strength,
-                           int64_t seed) {
+                           int64_t seed,
+                           sd_tiling_params_t vae_tiling_params) {
     if (sd_ctx == NULL) {
         return NULL;
     }
+    sd_ctx->sd->vae_tiling_params = vae_tiling_params;
+    sd_ctx->sd->begin_generation_stats();
 
     LOG_INFO("img2vid %dx%d", width, height);
 
@@ -2379,29 +2849,10 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
 
     int64_t t0 = ggml_time_ms();
 
-    SDCondition cond = sd_ctx->sd->get_svd_condition(work_ctx,
-                                                     init_image,
-                                                     width,
-                                                     height,
-                                                     fps,
-                                                     motion_bucket_id,
-                                                     augmentation_level);
-
-    auto uc_crossattn = ggml_dup_tensor(work_ctx, cond.c_crossattn);
-    ggml_set_f32(uc_crossattn, 0.f);
-
-    auto uc_concat = ggml_dup_tensor(work_ctx, cond.c_concat);
-    ggml_set_f32(uc_concat, 0.f);
-
-    auto uc_vector = ggml_dup_tensor(work_ctx, cond.c_vector);
-
-    SDCondition uncond = SDCondition(uc_crossattn, uc_vector, uc_concat);
-
+    SDCondition cond;
+    SDCondition uncond;
+    get_img2vid_conditions(sd_ctx, work_ctx, init_image, width, height, motion_bucket_id, fps, augmentation_level, cond, uncond);
     int64_t t1 = ggml_time_ms();
-    LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
-    if (sd_ctx->sd->free_params_immediately) {
-        sd_ctx->sd->clip_vision->free_params_buffer();
-    }
 
     sd_ctx->sd->rng->manual_seed(seed);
     int C                   = 4;
@@ -2459,8 +2910,10 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
         result_images[i].channel = 3;
         result_images[i].data    = sd_tensor_to_image(img_i);
     }
+    sd_ctx->sd->stats.add_work_ctx(work_ctx);
     ggml_free(work_ctx);
 
+    sd_ctx->sd->end_generation_stats();
     int64_t t3 = ggml_time_ms();
 
     LOG_INFO("img2vid completed in %.2fs", (t3 - t0) * 1.0f / 1000);
@@ -2468,6 +2921,175 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
     return result_images;
 }
 
+SD_API bool img2vid_windowed(sd_ctx_t* sd_ctx,
+                             sd_image_t init_image,
+                             int width,
+                             int height,
+                             int video_frames,
+                             int motion_bucket_id,
+                             int fps,
+                             float augmentation_level,
+                             sd_guidance_params_t guidance,
+                             enum sample_method_t sample_method,
+                             int sample_steps,
+                             float strength,
+                             int64_t seed,
+                             sd_tiling_params_t vae_tiling_params,
+                             int window_frames,
+                             int window_overlap,
+                             sd_image_rows_cb_t on_frame,
+                             void* data) {
+    if (sd_ctx == NULL || on_frame == NULL || video_frames <= 0) {
+        return false;
+    }
+    sd_ctx->sd->vae_tiling_params = vae_tiling_params;
+    sd_ctx->sd->begin_generation_stats();
+    window_frames                 = window_frames <= 0 ? video_frames : std::min(window_frames, video_frames);
+    window_overlap                = std::max(0, std::min(window_overlap, window_frames - 1));
+
+    // window starts, the last window is moved back to end at the last frame
+    std::vector<int> starts;
+    for (int start = 0;; start += window_frames - window_overlap) {
+        start = std::min(start, video_frames - window_frames);
+        starts.push_back(start);
+        if (start + window_frames >= video_frames) {
+            break;
+        }
+    }
+    LOG_INFO("img2vid %dx%d, %d frames in %d windows of %d frames overlapping by %d",
+             width, height, video_frames, (int)starts.size(), window_frames, window_overlap);
+
+    std::vector<float> sigmas = sd_ctx->sd->denoiser->get_sigmas(sample_steps);
+
+    // the conditions, shared by all windows
+    struct ggml_init_params params;
+    params.mem_size = static_cast<size_t>(10 * 1024) * 1024;  // 10 MB
+    params.mem_size += width * height * 3 * sizeof(float);
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* cond_ctx = ggml_init(params);
+    if (!cond_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return false;
+    }
+
+    if (seed < 0) {
+        seed = (int)time(NULL);
+    }
+
+    sd_ctx->sd->rng->manual_seed(seed);
+
+    int64_t t0 = ggml_time_ms();
+
+    SDCondition cond;
+    SDCondition uncond;
+    get_img2vid_conditions(sd_ctx, cond_ctx, init_image, width, height, motion_bucket_id, fps, augmentation_level, cond, uncond);
+
+    sd_ctx->sd->rng->manual_seed(seed);
+    int C             = 4;
+    int W             = width / 8;
+    int H             = height / 8;
+    size_t frame_size = (size_t)W * H * C;
+
+    // final latents and noise of the frames the next window shares with the current one
+    std::vector<float> held_latents;
+    std::vector<float> held_noise;
+
+    bool ok = true;
+    for (size_t k = 0; k < starts.size() && ok; k++) {
+        int start      = starts[k];
+        int next_start = k + 1 < starts.size() ? starts[k + 1] : video_frames;
+        int overlap    = k > 0 ? starts[k - 1] + window_frames - start : 0;
+        int n_final    = next_start - start;  // frames no later window touches
+        LOG_INFO("window %d/%d: frames %d-%d", (int)k + 1, (int)starts.size(), start, start + window_frames - 1);
+
+        params.mem_size = static_cast<size_t>(10 * 1024) * 1024;  // 10 MB
+        params.mem_size += width * height * 3 * sizeof(float) * window_frames;
+
+        struct ggml_context* work_ctx = ggml_init(params);
+        if (!work_ctx) {
+            LOG_ERROR("ggml_init() failed");
+            ok = false;
+            break;
+        }
+
+        struct ggml_tensor* x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, window_frames);
+        ggml_set_f32(x_t, 0.f);
+
+        // shared frames keep the noise they had in the previous window, the new ones continue the seed
+        struct ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, window_frames);
+        float* noise_data         = (float*)noise->data;
+        if (overlap > 0) {
+            memcpy(noise_data, held_noise.data(), overlap * frame_size * sizeof(float));
+        }
+        sd_ctx->sd->rng->randn(noise_data + overlap * frame_size, (window_frames - overlap) * frame_size);
+
+        struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
+                                                     x_t,
+                                                     noise,
+                                                     cond,
+                                                     uncond,
+                                                     {},
+                                                     0.f,
+                                                     guidance,
+                                                     0.f,
+                                                     sample_method,
+                                                     sigmas,
+                                                     -1,
+                                                     SDCondition(NULL, NULL, NULL),
+                                                     std::vector<struct ggml_tensor*>(),
+                                                     NULL);
+        if (x_0 == NULL) {
+            ggml_free(work_ctx);
+            ok = false;
+            break;
+        }
+
+        // crossfade from the previous window over the shared frames
+        float* latents = (float*)x_0->data;
+        for (int i = 0; i < overlap; i++) {
+            float a           = (i + 1.0f) / (overlap + 1.0f);
+            float* frame      = latents + i * frame_size;
+            const float* held = held_latents.data() + i * frame_size;
+            for (size_t j = 0; j < frame_size; j++) {
+                frame[j] = held[j] * (1.0f - a) + frame[j] * a;
+            }
+        }
+        held_latents.assign(latents + n_final * frame_size, latents + window_frames * frame_size);
+        held_noise.assign(noise_data + n_final * frame_size, noise_data + window_frames * frame_size);
+
+        // decode and hand over the final frames, the decoder sees them together
+        struct ggml_tensor* final_latents = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, n_final);
+        memcpy(final_latents->data, latents, n_final * frame_size * sizeof(float));
+        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents);
+        if (img == NULL) {
+            ggml_free(work_ctx);
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < n_final; i++) {
+            sd_image_t frame = {(uint32_t)width, (uint32_t)height, 3, sd_tensor_to_mul_image(img, i)};
+            on_frame(start + i, 0, frame, data);
+            free(frame.data);
+        }
+        sd_ctx->sd->stats.add_work_ctx(work_ctx);
+        ggml_free(work_ctx);
+    }
+    sd_ctx->sd->stats.add_work_ctx(cond_ctx);
+    ggml_free(cond_ctx);
+
+    if (sd_ctx->sd->free_params_immediately) {
+        sd_ctx->sd->diffusion_model->free_params_buffer();
+        sd_ctx->sd->first_stage_model->free_params_buffer();
+    }
+
+    sd_ctx->sd->end_generation_stats();
+    int64_t t1 = ggml_time_ms();
+    LOG_INFO("img2vid completed in %.2fs", (t1 - t0) * 1.0f / 1000);
+    return ok;
+}
+
 sd_image_t* edit(sd_ctx_t* sd_ctx,
                  sd_image_t* ref_images,
                  int ref_images_count,
@@ -2486,11 +3108,14 @@ sd_image_t* edit(sd_ctx_t* sd_ctx,
                  float control_strength,
                  float style_ratio,
                  bool normalize_input,
-                 const char* input_id_images_path_c_str) {
+                 const char* input_id_images_path_c_str,
+                 sd_tiling_params_t vae_tiling_params) {
     LOG_DEBUG("edit %dx%d", width, height);
     if (sd_ctx == NULL) {
         return NULL;
     }
+    sd_ctx->sd->vae_tiling_params = vae_tiling_params;
+    sd_ctx->sd->begin_generation_stats();
     if (ref_images_count <= 0) {
         LOG_ERROR("ref images count should > 0");
         return NULL;
@@ -2576,9 +3201,213 @@ sd_image_t* edit(sd_ctx_t* sd_ctx,
                                                NULL,
                                                ref_latents);
 
+    sd_ctx->sd->end_generation_stats();
     size_t t2 = ggml_time_ms();
 
     LOG_INFO("edit completed in %.2fs", (t2 - t0) * 1.0f / 1000);
 
     return result_images;
-}
\ No newline at end of file
+}
+
+bool sd_get_generation_stats(sd_ctx_t* sd_ctx, sd_generation_stats_t* stats) {
+    if (sd_ctx == NULL || sd_ctx->sd == NULL || stats == NULL || !sd_ctx->sd->stats.valid) {
+        return false;
+    }
+    const GenerationStats& s = sd_ctx->sd->stats;
+    stats->load_ms           = sd_ctx->sd->load_time_us / 1000.f;
+    stats->lora_apply_ms     = s.lora_apply_us / 1000.f;
+    stats->tokenize_ms       = s.tokenize_us / 1000.f;
+    stats->text_encoder_ms   = s.text_encoder_us / 1000.f;
+    stats->sampling_ms       = s.sampling_us / 1000.f;
+    stats->control_net_ms    = s.control_net_us / 1000.f;
+    stats->vae_encode_ms     = s.vae_encode_us / 1000.f;
+    stats->vae_decode_ms     = s.vae_decode_us / 1000.f;
+    stats->preview_ms        = s.preview_us / 1000.f;
+    stats->total_ms          = s.total_us / 1000.f;
+    stats->step_ms           = s.step_ms.data();
+    stats->step_count        = (int)s.step_ms.size();
+    stats->runners           = s.runner_stats.data();
+    stats->runner_count      = (int)s.runner_stats.size();
+    stats->work_ctx_size     = s.work_ctx_size;
+    return true;
+}
+
+/*================================================== Tiny models ===================================================*/
+
+bool generate_tiny_model(const char* arch, int depth, bool with_t5, uint64_t seed, const char* output_path, enum sd_type_t output_type) {
+    std::map<std::string, SDVersion> versions = {
+        {"sd1", VERSION_SD1},
+        {"sd2", VERSION_SD2},
+        {"sdxl", VERSION_SDXL},
+        {"sd3", VERSION_SD3},
+        {"flux", VERSION_FLUX},
+        {"flux-schnell", VERSION_FLUX},
+    };
+    auto it = versions.find(arch);
+    if (it == versions.end()) {
+        LOG_ERROR("unknown architecture '%s'", arch);
+        return false;
+    }
+    SDVersion version = it->second;
+    depth             = std::max(depth, 1);
+    std::string last  = std::to_string(depth - 1);
+
+    // with the marker the runners read their block counts from the tensor names, one name of the last block
+    // of a stack is enough
+    std::map<std::string, enum ggml_type> tensor_types;
+    tensor_types[SD_TINY_MODEL_KEY] = GGML_TYPE_COUNT;
+    if (sd_version_is_sd3(version)) {
+        tensor_types["model.diffusion_model.joint_blocks." + last + ".x_block.attn.qkv.weight"]               = GGML_TYPE_F32;
+        tensor_types["text_encoders.clip_l.transformer.text_model.encoder.layers." + last + ".mlp.fc1.weight"] = GGML_TYPE_F32;
+        tensor_types["text_encoders.clip_g.transformer.text_model.encoder.layers." + last + ".mlp.fc1.weight"] = GGML_TYPE_F32;
+    } else if (sd_version_is_flux(version)) {
+        tensor_types["model.diffusion_model.double_blocks." + last + ".img_attn.qkv.weight"]                   = GGML_TYPE_F32;
+        tensor_types["model.diffusion_model.single_blocks." + last + ".linear1.weight"]                        = GGML_TYPE_F32;
+        tensor_types["text_encoders.clip_l.transformer.text_model.encoder.layers." + last + ".mlp.fc1.weight"] = GGML_TYPE_F32;
+        if (strcmp(arch, "flux") == 0) {
+            tensor_types["model.diffusion_model.guidance_in.in_layer.weight"] = GGML_TYPE_F32;
+        }
+    } else {
+        // depth res blocks per level (at most the 2 of the real models) and transformer blocks per attention layer
+        int levels           = sd_version_is_sdxl(version) ? 3 : 4;
+        int res_blocks       = std::min(depth, 2);
+        int last_input_block = levels * (res_blocks + 1) - 1;
+        tensor_types["model.diffusion_model.input_blocks." + std::to_string(last_input_block) + ".0.in_layers.0.weight"] = GGML_TYPE_F32;
+        // the transformer depth is per level, levels without attention ignore it
+        for (int i = 0; i < levels; i++) {
+            std::string input_block = std::to_string(1 + i * (res_blocks + 1));
+            tensor_types["model.diffusion_model.input_blocks." + input_block + ".1.transformer_blocks." + last + ".attn1.to_q.weight"] = GGML_TYPE_F32;
+        }
+        tensor_types["model.diffusion_model.middle_block.1.transformer_blocks." + last + ".attn1.to_q.weight"]          = GGML_TYPE_F32;
+        tensor_types["cond_stage_model.transformer.text_model.encoder.layers." + last + ".mlp.fc1.weight"]              = GGML_TYPE_F32;
+        if (sd_version_is_sdxl(version)) {
+            tensor_types["cond_stage_model.1.transformer.text_model.encoder.layers." + last + ".mlp.fc1.weight"] = GGML_TYPE_F32;
+        }
+    }
+    if (with_t5 && (sd_version_is_sd3(version) || sd_version_is_flux(version))) {
+        tensor_types["text_encoders.t5xxl.transformer.encoder.block." + last + ".layer.0.SelfAttention.q.weight"] = GGML_TYPE_F32;
+    }
+
+    // the real runners give the exact names and shapes
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    std::shared_ptr<Conditioner> cond_stage_model;
+    std::shared_ptr<DiffusionModel> diffusion_model;
+    if (sd_version_is_sd3(version)) {
+        cond_stage_model = std::make_shared<SD3CLIPEmbedder>(backend, tensor_types);
+        diffusion_model  = std::make_shared<MMDiTModel>(backend, tensor_types);
+    } else if (sd_version_is_flux(version)) {
+        cond_stage_model = std::make_shared<FluxCLIPEmbedder>(backend, tensor_types);
+        diffusion_model  = std::make_shared<FluxModel>(backend, tensor_types, version);
+    } else {
+        cond_stage_model = std::make_shared<FrozenCLIPEmbedderWithCustomWords>(backend, tensor_types, "", version);
+        diffusion_model  = std::make_shared<UNetModel>(backend, tensor_types, version);
+    }
+    auto first_stage_model = std::make_shared<AutoEncoderKL>(backend, tensor_types, "first_stage_model", false, false, version);
+    cond_stage_model->alloc_params_buffer();
+    diffusion_model->alloc_params_buffer();
+    first_stage_model->alloc_params_buffer();
+
+    std::map<std::string, struct ggml_tensor*> tensors;
+    cond_stage_model->get_param_tensors(tensors);
+    diffusion_model->get_param_tensors(tensors);
+    first_stage_model->get_param_tensors(tensors, "first_stage_model");
+
+    // weights ~ N(0, 1 / fan_in) keep the activations in range through the blocks, norm scales are 1 and biases 0.
+    // Philox draws one stream per tensor, the weights only depend on the seed and the tensor names.
+    std::vector<std::pair<std::string, struct ggml_tensor*>> list(tensors.begin(), tensors.end());
+    std::atomic<bool> failed(false);
+    int64_t n_params = 0;
+    for (auto& pair : list) {
+        if (pair.second->data == NULL) {
+            LOG_ERROR("tensor '%s' has no buffer", pair.first.c_str());
+            failed = true;
+            break;
+        }
+        n_params += ggml_nelements(pair.second);
+    }
+    if (!failed) {
+        std::atomic<size_t> next_tensor(0);
+        auto worker = [&]() {
+            std::vector<float> values;
+            for (size_t i = next_tensor++; i < list.size(); i = next_tensor++) {
+                const std::string& name = list[i].first;
+                struct ggml_tensor* t   = list[i].second;
+                int64_t n               = ggml_nelements(t);
+                int n_dims              = ggml_n_dims(t);
+                values.resize(n);
+                if (n_dims >= 2) {
+                    float scale = 1.0f / sqrtf((float)(n / t->ne[n_dims - 1]));
+                    PhiloxRNG::randn(seed, (uint32_t)i, 0, n, values.data());
+                    for (int64_t j = 0; j < n; j++) {
+                        values[j] *= scale;
+                    }
+                } else {
+                    std::fill(values.begin(), values.end(), ends_with(name, ".bias") ? 0.0f : 1.0f);
+                }
+                if (t->type == GGML_TYPE_F32) {
+                    memcpy(t->data, values.data(), n * sizeof(float));
+                } else if (t->type == GGML_TYPE_F16) {
+                    ggml_fp32_to_fp16_row(values.data(), (ggml_fp16_t*)t->data, n);
+                } else {
+                    LOG_ERROR("tensor '%s' has the unexpected type %s", name.c_str(), ggml_type_name(t->type));
+                    failed = true;
+                }
+            }
+        };
+        int n_workers = std::min(get_num_physical_cores(), (int)list.size());
+        if (n_workers <= 1) {
+            worker();
+        } else {
+            std::vector<std::thread> workers;
+            for (int i = 0; i < n_workers; i++) {
+                workers.emplace_back(worker);
+            }
+            for (auto& t : workers) {
+                t.join();
+            }
+        }
+    }
+
+    // written as is first, the loader then converts it to output_type like a real checkpoint
+    std::string tmp_path = std::string(output_path) + ".tmp";
+    if (!failed) {
+        LOG_INFO("%s with depth %d: %d tensors, %.1fM parameters", arch, depth, (int)list.size(), n_params / 1e6);
+        gguf_context* gguf_ctx = gguf_init_empty();
+        gguf_set_val_bool(gguf_ctx, SD_TINY_MODEL_KEY, true);
+        for (auto& pair : list) {
+            ggml_set_name(pair.second, pair.first.c_str());
+            gguf_add_tensor(gguf_ctx, pair.second);
+        }
+        if (!gguf_write_to_file(gguf_ctx, tmp_path.c_str(), false)) {
+            LOG_ERROR("failed to write '%s'", tmp_path.c_str());
+            failed = true;
+        }
+        gguf_free(gguf_ctx);
+    }
+    cond_stage_model.reset();
+    diffusion_model.reset();
+    first_stage_model.reset();
+    ggml_backend_free(backend);
+    if (failed) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    bool success = false;
+    {
+        ModelLoader model_loader;
+        if (model_loader.init_from_file(tmp_path)) {
+            SDVersion detected = model_loader.get_sd_version();
+            if (detected != version) {
+                LOG_WARN("the model is detected as %s instead of %s",
+                         detected < VERSION_COUNT ? model_version_to_str[detected] : "unknown",
+                         model_version_to_str[version]);
+            }
+            success = model_loader.save_to_gguf_file(output_path, (ggml_type)output_type);
+        } else {
+            LOG_ERROR("init model loader from file failed: '%s'", tmp_path.c_str());
+        }
+    }
+    remove(tmp_path.c_str());
+    return success;
+}
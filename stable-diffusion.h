@@ -129,13 +129,19 @@ typedef struct {
 
 typedef void (*sd_log_cb_t)(enum sd_log_level_t level, const char* text, void* data);
 typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
+// called from a preview thread while sampling goes on, a step is skipped when the previous preview
+// is still rendering. The image data is freed after the callback returns.
 typedef void (*sd_preview_cb_t)(int, sd_image_t);
 typedef bool (*sd_graph_eval_callback_t)(struct ggml_tensor* t, bool ask, void* user_data);
+// rows.height rows of image index, starting at row y. When set, generated images are decoded
+// in streaming mode and handed over only through this callback, their data is NULL in the results.
+typedef void (*sd_image_rows_cb_t)(int index, uint32_t y, sd_image_t rows, void* data);
 
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
 SD_API void sd_set_preview_callback(sd_preview_cb_t cb, sd_preview_t mode, int interval);
 SD_API void sd_set_backend_eval_callback(sd_graph_eval_callback_t cb, void* data);
+SD_API void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data);
 SD_API int32_t get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -166,6 +172,18 @@ typedef struct sd_guidance_params_t {
     sd_apg_params_t apg;
 } sd_guidance_params_t;
 
+typedef struct sd_tiling_params_t {
+    bool enabled;             // tile even without a memory budget, also enabled by vae_tiling of new_sd_ctx
+    int tile_size_x;          // tile size in latent pixels, <= 0 to pick it from rel_size or the memory budget
+    int tile_size_y;
+    float target_overlap;     // [0, 0.5]
+    float rel_size_x;         // <= 1: fraction of the latent width, > 1: number of tiles across, 0: unused
+    float rel_size_y;
+    int batch_size;           // tiles computed together in one graph
+    size_t memory_budget_mb;  // compute buffer budget of the VAE, 0: no budget
+    int latent_batch_size;    // latents the VAE decodes together when not tiling, 0: as many as fit the budget (1 without one)
+} sd_tiling_params_t;
+
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* clip_l_path,
                             const char* clip_g_path,
@@ -188,7 +206,8 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             bool keep_control_net_cpu,
                             bool keep_vae_on_cpu,
                             bool diffusion_flash_attn,
-                            bool tae_preview_only);
+                            bool tae_preview_only,
+                            bool use_mmap);  // map gguf/safetensors files, cpu weights are used in place
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
@@ -208,7 +227,8 @@ SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            float control_strength,
                            float style_strength,
                            bool normalize_input,
-                           const char* input_id_images_path);
+                           const char* input_id_images_path,
+                           sd_tiling_params_t vae_tiling_params);
 
 SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
@@ -229,7 +249,8 @@ SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            float control_strength,
                            float style_strength,
                            bool normalize_input,
-                           const char* input_id_images_path);
+                           const char* input_id_images_path,
+                           sd_tiling_params_t vae_tiling_params);
 
 SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
@@ -243,7 +264,32 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            enum sample_method_t sample_method,
                            int sample_steps,
                            float strength,
-                           int64_t seed);
+                           int64_t seed,
+                           sd_tiling_params_t vae_tiling_params);
+
+// img2vid in temporal windows of window_frames frames (<= 0 for the whole clip) overlapping by
+// window_overlap frames, for clips too long to sample at once. Each window is sampled on its own, the
+// shared frames keep their noise and their latents are crossfaded from one window to the next.
+// Frames are decoded per window and handed over through on_frame(frame, 0, image, data) as soon as no
+// later window touches them, the memory use depends on the window and not on video_frames.
+SD_API bool img2vid_windowed(sd_ctx_t* sd_ctx,
+                             sd_image_t init_image,
+                             int width,
+                             int height,
+                             int video_frames,
+                             int motion_bucket_id,
+                             int fps,
+                             float augmentation_level,
+                             sd_guidance_params_t guidance,
+                             enum sample_method_t sample_method,
+                             int sample_steps,
+                             float strength,
+                             int64_t seed,
+                             sd_tiling_params_t vae_tiling_params,
+                             int window_frames,
+                             int window_overlap,
+                             sd_image_rows_cb_t on_frame,
+                             void* data);
 
 SD_API sd_image_t* edit(sd_ctx_t* sd_ctx,
                         sd_image_t* ref_images,
@@ -263,7 +309,39 @@ SD_API sd_image_t* edit(sd_ctx_t* sd_ctx,
                         float control_strength,
                         float style_strength,
                         bool normalize_input,
-                        const char* input_id_images_path);
+                        const char* input_id_images_path,
+                        sd_tiling_params_t vae_tiling_params);
+
+typedef struct {
+    const char* name;            // the runner's description, e.g. "unet", "t5", "vae"
+    size_t params_buffer_size;   // bytes, as loaded when the generation started
+    size_t compute_buffer_size;  // bytes, largest compute buffer of the generation, 0 if the runner did not run
+    bool on_cpu;
+} sd_runner_stats_t;
+
+// times in milliseconds. Preview rendering runs on a thread of its own and overlaps sampling,
+// ControlNet is part of sampling.
+typedef struct {
+    float load_ms;  // new_sd_ctx
+    float lora_apply_ms;
+    float tokenize_ms;
+    float text_encoder_ms;  // without tokenizing, the CLIP vision encoder for img2vid
+    float sampling_ms;
+    float control_net_ms;
+    float vae_encode_ms;
+    float vae_decode_ms;
+    float preview_ms;
+    float total_ms;
+    const float* step_ms;  // one per denoiser call, heun and dpm2 call it twice per step, images of a batch one after the other
+    int step_count;
+    const sd_runner_stats_t* runners;
+    int runner_count;
+    size_t work_ctx_size;  // bytes of the work context in use at the end, its peak
+} sd_generation_stats_t;
+
+// stats of the last txt2img, img2img, img2vid, img2vid_windowed or edit call on sd_ctx, false before the first one.
+// The arrays belong to sd_ctx and stay valid until its next generation.
+SD_API bool sd_get_generation_stats(sd_ctx_t* sd_ctx, sd_generation_stats_t* stats);
 
 typedef struct upscaler_ctx_t upscaler_ctx_t;
 
@@ -271,10 +349,20 @@ SD_API upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path,
                                         int n_threads);
 SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
-SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor);
+// the upscaler always works in tiles: tile_size <= 0 uses the model's tile size, enabled and rel_size are unused,
+// memory_budget_mb caps the number of tiles computed together
+SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params);
+// upscales without holding the result: the finished rows go to on_rows (index 0) as the tiles are done,
+// memory use is bounded by one tile row of the output, e.g. to write gigapixel images to a file
+SD_API bool upscale_rows(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params,
+                         sd_image_rows_cb_t on_rows, void* data);
 
 SD_API bool convert(const char* model_path, const char* clip_l_path, const char* clip_g_path, const char* t5xxl_path, const char* diffusion_model_path, const char* vae_path, const char* output_path, enum sd_type_t output_type);
 
+// writes a model of random weights with the tensor names and shapes of arch (sd1, sd2, sdxl, sd3, flux, flux-schnell),
+// with depth blocks per stack instead of the full depth, so tests and benchmarks run the real code paths offline
+SD_API bool generate_tiny_model(const char* arch, int depth, bool with_t5, uint64_t seed, const char* output_path, enum sd_type_t output_type);
+
 SD_API uint8_t* preprocess_canny(uint8_t* img,
                                  int width,
                                  int height,
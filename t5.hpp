@@ -783,6 +783,19 @@ struct T5Runner : public GGMLRunner {
             vocab_size     = 32128;
             projection_dim = 4096;
         }
+        // the random weight models of sd-tiny-model have fewer blocks, real checkpoints keep the depth of their version
+        int64_t detected_layers   = 0;
+        std::string blocks_prefix = prefix + ".encoder.block.";
+        if (is_tiny_model(tensor_types)) {
+            for (auto& pair : tensor_types) {
+                if (pair.first.compare(0, blocks_prefix.size(), blocks_prefix) == 0) {
+                    detected_layers = std::max(detected_layers, (int64_t)atoi(pair.first.c_str() + blocks_prefix.size()) + 1);
+                }
+            }
+        }
+        if (detected_layers > 0 && detected_layers < num_layers) {
+            num_layers = detected_layers;
+        }
 
         model = T5(num_layers, model_dim, ff_dim, num_heads, vocab_size, projection_dim);
         model.init(params_ctx, tensor_types, prefix);
@@ -211,6 +211,52 @@ public:
             in_channels = 8;
         }
 
+        // the random weight models of sd-tiny-model have fewer res blocks per level and fewer transformer
+        // blocks than the defaults of their version, read both from the tensor names. real checkpoints keep
+        // the block counts of their version
+        size_t len_mults = channel_mult.size();
+        if (is_tiny_model(tensor_types)) {
+            int max_input_block = -1;
+            std::map<int, int> max_transformer_blocks;  // by input block, -1 for the middle block
+            for (auto& pair : tensor_types) {
+                const std::string& tensor_name = pair.first;
+                size_t pos                     = tensor_name.find("model.diffusion_model.");
+                if (pos == std::string::npos) {
+                    continue;
+                }
+                int block = 0;
+                size_t ib = tensor_name.find("input_blocks.", pos);
+                if (ib != std::string::npos) {
+                    block           = atoi(tensor_name.c_str() + ib + 13);
+                    max_input_block = std::max(max_input_block, block);
+                } else if (tensor_name.find("middle_block.", pos) != std::string::npos) {
+                    block = -1;
+                } else {
+                    continue;
+                }
+                size_t tb = tensor_name.find("transformer_blocks.", pos);
+                if (tb != std::string::npos) {
+                    int n_blocks                  = atoi(tensor_name.c_str() + tb + 19) + 1;
+                    max_transformer_blocks[block] = std::max(max_transformer_blocks[block], n_blocks);
+                }
+            }
+            // input_blocks.0 and num_res_blocks + 1 blocks per level, without the downsample of the last level
+            if (max_input_block >= 0 && (max_input_block + 1) % len_mults == 0) {
+                int detected_res_blocks = (int)((max_input_block + 1) / len_mults) - 1;
+                if (detected_res_blocks >= 1 && detected_res_blocks < num_res_blocks) {
+                    num_res_blocks = detected_res_blocks;
+                }
+            }
+            // each level keeps its own depth, the middle block uses the one of the last level
+            for (auto& pair : max_transformer_blocks) {
+                size_t level = pair.first < 0 ? len_mults - 1 : (pair.first - 1) / (num_res_blocks + 1);
+                if (pair.first != 0 && level < transformer_depth.size()) {
+                    transformer_depth[level] = std::min(transformer_depth[level], pair.second);
+                }
+            }
+            LOG_INFO("tiny UNet res blocks per level: %d, transformer depth: %d", num_res_blocks, transformer_depth.back());
+        }
+
         // dims is always 2
         // use_temporal_attention is always True for SVD
 
@@ -253,7 +299,6 @@ public:
             }
         };
 
-        size_t len_mults = channel_mult.size();
         for (int i = 0; i < len_mults; i++) {
             int mult = channel_mult[i];
             for (int j = 0; j < num_res_blocks; j++) {
@@ -49,42 +49,119 @@ struct UpscalerGGML {
         return true;
     }
 
-    sd_image_t upscale(sd_image_t input_image, uint32_t upscale_factor) {
+    // compute buffer of one esrgan run over n tiles of tile_size_x x tile_size_y
+    size_t get_tile_buffer_size(int tile_size_x, int tile_size_y, int n) {
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = true;
+
+        struct ggml_context* probe_ctx = ggml_init(params);
+        if (!probe_ctx) {
+            LOG_ERROR("ggml_init() failed");
+            return SIZE_MAX;
+        }
+        ggml_tensor* x = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, tile_size_x, tile_size_y, 3, n);
+        size_t size    = esrgan_upscaler->get_compute_buffer_size([&]() -> struct ggml_cgraph* {
+            return esrgan_upscaler->build_graph(x);
+        });
+        ggml_free(probe_ctx);
+        LOG_DEBUG("upscaler compute buffer for %dx%dx%d: %.2f MB", tile_size_x, tile_size_y, n, size / 1024.f / 1024.f);
+        return size;
+    }
+
+    // upscales input_image in tiles read straight from its 8 bit data and hands the finished rows to on_rows,
+    // memory use is bounded by a band of one tile row of the output. The compute buffer is kept between calls,
+    // repeated upscales of the same tile geometry reuse it.
+    bool upscale_rows(sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params,
+                      std::function<void(const uint8_t*, int, int)> on_rows) {
         // upscale_factor, unused for RealESRGAN_x4plus_anime_6B.pth
-        sd_image_t upscaled_image = {0, 0, 0, NULL};
-        int output_width          = (int)input_image.width * esrgan_upscaler->scale;
-        int output_height         = (int)input_image.height * esrgan_upscaler->scale;
+        int output_width  = (int)input_image.width * esrgan_upscaler->scale;
+        int output_height = (int)input_image.height * esrgan_upscaler->scale;
         LOG_INFO("upscaling from (%i x %i) to (%i x %i)",
                  input_image.width, input_image.height, output_width, output_height);
+        if (input_image.channel < 3) {
+            LOG_ERROR("the upscaler needs an rgb image, got %u channels", input_image.channel);
+            return false;
+        }
+
+        int tile_size_x     = tiling_params.tile_size_x > 0 ? tiling_params.tile_size_x : esrgan_upscaler->tile_size;
+        int tile_size_y     = tiling_params.tile_size_y > 0 ? tiling_params.tile_size_y : esrgan_upscaler->tile_size;
+        tile_size_x         = std::min(tile_size_x, (int)input_image.width);
+        tile_size_y         = std::min(tile_size_y, (int)input_image.height);
+        float tile_overlap  = std::max(0.0f, std::min(tiling_params.target_overlap, 0.5f));
+        int tile_batch_size = std::max(1, tiling_params.batch_size);
+        if (tiling_params.memory_budget_mb > 0) {
+            size_t budget = tiling_params.memory_budget_mb * 1024 * 1024;
+            while (tile_batch_size > 1 && get_tile_buffer_size(tile_size_x, tile_size_y, tile_batch_size) > budget) {
+                tile_batch_size--;
+            }
+        }
+        LOG_INFO("upscaler tile size: %dx%d, overlap: %.2f, batch: %d", tile_size_x, tile_size_y, tile_overlap, tile_batch_size);
 
         struct ggml_init_params params;
-        params.mem_size = output_width * output_height * 3 * sizeof(float) * 2;
-        params.mem_size += 2 * ggml_tensor_overhead();
+        params.mem_size   = ggml_tensor_overhead();
         params.mem_buffer = NULL;
-        params.no_alloc   = false;
+        params.no_alloc   = true;
 
-        // draft context
         struct ggml_context* upscale_ctx = ggml_init(params);
         if (!upscale_ctx) {
             LOG_ERROR("ggml_init() failed");
-            return upscaled_image;
+            return false;
         }
-        LOG_DEBUG("upscale work buffer size: %.2f MB", params.mem_size / 1024.f / 1024.f);
+        // only the shape, the tiles are read from the image by on_split
         ggml_tensor* input_image_tensor = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, input_image.width, input_image.height, 3, 1);
-        sd_image_to_tensor(input_image.data, input_image_tensor);
 
-        ggml_tensor* upscaled = ggml_new_tensor_4d(upscale_ctx, GGML_TYPE_F32, output_width, output_height, 3, 1);
-        auto on_tiling        = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+        std::vector<uint8_t> plane_row;
+        auto on_split = [&](ggml_tensor* tile, int n, int x, int y) {
+            plane_row.resize(tile->ne[0]);
+            for (int iy = 0; iy < tile->ne[1]; iy++) {
+                const uint8_t* row = input_image.data + ((size_t)(y + iy) * input_image.width + x) * input_image.channel;
+                for (int k = 0; k < 3; k++) {
+                    for (int ix = 0; ix < tile->ne[0]; ix++) {
+                        plane_row[ix] = row[ix * input_image.channel + k];
+                    }
+                    float* tile_row = (float*)((char*)tile->data + n * tile->nb[3] + k * tile->nb[2] + iy * tile->nb[1]);
+                    sd_u8_to_f32_row(plane_row.data(), tile_row, tile->ne[0], 1.0f / 255.0f, 0.0f);
+                }
+            }
+        };
+        std::vector<uint8_t> rows_data;
+        auto on_rows_ready = [&](ggml_tensor* band, int y, int num_rows) {
+            rows_data.resize((size_t)output_width * num_rows * 3);
+            sd_image_f32_planar_to_u8((const float*)band->data, rows_data.data(), output_width, num_rows, 3, 255.0f, 0.0f,
+                                      n_threads, band->ne[0] * band->ne[1]);
+            on_rows(rows_data.data(), y, num_rows);
+        };
+        auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
             esrgan_upscaler->compute(n_threads, in, &out);
         };
         int64_t t0 = ggml_time_ms();
-        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, esrgan_upscaler->tile_size, 0.25f, on_tiling);
-        esrgan_upscaler->free_compute_buffer();
-        ggml_tensor_clamp(upscaled, 0.f, 1.f);
-        uint8_t* upscaled_data = sd_tensor_to_image(upscaled);
+        sd_tiling_stream(input_image_tensor, output_width, output_height, 3, esrgan_upscaler->scale,
+                         tile_size_x, tile_size_y, tile_overlap, on_tiling, on_rows_ready, tile_batch_size, on_split);
         ggml_free(upscale_ctx);
         int64_t t3 = ggml_time_ms();
         LOG_INFO("input_image_tensor upscaled, taking %.2fs", (t3 - t0) / 1000.0f);
+        return true;
+    }
+
+    sd_image_t upscale(sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params) {
+        sd_image_t upscaled_image = {0, 0, 0, NULL};
+        int output_width          = (int)input_image.width * esrgan_upscaler->scale;
+        int output_height         = (int)input_image.height * esrgan_upscaler->scale;
+
+        uint8_t* upscaled_data = (uint8_t*)malloc((size_t)output_width * output_height * 3);
+        if (upscaled_data == NULL) {
+            LOG_ERROR("failed to allocate the upscaled image");
+            return upscaled_image;
+        }
+        auto on_rows = [&](const uint8_t* rows, int y, int num_rows) {
+            memcpy(upscaled_data + (size_t)y * output_width * 3, rows, (size_t)num_rows * output_width * 3);
+        };
+        if (!upscale_rows(input_image, upscale_factor, tiling_params, on_rows)) {
+            free(upscaled_data);
+            return upscaled_image;
+        }
         upscaled_image = {
             (uint32_t)output_width,
             (uint32_t)output_height,
@@ -121,8 +198,18 @@ upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path_c_str,
     return upscaler_ctx;
 }
 
-sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor) {
-    return upscaler_ctx->upscaler->upscale(input_image, upscale_factor);
+sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params) {
+    return upscaler_ctx->upscaler->upscale(input_image, upscale_factor, tiling_params);
+}
+
+bool upscale_rows(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor, sd_tiling_params_t tiling_params,
+                  sd_image_rows_cb_t on_rows, void* data) {
+    int output_width = (int)input_image.width * upscaler_ctx->upscaler->esrgan_upscaler->scale;
+    auto on_band     = [&](const uint8_t* rows, int y, int num_rows) {
+        sd_image_t rows_image = {(uint32_t)output_width, (uint32_t)num_rows, 3, (uint8_t*)rows};
+        on_rows(0, (uint32_t)y, rows_image, data);
+    };
+    return upscaler_ctx->upscaler->upscale_rows(input_image, upscale_factor, tiling_params, on_band);
 }
 
 void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx) {
@@ -10,6 +10,7 @@
 #include <thread>
 #include <unordered_set>
 #include <vector>
+#include "image_ops.h"
 #include "preprocessing.hpp"
 
 #if defined(__APPLE__) && defined(__MACH__)
@@ -72,6 +73,19 @@ std::string format(const char* fmt, ...) {
     return std::string(buf.data(), size);
 }
 
+uint64_t fnv1a_64(const void* data, size_t n, uint64_t hash) {
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t fnv1a_64(const std::string& str, uint64_t hash) {
+    return fnv1a_64(str.data(), str.size(), hash);
+}
+
 #ifdef _WIN32  // code for windows
 #include <windows.h>
 
@@ -149,8 +163,59 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+MmapFile::~MmapFile() {
+    close();
+}
+
+bool MmapFile::open(const std::string& file_path) {
+    close();
+    HANDLE file = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+    void* addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (addr == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle_    = file;
+    mapping_handle_ = mapping;
+    data_           = (uint8_t*)addr;
+    size_           = (size_t)file_size.QuadPart;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != NULL) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_handle_ != NULL) {
+        CloseHandle((HANDLE)mapping_handle_);
+    }
+    if (file_handle_ != NULL) {
+        CloseHandle((HANDLE)file_handle_);
+    }
+    data_           = NULL;
+    size_           = 0;
+    mapping_handle_ = NULL;
+    file_handle_    = NULL;
+}
+
 #else  // Unix
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 bool file_exists(const std::string& filename) {
@@ -204,6 +269,40 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+MmapFile::~MmapFile() {
+    close();
+}
+
+bool MmapFile::open(const std::string& file_path) {
+    close();
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    data_ = (uint8_t*)addr;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != NULL) {
+        munmap(data_, size_);
+    }
+    data_ = NULL;
+    size_ = 0;
+}
+
 #endif
 
 // get_num_physical_cores is copy from
@@ -246,6 +345,8 @@ int32_t get_num_physical_cores() {
 
 static sd_progress_cb_t sd_progress_cb = NULL;
 void* sd_progress_cb_data              = NULL;
+// per thread, so a background thread can be silenced without touching the callback of the others
+static thread_local bool sd_progress_suppressed = false;
 
 static sd_preview_cb_t sd_preview_cb = NULL;
 sd_preview_t sd_preview_mode         = SD_PREVIEW_NONE;
@@ -254,6 +355,9 @@ int sd_preview_interval              = 1;
 static ggml_graph_eval_callback callback_eval = NULL;
 void * callback_eval_user_data = NULL;
 
+static sd_image_rows_cb_t sd_image_rows_cb = NULL;
+void* sd_image_rows_cb_data                = NULL;
+
 std::u32string utf8_to_utf32(const std::string& utf8_str) {
     std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> converter;
     return converter.from_bytes(utf8_str);
@@ -347,7 +451,16 @@ sd_image_t* preprocess_id_image(sd_image_t* img) {
     return resized;
 }
 
+bool sd_suppress_progress(bool suppress) {
+    bool was_suppressed    = sd_progress_suppressed;
+    sd_progress_suppressed = suppress;
+    return was_suppressed;
+}
+
 void pretty_progress(int step, int steps, float time) {
+    if (sd_progress_suppressed) {
+        return;
+    }
     if (sd_progress_cb) {
         sd_progress_cb(step, steps, time, sd_progress_cb_data);
         return;
@@ -444,6 +557,18 @@ int sd_get_preview_interval() {
     return sd_preview_interval;
 }
 
+void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data) {
+    sd_image_rows_cb      = cb;
+    sd_image_rows_cb_data = data;
+}
+
+sd_image_rows_cb_t sd_get_image_rows_callback() {
+    return sd_image_rows_cb;
+}
+void* sd_get_image_rows_callback_data() {
+    return sd_image_rows_cb_data;
+}
+
 sd_progress_cb_t sd_get_progress_callback() {
     return sd_progress_cb;
 }
@@ -498,19 +623,11 @@ sd_image_f32_t sd_image_t_to_sd_image_f32_t(sd_image_t image) {
     // Allocate memory for float data
     converted_image.data = (float*)malloc(image.width * image.height * image.channel * sizeof(float));
 
-    for (int i = 0; i < image.width * image.height * image.channel; i++) {
-        // Convert uint8_t to float
-        converted_image.data[i] = (float)image.data[i];
-    }
+    sd_u8_to_f32_row(image.data, converted_image.data, (size_t)image.width * image.height * image.channel, 1.0f, 0.0f);
 
     return converted_image;
 }
 
-// Function to perform double linear interpolation
-float interpolate(float v1, float v2, float v3, float v4, float x_ratio, float y_ratio) {
-    return v1 * (1 - x_ratio) * (1 - y_ratio) + v2 * x_ratio * (1 - y_ratio) + v3 * (1 - x_ratio) * y_ratio + v4 * x_ratio * y_ratio;
-}
-
 sd_image_f32_t resize_sd_image_f32_t(sd_image_f32_t image, int target_width, int target_height) {
     sd_image_f32_t resized_image;
     resized_image.width   = target_width;
@@ -520,44 +637,14 @@ sd_image_f32_t resize_sd_image_f32_t(sd_image_f32_t image, int target_width, int
     // Allocate memory for resized float data
     resized_image.data = (float*)malloc(target_width * target_height * image.channel * sizeof(float));
 
-    for (int y = 0; y < target_height; y++) {
-        for (int x = 0; x < target_width; x++) {
-            float original_x = (float)x * image.width / target_width;
-            float original_y = (float)y * image.height / target_height;
-
-            int x1 = (int)original_x;
-            int y1 = (int)original_y;
-            int x2 = x1 + 1;
-            int y2 = y1 + 1;
-
-            for (int k = 0; k < image.channel; k++) {
-                float v1 = *(image.data + y1 * image.width * image.channel + x1 * image.channel + k);
-                float v2 = *(image.data + y1 * image.width * image.channel + x2 * image.channel + k);
-                float v3 = *(image.data + y2 * image.width * image.channel + x1 * image.channel + k);
-                float v4 = *(image.data + y2 * image.width * image.channel + x2 * image.channel + k);
-
-                float x_ratio = original_x - x1;
-                float y_ratio = original_y - y1;
-
-                float value = interpolate(v1, v2, v3, v4, x_ratio, y_ratio);
-
-                *(resized_image.data + y * target_width * image.channel + x * image.channel + k) = value;
-            }
-        }
-    }
+    sd_image_f32_resize_bilinear(image.data, image.width, image.height,
+                                 resized_image.data, target_width, target_height, image.channel);
 
     return resized_image;
 }
 
 void normalize_sd_image_f32_t(sd_image_f32_t image, float means[3], float stds[3]) {
-    for (int y = 0; y < image.height; y++) {
-        for (int x = 0; x < image.width; x++) {
-            for (int k = 0; k < image.channel; k++) {
-                int index         = (y * image.width + x) * image.channel + k;
-                image.data[index] = (image.data[index] - means[k]) / stds[k];
-            }
-        }
-    }
+    sd_image_f32_normalize(image.data, image.width, image.height, image.channel, means, stds);
 }
 
 // Constants for means and std
@@ -573,33 +660,10 @@ sd_image_f32_t clip_preprocess(sd_image_f32_t image, int size) {
     int new_height      = (int)(scale * image.height);
     float* resized_data = (float*)malloc(new_width * new_height * image.channel * sizeof(float));
 
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            float original_x = (float)x * image.width / new_width;
-            float original_y = (float)y * image.height / new_height;
-
-            int x1 = (int)original_x;
-            int y1 = (int)original_y;
-            int x2 = x1 + 1;
-            int y2 = y1 + 1;
-
-            for (int k = 0; k < image.channel; k++) {
-                float v1 = *(image.data + y1 * image.width * image.channel + x1 * image.channel + k);
-                float v2 = *(image.data + y1 * image.width * image.channel + x2 * image.channel + k);
-                float v3 = *(image.data + y2 * image.width * image.channel + x1 * image.channel + k);
-                float v4 = *(image.data + y2 * image.width * image.channel + x2 * image.channel + k);
-
-                float x_ratio = original_x - x1;
-                float y_ratio = original_y - y1;
-
-                float value = interpolate(v1, v2, v3, v4, x_ratio, y_ratio);
+    sd_image_f32_resize_bilinear(image.data, image.width, image.height,
+                                 resized_data, new_width, new_height, image.channel);
 
-                *(resized_data + y * new_width * image.channel + x * image.channel + k) = value;
-            }
-        }
-    }
-
-    // Clip and preprocess
+    // Clip, scale to [0, 1] and normalize in one pass
     int h = (new_height - size) / 2;
     int w = (new_width - size) / 2;
 
@@ -609,32 +673,19 @@ sd_image_f32_t clip_preprocess(sd_image_f32_t image, int size) {
     result.channel = image.channel;
     result.data    = (float*)malloc(size * size * image.channel * sizeof(float));
 
-    for (int k = 0; k < image.channel; k++) {
-        for (int i = 0; i < size; i++) {
-            for (int j = 0; j < size; j++) {
-                *(result.data + i * size * image.channel + j * image.channel + k) =
-                    fmin(fmax(*(resized_data + (i + h) * new_width * image.channel + (j + w) * image.channel + k), 0.0f), 255.0f) / 255.0f;
-            }
+    for (int i = 0; i < size; i++) {
+        const float* row = resized_data + ((i + h) * new_width + w) * image.channel;
+        float* dst_row   = result.data + i * size * image.channel;
+        for (int j = 0; j < size * (int)image.channel; j++) {
+            int k      = j % image.channel;
+            float v    = fmin(fmax(row[j], 0.0f), 255.0f) / 255.0f;
+            dst_row[j] = (v - means[k]) / stds[k];
         }
     }
 
     // Free allocated memory
     free(resized_data);
 
-    // Normalize
-    for (int k = 0; k < image.channel; k++) {
-        for (int i = 0; i < size; i++) {
-            for (int j = 0; j < size; j++) {
-                // *(result.data + i * size * image.channel + j * image.channel + k) = 0.5f;
-                int offset  = i * size * image.channel + j * image.channel + k;
-                float value = *(result.data + offset);
-                value       = (value - means[k]) / stds[k];
-                // value = 0.5f;
-                *(result.data + offset) = value;
-            }
-        }
-    }
-
     return result;
 }
 
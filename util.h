@@ -15,6 +15,10 @@ bool contains(const std::string& str, const std::string& substr);
 
 std::string format(const char* fmt, ...);
 
+// 64-bit FNV-1a, chain calls by passing the previous result as hash
+uint64_t fnv1a_64(const void* data, size_t n, uint64_t hash = 0xcbf29ce484222325ULL);
+uint64_t fnv1a_64(const std::string& str, uint64_t hash);
+
 void replace_all_chars(std::string& str, char target, char replacement);
 
 bool file_exists(const std::string& filename);
@@ -23,6 +27,31 @@ std::string get_full_path(const std::string& dir, const std::string& filename);
 
 std::vector<std::string> get_files_from_dir(const std::string& dir);
 
+// read-only view of a whole file, mapped copy-on-write so that writes
+// (e.g. merging a LoRA into a weight that points into the mapping) stay private
+class MmapFile {
+public:
+    MmapFile() = default;
+    ~MmapFile();
+
+    bool open(const std::string& file_path);
+    void close();
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MmapFile(const MmapFile&)            = delete;
+    MmapFile& operator=(const MmapFile&) = delete;
+
+    uint8_t* data_ = NULL;
+    size_t size_   = 0;
+#ifdef _WIN32
+    void* file_handle_    = NULL;
+    void* mapping_handle_ = NULL;
+#endif
+};
+
 std::u32string utf8_to_utf32(const std::string& utf8_str);
 std::string utf32_to_utf8(const std::u32string& utf32_str);
 std::u32string unicode_value_to_utf32(int unicode_value);
@@ -49,6 +78,8 @@ sd_image_f32_t clip_preprocess(sd_image_f32_t image, int size);
 std::string path_join(const std::string& p1, const std::string& p2);
 std::vector<std::string> splitString(const std::string& str, char delimiter);
 void pretty_progress(int step, int steps, float time);
+// silences pretty_progress on the calling thread, returns the previous state
+bool sd_suppress_progress(bool suppress);
 
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...);
 
@@ -65,6 +96,9 @@ sd_preview_cb_t sd_get_preview_callback();
 sd_preview_t sd_get_preview_mode();
 int sd_get_preview_interval();
 
+sd_image_rows_cb_t sd_get_image_rows_callback();
+void* sd_get_image_rows_callback_data();
+
 #define LOG_DEBUG(format, ...) log_printf(SD_LOG_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_INFO(format, ...) log_printf(SD_LOG_INFO, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_WARN(format, ...) log_printf(SD_LOG_WARN, __FILE__, __LINE__, format, ##__VA_ARGS__)
@@ -565,7 +565,8 @@ struct AutoEncoderKL : public GGMLRunner {
         };
         // ggml_set_f32(z, 0.5f);
         // print_ggml_tensor(z);
-        return GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
+        // the compute buffer is kept for the next tile, callers free it with free_compute_buffer()
+        return GGMLRunner::compute(get_graph, n_threads, false, output, output_ctx);
     }
 
     void test() {